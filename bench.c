@@ -0,0 +1,707 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * rpcd-bench - drive a running rpcd instance with a weighted mix of calls
+ * at a fixed number of outstanding requests and report per-call latency
+ * percentiles and throughput as JSON.
+ */
+
+#define _GNU_SOURCE /* nftw() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <ftw.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <libubus.h>
+#include <libubox/blobmsg_json.h>
+#include <libubox/uloop.h>
+#include <libubox/utils.h>
+
+#include <rpcd/session.h>
+
+#define RPC_BENCH_MAX_OPS		16
+#define RPC_BENCH_MAX_CONCURRENCY	64
+#define RPC_BENCH_TIMEOUT		5000
+#define RPC_BENCH_USER			"bench"
+
+struct rpc_bench_op {
+	char object[64];
+	char method[64];
+	uint32_t id;
+	int weight;
+	int issued;
+	int done;
+	int failed;
+	uint32_t *latency;
+};
+
+struct rpc_bench_slot {
+	struct ubus_request req;
+	struct rpc_bench_op *op;
+	uint64_t start;
+	bool busy;
+};
+
+static struct ubus_context *ctx;
+static struct blob_buf buf;
+
+static struct rpc_bench_op ops[RPC_BENCH_MAX_OPS];
+static struct rpc_bench_slot slots[RPC_BENCH_MAX_CONCURRENCY];
+static int n_ops = 0;
+static int weight_sum = 0;
+
+static char sid[RPC_SID_LEN + 1] = RPC_DEFAULT_SESSION_ID;
+static const char *config = "rpcd";
+static const char *username = NULL;
+static const char *password = NULL;
+static const char *path = NULL;
+static char file_dir[PATH_MAX] = "/etc/config";
+static char file_path[PATH_MAX] = "/etc/config/rpcd";
+static char fixture[PATH_MAX];
+static int total = 1000;
+static int issued = 0;
+static int completed = 0;
+static uint64_t bench_start, bench_end;
+
+static uint64_t
+rpc_bench_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+rpc_bench_parse_mix(char *mix)
+{
+	struct rpc_bench_op *op;
+	char *tok, *sep, *p;
+
+	for (tok = strtok(mix, ","); tok; tok = strtok(NULL, ",")) {
+		if (n_ops >= RPC_BENCH_MAX_OPS)
+			return -1;
+
+		op = &ops[n_ops];
+		op->weight = 1;
+
+		p = strchr(tok, '=');
+
+		if (p) {
+			*p++ = 0;
+			op->weight = atoi(p);
+		}
+
+		sep = strrchr(tok, '.');
+
+		if (!sep || op->weight <= 0)
+			return -1;
+
+		*sep++ = 0;
+
+		snprintf(op->object, sizeof(op->object), "%s", tok);
+		snprintf(op->method, sizeof(op->method), "%s", sep);
+
+		weight_sum += op->weight;
+		n_ops++;
+	}
+
+	return n_ops ? 0 : -1;
+}
+
+/*
+ * Known calls get a meaningful argument set, anything else, e.g. exec
+ * plugin methods, is invoked with the session id only.
+ */
+static void
+rpc_bench_build_msg(struct rpc_bench_op *op)
+{
+	void *c;
+
+	blob_buf_init(&buf, 0);
+
+	if (!strcmp(op->object, "session")) {
+		if (!strcmp(op->method, "login")) {
+			blobmsg_add_string(&buf, "username",
+			                   username ? username : RPC_BENCH_USER);
+			blobmsg_add_string(&buf, "password", password ? password : "");
+			return;
+		}
+
+		blobmsg_add_string(&buf, "ubus_rpc_session", sid);
+
+		if (!strcmp(op->method, "access")) {
+			blobmsg_add_string(&buf, "scope", "uci");
+			blobmsg_add_string(&buf, "object", config);
+			blobmsg_add_string(&buf, "function", "read");
+		}
+
+		return;
+	}
+
+	blobmsg_add_string(&buf, "ubus_rpc_session", sid);
+
+	if (!strcmp(op->object, "uci")) {
+		blobmsg_add_string(&buf, "config", config);
+
+		if (!strcmp(op->method, "set")) {
+			blobmsg_add_string(&buf, "section", "bench");
+			c = blobmsg_open_table(&buf, "values");
+			blobmsg_add_u32(&buf, "counter", issued);
+			blobmsg_close_table(&buf, c);
+		}
+		else if (!strcmp(op->method, "apply")) {
+			blobmsg_add_u8(&buf, "rollback", false);
+		}
+	}
+	else if (!strcmp(op->object, "file")) {
+		if (path)
+			blobmsg_add_string(&buf, "path", path);
+		else if (!strcmp(op->method, "list"))
+			blobmsg_add_string(&buf, "path", file_dir);
+		else
+			blobmsg_add_string(&buf, "path", file_path);
+	}
+}
+
+static struct rpc_bench_op *
+rpc_bench_pick_op(void)
+{
+	int i, n = rand() % weight_sum;
+
+	for (i = 0; i < n_ops; i++) {
+		if (n < ops[i].weight)
+			return &ops[i];
+
+		n -= ops[i].weight;
+	}
+
+	return &ops[n_ops - 1];
+}
+
+static void rpc_bench_issue(struct rpc_bench_slot *slot);
+
+static void
+rpc_bench_complete_cb(struct ubus_request *req, int ret)
+{
+	struct rpc_bench_slot *slot = container_of(req, struct rpc_bench_slot, req);
+	struct rpc_bench_op *op = slot->op;
+	uint64_t usec = rpc_bench_usec() - slot->start;
+
+	op->latency[op->done++] = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+
+	if (ret)
+		op->failed++;
+
+	slot->busy = false;
+
+	if (++completed >= total) {
+		bench_end = rpc_bench_usec();
+		uloop_end();
+		return;
+	}
+
+	rpc_bench_issue(slot);
+}
+
+static void
+rpc_bench_issue(struct rpc_bench_slot *slot)
+{
+	struct rpc_bench_op *op;
+
+	if (issued >= total)
+		return;
+
+	op = rpc_bench_pick_op();
+
+	rpc_bench_build_msg(op);
+
+	slot->op = op;
+	slot->busy = true;
+	slot->start = rpc_bench_usec();
+
+	issued++;
+	op->issued++;
+
+	if (ubus_invoke_async(ctx, op->id, op->method, buf.head, &slot->req)) {
+		rpc_bench_complete_cb(&slot->req, UBUS_STATUS_UNKNOWN_ERROR);
+		return;
+	}
+
+	slot->req.complete_cb = rpc_bench_complete_cb;
+	ubus_complete_request_async(ctx, &slot->req);
+}
+
+static void
+rpc_bench_login_cb(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+	struct blob_attr *cur;
+	int rem;
+
+	blobmsg_for_each_attr(cur, msg, rem) {
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING &&
+		    !strcmp(blobmsg_name(cur), "ubus_rpc_session"))
+			snprintf(sid, sizeof(sid), "%s", blobmsg_get_string(cur));
+	}
+}
+
+static int
+rpc_bench_login(void)
+{
+	uint32_t id;
+
+	if (ubus_lookup_id(ctx, "session", &id))
+		return -1;
+
+	blob_buf_init(&buf, 0);
+	blobmsg_add_string(&buf, "username", username);
+	blobmsg_add_string(&buf, "password", password ? password : "");
+
+	return ubus_invoke(ctx, id, "login", buf.head, rpc_bench_login_cb, NULL,
+	                   RPC_BENCH_TIMEOUT);
+}
+
+static int
+rpc_bench_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t
+rpc_bench_percentile(struct rpc_bench_op *op, int pct)
+{
+	if (!op->done)
+		return 0;
+
+	return op->latency[(op->done - 1) * pct / 100];
+}
+
+static void
+rpc_bench_report(FILE *out, int concurrency)
+{
+	struct rpc_bench_op *op;
+	uint64_t elapsed = bench_end - bench_start;
+	char name[130];
+	char *json;
+	void *c, *d;
+	int i;
+
+	blob_buf_init(&buf, 0);
+
+	blobmsg_add_u32(&buf, "requests", completed);
+	blobmsg_add_u32(&buf, "concurrency", concurrency);
+	blobmsg_add_u64(&buf, "elapsed_usec", elapsed);
+	blobmsg_add_u32(&buf, "ops_per_sec",
+	                elapsed ? (uint64_t)completed * 1000000 / elapsed : 0);
+
+	c = blobmsg_open_table(&buf, "calls");
+
+	for (i = 0; i < n_ops; i++) {
+		op = &ops[i];
+
+		qsort(op->latency, op->done, sizeof(*op->latency), rpc_bench_cmp);
+
+		snprintf(name, sizeof(name), "%s.%s", op->object, op->method);
+		d = blobmsg_open_table(&buf, name);
+
+		blobmsg_add_u32(&buf, "requests", op->done);
+		blobmsg_add_u32(&buf, "failed", op->failed);
+		blobmsg_add_u32(&buf, "p50_usec", rpc_bench_percentile(op, 50));
+		blobmsg_add_u32(&buf, "p99_usec", rpc_bench_percentile(op, 99));
+		blobmsg_add_u32(&buf, "max_usec",
+		                op->done ? op->latency[op->done - 1] : 0);
+		blobmsg_add_u32(&buf, "ops_per_sec",
+		                elapsed ? (uint64_t)op->done * 1000000 / elapsed : 0);
+
+		blobmsg_close_table(&buf, d);
+	}
+
+	blobmsg_close_table(&buf, c);
+
+	json = blobmsg_format_json(buf.head, true);
+
+	if (json) {
+		fprintf(out, "%s\n", json);
+		free(json);
+	}
+}
+
+static pid_t
+rpc_bench_spawn(char * const *argv)
+{
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+static int
+rpc_bench_write(const char *dir, const char *file, const char *data)
+{
+	char p[PATH_MAX];
+	FILE *f;
+	int rv;
+
+	snprintf(p, sizeof(p), "%s/%s", dir, file);
+
+	f = fopen(p, "w");
+
+	if (!f)
+		return -1;
+
+	rv = (fputs(data, f) < 0) ? -1 : 0;
+
+	if (fclose(f))
+		rv = -1;
+
+	return rv;
+}
+
+/*
+ * Populate a private tree holding the config directory, the ACL directory
+ * and the runtime directory of the spawned rpcd. It provides a login with
+ * unrestricted access and an empty password and a "bench" section for
+ * uci.set to modify, so the host's own configuration is never touched.
+ */
+static int
+rpc_bench_fixture(void)
+{
+	char p[PATH_MAX];
+
+	static const char *acl =
+		"{\n"
+		"\t\"unauthenticated\": {\n"
+		"\t\t\"read\": { \"ubus\": { \"session\": [ \"access\", \"login\" ] } }\n"
+		"\t},\n"
+		"\t\"bench\": {\n"
+		"\t\t\"read\": {\n"
+		"\t\t\t\"ubus\": { \"*\": [ \"*\" ] },\n"
+		"\t\t\t\"uci\": [ \"*\" ],\n"
+		"\t\t\t\"file\": { \"/*\": [ \"read\", \"list\" ] }\n"
+		"\t\t},\n"
+		"\t\t\"write\": {\n"
+		"\t\t\t\"ubus\": { \"*\": [ \"*\" ] },\n"
+		"\t\t\t\"uci\": [ \"*\" ],\n"
+		"\t\t\t\"file\": { \"/*\": [ \"write\", \"exec\" ] }\n"
+		"\t\t}\n"
+		"\t}\n"
+		"}\n";
+
+	static const char *conf =
+		"config login\n"
+		"\toption username '" RPC_BENCH_USER "'\n"
+		"\toption password ''\n"
+		"\tlist read 'bench'\n"
+		"\tlist write 'bench'\n"
+		"\n"
+		"config bench 'bench'\n"
+		"\toption counter '0'\n";
+
+	snprintf(fixture, sizeof(fixture), "/tmp/rpcd-bench.XXXXXX");
+
+	if (!mkdtemp(fixture)) {
+		fixture[0] = 0;
+		return -1;
+	}
+
+	snprintf(p, sizeof(p), "%s/config", fixture);
+
+	if (mkdir(p, 0700) || rpc_bench_write(p, "rpcd", conf))
+		return -1;
+
+	snprintf(file_dir, sizeof(file_dir), "%s", p);
+	snprintf(file_path, sizeof(file_path), "%s/rpcd", p);
+
+	snprintf(p, sizeof(p), "%s/acl.d", fixture);
+
+	if (mkdir(p, 0700) || rpc_bench_write(p, "bench.json", acl))
+		return -1;
+
+	snprintf(p, sizeof(p), "%s/run", fixture);
+
+	return mkdir(p, 0700);
+}
+
+static int
+rpc_bench_unlink_cb(const char *p, const struct stat *s, int flag,
+                    struct FTW *ftw)
+{
+	return remove(p);
+}
+
+/*
+ * Start a private ubusd and the given rpcd binary on a socket of our own,
+ * pointing rpcd at the fixture tree, and wait until the rpcd objects show
+ * up on the bus.
+ */
+static int
+rpc_bench_start(const char *rpcd, const char *sock, pid_t *pids)
+{
+	char confdir[PATH_MAX], acldir[PATH_MAX], rundir[PATH_MAX];
+	char * const ubusd_argv[] = { "ubusd", "-s", (char *)sock, NULL };
+	char * const rpcd_argv[] = {
+		(char *)rpcd, "-s", (char *)sock,
+		"-c", confdir, "-a", acldir, "-t", rundir, NULL
+	};
+	struct stat s;
+	uint32_t id;
+	int i;
+
+	if (rpc_bench_fixture())
+		return -1;
+
+	snprintf(confdir, sizeof(confdir), "%s/config", fixture);
+	snprintf(acldir, sizeof(acldir), "%s/acl.d", fixture);
+	snprintf(rundir, sizeof(rundir), "%s/run", fixture);
+
+	unlink(sock);
+
+	pids[0] = rpc_bench_spawn(ubusd_argv);
+
+	if (pids[0] < 0)
+		return -1;
+
+	for (i = 0; i < 50 && stat(sock, &s); i++)
+		usleep(100 * 1000);
+
+	pids[1] = rpc_bench_spawn(rpcd_argv);
+
+	if (pids[1] < 0)
+		return -1;
+
+	ctx = ubus_connect(sock);
+
+	if (!ctx)
+		return -1;
+
+	for (i = 0; i < 50 && ubus_lookup_id(ctx, "session", &id); i++)
+		usleep(100 * 1000);
+
+	return (i < 50) ? 0 : -1;
+}
+
+/* Terminate and reap the spawned processes and remove the fixture tree. */
+static void
+rpc_bench_stop(pid_t *pids, const char *sock)
+{
+	int i;
+
+	for (i = 1; i >= 0; i--) {
+		if (pids[i] <= 0)
+			continue;
+
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+		pids[i] = 0;
+	}
+
+	if (sock)
+		unlink(sock);
+
+	if (fixture[0])
+		nftw(fixture, rpc_bench_unlink_cb, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static int
+usage(const char *prog)
+{
+	fprintf(stderr,
+	        "Usage: %s [options]\n"
+	        " -s <socket>      ubus socket of the rpcd instance\n"
+	        " -r <rpcd>        spawn ubusd and the given rpcd on the socket\n"
+	        " -m <mix>         weighted calls, e.g. session.access=5,uci.get=3\n"
+	        " -n <count>       total number of requests (default 1000)\n"
+	        " -c <count>       outstanding requests (default 4)\n"
+	        " -u <user>        login to use for authenticated calls\n"
+	        "                  (default " RPC_BENCH_USER " with -r)\n"
+	        " -p <password>    password of the login\n"
+	        " -x <config>      uci config to operate on (default rpcd)\n"
+	        " -f <path>        path for file calls (default the rpcd config\n"
+	        "                  file or its directory for file.list)\n"
+	        " -o <file>        write results to file instead of stdout\n",
+	        prog);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *ubus_socket = NULL, *output = NULL, *rpcd = NULL;
+	char sock[64];
+	pid_t pids[2] = { 0, 0 };
+	char *mix = NULL;
+	int i, ch, concurrency = 4, rv = 1;
+	FILE *out = stdout;
+
+	while ((ch = getopt(argc, argv, "s:r:m:n:c:u:p:x:f:o:")) != -1) {
+		switch (ch) {
+		case 's':
+			ubus_socket = optarg;
+			break;
+
+		case 'r':
+			rpcd = optarg;
+			break;
+
+		case 'm':
+			mix = optarg;
+			break;
+
+		case 'n':
+			total = atoi(optarg);
+			break;
+
+		case 'c':
+			concurrency = atoi(optarg);
+			break;
+
+		case 'u':
+			username = optarg;
+			break;
+
+		case 'p':
+			password = optarg;
+			break;
+
+		case 'x':
+			config = optarg;
+			break;
+
+		case 'f':
+			path = optarg;
+			break;
+
+		case 'o':
+			output = optarg;
+			break;
+
+		default:
+			return usage(argv[0]);
+		}
+	}
+
+	if (!mix || rpc_bench_parse_mix(mix) || total <= 0 ||
+	    concurrency <= 0 || concurrency > RPC_BENCH_MAX_CONCURRENCY)
+		return usage(argv[0]);
+
+	uloop_init();
+
+	if (rpcd) {
+		if (!ubus_socket) {
+			snprintf(sock, sizeof(sock), "/tmp/rpcd-bench.%d.sock", getpid());
+			ubus_socket = sock;
+		}
+
+		if (!username)
+			username = RPC_BENCH_USER;
+
+		if (rpc_bench_start(rpcd, ubus_socket, pids)) {
+			fprintf(stderr, "Failed to start %s\n", rpcd);
+			goto out;
+		}
+	}
+	else {
+		ctx = ubus_connect(ubus_socket);
+	}
+
+	if (!ctx) {
+		fprintf(stderr, "Failed to connect to ubus\n");
+		goto out;
+	}
+
+	ubus_add_uloop(ctx);
+
+	if (username && rpc_bench_login()) {
+		fprintf(stderr, "Failed to login as %s\n", username);
+		goto out;
+	}
+
+	for (i = 0; i < n_ops; i++) {
+		if (ubus_lookup_id(ctx, ops[i].object, &ops[i].id)) {
+			fprintf(stderr, "Object %s not found\n", ops[i].object);
+			goto out;
+		}
+
+		ops[i].latency = calloc(total, sizeof(*ops[i].latency));
+
+		if (!ops[i].latency)
+			goto out;
+	}
+
+	srand(time(NULL));
+
+	bench_start = rpc_bench_usec();
+
+	for (i = 0; i < concurrency; i++)
+		rpc_bench_issue(&slots[i]);
+
+	uloop_run();
+
+	if (!bench_end)
+		bench_end = rpc_bench_usec();
+
+	if (output) {
+		out = fopen(output, "w");
+
+		if (!out) {
+			fprintf(stderr, "Failed to open %s\n", output);
+			goto out;
+		}
+	}
+
+	rpc_bench_report(out, concurrency);
+
+	if (out != stdout)
+		fclose(out);
+
+	rv = 0;
+
+	/* a call failing every time measures nothing but its error path */
+	for (i = 0; i < n_ops; i++) {
+		if (ops[i].done && ops[i].failed == ops[i].done) {
+			fprintf(stderr, "All %s.%s calls failed\n",
+			        ops[i].object, ops[i].method);
+			rv = 1;
+		}
+	}
+
+out:
+	if (ctx)
+		ubus_free(ctx);
+
+	uloop_done();
+
+	rpc_bench_stop(pids, rpcd ? ubus_socket : NULL);
+
+	return rv;
+}
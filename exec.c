@@ -16,6 +16,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* pipe2() */
+
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -23,10 +25,39 @@
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
+#include <time.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#include <libubox/avl-cmp.h>
+
 #include <rpcd/exec.h>
+#include <rpcd/stats.h>
+
+extern char **environ;
+
+/*
+ * Resolved command paths, keyed by command name. The cache is dropped as a
+ * whole whenever $PATH or the mtime of one of its directories changes,
+ * which is checked at most once per second.
+ */
+struct rpc_exec_path {
+	struct avl_node avl;
+	char *path;
+};
+
+struct rpc_exec_dir {
+	struct timespec mtime;
+	char *dir;
+};
+
+static struct avl_tree paths;
+static struct rpc_exec_dir *dirs;
+static int n_dirs = 0;
+static char *search_path;
+static time_t checked = 0;
 
 static int
 rpc_errno_status(void)
@@ -50,45 +81,428 @@ rpc_errno_status(void)
 	}
 }
 
+static void
+rpc_exec_lookup_flush(void)
+{
+	struct rpc_exec_path *p, *tmp;
+	int i;
+
+	if (!paths.comp)
+		avl_init(&paths, avl_strcmp, false, NULL);
+
+	avl_remove_all_elements(&paths, p, avl, tmp)
+		free(p);
+
+	for (i = 0; i < n_dirs; i++)
+		free(dirs[i].dir);
+
+	free(dirs);
+	free(search_path);
+
+	dirs = NULL;
+	n_dirs = 0;
+	search_path = NULL;
+}
+
+static bool
+rpc_exec_lookup_valid(const char *search)
+{
+	struct stat s;
+	time_t now = time(NULL);
+	int i;
+
+	if (!search_path || strcmp(search_path, search))
+		return false;
+
+	if (now == checked)
+		return true;
+
+	for (i = 0; i < n_dirs; i++)
+	{
+		if (stat(dirs[i].dir, &s))
+			memset(&s, 0, sizeof(s));
+
+		if (s.st_mtim.tv_sec != dirs[i].mtime.tv_sec ||
+		    s.st_mtim.tv_nsec != dirs[i].mtime.tv_nsec)
+			return false;
+	}
+
+	checked = now;
+
+	return true;
+}
+
+static void
+rpc_exec_lookup_init(const char *search)
+{
+	const char *p, *e;
+	struct stat s;
+	int n = 1;
+
+	rpc_exec_lookup_flush();
+
+	for (p = search; *p; p++)
+		if (*p == ':')
+			n++;
+
+	search_path = strdup(search);
+	dirs = calloc(n, sizeof(*dirs));
+
+	if (!search_path || !dirs)
+		return;
+
+	for (p = search; ; p = e + 1)
+	{
+		e = strchr(p, ':');
+
+		if (!e)
+			e = p + strlen(p);
+
+		if (e > p && (dirs[n_dirs].dir = strndup(p, e - p)) != NULL)
+		{
+			if (!stat(dirs[n_dirs].dir, &s))
+				dirs[n_dirs].mtime = s.st_mtim;
+
+			n_dirs++;
+		}
+
+		if (!*e)
+			break;
+	}
+
+	checked = time(NULL);
+}
+
+/*
+ * Resolve the given command against $PATH. Commands containing a slash are
+ * used as-is if they refer to a regular file. The returned string is valid
+ * until the next call.
+ */
 const char *
 rpc_exec_lookup(const char *cmd)
 {
+	struct rpc_exec_path *p;
 	struct stat s;
-	int plen = 0, clen = strlen(cmd) + 1;
-	char *search, *p;
-	static char path[PATH_MAX];
+	char path[PATH_MAX], *search, *str;
+	int i;
 
-	if (!stat(cmd, &s) && S_ISREG(s.st_mode))
-		return cmd;
+	if (strchr(cmd, '/'))
+		return (!stat(cmd, &s) && S_ISREG(s.st_mode)) ? cmd : NULL;
 
 	search = getenv("PATH");
 
 	if (!search)
 		search = "/bin:/usr/bin:/sbin:/usr/sbin";
 
-	p = search;
+	if (!rpc_exec_lookup_valid(search))
+		rpc_exec_lookup_init(search);
 
-	do
+	p = avl_find_element(&paths, cmd, p, avl);
+
+	if (p)
+		return p->path;
+
+	path[0] = 0;
+
+	for (i = 0; i < n_dirs; i++)
 	{
-		if (*p != ':' && *p != '\0')
+		if (snprintf(path, sizeof(path), "%s/%s", dirs[i].dir, cmd) >= sizeof(path))
 			continue;
 
-		plen = p - search;
+		if (!stat(path, &s) && S_ISREG(s.st_mode))
+			break;
+
+		path[0] = 0;
+	}
+
+	/* negative results are cached as well */
+	p = calloc_a(sizeof(*p), &str, strlen(cmd) + strlen(path) + 2);
+
+	if (!p)
+		return NULL;
 
-		if ((plen + clen) >= sizeof(path))
+	p->avl.key = strcpy(str, cmd);
+	p->path = path[0] ? strcpy(str + strlen(cmd) + 1, path) : NULL;
+	avl_insert(&paths, &p->avl);
+
+	return p->path;
+}
+
+/*
+ * Launch the given executable with stdin, stdout and stderr connected to
+ * the passed descriptors, -1 connects /dev/null instead. posix_spawn() lets
+ * the C library use vfork() semantics so the - potentially large - address
+ * space of rpcd is never copied. The descriptors should be opened with
+ * O_CLOEXEC so that no other child inherits them.
+ */
+pid_t
+rpc_exec_spawn(const char *cmd, const char * const *argv,
+               char * const *envp, int in, int out, int err)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigdef;
+	int i, rv, fds[3] = { in, out, err };
+	uint64_t start;
+	pid_t pid;
+
+	if (posix_spawn_file_actions_init(&fa))
+		return -1;
+
+	if (posix_spawnattr_init(&attr))
+	{
+		posix_spawn_file_actions_destroy(&fa);
+		return -1;
+	}
+
+	/* rpcd ignores SIGPIPE, children must not inherit that */
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGPIPE);
+
+	rv = posix_spawnattr_setsigdefault(&attr, &sigdef);
+
+	if (!rv)
+		rv = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+	for (i = 0; i < 3 && !rv; i++)
+	{
+		if (fds[i] < 0)
+			rv = posix_spawn_file_actions_addopen(&fa, i, "/dev/null",
+			                                      O_RDWR, 0);
+		else
+			rv = posix_spawn_file_actions_adddup2(&fa, fds[i], i);
+	}
+
+	start = rpc_stats_exec_begin();
+
+	if (!rv)
+		rv = posix_spawn(&pid, cmd, &fa, &attr, (char * const *)argv,
+		                 envp ? envp : environ);
+
+	rpc_stats_exec_end(RPC_STATS_EXEC_SPAWN, start,
+	                   rv ? UBUS_STATUS_UNKNOWN_ERROR : UBUS_STATUS_OK);
+
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+
+	if (rv)
+	{
+		errno = rv;
+		return -1;
+	}
+
+	return pid;
+}
+
+/*
+ * Children are admitted by a central scheduler. Each session - requests
+ * without one share an anonymous queue - has a FIFO of waiting jobs, the
+ * queues holding waiting jobs are kept on a ring which is served
+ * round-robin, one job per queue and turn, as long as neither the global
+ * nor the per-session limit is reached.
+ */
+struct rpc_exec_queue {
+	struct avl_node avl;
+	struct list_head ring;
+	struct list_head jobs;
+	int running;
+	int waiting;
+};
+
+static struct avl_tree queues;
+static LIST_HEAD(ring);
+static int running = 0;
+static int waiting = 0;
+static int max_jobs = RPC_EXEC_MAX_JOBS;
+static int max_session_jobs = RPC_EXEC_MAX_SESSION_JOBS;
+
+void
+rpc_exec_limits(int jobs, int session_jobs)
+{
+	if (jobs > 0)
+		max_jobs = jobs;
+
+	if (session_jobs > 0)
+		max_session_jobs = session_jobs;
+}
+
+static struct rpc_exec_queue *
+rpc_exec_queue_get(const char *sid)
+{
+	struct rpc_exec_queue *q;
+	char *str;
+
+	if (!queues.comp)
+		avl_init(&queues, avl_strcmp, false, NULL);
+
+	if (!sid)
+		sid = "";
+
+	q = avl_find_element(&queues, sid, q, avl);
+
+	if (q)
+		return q;
+
+	q = calloc_a(sizeof(*q), &str, strlen(sid) + 1);
+
+	if (!q)
+		return NULL;
+
+	q->avl.key = strcpy(str, sid);
+	INIT_LIST_HEAD(&q->ring);
+	INIT_LIST_HEAD(&q->jobs);
+	avl_insert(&queues, &q->avl);
+
+	return q;
+}
+
+static void
+rpc_exec_queue_put(struct rpc_exec_queue *q)
+{
+	if (!q->running && list_empty(&q->jobs))
+	{
+		avl_delete(&queues, &q->avl);
+		free(q);
+	}
+}
+
+static void
+rpc_exec_dispatch(void)
+{
+	struct rpc_exec_queue *q, *qtmp;
+	struct rpc_exec_job *j, *jtmp;
+	LIST_HEAD(admitted);
+
+	list_for_each_entry_safe(q, qtmp, &ring, ring)
+	{
+		if (running >= max_jobs)
+			break;
+
+		if (q->running >= max_session_jobs)
 			continue;
 
-		strncpy(path, search, plen);
-		sprintf(path + plen, "/%s", cmd);
+		j = list_first_entry(&q->jobs, struct rpc_exec_job, list);
+		list_move_tail(&j->list, &admitted);
+		uloop_timeout_cancel(&j->wait);
 
-		if (!stat(path, &s) && S_ISREG(s.st_mode))
-			return path;
+		q->waiting--;
+		waiting--;
+
+		q->running++;
+		running++;
 
-		search = p + 1;
+		/* requeue at the tail, the walk visits it again after the others */
+		list_del_init(&q->ring);
+
+		if (!list_empty(&q->jobs))
+			list_add_tail(&q->ring, &ring);
 	}
-	while (*p++);
 
-	return NULL;
+	/* run callbacks may release and thereby dispatch again */
+	list_for_each_entry_safe(j, jtmp, &admitted, list)
+	{
+		list_del_init(&j->list);
+		rpc_stats_exec_end(RPC_STATS_EXEC_QUEUE, j->queued, UBUS_STATUS_OK);
+
+		j->started = rpc_stats_exec_begin();
+		j->run(j);
+	}
+}
+
+static void
+rpc_exec_wait_cb(struct uloop_timeout *t)
+{
+	struct rpc_exec_job *job = container_of(t, struct rpc_exec_job, wait);
+	struct rpc_exec_queue *q = job->queue;
+
+	list_del_init(&job->list);
+	job->queue = NULL;
+
+	q->waiting--;
+	waiting--;
+
+	if (list_empty(&q->jobs))
+		list_del_init(&q->ring);
+
+	rpc_exec_queue_put(q);
+
+	rpc_stats_exec_end(RPC_STATS_EXEC_QUEUE, job->queued, UBUS_STATUS_TIMEOUT);
+	job->fail(job, UBUS_STATUS_TIMEOUT);
+}
+
+/*
+ * Queue the job for the given session, its run callback is invoked once the
+ * limits permit, possibly before this function returns. It must eventually
+ * be followed by rpc_exec_release().
+ *
+ * Jobs providing a fail callback are subject to RPC_EXEC_MAX_QUEUED and
+ * RPC_EXEC_MAX_WAITING, and are dropped after waiting RPC_EXEC_MAX_WAIT.
+ * Instead of run, fail is then invoked with the status to answer with and
+ * no release is required.
+ */
+void
+rpc_exec_schedule(struct rpc_exec_job *job, const char *sid)
+{
+	struct rpc_exec_queue *q = rpc_exec_queue_get(sid);
+
+	INIT_LIST_HEAD(&job->list);
+	job->queue = q;
+	job->queued = rpc_stats_exec_begin();
+	job->started = 0;
+
+	/* unaccounted if out of memory, better than failing the request */
+	if (!q)
+	{
+		job->run(job);
+		return;
+	}
+
+	if (job->fail &&
+	    (q->waiting >= RPC_EXEC_MAX_QUEUED || waiting >= RPC_EXEC_MAX_WAITING))
+	{
+		job->queue = NULL;
+		rpc_exec_queue_put(q);
+
+		rpc_stats_exec_end(RPC_STATS_EXEC_QUEUE, job->queued,
+		                   UBUS_STATUS_UNKNOWN_ERROR);
+		job->fail(job, UBUS_STATUS_UNKNOWN_ERROR);
+		return;
+	}
+
+	list_add_tail(&job->list, &q->jobs);
+
+	q->waiting++;
+	waiting++;
+
+	if (job->fail)
+	{
+		job->wait.cb = rpc_exec_wait_cb;
+		uloop_timeout_set(&job->wait, RPC_EXEC_MAX_WAIT);
+	}
+
+	if (list_empty(&q->ring))
+		list_add_tail(&q->ring, &ring);
+
+	rpc_exec_dispatch();
+}
+
+void
+rpc_exec_release(struct rpc_exec_job *job)
+{
+	struct rpc_exec_queue *q = job->queue;
+
+	if (!q)
+		return;
+
+	job->queue = NULL;
+
+	rpc_stats_exec_end(RPC_STATS_EXEC_RUN, job->started, UBUS_STATUS_OK);
+
+	q->running--;
+	running--;
+
+	rpc_exec_queue_put(q);
+	rpc_exec_dispatch();
 }
 
 
@@ -139,7 +553,7 @@ rpc_exec_reply(struct rpc_exec_context *c, int rv)
 			ubus_send_reply(c->context, &c->request, c->blob.head);
 	}
 
-	ubus_complete_deferred_request(c->context, &c->request, rv);
+	rpc_stats_complete(c->context, &c->request, rv);
 
 	blob_buf_free(&c->blob);
 
@@ -152,6 +566,7 @@ rpc_exec_reply(struct rpc_exec_context *c, int rv)
 	if (c->priv)
 		free(c->priv);
 
+	rpc_exec_release(&c->job);
 	free(c);
 }
 
@@ -270,110 +685,172 @@ rpc_exec_epipe_state_cb(struct ustream *s)
 		rpc_exec_reply(c, UBUS_STATUS_OK);
 }
 
-int
-rpc_exec(const char **args, rpc_exec_write_cb_t in,
-         rpc_exec_read_cb_t out, rpc_exec_read_cb_t err,
-         rpc_exec_done_cb_t end, void *priv, struct ubus_context *ctx,
-         struct ubus_request_data *req)
+/*
+ * Answer a request whose command never ran. The finish callback still runs,
+ * with a status of -1 and its result ignored, so that it can release the
+ * resources behind priv.
+ */
+static void
+rpc_exec_abort(struct rpc_exec_context *c, int rv)
+{
+	if (c->finish_cb)
+		c->finish_cb(&c->blob, -1, c->priv);
+
+	rpc_stats_complete(c->context, &c->request, rv);
+	blob_buf_free(&c->blob);
+
+	if (c->priv)
+		free(c->priv);
+
+	free(c);
+}
+
+static void
+rpc_exec_start(struct rpc_exec_job *job)
 {
 	pid_t pid;
+	int rv;
 
 	int ipipe[2];
 	int opipe[2];
 	int epipe[2];
 
-	const char *cmd;
-	struct rpc_exec_context *c;
+	struct rpc_exec_context *c =
+		container_of(job, struct rpc_exec_context, job);
 
-	cmd = rpc_exec_lookup(args[0]);
+	if (pipe2(ipipe, O_CLOEXEC))
+		goto fail_ipipe;
 
-	if (!cmd)
-		return UBUS_STATUS_NOT_FOUND;
+	if (pipe2(opipe, O_CLOEXEC))
+		goto fail_opipe;
 
-	c = malloc(sizeof(*c));
+	if (pipe2(epipe, O_CLOEXEC))
+		goto fail_epipe;
 
-	if (!c)
-		return UBUS_STATUS_UNKNOWN_ERROR;
+	pid = rpc_exec_spawn(c->cmd, c->argv, NULL, ipipe[0], opipe[1], epipe[1]);
 
-	if (pipe(ipipe))
-		goto fail_ipipe;
+	if (pid < 0)
+		goto fail_spawn;
 
-	if (pipe(opipe))
-		goto fail_opipe;
+	ustream_declare_read(c->opipe, opipe[0], opipe);
+	ustream_declare_read(c->epipe, epipe[0], epipe);
 
-	if (pipe(epipe))
-		goto fail_epipe;
+	c->process.pid = pid;
+	c->process.cb = rpc_exec_process_cb;
+	uloop_process_add(&c->process);
+
+	c->timeout.cb = rpc_exec_timeout_cb;
+	uloop_timeout_set(&c->timeout, RPC_EXEC_MAX_RUNTIME);
 
-	switch ((pid = fork()))
+	if (c->stdin_cb)
+	{
+		ustream_declare_write(c->ipipe, ipipe[1], ipipe);
+		rpc_exec_ipipe_write_cb(&c->ipipe.stream, 0);
+	}
+	else
 	{
-	case -1:
-		return rpc_errno_status();
+		close(ipipe[1]);
+	}
 
-	case 0:
-		uloop_done();
+	close(ipipe[0]);
+	close(opipe[1]);
+	close(epipe[1]);
 
-		dup2(ipipe[0], 0);
-		dup2(opipe[1], 1);
-		dup2(epipe[1], 2);
+	return;
 
-		close(ipipe[0]);
-		close(ipipe[1]);
-		close(opipe[0]);
-		close(opipe[1]);
-		close(epipe[0]);
-		close(epipe[1]);
+fail_spawn:
+	close(epipe[0]);
+	close(epipe[1]);
 
-		if (execv(cmd, (char * const *)args))
-			return rpc_errno_status();
+fail_epipe:
+	close(opipe[0]);
+	close(opipe[1]);
 
-	default:
-		memset(c, 0, sizeof(*c));
-		blob_buf_init(&c->blob, 0);
+fail_opipe:
+	close(ipipe[0]);
+	close(ipipe[1]);
 
-		c->stdin_cb  = in;
-		c->stdout_cb = out;
-		c->stderr_cb = err;
-		c->finish_cb = end;
-		c->priv      = priv;
+fail_ipipe:
+	rv = rpc_errno_status();
 
-		ustream_declare_read(c->opipe, opipe[0], opipe);
-		ustream_declare_read(c->epipe, epipe[0], epipe);
+	rpc_exec_release(&c->job);
+	rpc_exec_abort(c, rv);
+}
 
-		c->process.pid = pid;
-		c->process.cb = rpc_exec_process_cb;
-		uloop_process_add(&c->process);
+static void
+rpc_exec_fail(struct rpc_exec_job *job, int ret)
+{
+	struct rpc_exec_context *c =
+		container_of(job, struct rpc_exec_context, job);
 
-		c->timeout.cb = rpc_exec_timeout_cb;
-		uloop_timeout_set(&c->timeout, RPC_EXEC_MAX_RUNTIME);
+	rpc_exec_abort(c, ret);
+}
 
-		if (c->stdin_cb)
-		{
-			ustream_declare_write(c->ipipe, ipipe[1], ipipe);
-			rpc_exec_ipipe_write_cb(&c->ipipe.stream, 0);
-		}
-		else
-		{
-			close(ipipe[1]);
-		}
+/*
+ * Like rpc_exec() but account the child to the given session, so that its
+ * concurrency limit applies. The request is always deferred, the process is
+ * launched as soon as the scheduler admits it.
+ */
+int
+rpc_exec_as(const char *sid, const char **args, rpc_exec_write_cb_t in,
+            rpc_exec_read_cb_t out, rpc_exec_read_cb_t err,
+            rpc_exec_done_cb_t end, void *priv, struct ubus_context *ctx,
+            struct ubus_request_data *req)
+{
+	const char *cmd, **argv;
+	struct rpc_exec_context *c;
+	size_t len;
+	char *str;
+	int i, n;
+
+	cmd = rpc_exec_lookup(args[0]);
+
+	if (!cmd)
+		return UBUS_STATUS_NOT_FOUND;
+
+	/* the argument vector may live on the stack of the caller */
+	for (n = 0, len = strlen(cmd) + 1; args[n]; n++)
+		len += strlen(args[n]) + 1;
+
+	c = calloc_a(sizeof(*c), &argv, (n + 1) * sizeof(*argv), &str, len);
 
-		close(ipipe[0]);
-		close(opipe[1]);
-		close(epipe[1]);
+	if (!c)
+		return UBUS_STATUS_UNKNOWN_ERROR;
 
-		c->context = ctx;
-		ubus_defer_request(ctx, req, &c->request);
+	c->cmd = strcpy(str, cmd);
+	str += strlen(str) + 1;
+
+	for (i = 0; i < n; i++)
+	{
+		argv[i] = strcpy(str, args[i]);
+		str += strlen(str) + 1;
 	}
 
-	return UBUS_STATUS_OK;
+	c->argv = argv;
 
-fail_epipe:
-	close(opipe[0]);
-	close(opipe[1]);
+	blob_buf_init(&c->blob, 0);
 
-fail_opipe:
-	close(ipipe[0]);
-	close(ipipe[1]);
+	c->stdin_cb  = in;
+	c->stdout_cb = out;
+	c->stderr_cb = err;
+	c->finish_cb = end;
+	c->priv      = priv;
 
-fail_ipipe:
-	return rpc_errno_status();
+	c->context = ctx;
+	ubus_defer_request(ctx, req, &c->request);
+
+	c->job.run = rpc_exec_start;
+	c->job.fail = rpc_exec_fail;
+	rpc_exec_schedule(&c->job, sid);
+
+	return UBUS_STATUS_OK;
+}
+
+int
+rpc_exec(const char **args, rpc_exec_write_cb_t in,
+         rpc_exec_read_cb_t out, rpc_exec_read_cb_t err,
+         rpc_exec_done_cb_t end, void *priv, struct ubus_context *ctx,
+         struct ubus_request_data *req)
+{
+	return rpc_exec_as(NULL, args, in, out, err, end, priv, ctx, req);
 }
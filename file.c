@@ -17,6 +17,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* pipe2(), asprintf() */
+
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -24,15 +26,18 @@
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <libubus.h>
+#include <libubox/avl.h>
 #include <libubox/blobmsg.h>
 #include <libubox/md5.h>
 #include <libubox/ustream.h>
 #include <libubox/utils.h>
 
 #include <rpcd/plugin.h>
+#include <rpcd/sha256.h>
 
 /* limit of sys & proc files */
 #define RPC_FILE_MIN_SIZE		(128)
@@ -41,6 +46,27 @@
 #define RPC_FILE_MAX_SIZE		(4096 * 64)
 #define RPC_FILE_MAX_RUNTIME	(3 * 1000)
 
+/* streamed commands are killed after this time */
+#define RPC_FILE_STREAM_MAX_RUNTIME	(10 * 60 * 1000)
+
+/* abandoned uploads are discarded after this time */
+#define RPC_FILE_UPLOAD_TIMEOUT	(60 * 1000)
+
+/* upper limit of concurrently open uploads */
+#define RPC_FILE_UPLOAD_MAX		8
+
+/* number of cached file digests */
+#define RPC_FILE_DIGEST_CACHE_SIZE	16
+
+/* files up to this size are hashed in place, larger ones on a thread */
+#define RPC_FILE_DIGEST_INLINE_SIZE	(4096 * 16)
+
+/* read size of the digest computation */
+#define RPC_FILE_DIGEST_BUFFER_SIZE	(4096 * 32)
+
+/* size of the chunks of streamed reads */
+#define RPC_FILE_CHUNK_SIZE		(4096 * 16)
+
 #define ustream_for_each_read_buffer(stream, ptr, len) \
 	for (ptr = ustream_get_read_buf(stream, &len);     \
 	     ptr != NULL && len > 0;                       \
@@ -54,7 +80,14 @@
 	us.stream.notify_state  = rpc_file_##name##_state_cb; \
 	ustream_fd_init(&us, fd);
 
+static const struct rpc_daemon_ops *ops;
+
 struct rpc_file_exec_context {
+	struct rpc_exec_job job;
+	char *cmd;
+	struct blob_attr *arg;
+	struct blob_attr *env;
+	bool stream;
 	struct ubus_context *context;
 	struct ubus_request_data request;
 	struct uloop_timeout timeout;
@@ -69,7 +102,86 @@ struct rpc_file_exec_context {
 };
 
 
+struct rpc_file_read_context {
+	struct rpc_worker_job job;
+	struct stat s;
+	int fd;
+	bool base64;
+	bool ranged;
+	off_t offset;
+	off_t end;
+};
+
+/* copy of a request whose handler body runs on a worker */
+struct rpc_file_call {
+	struct rpc_worker_job job;
+	int (*body)(struct blob_attr *msg, struct blob_buf *b);
+	struct blob_attr *msg;
+};
+
+enum rpc_file_durability {
+	RPC_FILE_DURABILITY_SYNC,
+	RPC_FILE_DURABILITY_NONE,
+	RPC_FILE_DURABILITY_DATASYNC,
+	RPC_FILE_DURABILITY_ATOMIC,
+};
+
+struct rpc_file_upload {
+	struct rpc_worker_job job;
+	struct list_head list;
+	struct uloop_timeout timeout;
+	enum rpc_file_durability durability;
+	bool commit;
+	uint32_t id;
+	int fd;
+	off_t offset;
+	char *path;
+	char *tmp;
+	char *sid;
+};
+
+struct rpc_file_digest_key {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	time_t mtime;
+	long mtime_nsec;
+};
+
+struct rpc_file_digest {
+	struct avl_node avl;
+	struct list_head lru;
+	struct rpc_file_digest_key key;
+	uint8_t md5[16];
+	uint8_t sha256[RPC_SHA256_LEN];
+};
+
+struct rpc_file_digest_job {
+	struct rpc_worker_job job;
+	struct list_head list;
+	struct list_head waiters;
+	struct rpc_file_digest_key key;
+	int fd;
+	int err;
+	uint8_t md5[16];
+	uint8_t sha256[RPC_SHA256_LEN];
+};
+
+struct rpc_file_digest_waiter {
+	struct list_head list;
+	struct ubus_context *context;
+	struct ubus_request_data request;
+	bool sha256;
+};
+
+
 static struct blob_buf buf;
+static struct avl_tree digests;
+static LIST_HEAD(digests_lru);
+static LIST_HEAD(digest_jobs);
+static LIST_HEAD(uploads);
+static uint32_t upload_id = 0;
+static int n_uploads = 0;
 
 enum {
 	RPC_F_R_PATH,
@@ -80,15 +192,38 @@ static const struct blobmsg_policy rpc_file_r_policy[__RPC_F_R_MAX] = {
 	[RPC_F_R_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+	RPC_F_L_PATH,
+	RPC_F_L_STAT,
+	RPC_F_L_OFFSET,
+	RPC_F_L_LIMIT,
+	RPC_F_L_FILTER,
+	__RPC_F_L_MAX,
+};
+
+static const struct blobmsg_policy rpc_file_l_policy[__RPC_F_L_MAX] = {
+	[RPC_F_L_PATH]   = { .name = "path",   .type = BLOBMSG_TYPE_STRING },
+	[RPC_F_L_STAT]   = { .name = "stat",   .type = BLOBMSG_TYPE_BOOL   },
+	[RPC_F_L_OFFSET] = { .name = "offset", .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_L_LIMIT]  = { .name = "limit",  .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_L_FILTER] = { .name = "filter", .type = BLOBMSG_TYPE_STRING },
+};
+
 enum {
 	RPC_F_RB_PATH,
 	RPC_F_RB_BASE64,
+	RPC_F_RB_OFFSET,
+	RPC_F_RB_LENGTH,
+	RPC_F_RB_STREAM,
 	__RPC_F_RB_MAX,
 };
 
 static const struct blobmsg_policy rpc_file_rb_policy[__RPC_F_RB_MAX] = {
 	[RPC_F_RB_PATH]   = { .name = "path",   .type = BLOBMSG_TYPE_STRING },
 	[RPC_F_RB_BASE64] = { .name = "base64", .type = BLOBMSG_TYPE_BOOL   },
+	[RPC_F_RB_OFFSET] = { .name = "offset", .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_RB_LENGTH] = { .name = "length", .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_RB_STREAM] = { .name = "stream", .type = BLOBMSG_TYPE_BOOL   },
 };
 
 enum {
@@ -97,6 +232,7 @@ enum {
 	RPC_F_RW_APPEND,
 	RPC_F_RW_MODE,
 	RPC_F_RW_BASE64,
+	RPC_F_RW_DURABILITY,
 	__RPC_F_RW_MAX,
 };
 
@@ -106,19 +242,74 @@ static const struct blobmsg_policy rpc_file_rw_policy[__RPC_F_RW_MAX] = {
 	[RPC_F_RW_APPEND] = { .name = "append", .type = BLOBMSG_TYPE_BOOL  },
 	[RPC_F_RW_MODE]   = { .name = "mode",   .type = BLOBMSG_TYPE_INT32  },
 	[RPC_F_RW_BASE64] = { .name = "base64", .type = BLOBMSG_TYPE_BOOL   },
+	[RPC_F_RW_DURABILITY] = { .name = "durability",
+	                          .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_F_UO_PATH,
+	RPC_F_UO_MODE,
+	RPC_F_UO_DURABILITY,
+	RPC_F_UO_SESSION,
+	__RPC_F_UO_MAX,
+};
+
+static const struct blobmsg_policy rpc_file_uo_policy[__RPC_F_UO_MAX] = {
+	[RPC_F_UO_PATH]       = { .name = "path",       .type = BLOBMSG_TYPE_STRING },
+	[RPC_F_UO_MODE]       = { .name = "mode",       .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_UO_DURABILITY] = { .name = "durability", .type = BLOBMSG_TYPE_STRING },
+	[RPC_F_UO_SESSION]    = { .name = "ubus_rpc_session",
+	                          .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_F_UA_HANDLE,
+	RPC_F_UA_OFFSET,
+	RPC_F_UA_DATA,
+	RPC_F_UA_BASE64,
+	RPC_F_UA_SESSION,
+	__RPC_F_UA_MAX,
+};
+
+static const struct blobmsg_policy rpc_file_ua_policy[__RPC_F_UA_MAX] = {
+	[RPC_F_UA_HANDLE]  = { .name = "handle", .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_UA_OFFSET]  = { .name = "offset", .type = BLOBMSG_TYPE_INT32  },
+	[RPC_F_UA_DATA]    = { .name = "data",   .type = BLOBMSG_TYPE_STRING },
+	[RPC_F_UA_BASE64]  = { .name = "base64", .type = BLOBMSG_TYPE_BOOL   },
+	[RPC_F_UA_SESSION] = { .name = "ubus_rpc_session",
+	                       .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_F_UC_HANDLE,
+	RPC_F_UC_ABORT,
+	RPC_F_UC_SESSION,
+	__RPC_F_UC_MAX,
+};
+
+static const struct blobmsg_policy rpc_file_uc_policy[__RPC_F_UC_MAX] = {
+	[RPC_F_UC_HANDLE]  = { .name = "handle", .type = BLOBMSG_TYPE_INT32 },
+	[RPC_F_UC_ABORT]   = { .name = "abort",  .type = BLOBMSG_TYPE_BOOL  },
+	[RPC_F_UC_SESSION] = { .name = "ubus_rpc_session",
+	                       .type = BLOBMSG_TYPE_STRING },
 };
 
 enum {
 	RPC_E_CMD,
 	RPC_E_PARM,
 	RPC_E_ENV,
+	RPC_E_STREAM,
+	RPC_E_SESSION,
 	__RPC_E_MAX,
 };
 
 static const struct blobmsg_policy rpc_exec_policy[__RPC_E_MAX] = {
-	[RPC_E_CMD]  = { .name = "command", .type = BLOBMSG_TYPE_STRING },
-	[RPC_E_PARM] = { .name = "params",  .type = BLOBMSG_TYPE_ARRAY  },
-	[RPC_E_ENV]  = { .name = "env",     .type = BLOBMSG_TYPE_TABLE  },
+	[RPC_E_CMD]    = { .name = "command", .type = BLOBMSG_TYPE_STRING },
+	[RPC_E_PARM]   = { .name = "params",  .type = BLOBMSG_TYPE_ARRAY  },
+	[RPC_E_ENV]    = { .name = "env",     .type = BLOBMSG_TYPE_TABLE  },
+	[RPC_E_STREAM] = { .name = "stream",  .type = BLOBMSG_TYPE_BOOL   },
+	[RPC_E_SESSION] = { .name = "ubus_rpc_session",
+	                    .type = BLOBMSG_TYPE_STRING },
 };
 
 static const char *d_types[] = {
@@ -156,10 +347,9 @@ rpc_errno_status(void)
 }
 
 static struct blob_attr **
-rpc_check_path(struct blob_attr *msg, char **path, struct stat *s)
+rpc_check_path(struct blob_attr *msg, struct blob_attr **tb, char **path,
+               struct stat *s)
 {
-	static struct blob_attr *tb[__RPC_F_R_MAX];
-
 	blobmsg_parse(rpc_file_r_policy, __RPC_F_R_MAX, tb, blob_data(msg), blob_len(msg));
 
 	if (!tb[RPC_F_R_PATH])
@@ -176,18 +366,167 @@ rpc_check_path(struct blob_attr *msg, char **path, struct stat *s)
 	return tb;
 }
 
+static int
+rpc_file_call_run(struct rpc_worker_job *job)
+{
+	struct rpc_file_call *c = container_of(job, struct rpc_file_call, job);
+
+	return c->body(c->msg, &job->buf);
+}
+
+static void
+rpc_file_call_done(struct rpc_worker_job *job, int ret)
+{
+	ops->worker_complete(job, ret);
+	free(container_of(job, struct rpc_file_call, job));
+}
+
+/*
+ * Run a handler body, which must not touch any state shared with the main
+ * loop, on a worker and reply with the buffer it filled.
+ */
+static int
+rpc_file_call(struct ubus_context *ctx, struct ubus_request_data *req,
+              struct blob_attr *msg,
+              int (*body)(struct blob_attr *, struct blob_buf *))
+{
+	struct rpc_file_call *c;
+	struct blob_attr *m;
+	int rv;
+
+	c = calloc_a(sizeof(*c), &m, blob_pad_len(msg));
+
+	if (!c)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	c->msg = memcpy(m, msg, blob_pad_len(msg));
+	c->body = body;
+	c->job.run = rpc_file_call_run;
+	c->job.done = rpc_file_call_done;
+
+	if ((rv = ops->worker_submit(&c->job, ctx, req)) != UBUS_STATUS_OK)
+		free(c);
+
+	return rv;
+}
+
+static ssize_t
+rpc_file_read_data(int fd, char *dst, off_t offset, size_t len)
+{
+	ssize_t rlen, total = 0;
+
+	while (total < len)
+	{
+		rlen = pread(fd, dst + total, len - total, offset + total);
+
+		if (rlen < 0 && errno == EINTR)
+			continue;
+
+		if (rlen < 0)
+			return (total > 0) ? total : -1;
+
+		if (rlen == 0)
+			break;
+
+		total += rlen;
+	}
+
+	return total;
+}
+
+/*
+ * Put up to len bytes at offset into b as "data". For base64 the raw
+ * bytes are read into the tail of the string buffer and encoded towards
+ * its head, which never overtakes the unread input, so no second copy is
+ * needed. Ranged replies also describe the returned range.
+ */
+static int
+rpc_file_read_range(struct blob_buf *b, int fd, const struct stat *s,
+                    off_t offset, size_t len, bool base64, bool ranged,
+                    bool *eof)
+{
+	size_t size = base64 ? B64_ENCODE_LEN(len) : len + 1;
+	ssize_t rlen, dlen;
+	char *wbuf, *data;
+
+	blob_buf_init(b, 0);
+
+	wbuf = blobmsg_alloc_string_buffer(b, "data", size);
+
+	if (!wbuf)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	data = base64 ? wbuf + size - 1 - len : wbuf;
+
+	if ((rlen = rpc_file_read_data(fd, data, offset, len)) < 0)
+		return rpc_errno_status();
+
+	if (rlen == 0 && !ranged)
+		return UBUS_STATUS_NO_DATA;
+
+	dlen = rlen;
+
+	if (base64 && (dlen = b64_encode(data, rlen, wbuf, size)) < 0)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	*(wbuf + dlen) = '\0';
+	blobmsg_add_string_buffer(b);
+
+	*eof = (rlen < len || (s->st_size > 0 && offset + rlen >= s->st_size));
+
+	if (ranged)
+	{
+		blobmsg_add_u32(b, "offset", offset);
+		blobmsg_add_u32(b, "length", rlen);
+		blobmsg_add_u32(b, "size", s->st_size);
+		blobmsg_add_u8(b, "eof", *eof);
+	}
+
+	return UBUS_STATUS_OK;
+}
+
+static int
+rpc_file_read_run(struct rpc_worker_job *job)
+{
+	struct rpc_file_read_context *c =
+		container_of(job, struct rpc_file_read_context, job);
+	bool eof;
+
+	return rpc_file_read_range(&job->buf, c->fd, &c->s, c->offset,
+	                           c->end - c->offset, c->base64, c->ranged, &eof);
+}
+
+static void
+rpc_file_read_done(struct rpc_worker_job *job, int ret)
+{
+	struct rpc_file_read_context *c =
+		container_of(job, struct rpc_file_read_context, job);
+
+	ops->worker_complete(job, ret);
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * Without offset, length or stream the whole file is returned, as long as
+ * it is smaller than RPC_FILE_MAX_SIZE. Ranged reads return at most that
+ * much along with the range and an "eof" flag, the next range starts at
+ * "offset" + "length". Streamed reads are ranged reads of at most
+ * RPC_FILE_CHUNK_SIZE, the caller pulls the file chunk by chunk by
+ * following that cursor until "eof" is set.
+ */
 static int
 rpc_file_read(struct ubus_context *ctx, struct ubus_object *obj,
               struct ubus_request_data *req, const char *method,
               struct blob_attr *msg)
 {
-	static struct blob_attr *tb[__RPC_F_RB_MAX];
-	bool base64 = false;
+	struct blob_attr *tb[__RPC_F_RB_MAX];
+	struct rpc_file_read_context *c;
+	bool base64 = false, ranged, stream;
+	off_t offset = 0, end;
 	int fd, rv;
-	ssize_t len;
 	char *path;
 	struct stat s;
-	char *wbuf;
 
 	blobmsg_parse(rpc_file_rb_policy, __RPC_F_RB_MAX, tb, blob_data(msg), blob_len(msg));
 
@@ -199,280 +538,1057 @@ rpc_file_read(struct ubus_context *ctx, struct ubus_object *obj,
 	if (stat(path, &s))
 		return rpc_errno_status();
 
-	if (s.st_size >= RPC_FILE_MAX_SIZE)
+	stream = tb[RPC_F_RB_STREAM] && blobmsg_get_bool(tb[RPC_F_RB_STREAM]);
+	ranged = tb[RPC_F_RB_OFFSET] || tb[RPC_F_RB_LENGTH] || stream;
+
+	if (!ranged && s.st_size >= RPC_FILE_MAX_SIZE)
 		return UBUS_STATUS_NOT_SUPPORTED;
 
-	if ((fd = open(path, O_RDONLY)) < 0)
-		return rpc_errno_status();
+	if (tb[RPC_F_RB_BASE64])
+		base64 = blobmsg_get_bool(tb[RPC_F_RB_BASE64]);
+
+	if (tb[RPC_F_RB_OFFSET])
+		offset = blobmsg_get_u32(tb[RPC_F_RB_OFFSET]);
 
 	/* some sysfs files do not report a length */
-	if (s.st_size == 0)
-		s.st_size = RPC_FILE_MIN_SIZE;
+	if (tb[RPC_F_RB_LENGTH])
+		end = offset + blobmsg_get_u32(tb[RPC_F_RB_LENGTH]);
+	else if (s.st_size == 0)
+		end = offset + (ranged ? RPC_FILE_MAX_SIZE - 1 : RPC_FILE_MIN_SIZE);
+	else
+		end = (offset < s.st_size) ? s.st_size : offset;
+
+	if (stream && end - offset > RPC_FILE_CHUNK_SIZE)
+		end = offset + RPC_FILE_CHUNK_SIZE;
+	else if (end - offset >= RPC_FILE_MAX_SIZE)
+		end = offset + RPC_FILE_MAX_SIZE - 1;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return rpc_errno_status();
+
+	c = calloc(1, sizeof(*c));
+
+	if (!c)
+	{
+		close(fd);
+		return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	c->s = s;
+	c->fd = fd;
+	c->base64 = base64;
+	c->ranged = ranged;
+	c->offset = offset;
+	c->end = end;
+	c->job.run = rpc_file_read_run;
+	c->job.done = rpc_file_read_done;
+
+	if ((rv = ops->worker_submit(&c->job, ctx, req)) != UBUS_STATUS_OK)
+	{
+		close(fd);
+		free(c);
+	}
+
+	return rv;
+}
+
+static bool
+rpc_file_parse_durability(struct blob_attr *attr, enum rpc_file_durability *d)
+{
+	const char *val;
+
+	*d = RPC_FILE_DURABILITY_SYNC;
+
+	if (!attr)
+		return true;
+
+	val = blobmsg_get_string(attr);
+
+	if (!strcmp(val, "none"))
+		*d = RPC_FILE_DURABILITY_NONE;
+	else if (!strcmp(val, "datasync"))
+		*d = RPC_FILE_DURABILITY_DATASYNC;
+	else if (!strcmp(val, "atomic"))
+		*d = RPC_FILE_DURABILITY_ATOMIC;
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * Open the file to write to. Atomic writes go to a temporary file next to
+ * the target which is renamed into place by rpc_file_commit(), it takes
+ * over the owner and, unless a mode was given, the mode of an existing
+ * target like an in-place write would keep them.
+ */
+static int
+rpc_file_open(const char *path, mode_t mode, bool set_mode, int append,
+              enum rpc_file_durability d, char **tmp)
+{
+	struct stat s;
+	bool exists;
+	int fd;
+
+	*tmp = NULL;
+
+	/*
+	 * The umask is process wide and cannot be cleared for a single open()
+	 * while workers create files, so new files get their mode by fchmod().
+	 */
+	if (d != RPC_FILE_DURABILITY_ATOMIC)
+	{
+		fd = open(path, O_WRONLY | O_CLOEXEC | append);
+
+		if (fd >= 0 || errno != ENOENT)
+			return fd;
+
+		fd = open(path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC | append, mode);
+
+		if (fd >= 0)
+			fchmod(fd, mode);
+		else if (errno == EEXIST)
+			fd = open(path, O_WRONLY | O_CLOEXEC | append);
+
+		return fd;
+	}
+
+	if (asprintf(tmp, "%s.XXXXXX", path) < 0)
+	{
+		*tmp = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	exists = !stat(path, &s);
+
+	if (!exists && errno != ENOENT)
+	{
+		free(*tmp);
+		*tmp = NULL;
+
+		return -1;
+	}
+
+	if (exists && !set_mode)
+		mode = s.st_mode & 07777;
+
+	fd = mkostemp(*tmp, O_CLOEXEC);
+
+	if (fd < 0 || (exists && fchown(fd, s.st_uid, s.st_gid) < 0) ||
+	    fchmod(fd, mode) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(*tmp);
+		}
+
+		free(*tmp);
+		*tmp = NULL;
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+rpc_file_write_all(int fd, const char *data, size_t len)
+{
+	ssize_t wlen;
+
+	while (len > 0)
+	{
+		wlen = write(fd, data, len);
+
+		if (wlen < 0 && errno == EINTR)
+			continue;
+
+		if (wlen < 0)
+			return -1;
+
+		data += wlen;
+		len -= wlen;
+	}
+
+	return 0;
+}
+
+static int
+rpc_file_sync_dir(const char *path)
+{
+	char *dir, *p;
+	int fd, rv;
+
+	if ((dir = strdup(path)) == NULL)
+		return -1;
+
+	p = strrchr(dir, '/');
+
+	if (p == dir)
+		p[1] = 0;
+	else if (p)
+		*p = 0;
+	else
+		strcpy(dir, ".");
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir);
+
+	if (fd < 0)
+		return -1;
+
+	rv = fsync(fd);
+	close(fd);
+
+	return rv;
+}
+
+/*
+ * Flush and close the descriptor according to the requested durability.
+ * "none" leaves flushing to the kernel, "datasync" flushes the file data,
+ * "atomic" flushes the temporary file, renames it over the target and
+ * flushes the directory. Without durability the file is fsync()ed as well
+ * as the whole system sync()ed, which is what file.write always did.
+ */
+static int
+rpc_file_commit(int fd, enum rpc_file_durability d, int rv,
+                char *tmp, const char *path)
+{
+	switch (d)
+	{
+	case RPC_FILE_DURABILITY_NONE:
+		break;
+
+	case RPC_FILE_DURABILITY_DATASYNC:
+	case RPC_FILE_DURABILITY_ATOMIC:
+		if (fdatasync(fd) < 0)
+			rv = -1;
+		break;
+
+	case RPC_FILE_DURABILITY_SYNC:
+		if (fsync(fd) < 0)
+			rv = -1;
+		break;
+	}
+
+	close(fd);
+
+	if (d == RPC_FILE_DURABILITY_SYNC)
+		sync();
+
+	if (tmp)
+	{
+		if (!rv && (rename(tmp, path) || rpc_file_sync_dir(path)))
+			rv = -1;
+
+		if (rv)
+			unlink(tmp);
+
+		free(tmp);
+	}
+
+	return rv;
+}
+
+static int
+__rpc_file_write(struct blob_attr *msg, struct blob_buf *b)
+{
+	struct blob_attr *tb[__RPC_F_RW_MAX];
+	enum rpc_file_durability durability;
+	int append = O_TRUNC;
+	mode_t mode = 0666;
+	int fd, rv = 0;
+	void *data = NULL;
+	ssize_t data_len = 0;
+	char *tmp;
+
+	blobmsg_parse(rpc_file_rw_policy, __RPC_F_RW_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_F_RW_PATH] || !tb[RPC_F_RW_DATA])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_file_parse_durability(tb[RPC_F_RW_DURABILITY], &durability))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	data = blobmsg_data(tb[RPC_F_RW_DATA]);
+	data_len = blobmsg_data_len(tb[RPC_F_RW_DATA]) - 1;
+
+	if (tb[RPC_F_RW_APPEND] && blobmsg_get_bool(tb[RPC_F_RW_APPEND]))
+		append = O_APPEND;
+
+	/* the temporary file does not carry the previous contents */
+	if (append == O_APPEND && durability == RPC_FILE_DURABILITY_ATOMIC)
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	if (tb[RPC_F_RW_MODE])
+		mode = blobmsg_get_u32(tb[RPC_F_RW_MODE]);
+
+	fd = rpc_file_open(blobmsg_data(tb[RPC_F_RW_PATH]), mode,
+	                   !!tb[RPC_F_RW_MODE], append, durability, &tmp);
+
+	if (fd < 0)
+		return rpc_errno_status();
+
+	if (tb[RPC_F_RW_BASE64] && blobmsg_get_bool(tb[RPC_F_RW_BASE64]))
+	{
+		data_len = b64_decode(data, data, data_len);
+		if (data_len < 0)
+		{
+			errno = EINVAL;
+			rv = -1;
+			goto out;
+		}
+	}
+
+	if (rpc_file_write_all(fd, data, data_len) < 0)
+		rv = -1;
+
+out:
+	if (rpc_file_commit(fd, durability, rv, tmp,
+	                    blobmsg_data(tb[RPC_F_RW_PATH])))
+		return rpc_errno_status();
+
+	return 0;
+}
+
+static int
+rpc_file_write(struct ubus_context *ctx, struct ubus_object *obj,
+               struct ubus_request_data *req, const char *method,
+               struct blob_attr *msg)
+{
+	return rpc_file_call(ctx, req, msg, __rpc_file_write);
+}
+
+/*
+ * Chunked uploads. upload_open returns a handle which upload_append calls
+ * fill in order, each one stating the offset it expects to write at, and
+ * upload_close commits with the durability requested at open, so the file
+ * is flushed once instead of after each chunk. Handles are bound to the
+ * session that opened them and discarded after RPC_FILE_UPLOAD_TIMEOUT of
+ * inactivity. The final commit runs on a worker.
+ */
+static void
+rpc_file_upload_detach(struct rpc_file_upload *u)
+{
+	uloop_timeout_cancel(&u->timeout);
+	list_del(&u->list);
+	n_uploads--;
+}
+
+static int
+rpc_file_upload_run(struct rpc_worker_job *job)
+{
+	struct rpc_file_upload *u = container_of(job, struct rpc_file_upload, job);
+
+	/* a failed commit removes the temporary file of atomic uploads */
+	if (rpc_file_commit(u->fd,
+	                    u->commit ? u->durability : RPC_FILE_DURABILITY_NONE,
+	                    u->commit ? 0 : -1, u->tmp, u->path) && u->commit)
+		return rpc_errno_status();
+
+	blob_buf_init(&job->buf, 0);
+	blobmsg_add_u32(&job->buf, "size", u->offset);
+
+	return UBUS_STATUS_OK;
+}
+
+static void
+rpc_file_upload_done(struct rpc_worker_job *job, int ret)
+{
+	ops->worker_complete(job, ret);
+	free(container_of(job, struct rpc_file_upload, job));
+}
+
+static void
+rpc_file_upload_free(struct rpc_file_upload *u)
+{
+	rpc_file_upload_detach(u);
+	rpc_file_upload_run(&u->job);
+	blob_buf_free(&u->job.buf);
+	free(u);
+}
+
+static void
+rpc_file_upload_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_file_upload *u =
+		container_of(t, struct rpc_file_upload, timeout);
+
+	rpc_file_upload_free(u);
+}
+
+static struct rpc_file_upload *
+rpc_file_upload_find(struct blob_attr *handle, struct blob_attr *sid)
+{
+	struct rpc_file_upload *u;
+
+	if (!handle)
+		return NULL;
+
+	list_for_each_entry(u, &uploads, list)
+	{
+		if (u->id != blobmsg_get_u32(handle))
+			continue;
+
+		if (strcmp(u->sid, sid ? blobmsg_data(sid) : ""))
+			return NULL;
+
+		return u;
+	}
+
+	return NULL;
+}
+
+static int
+rpc_file_upload_open(struct ubus_context *ctx, struct ubus_object *obj,
+                     struct ubus_request_data *req, const char *method,
+                     struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_F_UO_MAX];
+	enum rpc_file_durability durability;
+	struct rpc_file_upload *u;
+	const char *sid;
+	char *path, *sidstr;
+	mode_t mode = 0666;
+	int fd;
+
+	blobmsg_parse(rpc_file_uo_policy, __RPC_F_UO_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_F_UO_PATH])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_file_parse_durability(tb[RPC_F_UO_DURABILITY], &durability))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (n_uploads >= RPC_FILE_UPLOAD_MAX)
+		return UBUS_STATUS_NOT_SUPPORTED;
+
+	if (tb[RPC_F_UO_MODE])
+		mode = blobmsg_get_u32(tb[RPC_F_UO_MODE]);
+
+	sid = tb[RPC_F_UO_SESSION] ? blobmsg_data(tb[RPC_F_UO_SESSION]) : "";
+
+	u = calloc_a(sizeof(*u),
+		&path, strlen(blobmsg_data(tb[RPC_F_UO_PATH])) + 1,
+		&sidstr, strlen(sid) + 1);
+
+	if (!u)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	u->path = strcpy(path, blobmsg_data(tb[RPC_F_UO_PATH]));
+	u->sid = strcpy(sidstr, sid);
+
+	fd = rpc_file_open(u->path, mode, !!tb[RPC_F_UO_MODE], O_TRUNC,
+	                   durability, &u->tmp);
+
+	if (fd < 0)
+	{
+		free(u);
+		return rpc_errno_status();
+	}
+
+	u->fd = fd;
+	u->id = ++upload_id;
+	u->durability = durability;
+	u->timeout.cb = rpc_file_upload_timeout_cb;
+	uloop_timeout_set(&u->timeout, RPC_FILE_UPLOAD_TIMEOUT);
+
+	list_add(&u->list, &uploads);
+	n_uploads++;
 
 	blob_buf_init(&buf, 0);
+	blobmsg_add_u32(&buf, "handle", u->id);
+	ubus_send_reply(ctx, req, buf.head);
+	blob_buf_free(&buf);
 
-	if (tb[RPC_F_RB_BASE64])
-		base64 = blobmsg_get_bool(tb[RPC_F_RB_BASE64]);
+	return UBUS_STATUS_OK;
+}
+
+static int
+rpc_file_upload_append(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_F_UA_MAX];
+	struct rpc_file_upload *u;
+	ssize_t data_len;
+	void *data;
+	int rv;
+
+	blobmsg_parse(rpc_file_ua_policy, __RPC_F_UA_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_F_UA_OFFSET] || !tb[RPC_F_UA_DATA])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	u = rpc_file_upload_find(tb[RPC_F_UA_HANDLE], tb[RPC_F_UA_SESSION]);
+
+	if (!u)
+		return UBUS_STATUS_NOT_FOUND;
+
+	/* lost or repeated chunk */
+	if (blobmsg_get_u32(tb[RPC_F_UA_OFFSET]) != u->offset)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	data = blobmsg_data(tb[RPC_F_UA_DATA]);
+	data_len = blobmsg_data_len(tb[RPC_F_UA_DATA]) - 1;
+
+	if (tb[RPC_F_UA_BASE64] && blobmsg_get_bool(tb[RPC_F_UA_BASE64]))
+	{
+		data_len = b64_decode(data, data, data_len);
+
+		if (data_len < 0)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+	}
+
+	if (rpc_file_write_all(u->fd, data, data_len) < 0)
+	{
+		rv = rpc_errno_status();
+		rpc_file_upload_free(u);
+		return rv;
+	}
+
+	u->offset += data_len;
+	uloop_timeout_set(&u->timeout, RPC_FILE_UPLOAD_TIMEOUT);
+
+	blob_buf_init(&buf, 0);
+	blobmsg_add_u32(&buf, "offset", u->offset);
+	ubus_send_reply(ctx, req, buf.head);
+	blob_buf_free(&buf);
+
+	return UBUS_STATUS_OK;
+}
+
+static int
+rpc_file_upload_close(struct ubus_context *ctx, struct ubus_object *obj,
+                      struct ubus_request_data *req, const char *method,
+                      struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_F_UC_MAX];
+	struct rpc_file_upload *u;
+	int rv;
+
+	blobmsg_parse(rpc_file_uc_policy, __RPC_F_UC_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	u = rpc_file_upload_find(tb[RPC_F_UC_HANDLE], tb[RPC_F_UC_SESSION]);
+
+	if (!u)
+		return UBUS_STATUS_NOT_FOUND;
+
+	u->commit = !tb[RPC_F_UC_ABORT] || !blobmsg_get_bool(tb[RPC_F_UC_ABORT]);
+	u->job.run = rpc_file_upload_run;
+	u->job.done = rpc_file_upload_done;
+
+	rpc_file_upload_detach(u);
+
+	if ((rv = ops->worker_submit(&u->job, ctx, req)) != UBUS_STATUS_OK)
+	{
+		u->commit = false;
+		rpc_file_upload_run(&u->job);
+		blob_buf_free(&u->job.buf);
+		free(u);
+	}
+
+	return rv;
+}
+
+/*
+ * Digests of regular files are cached by device, inode, size and mtime and
+ * computed together in one pass, md5 and sha256 alike. Files larger than
+ * RPC_FILE_DIGEST_INLINE_SIZE are hashed on a worker. Concurrent requests
+ * for the same file wait for the same job.
+ */
+static int
+rpc_file_digest_cmp(const void *k1, const void *k2, void *ptr)
+{
+	return memcmp(k1, k2, sizeof(struct rpc_file_digest_key));
+}
+
+static void
+rpc_file_digest_compute(struct rpc_file_digest_job *job)
+{
+	md5_ctx_t md5;
+	rpc_sha256_ctx_t sha256;
+	ssize_t len;
+	char *data;
+
+	data = malloc(RPC_FILE_DIGEST_BUFFER_SIZE);
+
+	if (!data)
+	{
+		job->err = ENOMEM;
+		return;
+	}
+
+	md5_begin(&md5);
+	rpc_sha256_begin(&sha256);
+
+	while ((len = read(job->fd, data, RPC_FILE_DIGEST_BUFFER_SIZE)) != 0)
+	{
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0)
+		{
+			job->err = errno;
+			break;
+		}
+
+		md5_hash(data, len, &md5);
+		rpc_sha256_hash(data, len, &sha256);
+	}
+
+	md5_end(job->md5, &md5);
+	rpc_sha256_end(job->sha256, &sha256);
+
+	free(data);
+}
+
+static int
+rpc_file_digest_run(struct rpc_worker_job *job)
+{
+	rpc_file_digest_compute(container_of(job, struct rpc_file_digest_job, job));
+
+	return UBUS_STATUS_OK;
+}
+
+static void
+rpc_file_digest_reply(struct ubus_context *ctx, struct ubus_request_data *req,
+                      const uint8_t *digest, bool sha256)
+{
+	int i, len = sha256 ? RPC_SHA256_LEN : 16;
+	char *wbuf;
+
+	blob_buf_init(&buf, 0);
+	wbuf = blobmsg_alloc_string_buffer(&buf, sha256 ? "sha256" : "md5",
+	                                   len * 2 + 1);
+
+	for (i = 0; i < len; i++)
+		sprintf(wbuf + (i * 2), "%02x", digest[i]);
+
+	blobmsg_add_string_buffer(&buf);
+	ubus_send_reply(ctx, req, buf.head);
+	blob_buf_free(&buf);
+}
+
+static void
+rpc_file_digest_store(struct rpc_file_digest_job *job)
+{
+	struct rpc_file_digest *d;
+
+	if (!digests.comp)
+		avl_init(&digests, rpc_file_digest_cmp, false, NULL);
+
+	if (avl_find(&digests, &job->key))
+		return;
+
+	if (digests.count >= RPC_FILE_DIGEST_CACHE_SIZE)
+	{
+		d = list_last_entry(&digests_lru, struct rpc_file_digest, lru);
+		avl_delete(&digests, &d->avl);
+		list_del(&d->lru);
+		free(d);
+	}
+
+	d = calloc(1, sizeof(*d));
+
+	if (!d)
+		return;
+
+	d->key = job->key;
+	memcpy(d->md5, job->md5, sizeof(d->md5));
+	memcpy(d->sha256, job->sha256, sizeof(d->sha256));
+
+	d->avl.key = &d->key;
+	avl_insert(&digests, &d->avl);
+	list_add(&d->lru, &digests_lru);
+}
+
+static void
+rpc_file_digest_finish(struct rpc_file_digest_job *job)
+{
+	struct rpc_file_digest_waiter *w, *tmp;
+
+	list_del(&job->list);
+	close(job->fd);
+
+	if (!job->err)
+		rpc_file_digest_store(job);
+
+	list_for_each_entry_safe(w, tmp, &job->waiters, list)
+	{
+		if (!job->err)
+			rpc_file_digest_reply(w->context, &w->request,
+			                      w->sha256 ? job->sha256 : job->md5,
+			                      w->sha256);
+
+		errno = job->err;
+		ops->complete_deferred(w->context, &w->request,
+		                       job->err ? rpc_errno_status() : UBUS_STATUS_OK);
+
+		list_del(&w->list);
+		free(w);
+	}
+
+	free(job);
+}
+
+static void
+rpc_file_digest_done(struct rpc_worker_job *job, int ret)
+{
+	rpc_file_digest_finish(container_of(job, struct rpc_file_digest_job, job));
+}
+
+static int
+rpc_file_digest(struct ubus_context *ctx, struct ubus_request_data *req,
+                struct blob_attr *msg, bool sha256)
+{
+	struct blob_attr *tb[__RPC_F_R_MAX];
+	struct rpc_file_digest_key key;
+	struct rpc_file_digest_waiter *w;
+	struct rpc_file_digest_job *job;
+	struct rpc_file_digest *d;
+	struct stat s;
+	int fd, rv;
+
+	blobmsg_parse(rpc_file_r_policy, __RPC_F_R_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_F_R_PATH])
+		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	len = s.st_size + 1;
-	if (base64)
-		len = B64_ENCODE_LEN(s.st_size);
-	wbuf = blobmsg_alloc_string_buffer(&buf, "data", len);
+	if ((fd = open(blobmsg_data(tb[RPC_F_R_PATH]), O_RDONLY | O_CLOEXEC)) < 0)
+		return rpc_errno_status();
 
-	if (!wbuf)
+	if (fstat(fd, &s))
 	{
-		rv = UBUS_STATUS_UNKNOWN_ERROR;
-		goto out;
+		rv = rpc_errno_status();
+		close(fd);
+		return rv;
 	}
 
-	if ((len = read(fd, wbuf, s.st_size)) <= 0)
+	if (!S_ISREG(s.st_mode))
 	{
-		rv = UBUS_STATUS_NO_DATA;
-		goto out;
+		close(fd);
+		return UBUS_STATUS_NOT_SUPPORTED;
 	}
 
-	if (base64)
-	{
-		uint8_t *data = calloc(len, sizeof(uint8_t));
-		if (!data)
-		{
-			rv = UBUS_STATUS_UNKNOWN_ERROR;
-			goto out;
-		}
-		memcpy(data, wbuf, len);
+	memset(&key, 0, sizeof(key));
+	key.dev = s.st_dev;
+	key.ino = s.st_ino;
+	key.size = s.st_size;
+	key.mtime = s.st_mtim.tv_sec;
+	key.mtime_nsec = s.st_mtim.tv_nsec;
 
-		len = b64_encode(data, len, wbuf, B64_ENCODE_LEN(len));
-		free(data);
-		if (len < 0)
-		{
-			rv = UBUS_STATUS_UNKNOWN_ERROR;
-			goto out;
-		}
+	d = digests.comp ? avl_find_element(&digests, &key, d, avl) : NULL;
+
+	if (d)
+	{
+		close(fd);
+		list_move(&d->lru, &digests_lru);
+		rpc_file_digest_reply(ctx, req, sha256 ? d->sha256 : d->md5, sha256);
+		return UBUS_STATUS_OK;
 	}
 
-	*(wbuf + len) = '\0';
-	blobmsg_add_string_buffer(&buf);
+	list_for_each_entry(job, &digest_jobs, list)
+		if (!memcmp(&job->key, &key, sizeof(key)))
+			break;
 
-	ubus_send_reply(ctx, req, buf.head);
-	rv = UBUS_STATUS_OK;
+	if (&job->list == &digest_jobs)
+	{
+		job = calloc(1, sizeof(*job));
 
-out:
-	blob_buf_free(&buf);
-	close(fd);
-	return rv;
-}
+		if (!job)
+		{
+			close(fd);
+			return UBUS_STATUS_UNKNOWN_ERROR;
+		}
 
-static int
-rpc_file_write(struct ubus_context *ctx, struct ubus_object *obj,
-               struct ubus_request_data *req, const char *method,
-               struct blob_attr *msg)
-{
-	struct blob_attr *tb[__RPC_F_RW_MAX];
-	int append = O_TRUNC;
-	mode_t prev_mode, mode = 0666;
-	int fd, rv = 0;
-	void *data = NULL;
-	ssize_t data_len = 0;
+		job->key = key;
+		job->fd = fd;
+		INIT_LIST_HEAD(&job->waiters);
+		fd = -1;
 
-	blobmsg_parse(rpc_file_rw_policy, __RPC_F_RW_MAX, tb,
-	              blob_data(msg), blob_len(msg));
+		if (s.st_size <= RPC_FILE_DIGEST_INLINE_SIZE)
+		{
+			rpc_file_digest_compute(job);
+			list_add(&job->list, &digest_jobs);
 
-	if (!tb[RPC_F_RW_PATH] || !tb[RPC_F_RW_DATA])
-		return UBUS_STATUS_INVALID_ARGUMENT;
+			errno = job->err;
+			rv = job->err ? rpc_errno_status() : UBUS_STATUS_OK;
 
-	data = blobmsg_data(tb[RPC_F_RW_DATA]);
-	data_len = blobmsg_data_len(tb[RPC_F_RW_DATA]) - 1;
+			if (!rv)
+				rpc_file_digest_reply(ctx, req,
+				                      sha256 ? job->sha256 : job->md5, sha256);
 
-	if (tb[RPC_F_RW_APPEND] && blobmsg_get_bool(tb[RPC_F_RW_APPEND]))
-		append = O_APPEND;
+			rpc_file_digest_finish(job);
+			return rv;
+		}
 
-	if (tb[RPC_F_RW_MODE])
-		mode = blobmsg_get_u32(tb[RPC_F_RW_MODE]);
+		job->job.run = rpc_file_digest_run;
+		job->job.done = rpc_file_digest_done;
 
-	prev_mode = umask(0);
-	fd = open(blobmsg_data(tb[RPC_F_RW_PATH]), O_CREAT | O_WRONLY | append, mode);
-	umask(prev_mode);
-	if (fd < 0)
-		return rpc_errno_status();
+		list_add(&job->list, &digest_jobs);
 
-	if (tb[RPC_F_RW_BASE64] && blobmsg_get_bool(tb[RPC_F_RW_BASE64]))
-	{
-		data_len = b64_decode(data, data, data_len);
-		if (data_len < 0)
+		if ((rv = ops->worker_submit(&job->job, NULL, NULL)) != UBUS_STATUS_OK)
 		{
-			rv = UBUS_STATUS_UNKNOWN_ERROR;
-			goto out;
+			job->err = EAGAIN;
+			rpc_file_digest_finish(job);
+			return rv;
 		}
 	}
 
-	if (write(fd, data, data_len) < 0)
-		rv = -1;
+	if (fd >= 0)
+		close(fd);
 
-out:
-	if (fsync(fd) < 0)
-		rv = -1;
+	w = calloc(1, sizeof(*w));
 
-	close(fd);
-	sync();
+	/* the job completes regardless and caches the result */
+	if (!w)
+		return UBUS_STATUS_UNKNOWN_ERROR;
 
-	if (rv)
-		return rpc_errno_status();
+	w->context = ctx;
+	w->sha256 = sha256;
+	ubus_defer_request(ctx, req, &w->request);
+	list_add_tail(&w->list, &job->waiters);
 
-	return 0;
+	return UBUS_STATUS_OK;
 }
 
 static int
 rpc_file_md5(struct ubus_context *ctx, struct ubus_object *obj,
              struct ubus_request_data *req, const char *method,
              struct blob_attr *msg)
-{ 
-	int rv, i;
-	char *path;
-	struct stat s;
-	uint8_t md5[16];
-	char *wbuf;
-
-	if (!rpc_check_path(msg, &path, &s))
-		return rpc_errno_status();
-
-	if (!S_ISREG(s.st_mode))
-		return UBUS_STATUS_NOT_SUPPORTED;
-
-	if ((rv = md5sum(path, md5)) <= 0)
-		return rpc_errno_status();
-
-	blob_buf_init(&buf, 0);
-	wbuf = blobmsg_alloc_string_buffer(&buf, "md5", 33);
+{
+	return rpc_file_digest(ctx, req, msg, false);
+}
 
-	for (i = 0; i < 16; i++)
-		sprintf(wbuf + (i * 2), "%02x", (uint8_t) md5[i]);
+static int
+rpc_file_sha256(struct ubus_context *ctx, struct ubus_object *obj,
+                struct ubus_request_data *req, const char *method,
+                struct blob_attr *msg)
+{
+	return rpc_file_digest(ctx, req, msg, true);
+}
 
-	blobmsg_add_string_buffer(&buf);
-	ubus_send_reply(ctx, req, buf.head);
-	blob_buf_free(&buf);
+static int
+rpc_file_stat_type(const struct stat *s)
+{
+	return S_ISREG(s->st_mode) ? DT_REG :
+	        S_ISDIR(s->st_mode) ? DT_DIR :
+	         S_ISCHR(s->st_mode) ? DT_CHR :
+	          S_ISBLK(s->st_mode) ? DT_BLK :
+	           S_ISFIFO(s->st_mode) ? DT_FIFO :
+	            S_ISLNK(s->st_mode) ? DT_LNK :
+	             S_ISSOCK(s->st_mode) ? DT_SOCK :
+	              DT_UNKNOWN;
+}
 
-	return UBUS_STATUS_OK;
+static void
+rpc_file_add_stat(struct blob_buf *b, const struct stat *s)
+{
+	blobmsg_add_u32(b, "size",  s->st_size);
+	blobmsg_add_u32(b, "mode",  s->st_mode);
+	blobmsg_add_u32(b, "atime", s->st_atime);
+	blobmsg_add_u32(b, "mtime", s->st_mtime);
+	blobmsg_add_u32(b, "ctime", s->st_ctime);
+	blobmsg_add_u32(b, "inode", s->st_ino);
+	blobmsg_add_u32(b, "uid",   s->st_uid);
+	blobmsg_add_u32(b, "gid",   s->st_gid);
 }
 
+/*
+ * Entries matching "filter", a shell pattern, are counted in "total" and
+ * returned from "offset" on, at most "limit" of them. With "stat" each
+ * entry carries the file.stat fields, looked up relative to the open
+ * directory and without following symlinks.
+ */
 static int
-rpc_file_list(struct ubus_context *ctx, struct ubus_object *obj,
-              struct ubus_request_data *req, const char *method,
-              struct blob_attr *msg)
+__rpc_file_list(struct blob_attr *msg, struct blob_buf *b)
 {
+	struct blob_attr *tb[__RPC_F_L_MAX];
+	uint32_t n = 0, offset = 0, limit = UINT32_MAX;
+	const char *filter = NULL;
+	bool with_stat;
 	DIR *fd;
 	void *c, *d;
-	char *path;
 	struct stat s;
 	struct dirent *e;
 
-	if (!rpc_check_path(msg, &path, &s))
-		return rpc_errno_status();
+	blobmsg_parse(rpc_file_l_policy, __RPC_F_L_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_F_L_PATH])
+		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	if ((fd = opendir(path)) == NULL)
+	with_stat = tb[RPC_F_L_STAT] && blobmsg_get_bool(tb[RPC_F_L_STAT]);
+
+	if (tb[RPC_F_L_OFFSET])
+		offset = blobmsg_get_u32(tb[RPC_F_L_OFFSET]);
+
+	if (tb[RPC_F_L_LIMIT])
+		limit = blobmsg_get_u32(tb[RPC_F_L_LIMIT]);
+
+	if (tb[RPC_F_L_FILTER])
+		filter = blobmsg_get_string(tb[RPC_F_L_FILTER]);
+
+	if ((fd = opendir(blobmsg_data(tb[RPC_F_L_PATH]))) == NULL)
 		return rpc_errno_status();
 
-	blob_buf_init(&buf, 0);
-	c = blobmsg_open_array(&buf, "entries");
+	blob_buf_init(b, 0);
+	c = blobmsg_open_array(b, "entries");
 
 	while ((e = readdir(fd)) != NULL)
 	{
 		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
 			continue;
 
-		d = blobmsg_open_table(&buf, NULL);
-		blobmsg_add_string(&buf, "name", e->d_name);
-		blobmsg_add_string(&buf, "type", d_types[e->d_type]);
-		blobmsg_close_table(&buf, d);
+		if (filter && fnmatch(filter, e->d_name, 0))
+			continue;
+
+		if (n++ < offset || n - offset > limit)
+			continue;
+
+		d = blobmsg_open_table(b, NULL);
+		blobmsg_add_string(b, "name", e->d_name);
+
+		if (with_stat &&
+		    !fstatat(dirfd(fd), e->d_name, &s, AT_SYMLINK_NOFOLLOW))
+		{
+			blobmsg_add_string(b, "type", d_types[rpc_file_stat_type(&s)]);
+			rpc_file_add_stat(b, &s);
+		}
+		else
+		{
+			blobmsg_add_string(b, "type", d_types[e->d_type]);
+		}
+
+		blobmsg_close_table(b, d);
 	}
 
 	closedir(fd);
 
-	blobmsg_close_array(&buf, c);
-	ubus_send_reply(ctx, req, buf.head);
-	blob_buf_free(&buf);
+	blobmsg_close_array(b, c);
+
+	if (offset || limit != UINT32_MAX || filter)
+		blobmsg_add_u32(b, "total", n);
 
 	return 0;
 }
 
 static int
-rpc_file_stat(struct ubus_context *ctx, struct ubus_object *obj,
+rpc_file_list(struct ubus_context *ctx, struct ubus_object *obj,
               struct ubus_request_data *req, const char *method,
               struct blob_attr *msg)
 {
-	int type;
+	return rpc_file_call(ctx, req, msg, __rpc_file_list);
+}
+
+static int
+__rpc_file_stat(struct blob_attr *msg, struct blob_buf *b)
+{
+	struct blob_attr *tb[__RPC_F_R_MAX];
 	char *path;
 	struct stat s;
 
-	if (!rpc_check_path(msg, &path, &s))
+	if (!rpc_check_path(msg, tb, &path, &s))
 		return rpc_errno_status();
 
-	blob_buf_init(&buf, 0);
-
-	type = S_ISREG(s.st_mode) ? DT_REG :
-	        S_ISDIR(s.st_mode) ? DT_DIR :
-	         S_ISCHR(s.st_mode) ? DT_CHR :
-	          S_ISBLK(s.st_mode) ? DT_BLK :
-	           S_ISFIFO(s.st_mode) ? DT_FIFO :
-	            S_ISLNK(s.st_mode) ? DT_LNK :
-	             S_ISSOCK(s.st_mode) ? DT_SOCK :
-	              DT_UNKNOWN;
-
-	blobmsg_add_string(&buf, "path", path);
-	blobmsg_add_string(&buf, "type", d_types[type]);
-	blobmsg_add_u32(&buf, "size",  s.st_size);
-	blobmsg_add_u32(&buf, "mode",  s.st_mode);
-	blobmsg_add_u32(&buf, "atime", s.st_atime);
-	blobmsg_add_u32(&buf, "mtime", s.st_mtime);
-	blobmsg_add_u32(&buf, "ctime", s.st_ctime);
-	blobmsg_add_u32(&buf, "inode", s.st_ino);
-	blobmsg_add_u32(&buf, "uid",   s.st_uid);
-	blobmsg_add_u32(&buf, "gid",   s.st_gid);
+	blob_buf_init(b, 0);
 
-	ubus_send_reply(ctx, req, buf.head);
-	blob_buf_free(&buf);
+	blobmsg_add_string(b, "path", path);
+	blobmsg_add_string(b, "type", d_types[rpc_file_stat_type(&s)]);
+	rpc_file_add_stat(b, &s);
 
 	return 0;
 }
 
-static const char *
-rpc_file_exec_lookup(const char *cmd)
+static int
+rpc_file_stat(struct ubus_context *ctx, struct ubus_object *obj,
+              struct ubus_request_data *req, const char *method,
+              struct blob_attr *msg)
+{
+	return rpc_file_call(ctx, req, msg, __rpc_file_stat);
+}
+
+/*
+ * Build the environment for file.exec, the current one with the string
+ * members of "env" added or overridden.
+ */
+static char **
+rpc_file_exec_env(const struct blob_attr *env)
 {
-	struct stat s;
-	int plen = 0, clen = strlen(cmd) + 1;
-	char *search, *p;
-	static char path[PATH_MAX];
+	extern char **environ;
+	struct blob_attr *cur;
+	int i, j, rem, n = 0, len;
+	char **envp;
 
-	if (!stat(cmd, &s) && S_ISREG(s.st_mode))
-		return cmd;
+	for (i = 0; environ[i]; i++)
+		n++;
 
-	search = getenv("PATH");
+	blobmsg_for_each_attr(cur, env, rem)
+		n++;
 
-	if (!search)
-		search = "/bin:/usr/bin:/sbin:/usr/sbin";
+	envp = calloc(n + 1, sizeof(char *));
 
-	p = search;
+	if (!envp)
+		return NULL;
 
-	do
+	for (i = 0, n = 0; environ[i]; i++)
 	{
-		if (*p != ':' && *p != '\0')
-			continue;
+		blobmsg_for_each_attr(cur, env, rem)
+		{
+			len = strlen(blobmsg_name(cur));
 
-		plen = p - search;
+			if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING &&
+			    !strncmp(environ[i], blobmsg_name(cur), len) &&
+			    environ[i][len] == '=')
+				break;
+		}
 
-		if ((plen + clen) >= sizeof(path))
-			continue;
+		if (!rem)
+			envp[n++] = strdup(environ[i]);
+	}
 
-		strncpy(path, search, plen);
-		sprintf(path + plen, "/%s", cmd);
+	blobmsg_for_each_attr(cur, env, rem)
+	{
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			continue;
 
-		if (!stat(path, &s) && S_ISREG(s.st_mode))
-			return path;
+		if (asprintf(&envp[n], "%s=%s", blobmsg_name(cur),
+		             blobmsg_get_string(cur)) < 0)
+			envp[n] = NULL;
 
-		search = p + 1;
+		n++;
 	}
-	while (*p++);
 
-	return NULL;
+	/* compact entries we failed to allocate */
+	for (i = 0, j = 0; i < n; i++)
+		if (envp[i])
+			envp[j++] = envp[i];
+
+	envp[j] = NULL;
+
+	return envp;
+}
+
+static void
+rpc_file_exec_env_free(char **envp)
+{
+	int i;
+
+	if (!envp)
+		return;
+
+	for (i = 0; envp[i]; i++)
+		free(envp[i]);
+
+	free(envp);
 }
 
 
@@ -500,6 +1616,16 @@ rpc_ustream_to_blobmsg(struct ustream *s, const char *name)
 	}
 }
 
+static void
+rpc_file_exec_free(struct rpc_file_exec_context *c)
+{
+	ops->exec_release(&c->job);
+
+	free(c->arg);
+	free(c->env);
+	free(c);
+}
+
 static void
 rpc_file_exec_reply(struct rpc_file_exec_context *c, int rv)
 {
@@ -519,7 +1645,7 @@ rpc_file_exec_reply(struct rpc_file_exec_context *c, int rv)
 		blob_buf_free(&buf);
 	}
 
-	ubus_complete_deferred_request(c->context, &c->request, rv);
+	ops->complete_deferred(c->context, &c->request, rv);
 
 	ustream_free(&c->opipe.stream);
 	ustream_free(&c->epipe.stream);
@@ -527,7 +1653,7 @@ rpc_file_exec_reply(struct rpc_file_exec_context *c, int rv)
 	close(c->opipe.fd.fd);
 	close(c->epipe.fd.fd);
 
-	free(c);
+	rpc_file_exec_free(c);
 }
 
 static void
@@ -592,114 +1718,203 @@ rpc_file_exec_epipe_state_cb(struct ustream *s)
 		rpc_file_exec_reply(c, UBUS_STATUS_OK);
 }
 
-static int
-rpc_file_exec_run(const char *cmd,
-                  const struct blob_attr *arg, const struct blob_attr *env,
-                  struct ubus_context *ctx, struct ubus_request_data *req)
+static void
+rpc_file_exec_stream_cb(struct uloop_process *p, int stat)
+{
+	struct rpc_file_exec_context *c =
+		container_of(p, struct rpc_file_exec_context, process);
+
+	uloop_timeout_cancel(&c->timeout);
+	rpc_file_exec_free(c);
+}
+
+static void
+rpc_file_exec_stream_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_file_exec_context *c =
+		container_of(t, struct rpc_file_exec_context, timeout);
+
+	kill(c->process.pid, SIGKILL);
+}
+
+static void
+rpc_file_exec_start(struct rpc_exec_job *job)
 {
 	pid_t pid;
 
 	int opipe[2];
 	int epipe[2];
 
-	int rem;
+	int rem, arglen, rv = UBUS_STATUS_UNKNOWN_ERROR;
 	struct blob_attr *cur;
 
-	char arglen;
-	char **args;
+	const char **args;
+	char **envp = NULL;
 
-	struct rpc_file_exec_context *c;
+	struct rpc_file_exec_context *c =
+		container_of(job, struct rpc_file_exec_context, job);
 
-	cmd = rpc_file_exec_lookup(cmd);
+	arglen = 2;
 
-	if (!cmd)
-		return UBUS_STATUS_NOT_FOUND;
+	blobmsg_for_each_attr(cur, c->arg, rem)
+		arglen++;
 
-	c = malloc(sizeof(*c));
+	args = calloc(arglen, sizeof(char *));
 
-	if (!c)
-		return UBUS_STATUS_UNKNOWN_ERROR;
+	if (!args)
+		goto out;
 
-	if (pipe(opipe) || pipe(epipe))
-		return rpc_errno_status();
+	arglen = 0;
+	args[arglen++] = c->cmd;
+
+	blobmsg_for_each_attr(cur, c->arg, rem)
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING)
+			args[arglen++] = blobmsg_data(cur);
+
+	if (c->env && !(envp = rpc_file_exec_env(c->env)))
+		goto out;
 
-	switch ((pid = fork()))
+	if (pipe2(opipe, O_CLOEXEC))
+		goto fail_errno;
+
+	/*
+	 * In streaming mode stdout and stderr share one pipe whose read end
+	 * is handed to the caller, output is neither buffered nor limited and
+	 * the reader's pace throttles the command. Closing the descriptor
+	 * terminates it with SIGPIPE, commands ignoring that are killed after
+	 * RPC_FILE_STREAM_MAX_RUNTIME. The exec slot is released once the
+	 * descriptor is passed, long running streams must not hold it.
+	 */
+	if (c->stream)
 	{
-	case -1:
-		return rpc_errno_status();
+		pid = ops->exec_spawn(c->cmd, args, envp, -1, opipe[1], opipe[1]);
+		close(opipe[1]);
+
+		if (pid < 0)
+		{
+			close(opipe[0]);
+			goto fail_errno;
+		}
+
+		blob_buf_init(&buf, 0);
+		blobmsg_add_u32(&buf, "pid", pid);
+		ubus_send_reply(c->context, &c->request, buf.head);
+		blob_buf_free(&buf);
+
+		ubus_request_set_fd(c->context, &c->request, opipe[0]);
+		ops->complete_deferred(c->context, &c->request, UBUS_STATUS_OK);
+		ops->exec_release(&c->job);
+
+		c->process.pid = pid;
+		c->process.cb = rpc_file_exec_stream_cb;
+		uloop_process_add(&c->process);
 
-	case 0:
-		uloop_done();
+		c->timeout.cb = rpc_file_exec_stream_timeout_cb;
+		uloop_timeout_set(&c->timeout, RPC_FILE_STREAM_MAX_RUNTIME);
 
-		dup2(opipe[1], 1);
-		dup2(epipe[1], 2);
+		rpc_file_exec_env_free(envp);
+		free(args);
+
+		return;
+	}
 
-		close(0);
+	if (pipe2(epipe, O_CLOEXEC))
+	{
 		close(opipe[0]);
 		close(opipe[1]);
+		goto fail_errno;
+	}
+
+	pid = ops->exec_spawn(c->cmd, args, envp, -1, opipe[1], epipe[1]);
+
+	close(opipe[1]);
+	close(epipe[1]);
+
+	if (pid < 0)
+	{
+		close(opipe[0]);
 		close(epipe[0]);
-		close(epipe[1]);
+		goto fail_errno;
+	}
 
-		arglen = 2;
-		args = malloc(sizeof(char *) * arglen);
+	ustream_declare(c->opipe, opipe[0], exec_opipe);
+	ustream_declare(c->epipe, epipe[0], exec_epipe);
 
-		if (!args)
-			return UBUS_STATUS_UNKNOWN_ERROR;
+	c->process.pid = pid;
+	c->process.cb = rpc_file_exec_process_cb;
+	uloop_process_add(&c->process);
 
-		args[0] = (char *)cmd;
-		args[1] = NULL;
+	c->timeout.cb = rpc_file_exec_timeout_cb;
+	uloop_timeout_set(&c->timeout, RPC_FILE_MAX_RUNTIME);
 
-		if (arg)
-		{
-			blobmsg_for_each_attr(cur, arg, rem)
-			{
-				if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
-					continue;
+	rpc_file_exec_env_free(envp);
+	free(args);
 
-				arglen++;
+	return;
 
-				if (!(args = realloc(args, sizeof(char *) * arglen)))
-					return UBUS_STATUS_UNKNOWN_ERROR;
+fail_errno:
+	rv = rpc_errno_status();
 
-				args[arglen-2] = blobmsg_data(cur);
-				args[arglen-1] = NULL;
-			}
-		}
+out:
+	rpc_file_exec_env_free(envp);
+	free(args);
 
-		if (env)
-		{
-			blobmsg_for_each_attr(cur, env, rem)
-			{
-				if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
-					continue;
+	ops->complete_deferred(c->context, &c->request, rv);
+	rpc_file_exec_free(c);
+}
 
-				setenv(blobmsg_name(cur), blobmsg_data(cur), 1);
-			}
-		}
+static void
+rpc_file_exec_fail(struct rpc_exec_job *job, int ret)
+{
+	struct rpc_file_exec_context *c =
+		container_of(job, struct rpc_file_exec_context, job);
 
-		if (execv(cmd, args))
-			return rpc_errno_status();
+	ops->complete_deferred(c->context, &c->request, ret);
+	rpc_file_exec_free(c);
+}
 
-	default:
-		memset(c, 0, sizeof(*c));
+static int
+rpc_file_exec_run(const char *cmd,
+                  const struct blob_attr *arg, const struct blob_attr *env,
+                  bool stream, const char *sid, struct ubus_context *ctx,
+                  struct ubus_request_data *req)
+{
+	struct rpc_file_exec_context *c;
+	char *str;
 
-		ustream_declare(c->opipe, opipe[0], exec_opipe);
-		ustream_declare(c->epipe, epipe[0], exec_epipe);
+	cmd = ops->exec_lookup(cmd);
 
-		c->process.pid = pid;
-		c->process.cb = rpc_file_exec_process_cb;
-		uloop_process_add(&c->process);
+	if (!cmd)
+		return UBUS_STATUS_NOT_FOUND;
 
-		c->timeout.cb = rpc_file_exec_timeout_cb;
-		uloop_timeout_set(&c->timeout, RPC_FILE_MAX_RUNTIME);
+	/* the command may have to wait for admission, keep copies around */
+	c = calloc_a(sizeof(*c), &str, strlen(cmd) + 1);
 
-		close(opipe[1]);
-		close(epipe[1]);
+	if (!c)
+		return UBUS_STATUS_UNKNOWN_ERROR;
 
-		c->context = ctx;
-		ubus_defer_request(ctx, req, &c->request);
+	c->cmd = strcpy(str, cmd);
+	c->arg = arg ? blob_memdup((struct blob_attr *)arg) : NULL;
+	c->env = env ? blob_memdup((struct blob_attr *)env) : NULL;
+
+	if ((arg && !c->arg) || (env && !c->env))
+	{
+		free(c->arg);
+		free(c->env);
+		free(c);
+
+		return UBUS_STATUS_UNKNOWN_ERROR;
 	}
 
+	c->stream = stream;
+
+	c->context = ctx;
+	ubus_defer_request(ctx, req, &c->request);
+
+	c->job.run = rpc_file_exec_start;
+	c->job.fail = rpc_file_exec_fail;
+	ops->exec_schedule(&c->job, sid);
+
 	return UBUS_STATUS_OK;
 }
 
@@ -717,7 +1932,10 @@ rpc_file_exec(struct ubus_context *ctx, struct ubus_object *obj,
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
 	return rpc_file_exec_run(blobmsg_data(tb[RPC_E_CMD]),
-					      tb[RPC_E_PARM], tb[RPC_E_ENV], ctx, req);
+	                         tb[RPC_E_PARM], tb[RPC_E_ENV],
+	                         tb[RPC_E_STREAM] && blobmsg_get_bool(tb[RPC_E_STREAM]),
+	                         tb[RPC_E_SESSION] ? blobmsg_data(tb[RPC_E_SESSION]) : NULL,
+	                         ctx, req);
 }
 
 
@@ -727,10 +1945,14 @@ rpc_file_api_init(const struct rpc_daemon_ops *o, struct ubus_context *ctx)
 	static const struct ubus_method file_methods[] = {
 		UBUS_METHOD("read",    rpc_file_read,  rpc_file_rb_policy),
 		UBUS_METHOD("write",   rpc_file_write, rpc_file_rw_policy),
-		UBUS_METHOD("list",    rpc_file_list,  rpc_file_r_policy),
+		UBUS_METHOD("list",    rpc_file_list,  rpc_file_l_policy),
 		UBUS_METHOD("stat",    rpc_file_stat,  rpc_file_r_policy),
 		UBUS_METHOD("md5",     rpc_file_md5,   rpc_file_r_policy),
+		UBUS_METHOD("sha256",  rpc_file_sha256, rpc_file_r_policy),
 		UBUS_METHOD("exec",    rpc_file_exec,  rpc_exec_policy),
+		UBUS_METHOD("upload_open",   rpc_file_upload_open,   rpc_file_uo_policy),
+		UBUS_METHOD("upload_append", rpc_file_upload_append, rpc_file_ua_policy),
+		UBUS_METHOD("upload_close",  rpc_file_upload_close,  rpc_file_uc_policy),
 	};
 
 	static struct ubus_object_type file_type =
@@ -743,6 +1965,8 @@ rpc_file_api_init(const struct rpc_daemon_ops *o, struct ubus_context *ctx)
 		.n_methods = ARRAY_SIZE(file_methods),
 	};
 
+	ops = o;
+
 	return ubus_add_object(ctx, &obj);
 }
 
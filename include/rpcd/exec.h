@@ -26,6 +26,15 @@
 #define RPC_EXEC_MAX_SIZE		(4096 * 64)
 #define RPC_EXEC_MAX_RUNTIME	(30 * 1000)
 
+/* default limits of concurrently running children, overall and per session */
+#define RPC_EXEC_MAX_JOBS			8
+#define RPC_EXEC_MAX_SESSION_JOBS	4
+
+/* limits of waiting children, per session and overall, and their wait time */
+#define RPC_EXEC_MAX_QUEUED		16
+#define RPC_EXEC_MAX_WAITING	64
+#define RPC_EXEC_MAX_WAIT		(10 * 1000)
+
 #define ustream_for_each_read_buffer(stream, ptr, len) \
 	for (ptr = ustream_get_read_buf(stream, &len);     \
 	     ptr != NULL && len > 0;                       \
@@ -55,7 +64,22 @@ typedef int (*rpc_exec_write_cb_t)(struct ustream *, void *);
 typedef int (*rpc_exec_read_cb_t)(struct blob_buf *, char *, int, void *);
 typedef int (*rpc_exec_done_cb_t)(struct blob_buf *, int, void *);
 
+struct rpc_exec_queue;
+
+struct rpc_exec_job {
+	struct list_head list;
+	struct rpc_exec_queue *queue;
+	struct uloop_timeout wait;
+	void (*run)(struct rpc_exec_job *job);
+	void (*fail)(struct rpc_exec_job *job, int ret);
+	uint64_t queued;
+	uint64_t started;
+};
+
 struct rpc_exec_context {
+	struct rpc_exec_job job;
+	const char *cmd;
+	const char **argv;
 	struct ubus_context *context;
 	struct ubus_request_data request;
 	struct uloop_timeout timeout;
@@ -80,6 +104,19 @@ struct rpc_exec_context {
 
 const char *rpc_exec_lookup(const char *cmd);
 
+pid_t rpc_exec_spawn(const char *cmd, const char * const *argv,
+                     char * const *envp, int in, int out, int err);
+
+void rpc_exec_limits(int jobs, int session_jobs);
+
+void rpc_exec_schedule(struct rpc_exec_job *job, const char *sid);
+void rpc_exec_release(struct rpc_exec_job *job);
+
+int rpc_exec_as(const char *sid, const char **args, rpc_exec_write_cb_t in,
+                rpc_exec_read_cb_t out, rpc_exec_read_cb_t err,
+                rpc_exec_done_cb_t end, void *priv, struct ubus_context *ctx,
+                struct ubus_request_data *req);
+
 int rpc_exec(const char **args, rpc_exec_write_cb_t in,
              rpc_exec_read_cb_t out, rpc_exec_read_cb_t err,
              rpc_exec_done_cb_t end, void *priv, struct ubus_context *ctx,
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/types.h>
@@ -37,6 +38,7 @@
 
 #include <rpcd/exec.h>
 #include <rpcd/session.h>
+#include <rpcd/worker.h>
 
 /* location of plugin executables */
 #define RPC_PLUGIN_DIRECTORY	"/usr/libexec/rpcd"
@@ -44,6 +46,15 @@
 /* location of plugin libraries */
 #define RPC_LIBRARY_DIRECTORY	"/usr/lib/rpcd"
 
+/* cached "list" output of plugin executables */
+#define RPC_PLUGIN_CACHE	"/var/run/rpcd/plugins.cache"
+
+/* time limit for a plugin executable to answer "list" */
+#define RPC_PLUGIN_LIST_TIMEOUT	(5 * 1000)
+
+/* upper limit of persistent workers per executable plugin */
+#define RPC_PLUGIN_WORKERS_MAX	4
+
 struct rpc_daemon_ops {
     bool (*session_access)(const char *sid, const char *scope,
                            const char *object, const char *function);
@@ -54,6 +65,20 @@ struct rpc_daemon_ops {
                 rpc_exec_read_cb_t err, rpc_exec_done_cb_t end,
                 void *priv, struct ubus_context *ctx,
                 struct ubus_request_data *req);
+    int (*session_access_batch)(const char *sid,
+                                struct rpc_session_access_check *checks,
+                                int n_checks);
+    /* deferred requests need to be completed by this to be timed */
+    void (*complete_deferred)(struct ubus_context *ctx,
+                              struct ubus_request_data *req, int ret);
+    const char *(*exec_lookup)(const char *cmd);
+    pid_t (*exec_spawn)(const char *cmd, const char * const *argv,
+                        char * const *envp, int in, int out, int err);
+    void (*exec_schedule)(struct rpc_exec_job *job, const char *sid);
+    void (*exec_release)(struct rpc_exec_job *job);
+    int (*worker_submit)(struct rpc_worker_job *job, struct ubus_context *ctx,
+                         struct ubus_request_data *req);
+    void (*worker_complete)(struct rpc_worker_job *job, int ret);
 };
 
 struct rpc_plugin {
@@ -63,4 +88,6 @@ struct rpc_plugin {
 
 int rpc_plugin_api_init(struct ubus_context *ctx);
 
+void rpc_plugin_dirs(const char *rundir);
+
 #endif
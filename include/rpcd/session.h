@@ -31,18 +31,35 @@
 #include <libubox/blobmsg_json.h>
 
 #define RPC_SID_LEN	32
+#define RPC_SID_RAW_LEN	(RPC_SID_LEN / 2)
 #define RPC_DEFAULT_SESSION_TIMEOUT	300
 #define RPC_DEFAULT_SESSION_ID	"00000000000000000000000000000000"
-#define RPC_SESSION_DIRECTORY	"/var/run/rpcd/sessions"
+#define RPC_SESSION_SNAPSHOT	"/var/run/rpcd/sessions.snapshot"
+#define RPC_SESSION_SNAPSHOT_VERSION	1
 #define RPC_SESSION_ACL_DIR		"/usr/share/rpcd/acl.d"
+#define RPC_SESSION_ACL_CACHE_SIZE	64
+#define RPC_SESSION_WHEEL_SLOTS	256
+#define RPC_SESSION_HASH_SIZE	512
+#define RPC_LOGIN_WORKERS	2
+#define RPC_LOGIN_QUEUE	16
+#define RPC_LOGIN_USER_PENDING	2
+#define RPC_LOGIN_MAX_CANDIDATES	8
+#define RPC_LOGIN_BACKOFF_MAX	60
+#define RPC_LOGIN_TIMEOUT	(10 * 1000)
 
 struct rpc_session {
-	struct avl_node avl;
+	struct list_head list;
+	uint8_t raw[RPC_SID_RAW_LEN];
 	char id[RPC_SID_LEN + 1];
 
-	struct uloop_timeout t;
+	struct list_head expiry;
+	time_t touched;
+
 	struct avl_tree data;
-	struct avl_tree acls;
+	struct rpc_session_acl_set *acls;
+
+	uint32_t acl_gen;
+	struct rpc_session_acl_cache *acl_cache;
 
 	int timeout;
 };
@@ -52,6 +69,15 @@ struct rpc_session_data {
 	struct blob_attr attr[];
 };
 
+struct rpc_session_acl_set {
+	struct avl_node avl;
+	struct avl_tree scopes;
+	struct rpc_session_arena *arena;
+	bool pooled;
+	int refcount;
+	uint32_t index;
+};
+
 struct rpc_session_acl_scope {
 	struct avl_node avl;
 	struct avl_tree acls;
@@ -64,11 +90,32 @@ struct rpc_session_acl {
 	int sort_len;
 };
 
+struct rpc_session_acl_cache {
+	uint32_t hash;
+	uint32_t gen;
+	bool allow;
+	char *key;
+};
+
 int rpc_session_api_init(struct ubus_context *ctx);
 
+void rpc_session_dirs(const char *confdir, const char *acldir,
+                      const char *rundir);
+
 bool rpc_session_access(const char *sid, const char *scope,
                         const char *object, const char *function);
 
+struct rpc_session_access_check {
+	const char *scope;
+	const char *object;
+	const char *function;
+	bool allow;
+};
+
+int rpc_session_access_batch(const char *sid,
+                             struct rpc_session_access_check *checks,
+                             int n_checks);
+
 struct rpc_session_cb {
 	struct list_head list;
 	void (*cb)(struct rpc_session *, void *);
@@ -0,0 +1,38 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RPC_SHA256_H
+#define __RPC_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RPC_SHA256_LEN	32
+
+/* modelled after the md5 interface of libubox */
+typedef struct rpc_sha256_ctx {
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t buffer[64];
+} rpc_sha256_ctx_t;
+
+void rpc_sha256_begin(rpc_sha256_ctx_t *ctx);
+void rpc_sha256_hash(const void *data, size_t length, rpc_sha256_ctx_t *ctx);
+void rpc_sha256_end(void *resbuf, rpc_sha256_ctx_t *ctx);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RPC_STATS_H
+#define __RPC_STATS_H
+
+#include <libubus.h>
+#include <libubox/avl.h>
+
+/* latency histogram buckets, bucket n counts calls taking < 2^n usec */
+#define RPC_STATS_BUCKETS	24
+
+/* deferred calls tracked at most, and the age after which they are dropped */
+#define RPC_STATS_MAX_PENDING	256
+#define RPC_STATS_PENDING_TIMEOUT	(60 * 1000)
+
+struct rpc_stats_method {
+	const char *name;
+	ubus_handler_t handler;
+	uint32_t calls;
+	uint32_t errors[__UBUS_STATUS_LAST];
+	uint32_t inflight;
+	uint64_t total_usec;
+	uint32_t max_usec;
+	uint32_t histogram[RPC_STATS_BUCKETS];
+};
+
+struct rpc_stats_object {
+	struct avl_node avl;
+	struct ubus_object *obj;
+	struct ubus_method *methods;
+	int n_methods;
+	struct rpc_stats_method stats[];
+};
+
+int rpc_stats_api_init(struct ubus_context *ctx, bool enable);
+
+int rpc_stats_wrap_object(struct ubus_object *obj);
+
+void rpc_stats_complete(struct ubus_context *ctx,
+                        struct ubus_request_data *req, int ret);
+
+enum rpc_stats_exec {
+	RPC_STATS_EXEC_SPAWN,
+	RPC_STATS_EXEC_QUEUE,
+	RPC_STATS_EXEC_RUN,
+	__RPC_STATS_EXEC_MAX,
+};
+
+uint64_t rpc_stats_exec_begin(void);
+void rpc_stats_exec_end(enum rpc_stats_exec type, uint64_t start, int ret);
+
+#endif
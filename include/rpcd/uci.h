@@ -36,8 +36,14 @@
 #define RPC_SNAPSHOT_DELTA	RPC_UCI_DIR_PREFIX "/snapshot-delta/"
 #define RPC_UCI_DIR		"/etc/config/"
 #define RPC_APPLY_TIMEOUT	60
+#define RPC_UCI_CACHE_SIZE	16
+#define RPC_UCI_BATCH_MAX_PACKAGES	16
+#define RPC_UCI_CONTEXT_POOL_SIZE	8
+#define RPC_UCI_VIEW_MAX_REMOVED	64
 
-int rpc_uci_api_init(struct ubus_context *ctx);
+int rpc_uci_api_init(struct ubus_context *ctx, int max_contexts);
+
+void rpc_uci_dirs(const char *confdir, const char *rundir);
 
 void rpc_uci_purge_savedirs(void);
 
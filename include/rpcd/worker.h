@@ -0,0 +1,57 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __RPC_WORKER_H
+#define __RPC_WORKER_H
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+
+/* default number of worker threads */
+#define RPC_WORKER_THREADS		4
+
+/* upper limit of jobs queued or running at a time */
+#define RPC_WORKER_MAX_JOBS		64
+
+struct rpc_worker_job;
+
+/* runs on a worker thread, fills the job buffer and returns a ubus status */
+typedef int (*rpc_worker_run_cb_t)(struct rpc_worker_job *);
+
+/* runs on the main loop once the job finished */
+typedef void (*rpc_worker_done_cb_t)(struct rpc_worker_job *, int);
+
+struct rpc_worker_job {
+	struct list_head list;
+	struct ubus_context *context;
+	struct ubus_request_data request;
+	struct blob_buf buf;
+	rpc_worker_run_cb_t run;
+	rpc_worker_done_cb_t done;
+	bool deferred;
+	int ret;
+};
+
+void rpc_worker_limits(int threads);
+
+int rpc_worker_submit(struct rpc_worker_job *job, struct ubus_context *ctx,
+                      struct ubus_request_data *req);
+
+void rpc_worker_complete(struct rpc_worker_job *job, int ret);
+
+#endif
@@ -16,23 +16,106 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE /* pipe2() */
+
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <libubus.h>
+#include <libubox/avl-cmp.h>
 #include <iwinfo.h>
 #include <iwinfo/utils.h>
 #include <net/ethernet.h>
 
 #ifdef linux
 #include <netinet/ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #endif
 
 #include <rpcd/plugin.h>
 
+/* default age in seconds up to which cached scan results are returned */
+#define RPC_IWINFO_SCAN_TTL		10
+
+/* scans not finished within this time are aborted */
+#define RPC_IWINFO_SCAN_TIMEOUT	(15 * 1000)
+
+/* upper limit of jobs waiting for the one running on the worker pool */
+#define RPC_IWINFO_MAX_PENDING	64
+
+struct rpc_iwinfo_scan {
+	struct avl_node avl;
+	struct rpc_worker_job start;
+	struct uloop_timeout timeout;
+	struct uloop_fd fd;
+	struct list_head waiters;
+	pid_t pid;
+	char *data;
+	int len;
+	bool running;
+	time_t updated;
+};
+
+struct rpc_iwinfo_scan_waiter {
+	struct list_head list;
+	struct ubus_context *context;
+	struct ubus_request_data request;
+};
+
+/* copy of a request whose handler body runs on a worker */
+struct rpc_iwinfo_request {
+	struct rpc_worker_job job;
+	int (*body)(struct blob_attr *msg, struct blob_buf *buf);
+	struct blob_attr *msg;
+};
+
+/* resolved backend of a network device, NULL if it is not wireless */
+struct rpc_iwinfo_backend {
+	struct avl_node avl;
+	const struct iwinfo_ops *ops;
+};
+
+struct rpc_iwinfo_country {
+	uint16_t iso3166;
+	char ccode[4];
+	const char *name;
+};
+
+/* supported countries of a phy in the order of IWINFO_ISO3166_NAMES */
+struct rpc_iwinfo_countries {
+	struct avl_node avl;
+	int n_countries;
+	struct rpc_iwinfo_country countries[];
+};
+
 
-static struct blob_buf buf;
 static const struct iwinfo_ops *iw;
 static const char *ifname;
+static const struct rpc_daemon_ops *ops;
+static struct avl_tree scans;
+static struct avl_tree backends;
+static struct avl_tree countries;
+static struct uloop_fd hotplug = { .fd = -1 };
+static struct rpc_worker_job flush_job;
+static bool flush_queued = false;
+static LIST_HEAD(pending);
+static int n_pending = 0;
+static bool busy = false;
+
+/*
+ * libiwinfo keeps global state and is not thread-safe, so everything
+ * calling into it, as well as iw, ifname and the caches, is serialized by
+ * this lock and only ever used from worker threads.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
 enum {
 	RPC_D_DEVICE,
@@ -43,6 +126,17 @@ static const struct blobmsg_policy rpc_device_policy[__RPC_D_MAX] = {
 	[RPC_D_DEVICE] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+	RPC_S_DEVICE,
+	RPC_S_TTL,
+	__RPC_S_MAX,
+};
+
+static const struct blobmsg_policy rpc_scan_policy[__RPC_S_MAX] = {
+	[RPC_S_DEVICE] = { .name = "device", .type = BLOBMSG_TYPE_STRING },
+	[RPC_S_TTL]    = { .name = "ttl",    .type = BLOBMSG_TYPE_INT32  },
+};
+
 enum {
 	RPC_A_DEVICE,
 	RPC_A_MACADDR,
@@ -63,6 +157,201 @@ static const struct blobmsg_policy rpc_uci_policy[__RPC_U_MAX] = {
 	[RPC_U_SECTION] = { .name = "section", .type = BLOBMSG_TYPE_STRING },
 };
 
+/*
+ * As all jobs serialize on the lock anyway, at most one of them is handed
+ * to the shared worker pool at a time and the others wait here, so that
+ * slow radios do not occupy threads needed by other plugins. Each done
+ * callback starts the next job through rpc_iwinfo_next().
+ */
+static int
+rpc_iwinfo_submit(struct rpc_worker_job *job, struct ubus_context *ctx,
+                  struct ubus_request_data *req)
+{
+	int rv;
+
+	if (!busy)
+	{
+		rv = ops->worker_submit(job, ctx, req);
+		busy = (rv == UBUS_STATUS_OK);
+
+		return rv;
+	}
+
+	if (n_pending >= RPC_IWINFO_MAX_PENDING)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	if (ctx && req)
+	{
+		job->context = ctx;
+		job->deferred = true;
+		ubus_defer_request(ctx, req, &job->request);
+	}
+
+	list_add_tail(&job->list, &pending);
+	n_pending++;
+
+	return UBUS_STATUS_OK;
+}
+
+static void
+rpc_iwinfo_next(void)
+{
+	struct rpc_worker_job *job;
+
+	busy = false;
+
+	while (!busy && !list_empty(&pending))
+	{
+		job = list_first_entry(&pending, struct rpc_worker_job, list);
+		list_del(&job->list);
+		n_pending--;
+
+		if (ops->worker_submit(job, NULL, NULL))
+			job->done(job, UBUS_STATUS_UNKNOWN_ERROR);
+		else
+			busy = true;
+	}
+}
+
+/*
+ * Backends are resolved once per device and kept open across calls. The
+ * handles and the country tables are dropped whenever a network device
+ * appears or disappears, as reported by rtnetlink. If no such
+ * notifications can be received they are dropped after each call. The
+ * notifications arrive on the main loop, which queues the flush as a job.
+ */
+static void
+rpc_iwinfo_flush(void)
+{
+	struct rpc_iwinfo_backend *b, *btmp;
+	struct rpc_iwinfo_countries *c, *ctmp;
+
+	if (backends.comp)
+		avl_remove_all_elements(&backends, b, avl, btmp)
+			free(b);
+
+	if (countries.comp)
+		avl_remove_all_elements(&countries, c, avl, ctmp)
+			free(c);
+
+	iwinfo_finish();
+}
+
+static const struct iwinfo_ops *
+rpc_iwinfo_backend(const char *device)
+{
+	struct rpc_iwinfo_backend *b;
+	char *str;
+
+	if (!backends.comp)
+		avl_init(&backends, avl_strcmp, false, NULL);
+
+	b = avl_find_element(&backends, device, b, avl);
+
+	if (b)
+		return b->ops;
+
+	b = calloc_a(sizeof(*b), &str, strlen(device) + 1);
+
+	if (!b)
+		return iwinfo_backend(device);
+
+	b->avl.key = strcpy(str, device);
+	b->ops = iwinfo_type(device) ? iwinfo_backend(device) : NULL;
+	avl_insert(&backends, &b->avl);
+
+	return b->ops;
+}
+
+static int
+rpc_iwinfo_flush_run(struct rpc_worker_job *job)
+{
+	pthread_mutex_lock(&lock);
+	rpc_iwinfo_flush();
+	pthread_mutex_unlock(&lock);
+
+	return UBUS_STATUS_OK;
+}
+
+static void
+rpc_iwinfo_flush_done(struct rpc_worker_job *job, int ret)
+{
+	flush_queued = false;
+	rpc_iwinfo_next();
+}
+
+static void
+rpc_iwinfo_hotplug_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	char msg[4096];
+	bool flush = false;
+	ssize_t len;
+
+	while ((len = recv(u->fd, msg, sizeof(msg), 0)) > 0)
+	{
+		for (nh = (struct nlmsghdr *)msg; NLMSG_OK(nh, len);
+		     nh = NLMSG_NEXT(nh, len))
+		{
+			if (nh->nlmsg_type == RTM_DELLINK)
+			{
+				flush = true;
+				continue;
+			}
+
+			if (nh->nlmsg_type != RTM_NEWLINK)
+				continue;
+
+			/*
+			 * Registration of a device reports all flags as changed.
+			 * This also catches names cached as non-wireless before
+			 * the device appeared.
+			 */
+			ifi = NLMSG_DATA(nh);
+
+			if (ifi->ifi_change == ~0U)
+				flush = true;
+		}
+	}
+
+	/* lost notifications, start over */
+	if (len < 0 && errno == ENOBUFS)
+		flush = true;
+
+	if (flush && !flush_queued)
+	{
+		flush_job.run = rpc_iwinfo_flush_run;
+		flush_job.done = rpc_iwinfo_flush_done;
+		flush_queued = !rpc_iwinfo_submit(&flush_job, NULL, NULL);
+	}
+}
+
+static void
+rpc_iwinfo_hotplug_init(void)
+{
+	struct sockaddr_nl sa = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = RTMGRP_LINK,
+	};
+
+	hotplug.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+	                    NETLINK_ROUTE);
+
+	if (hotplug.fd < 0)
+		return;
+
+	if (bind(hotplug.fd, (struct sockaddr *)&sa, sizeof(sa)))
+	{
+		close(hotplug.fd);
+		hotplug.fd = -1;
+		return;
+	}
+
+	hotplug.cb = rpc_iwinfo_hotplug_cb;
+	uloop_fd_add(&hotplug, ULOOP_READ);
+}
+
 static int
 __rpc_iwinfo_open(struct blob_attr *device)
 {
@@ -70,7 +359,7 @@ __rpc_iwinfo_open(struct blob_attr *device)
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
 	ifname = blobmsg_data(device);
-	iw = iwinfo_backend(ifname);
+	iw = rpc_iwinfo_backend(ifname);
 
 	return iw ? UBUS_STATUS_OK : UBUS_STATUS_NOT_FOUND;
 }
@@ -91,11 +380,13 @@ rpc_iwinfo_close(void)
 {
 	iw = NULL;
 	ifname = NULL;
-	iwinfo_finish();
+
+	if (hotplug.fd < 0)
+		rpc_iwinfo_flush();
 }
 
 static void
-rpc_iwinfo_call_int(const char *name, int (*func)(const char *, int *),
+rpc_iwinfo_call_int(struct blob_buf *buf, const char *name, int (*func)(const char *, int *),
                     const char **map)
 {
 	int rv;
@@ -103,254 +394,552 @@ rpc_iwinfo_call_int(const char *name, int (*func)(const char *, int *),
 	if (!func(ifname, &rv))
 	{
 		if (!map)
-			blobmsg_add_u32(&buf, name, rv);
+			blobmsg_add_u32(buf, name, rv);
 		else
-			blobmsg_add_string(&buf, name, map[rv]);
+			blobmsg_add_string(buf, name, map[rv]);
 	}
 }
 
 static void
-rpc_iwinfo_call_hardware_id(const char *name)
+rpc_iwinfo_call_hardware_id(struct blob_buf *buf, const char *name)
 {
 	struct iwinfo_hardware_id ids;
 	void *c;
 
 	if (!iw->hardware_id(ifname, (char *)&ids))
 	{
-		c = blobmsg_open_array(&buf, name);
+		c = blobmsg_open_array(buf, name);
 
-		blobmsg_add_u32(&buf, NULL, ids.vendor_id);
-		blobmsg_add_u32(&buf, NULL, ids.device_id);
-		blobmsg_add_u32(&buf, NULL, ids.subsystem_vendor_id);
-		blobmsg_add_u32(&buf, NULL, ids.subsystem_device_id);
+		blobmsg_add_u32(buf, NULL, ids.vendor_id);
+		blobmsg_add_u32(buf, NULL, ids.device_id);
+		blobmsg_add_u32(buf, NULL, ids.subsystem_vendor_id);
+		blobmsg_add_u32(buf, NULL, ids.subsystem_device_id);
 
-		blobmsg_close_array(&buf, c);
+		blobmsg_close_array(buf, c);
 	}
 }
 
 static void
-rpc_iwinfo_add_encryption(const char *name, struct iwinfo_crypto_entry *e)
+rpc_iwinfo_add_encryption(struct blob_buf *buf, const char *name, struct iwinfo_crypto_entry *e)
 {
 	int ciph;
 	void *c, *d;
 
-	c = blobmsg_open_table(&buf, name);
+	c = blobmsg_open_table(buf, name);
 
-	blobmsg_add_u8(&buf, "enabled", e->enabled);
+	blobmsg_add_u8(buf, "enabled", e->enabled);
 
 	if (e->enabled)
 	{
 		if (!e->wpa_version)
 		{
-			d = blobmsg_open_array(&buf, "wep");
+			d = blobmsg_open_array(buf, "wep");
 
 			if (e->auth_algs & IWINFO_AUTH_OPEN)
-				blobmsg_add_string(&buf, NULL, "open");
+				blobmsg_add_string(buf, NULL, "open");
 
 			if (e->auth_algs & IWINFO_AUTH_SHARED)
-				blobmsg_add_string(&buf, NULL, "shared");
+				blobmsg_add_string(buf, NULL, "shared");
 
-			blobmsg_close_array(&buf, d);
+			blobmsg_close_array(buf, d);
 		}
 		else
 		{
-			d = blobmsg_open_array(&buf, "wpa");
+			d = blobmsg_open_array(buf, "wpa");
 
 			if (e->wpa_version > 2)
 			{
-				blobmsg_add_u32(&buf, NULL, 1);
-				blobmsg_add_u32(&buf, NULL, 2);
+				blobmsg_add_u32(buf, NULL, 1);
+				blobmsg_add_u32(buf, NULL, 2);
 			}
 			else
 			{
-				blobmsg_add_u32(&buf, NULL, e->wpa_version);
+				blobmsg_add_u32(buf, NULL, e->wpa_version);
 			}
 
-			blobmsg_close_array(&buf, d);
+			blobmsg_close_array(buf, d);
 
 
-			d = blobmsg_open_array(&buf, "authentication");
+			d = blobmsg_open_array(buf, "authentication");
 
 			if (e->auth_suites & IWINFO_KMGMT_PSK)
-				blobmsg_add_string(&buf, NULL, "psk");
+				blobmsg_add_string(buf, NULL, "psk");
 
 			if (e->auth_suites & IWINFO_KMGMT_8021x)
-				blobmsg_add_string(&buf, NULL, "802.1x");
+				blobmsg_add_string(buf, NULL, "802.1x");
 
 			if (!e->auth_suites ||
 				(e->auth_suites & IWINFO_KMGMT_NONE))
-				blobmsg_add_string(&buf, NULL, "none");
+				blobmsg_add_string(buf, NULL, "none");
 
-			blobmsg_close_array(&buf, d);
+			blobmsg_close_array(buf, d);
 		}
 
-		d = blobmsg_open_array(&buf, "ciphers");
+		d = blobmsg_open_array(buf, "ciphers");
 		ciph = e->pair_ciphers | e->group_ciphers;
 
 		if (ciph & IWINFO_CIPHER_WEP40)
-			blobmsg_add_string(&buf, NULL, "wep-40");
+			blobmsg_add_string(buf, NULL, "wep-40");
 
 		if (ciph & IWINFO_CIPHER_WEP104)
-			blobmsg_add_string(&buf, NULL, "wep-104");
+			blobmsg_add_string(buf, NULL, "wep-104");
 
 		if (ciph & IWINFO_CIPHER_TKIP)
-			blobmsg_add_string(&buf, NULL, "tkip");
+			blobmsg_add_string(buf, NULL, "tkip");
 
 		if (ciph & IWINFO_CIPHER_CCMP)
-			blobmsg_add_string(&buf, NULL, "ccmp");
+			blobmsg_add_string(buf, NULL, "ccmp");
 
 		if (ciph & IWINFO_CIPHER_WRAP)
-			blobmsg_add_string(&buf, NULL, "wrap");
+			blobmsg_add_string(buf, NULL, "wrap");
 
 		if (ciph & IWINFO_CIPHER_AESOCB)
-			blobmsg_add_string(&buf, NULL, "aes-ocb");
+			blobmsg_add_string(buf, NULL, "aes-ocb");
 
 		if (ciph & IWINFO_CIPHER_CKIP)
-			blobmsg_add_string(&buf, NULL, "ckip");
+			blobmsg_add_string(buf, NULL, "ckip");
 
 		if (!ciph || (ciph & IWINFO_CIPHER_NONE))
-			blobmsg_add_string(&buf, NULL, "none");
+			blobmsg_add_string(buf, NULL, "none");
 
-		blobmsg_close_array(&buf, d);
+		blobmsg_close_array(buf, d);
 	}
 
-	blobmsg_close_table(&buf, c);
+	blobmsg_close_table(buf, c);
 }
 
 static void
-rpc_iwinfo_call_encryption(const char *name)
+rpc_iwinfo_call_encryption(struct blob_buf *buf, const char *name)
 {
 	struct iwinfo_crypto_entry crypto = { 0 };
 
 	if (!iw->encryption(ifname, (char *)&crypto))
-		rpc_iwinfo_add_encryption(name, &crypto);
+		rpc_iwinfo_add_encryption(buf, name, &crypto);
 }
 
 static void
-rpc_iwinfo_call_htmodes(const char *name)
+rpc_iwinfo_call_htmodes(struct blob_buf *buf, const char *name)
 {
 	int modes;
 	void *c;
 
 	if (!iw->htmodelist(ifname, &modes))
 	{
-		c = blobmsg_open_array(&buf, name);
+		c = blobmsg_open_array(buf, name);
 
 		if (modes & IWINFO_HTMODE_HT20)
-			blobmsg_add_string(&buf, NULL, "HT20");
+			blobmsg_add_string(buf, NULL, "HT20");
 
 		if (modes & IWINFO_HTMODE_HT40)
-			blobmsg_add_string(&buf, NULL, "HT40");
+			blobmsg_add_string(buf, NULL, "HT40");
 
 		if (modes & IWINFO_HTMODE_VHT20)
-			blobmsg_add_string(&buf, NULL, "VHT20");
+			blobmsg_add_string(buf, NULL, "VHT20");
 
 		if (modes & IWINFO_HTMODE_VHT40)
-			blobmsg_add_string(&buf, NULL, "VHT40");
+			blobmsg_add_string(buf, NULL, "VHT40");
 
 		if (modes & IWINFO_HTMODE_VHT80)
-			blobmsg_add_string(&buf, NULL, "VHT80");
+			blobmsg_add_string(buf, NULL, "VHT80");
 
 		if (modes & IWINFO_HTMODE_VHT80_80)
-			blobmsg_add_string(&buf, NULL, "VHT80+80");
+			blobmsg_add_string(buf, NULL, "VHT80+80");
 
 		if (modes & IWINFO_HTMODE_VHT160)
-			blobmsg_add_string(&buf, NULL, "VHT160");
+			blobmsg_add_string(buf, NULL, "VHT160");
 
-		blobmsg_close_array(&buf, c);
+		blobmsg_close_array(buf, c);
 	}
 }
 
 static void
-rpc_iwinfo_call_hwmodes(const char *name)
+rpc_iwinfo_call_hwmodes(struct blob_buf *buf, const char *name)
 {
 	int modes;
 	void *c;
 
 	if (!iw->hwmodelist(ifname, &modes))
 	{
-		c = blobmsg_open_array(&buf, name);
+		c = blobmsg_open_array(buf, name);
 
 		if (modes & IWINFO_80211_AC)
-			blobmsg_add_string(&buf, NULL, "ac");
+			blobmsg_add_string(buf, NULL, "ac");
 
 		if (modes & IWINFO_80211_A)
-			blobmsg_add_string(&buf, NULL, "a");
+			blobmsg_add_string(buf, NULL, "a");
 
 		if (modes & IWINFO_80211_B)
-			blobmsg_add_string(&buf, NULL, "b");
+			blobmsg_add_string(buf, NULL, "b");
 
 		if (modes & IWINFO_80211_G)
-			blobmsg_add_string(&buf, NULL, "g");
+			blobmsg_add_string(buf, NULL, "g");
 
 		if (modes & IWINFO_80211_N)
-			blobmsg_add_string(&buf, NULL, "n");
+			blobmsg_add_string(buf, NULL, "n");
 
-		blobmsg_close_array(&buf, c);
+		blobmsg_close_array(buf, c);
 	}
 }
 
 static void
-rpc_iwinfo_call_str(const char *name, int (*func)(const char *, char *))
+rpc_iwinfo_call_str(struct blob_buf *buf, const char *name, int (*func)(const char *, char *))
 {
 	char rv[IWINFO_BUFSIZE] = { 0 };
 
 	if (!func(ifname, rv))
-		blobmsg_add_string(&buf, name, rv);
+		blobmsg_add_string(buf, name, rv);
+}
+
+static void
+rpc_iwinfo_add_info(struct blob_buf *buf)
+{
+	void *c;
+
+	rpc_iwinfo_call_str(buf, "phy", iw->phyname);
+
+	rpc_iwinfo_call_str(buf, "ssid", iw->ssid);
+	rpc_iwinfo_call_str(buf, "bssid", iw->bssid);
+	rpc_iwinfo_call_str(buf, "country", iw->country);
+
+	rpc_iwinfo_call_int(buf, "mode", iw->mode, IWINFO_OPMODE_NAMES);
+	rpc_iwinfo_call_int(buf, "channel", iw->channel, NULL);
+
+	rpc_iwinfo_call_int(buf, "frequency", iw->frequency, NULL);
+	rpc_iwinfo_call_int(buf, "frequency_offset", iw->frequency_offset, NULL);
+
+	rpc_iwinfo_call_int(buf, "txpower", iw->txpower, NULL);
+	rpc_iwinfo_call_int(buf, "txpower_offset", iw->txpower_offset, NULL);
+
+	rpc_iwinfo_call_int(buf, "quality", iw->quality, NULL);
+	rpc_iwinfo_call_int(buf, "quality_max", iw->quality_max, NULL);
+
+	rpc_iwinfo_call_int(buf, "signal", iw->signal, NULL);
+	rpc_iwinfo_call_int(buf, "noise", iw->noise, NULL);
+
+	rpc_iwinfo_call_int(buf, "bitrate", iw->bitrate, NULL);
+
+	rpc_iwinfo_call_encryption(buf, "encryption");
+	rpc_iwinfo_call_htmodes(buf, "htmodes");
+	rpc_iwinfo_call_hwmodes(buf, "hwmodes");
+
+	c = blobmsg_open_table(buf, "hardware");
+	rpc_iwinfo_call_hardware_id(buf, "id");
+	rpc_iwinfo_call_str(buf, "name", iw->hardware_name);
+	blobmsg_close_table(buf, c);
 }
 
 static int
-rpc_iwinfo_info(struct ubus_context *ctx, struct ubus_object *obj,
-                struct ubus_request_data *req, const char *method,
-                struct blob_attr *msg)
+rpc_iwinfo_info(struct blob_attr *msg, struct blob_buf *buf)
 {
 	int rv;
-	void *c;
 
 	rv = rpc_iwinfo_open(msg);
 
 	if (rv)
 		return rv;
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
-	rpc_iwinfo_call_str("phy", iw->phyname);
+	rpc_iwinfo_add_info(buf);
 
-	rpc_iwinfo_call_str("ssid", iw->ssid);
-	rpc_iwinfo_call_str("bssid", iw->bssid);
-	rpc_iwinfo_call_str("country", iw->country);
+	return UBUS_STATUS_OK;
+}
 
-	rpc_iwinfo_call_int("mode", iw->mode, IWINFO_OPMODE_NAMES);
-	rpc_iwinfo_call_int("channel", iw->channel, NULL);
+/*
+ * Scans run in a child forked by a worker while holding the lock, which
+ * drops the netlink state inherited from rpcd, performs the blocking scan
+ * and writes a status byte followed by the raw result entries to a pipe.
+ * Requests arriving meanwhile wait for the same scan, results are cached
+ * per device and returned to requests accepting their age.
+ *
+ * Forking a multithreaded process leaves the child with only the state
+ * other threads were in, so the child is restricted to what is safe there:
+ * the lock serializes every iwinfo and libnl call in rpcd, hence no other
+ * thread is inside them at fork time and iwinfo_finish() only releases
+ * state nobody else uses. The results are written into the buffer the
+ * parent already allocated, allocations within the iwinfo backend rely on
+ * malloc() being usable after fork() which glibc and musl both provide.
+ * Nothing else in the child touches ubus, uloop or stdio.
+ */
+static time_t
+rpc_iwinfo_now(void)
+{
+	struct timespec ts;
 
-	rpc_iwinfo_call_int("frequency", iw->frequency, NULL);
-	rpc_iwinfo_call_int("frequency_offset", iw->frequency_offset, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	rpc_iwinfo_call_int("txpower", iw->txpower, NULL);
-	rpc_iwinfo_call_int("txpower_offset", iw->txpower_offset, NULL);
+	return ts.tv_sec;
+}
 
-	rpc_iwinfo_call_int("quality", iw->quality, NULL);
-	rpc_iwinfo_call_int("quality_max", iw->quality_max, NULL);
+static void
+rpc_iwinfo_add_scanlist(struct blob_buf *buf, const char *res, int len)
+{
+	int i;
+	void *c, *d;
+	char mac[18];
+	struct iwinfo_scanlist_entry *e;
+
+	c = blobmsg_open_array(buf, "results");
 
-	rpc_iwinfo_call_int("signal", iw->signal, NULL);
-	rpc_iwinfo_call_int("noise", iw->noise, NULL);
+	for (i = 0; i + sizeof(*e) <= len; i += sizeof(*e))
+	{
+		e = (struct iwinfo_scanlist_entry *)&res[i];
+		d = blobmsg_open_table(buf, NULL);
+
+		if (e->ssid[0])
+			blobmsg_add_string(buf, "ssid", (const char *)e->ssid);
+
+		snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X",
+				 e->mac[0], e->mac[1], e->mac[2],
+				 e->mac[3], e->mac[4], e->mac[5]);
 
-	rpc_iwinfo_call_int("bitrate", iw->bitrate, NULL);
+		blobmsg_add_string(buf, "bssid", mac);
 
-	rpc_iwinfo_call_encryption("encryption");
-	rpc_iwinfo_call_htmodes("htmodes");
-	rpc_iwinfo_call_hwmodes("hwmodes");
+		blobmsg_add_string(buf, "mode", IWINFO_OPMODE_NAMES[e->mode]);
 
-	c = blobmsg_open_table(&buf, "hardware");
-	rpc_iwinfo_call_hardware_id("id");
-	rpc_iwinfo_call_str("name", iw->hardware_name);
-	blobmsg_close_table(&buf, c);
+		blobmsg_add_u32(buf, "channel", e->channel);
+		blobmsg_add_u32(buf, "signal", (uint32_t)(e->signal - 0x100));
 
-	ubus_send_reply(ctx, req, buf.head);
+		blobmsg_add_u32(buf, "quality", e->quality);
+		blobmsg_add_u32(buf, "quality_max", e->quality_max);
+
+		rpc_iwinfo_add_encryption(buf, "encryption", &e->crypto);
+
+		blobmsg_close_table(buf, d);
+	}
+
+	blobmsg_close_array(buf, c);
+}
+
+static void
+rpc_iwinfo_scan_finish(struct rpc_iwinfo_scan *s, int ret)
+{
+	struct rpc_iwinfo_scan_waiter *w, *tmp;
+	struct blob_buf b = { 0 };
+
+	uloop_timeout_cancel(&s->timeout);
+	s->running = false;
+
+	if (!ret)
+	{
+		blob_buf_init(&b, 0);
+		rpc_iwinfo_add_scanlist(&b, s->data, s->len);
+	}
+
+	list_for_each_entry_safe(w, tmp, &s->waiters, list)
+	{
+		if (!ret)
+			ubus_send_reply(w->context, &w->request, b.head);
+
+		ops->complete_deferred(w->context, &w->request, ret);
+
+		list_del(&w->list);
+		free(w);
+	}
+
+	blob_buf_free(&b);
+
+	/* devices which were never scanned are not kept around */
+	if (ret && !s->updated)
+	{
+		avl_delete(&scans, &s->avl);
+		free(s->data);
+		free(s);
+	}
+}
+
+static void
+rpc_iwinfo_scan_close(struct rpc_iwinfo_scan *s)
+{
+	if (s->fd.fd < 0)
+		return;
+
+	uloop_fd_delete(&s->fd);
+	close(s->fd.fd);
+	s->fd.fd = -1;
+}
+
+static void
+rpc_iwinfo_scan_read_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct rpc_iwinfo_scan *s = container_of(u, struct rpc_iwinfo_scan, fd);
+	ssize_t len;
+
+	while (s->len < IWINFO_BUFSIZE + 1)
+	{
+		len = read(u->fd, s->data + s->len, IWINFO_BUFSIZE + 1 - s->len);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && errno == EAGAIN)
+			return;
+
+		if (len <= 0)
+			break;
+
+		s->len += len;
+	}
+
+	rpc_iwinfo_scan_close(s);
+
+	/* failed scans are reported as empty but not cached */
+	if (s->len > 0 && !s->data[0])
+	{
+		memmove(s->data, s->data + 1, --s->len);
+		s->updated = rpc_iwinfo_now();
+	}
+	else
+	{
+		s->len = 0;
+	}
+
+	rpc_iwinfo_scan_finish(s, UBUS_STATUS_OK);
+}
+
+static void
+rpc_iwinfo_scan_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_iwinfo_scan *s =
+		container_of(t, struct rpc_iwinfo_scan, timeout);
+
+	kill(s->pid, SIGKILL);
+
+	rpc_iwinfo_scan_close(s);
+	rpc_iwinfo_scan_finish(s, UBUS_STATUS_TIMEOUT);
+}
+
+static void
+rpc_iwinfo_scan_child(const char *device, char *res, int fd)
+{
+	const struct iwinfo_ops *backend;
+	int len, off = 0, rv;
+
+	iwinfo_finish();
+
+	backend = iwinfo_backend(device);
+
+	if (!backend || backend->scanlist(device, res + 1, &len))
+		_exit(1);
+
+	res[0] = 0;
+	len++;
+
+	while (off < len)
+	{
+		rv = write(fd, res + off, len - off);
+
+		if (rv < 0 && errno == EINTR)
+			continue;
+
+		if (rv <= 0)
+			_exit(1);
+
+		off += rv;
+	}
+
+	_exit(0);
+}
+
+static int
+rpc_iwinfo_scan_start(struct rpc_worker_job *job)
+{
+	struct rpc_iwinfo_scan *s =
+		container_of(job, struct rpc_iwinfo_scan, start);
+	int fds[2], rv = UBUS_STATUS_OK;
+	pid_t pid;
+
+	pthread_mutex_lock(&lock);
+
+	if (!rpc_iwinfo_backend(s->avl.key))
+	{
+		rv = UBUS_STATUS_NOT_FOUND;
+	}
+	else if (pipe2(fds, O_CLOEXEC))
+	{
+		rv = UBUS_STATUS_UNKNOWN_ERROR;
+	}
+	else if ((pid = fork()) < 0)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		rv = UBUS_STATUS_UNKNOWN_ERROR;
+	}
+	else if (pid == 0)
+	{
+		close(fds[0]);
+		rpc_iwinfo_scan_child(s->avl.key, s->data, fds[1]);
+	}
+	else
+	{
+		close(fds[1]);
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+		s->fd.fd = fds[0];
+		s->pid = pid;
+	}
 
 	rpc_iwinfo_close();
+	pthread_mutex_unlock(&lock);
 
-	return UBUS_STATUS_OK;
+	return rv;
+}
+
+/*
+ * The child is not tracked as a process, it may already be gone and be
+ * reaped by uloop before this runs. Its end of the pipe closing tells
+ * when it finished, the write end is close-on-exec and closed before the
+ * lock is released so no other child can hold it open. Should the scan
+ * hang anyway, the timeout kills it and completes the waiters by itself.
+ */
+static void
+rpc_iwinfo_scan_started(struct rpc_worker_job *job, int ret)
+{
+	struct rpc_iwinfo_scan *s =
+		container_of(job, struct rpc_iwinfo_scan, start);
+
+	rpc_iwinfo_next();
+
+	if (ret)
+	{
+		rpc_iwinfo_scan_finish(s, ret);
+		return;
+	}
+
+	s->fd.cb = rpc_iwinfo_scan_read_cb;
+	uloop_fd_add(&s->fd, ULOOP_READ);
+
+	s->timeout.cb = rpc_iwinfo_scan_timeout_cb;
+	uloop_timeout_set(&s->timeout, RPC_IWINFO_SCAN_TIMEOUT);
+}
+
+static struct rpc_iwinfo_scan *
+rpc_iwinfo_scan_get(const char *device)
+{
+	struct rpc_iwinfo_scan *s;
+	char *str;
+
+	if (!scans.comp)
+		avl_init(&scans, avl_strcmp, false, NULL);
+
+	s = avl_find_element(&scans, device, s, avl);
+
+	if (s)
+		return s;
+
+	s = calloc_a(sizeof(*s), &str, strlen(device) + 1);
+
+	if (!s)
+		return NULL;
+
+	s->avl.key = strcpy(str, device);
+	s->fd.fd = -1;
+	s->start.run = rpc_iwinfo_scan_start;
+	s->start.done = rpc_iwinfo_scan_started;
+	INIT_LIST_HEAD(&s->waiters);
+	avl_insert(&scans, &s->avl);
+
+	return s;
 }
 
 static int
@@ -358,71 +947,100 @@ rpc_iwinfo_scan(struct ubus_context *ctx, struct ubus_object *obj,
                 struct ubus_request_data *req, const char *method,
                 struct blob_attr *msg)
 {
-	int i, rv, len;
-	void *c, *d;
-	char mac[18];
-	char res[IWINFO_BUFSIZE];
-	struct iwinfo_scanlist_entry *e;
+	struct blob_attr *tb[__RPC_S_MAX];
+	struct rpc_iwinfo_scan_waiter *w;
+	struct rpc_iwinfo_scan *s;
+	struct blob_buf b = { 0 };
+	int ttl = RPC_IWINFO_SCAN_TTL;
 
-	rv = rpc_iwinfo_open(msg);
-
-	if (rv)
-		return rv;
-
-	blob_buf_init(&buf, 0);
+	blobmsg_parse(rpc_scan_policy, __RPC_S_MAX, tb,
+	              blob_data(msg), blob_len(msg));
 
-	c = blobmsg_open_array(&buf, "results");
+	if (!tb[RPC_S_DEVICE])
+		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	if (!iw->scanlist(ifname, res, &len) && (len > 0))
-	{
-		for (i = 0; i < len; i += sizeof(struct iwinfo_scanlist_entry))
-		{
-			e = (struct iwinfo_scanlist_entry *)&res[i];
-			d = blobmsg_open_table(&buf, NULL);
+	if (tb[RPC_S_TTL])
+		ttl = blobmsg_get_u32(tb[RPC_S_TTL]);
 
-			if (e->ssid[0])
-				blobmsg_add_string(&buf, "ssid", (const char *)e->ssid);
+	s = rpc_iwinfo_scan_get(blobmsg_data(tb[RPC_S_DEVICE]));
 
-			snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X",
-					 e->mac[0], e->mac[1], e->mac[2],
-					 e->mac[3], e->mac[4], e->mac[5]);
+	if (!s)
+		return UBUS_STATUS_UNKNOWN_ERROR;
 
-			blobmsg_add_string(&buf, "bssid", mac);
+	if (!s->running && s->updated && rpc_iwinfo_now() - s->updated <= ttl)
+	{
+		blob_buf_init(&b, 0);
+		rpc_iwinfo_add_scanlist(&b, s->data, s->len);
+		ubus_send_reply(ctx, req, b.head);
+		blob_buf_free(&b);
 
-			blobmsg_add_string(&buf, "mode", IWINFO_OPMODE_NAMES[e->mode]);
+		return UBUS_STATUS_OK;
+	}
 
-			blobmsg_add_u32(&buf, "channel", e->channel);
-			blobmsg_add_u32(&buf, "signal", (uint32_t)(e->signal - 0x100));
+	if (!s->running)
+	{
+		if (!s->data && !(s->data = malloc(IWINFO_BUFSIZE + 1)))
+			return UBUS_STATUS_UNKNOWN_ERROR;
 
-			blobmsg_add_u32(&buf, "quality", e->quality);
-			blobmsg_add_u32(&buf, "quality_max", e->quality_max);
+		s->len = 0;
 
-			rpc_iwinfo_add_encryption("encryption", &e->crypto);
+		if (rpc_iwinfo_submit(&s->start, NULL, NULL))
+			return UBUS_STATUS_UNKNOWN_ERROR;
 
-			blobmsg_close_table(&buf, d);
-		}
+		s->running = true;
 	}
 
-	blobmsg_close_array(&buf, c);
+	w = calloc(1, sizeof(*w));
 
-	ubus_send_reply(ctx, req, buf.head);
+	/* the scan still completes and refreshes the cache */
+	if (!w)
+		return UBUS_STATUS_UNKNOWN_ERROR;
 
-	rpc_iwinfo_close();
+	w->context = ctx;
+	ubus_defer_request(ctx, req, &w->request);
+	list_add_tail(&w->list, &s->waiters);
 
 	return UBUS_STATUS_OK;
 }
 
+static void
+rpc_iwinfo_add_assoc(struct blob_buf *buf, const struct iwinfo_assoclist_entry *a)
+{
+	char mac[18];
+	void *e;
+
+	snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X",
+			 a->mac[0], a->mac[1], a->mac[2],
+			 a->mac[3], a->mac[4], a->mac[5]);
+
+	blobmsg_add_string(buf, "mac", mac);
+	blobmsg_add_u32(buf, "signal", a->signal);
+	blobmsg_add_u32(buf, "noise", a->noise);
+	blobmsg_add_u32(buf, "inactive", a->inactive);
+
+	e = blobmsg_open_table(buf, "rx");
+	blobmsg_add_u32(buf, "rate", a->rx_rate.rate);
+	blobmsg_add_u32(buf, "mcs", a->rx_rate.mcs);
+	blobmsg_add_u8(buf, "40mhz", a->rx_rate.is_40mhz);
+	blobmsg_add_u8(buf, "short_gi", a->rx_rate.is_short_gi);
+	blobmsg_close_table(buf, e);
+
+	e = blobmsg_open_table(buf, "tx");
+	blobmsg_add_u32(buf, "rate", a->tx_rate.rate);
+	blobmsg_add_u32(buf, "mcs", a->tx_rate.mcs);
+	blobmsg_add_u8(buf, "40mhz", a->tx_rate.is_40mhz);
+	blobmsg_add_u8(buf, "short_gi", a->tx_rate.is_short_gi);
+	blobmsg_close_table(buf, e);
+}
+
 static int
-rpc_iwinfo_assoclist(struct ubus_context *ctx, struct ubus_object *obj,
-                     struct ubus_request_data *req, const char *method,
-                     struct blob_attr *msg)
+rpc_iwinfo_assoclist(struct blob_attr *msg, struct blob_buf *buf)
 {
 	int i, rv, len;
-	char mac[18];
 	char res[IWINFO_BUFSIZE];
 	struct iwinfo_assoclist_entry *a;
 	struct ether_addr *macaddr = NULL;
-	void *c, *d, *e;
+	void *c, *d;
 	struct blob_attr *tb[__RPC_A_MAX];
 	bool found = false;
 
@@ -436,10 +1054,10 @@ rpc_iwinfo_assoclist(struct ubus_context *ctx, struct ubus_object *obj,
 	if (tb[RPC_A_MACADDR])
 		macaddr = ether_aton(blobmsg_data(tb[RPC_A_MACADDR]));
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
 	if (!macaddr)
-		c = blobmsg_open_array(&buf, "results");
+		c = blobmsg_open_array(buf, "results");
 
 	if (!iw->assoclist(ifname, res, &len) && (len > 0))
 	{
@@ -448,57 +1066,30 @@ rpc_iwinfo_assoclist(struct ubus_context *ctx, struct ubus_object *obj,
 			a = (struct iwinfo_assoclist_entry *)&res[i];
 
 			if (!macaddr)
-				d = blobmsg_open_table(&buf, NULL);
+				d = blobmsg_open_table(buf, NULL);
 			else if (memcmp(macaddr, a->mac, ETH_ALEN) != 0)
 				continue;
 
-			snprintf(mac, sizeof(mac), "%02X:%02X:%02X:%02X:%02X:%02X",
-					 a->mac[0], a->mac[1], a->mac[2],
-					 a->mac[3], a->mac[4], a->mac[5]);
-
-			blobmsg_add_string(&buf, "mac", mac);
-			blobmsg_add_u32(&buf, "signal", a->signal);
-			blobmsg_add_u32(&buf, "noise", a->noise);
-			blobmsg_add_u32(&buf, "inactive", a->inactive);
-
-			e = blobmsg_open_table(&buf, "rx");
-			blobmsg_add_u32(&buf, "rate", a->rx_rate.rate);
-			blobmsg_add_u32(&buf, "mcs", a->rx_rate.mcs);
-			blobmsg_add_u8(&buf, "40mhz", a->rx_rate.is_40mhz);
-			blobmsg_add_u8(&buf, "short_gi", a->rx_rate.is_short_gi);
-			blobmsg_close_table(&buf, e);
-
-			e = blobmsg_open_table(&buf, "tx");
-			blobmsg_add_u32(&buf, "rate", a->tx_rate.rate);
-			blobmsg_add_u32(&buf, "mcs", a->tx_rate.mcs);
-			blobmsg_add_u8(&buf, "40mhz", a->tx_rate.is_40mhz);
-			blobmsg_add_u8(&buf, "short_gi", a->tx_rate.is_short_gi);
-			blobmsg_close_table(&buf, e);
+			rpc_iwinfo_add_assoc(buf, a);
 
 			found = true;
 			if (!macaddr)
-				blobmsg_close_table(&buf, d);
+				blobmsg_close_table(buf, d);
 			else
 				break;
 		}
 	}
 
 	if (!macaddr)
-		blobmsg_close_array(&buf, c);
+		blobmsg_close_array(buf, c);
 	else if (!found)
 		return UBUS_STATUS_NOT_FOUND;
 
-	ubus_send_reply(ctx, req, buf.head);
-
-	rpc_iwinfo_close();
-
 	return UBUS_STATUS_OK;
 }
 
 static int
-rpc_iwinfo_freqlist(struct ubus_context *ctx, struct ubus_object *obj,
-                    struct ubus_request_data *req, const char *method,
-                    struct blob_attr *msg)
+rpc_iwinfo_freqlist(struct blob_attr *msg, struct blob_buf *buf)
 {
 	int i, rv, len, ch;
 	char res[IWINFO_BUFSIZE];
@@ -510,9 +1101,9 @@ rpc_iwinfo_freqlist(struct ubus_context *ctx, struct ubus_object *obj,
 	if (rv)
 		return rv;
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
-	c = blobmsg_open_array(&buf, "results");
+	c = blobmsg_open_array(buf, "results");
 
 	if (!iw->freqlist(ifname, res, &len) && (len > 0))
 	{
@@ -522,32 +1113,26 @@ rpc_iwinfo_freqlist(struct ubus_context *ctx, struct ubus_object *obj,
 		for (i = 0; i < len; i += sizeof(struct iwinfo_freqlist_entry))
 		{
 			f = (struct iwinfo_freqlist_entry *)&res[i];
-			d = blobmsg_open_table(&buf, NULL);
+			d = blobmsg_open_table(buf, NULL);
 
-			blobmsg_add_u32(&buf, "channel", f->channel);
-			blobmsg_add_u32(&buf, "mhz", f->mhz);
-			blobmsg_add_u8(&buf, "restricted", f->restricted);
+			blobmsg_add_u32(buf, "channel", f->channel);
+			blobmsg_add_u32(buf, "mhz", f->mhz);
+			blobmsg_add_u8(buf, "restricted", f->restricted);
 
 			if (ch > -1)
-				blobmsg_add_u8(&buf, "active", f->channel == ch);
+				blobmsg_add_u8(buf, "active", f->channel == ch);
 
-			blobmsg_close_table(&buf, d);
+			blobmsg_close_table(buf, d);
 		}
 	}
 
-	blobmsg_close_array(&buf, c);
-
-	ubus_send_reply(ctx, req, buf.head);
-
-	rpc_iwinfo_close();
+	blobmsg_close_array(buf, c);
 
 	return UBUS_STATUS_OK;
 }
 
 static int
-rpc_iwinfo_txpowerlist(struct ubus_context *ctx, struct ubus_object *obj,
-                       struct ubus_request_data *req, const char *method,
-                       struct blob_attr *msg)
+rpc_iwinfo_txpowerlist(struct blob_attr *msg, struct blob_buf *buf)
 {
 	int i, rv, len, pwr, off;
 	char res[IWINFO_BUFSIZE];
@@ -559,9 +1144,9 @@ rpc_iwinfo_txpowerlist(struct ubus_context *ctx, struct ubus_object *obj,
 	if (rv)
 		return rv;
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
-	c = blobmsg_open_array(&buf, "results");
+	c = blobmsg_open_array(buf, "results");
 
 	if (!iw->txpwrlist(ifname, res, &len) && (len > 0))
 	{
@@ -574,59 +1159,111 @@ rpc_iwinfo_txpowerlist(struct ubus_context *ctx, struct ubus_object *obj,
 		for (i = 0; i < len; i += sizeof(struct iwinfo_txpwrlist_entry))
 		{
 			t = (struct iwinfo_txpwrlist_entry *)&res[i];
-			d = blobmsg_open_table(&buf, NULL);
+			d = blobmsg_open_table(buf, NULL);
 
-			blobmsg_add_u32(&buf, "dbm", t->dbm + off);
-			blobmsg_add_u32(&buf, "mw", iwinfo_dbm2mw(t->dbm + off));
+			blobmsg_add_u32(buf, "dbm", t->dbm + off);
+			blobmsg_add_u32(buf, "mw", iwinfo_dbm2mw(t->dbm + off));
 
 			if (pwr > -1)
-				blobmsg_add_u8(&buf, "active", t->dbm == pwr);
+				blobmsg_add_u8(buf, "active", t->dbm == pwr);
 
-			blobmsg_close_table(&buf, d);
+			blobmsg_close_table(buf, d);
 		}
 	}
 
-	blobmsg_close_array(&buf, c);
+	blobmsg_close_array(buf, c);
 
-	ubus_send_reply(ctx, req, buf.head);
+	return UBUS_STATUS_OK;
+}
 
-	rpc_iwinfo_close();
+static int
+rpc_iwinfo_country_cmp(const void *a, const void *b)
+{
+	const struct iwinfo_country_entry *ca = a, *cb = b;
 
-	return UBUS_STATUS_OK;
+	return (int)ca->iso3166 - (int)cb->iso3166;
 }
 
-static const char *
-rpc_iwinfo_lookup_country(char *buf, int len, int iso3166)
+/*
+ * Build the country table of the phy behind the current device once,
+ * joining the driver's country list with the ISO 3166 names.
+ */
+static struct rpc_iwinfo_countries *
+rpc_iwinfo_countries(void)
 {
-	int i;
-	static char ccode[5];
-	struct iwinfo_country_entry *c;
+	struct rpc_iwinfo_countries *cl;
+	struct iwinfo_country_entry *e, key;
+	const struct iwinfo_iso3166_label *l;
+	char phy[IFNAMSIZ] = { 0 }, *str;
+	int len, n = 0, n_entries;
+	char *res;
+
+	if (iw->phyname(ifname, phy))
+		snprintf(phy, sizeof(phy), "%s", ifname);
+
+	if (!countries.comp)
+		avl_init(&countries, avl_strcmp, false, NULL);
+
+	cl = avl_find_element(&countries, phy, cl, avl);
+
+	if (cl)
+		return cl;
+
+	res = calloc(1, IWINFO_BUFSIZE);
+
+	if (!res)
+		return NULL;
 
-	for (i = 0; i < len; i += sizeof(struct iwinfo_country_entry))
+	if (iw->countrylist(ifname, res, &len) || len <= 0)
+		len = 0;
+
+	n_entries = len / sizeof(*e);
+	qsort(res, n_entries, sizeof(*e), rpc_iwinfo_country_cmp);
+
+	for (l = IWINFO_ISO3166_NAMES; l->iso3166; l++)
+		n++;
+
+	cl = calloc_a(sizeof(*cl) + n * sizeof(cl->countries[0]),
+	              &str, strlen(phy) + 1);
+
+	if (!cl)
 	{
-		c = (struct iwinfo_country_entry *)&buf[i];
+		free(res);
+		return NULL;
+	}
 
-		if (c->iso3166 == iso3166)
-		{
-			snprintf(ccode, sizeof(ccode), "%s", c->ccode);
-			return ccode;
-		}
+	for (l = IWINFO_ISO3166_NAMES; l->iso3166; l++)
+	{
+		key.iso3166 = l->iso3166;
+		e = bsearch(&key, res, n_entries, sizeof(*e), rpc_iwinfo_country_cmp);
+
+		if (!e)
+			continue;
+
+		cl->countries[cl->n_countries].iso3166 = l->iso3166;
+		cl->countries[cl->n_countries].name = (const char *)l->name;
+		snprintf(cl->countries[cl->n_countries].ccode,
+		         sizeof(cl->countries[0].ccode), "%s", e->ccode);
+
+		cl->n_countries++;
 	}
 
-	return NULL;
+	free(res);
+
+	cl->avl.key = strcpy(str, phy);
+	avl_insert(&countries, &cl->avl);
+
+	return cl;
 }
 
 static int
-rpc_iwinfo_countrylist(struct ubus_context *ctx, struct ubus_object *obj,
-                       struct ubus_request_data *req, const char *method,
-                       struct blob_attr *msg)
+rpc_iwinfo_countrylist(struct blob_attr *msg, struct blob_buf *buf)
 {
-	int rv, len;
+	int i, rv;
 	char cur[3];
 	char iso3166[3];
-	char res[IWINFO_BUFSIZE] = {0};
-	const char *ccode;
-	const struct iwinfo_iso3166_label *l;
+	struct rpc_iwinfo_countries *cl;
+	struct rpc_iwinfo_country *co;
 	void *c, *d;
 
 	rv = rpc_iwinfo_open(msg);
@@ -634,52 +1271,42 @@ rpc_iwinfo_countrylist(struct ubus_context *ctx, struct ubus_object *obj,
 	if (rv)
 		return rv;
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
-	c = blobmsg_open_array(&buf, "results");
+	c = blobmsg_open_array(buf, "results");
 
-	if (!iw->countrylist(ifname, res, &len) && (len > 0))
+	if ((cl = rpc_iwinfo_countries()) != NULL && cl->n_countries > 0)
 	{
 		if (iw->country(ifname, cur))
 			memset(cur, 0, sizeof(cur));
 
-		for (l = IWINFO_ISO3166_NAMES; l->iso3166; l++)
+		for (i = 0; i < cl->n_countries; i++)
 		{
-			ccode = rpc_iwinfo_lookup_country(res, len, l->iso3166);
-
-			if (!ccode)
-				continue;
-
-			d = blobmsg_open_table(&buf, NULL);
+			co = &cl->countries[i];
+			d = blobmsg_open_table(buf, NULL);
 
-			blobmsg_add_string(&buf, "code", ccode);
-			blobmsg_add_string(&buf, "country", (const char *)l->name);
+			blobmsg_add_string(buf, "code", co->ccode);
+			blobmsg_add_string(buf, "country", co->name);
 
 			snprintf(iso3166, sizeof(iso3166), "%c%c",
-			         (l->iso3166 / 256), (l->iso3166 % 256));
+			         (co->iso3166 / 256), (co->iso3166 % 256));
 
-			blobmsg_add_string(&buf, "iso3166", iso3166);
+			blobmsg_add_string(buf, "iso3166", iso3166);
 
 			if (cur[0])
-				blobmsg_add_u8(&buf, "active", !strncmp(ccode, cur, 2));
+				blobmsg_add_u8(buf, "active", !strncmp(co->ccode, cur, 2));
 
-			blobmsg_close_table(&buf, d);
+			blobmsg_close_table(buf, d);
 		}
 	}
 
-	blobmsg_close_array(&buf, c);
-
-	ubus_send_reply(ctx, req, buf.head);
-
-	rpc_iwinfo_close();
+	blobmsg_close_array(buf, c);
 
 	return UBUS_STATUS_OK;
 }
 
 static int
-rpc_iwinfo_phyname(struct ubus_context *ctx, struct ubus_object *obj,
-                   struct ubus_request_data *req, const char *method,
-                   struct blob_attr *msg)
+rpc_iwinfo_phyname(struct blob_attr *msg, struct blob_buf *buf)
 {
 	int i;
 	bool found = false;
@@ -714,21 +1341,15 @@ rpc_iwinfo_phyname(struct ubus_context *ctx, struct ubus_object *obj,
 
 	if (found)
 	{
-		blob_buf_init(&buf, 0);
-		blobmsg_add_string(&buf, "phyname", res);
-
-		ubus_send_reply(ctx, req, buf.head);
+		blob_buf_init(buf, 0);
+		blobmsg_add_string(buf, "phyname", res);
 	}
 
-	rpc_iwinfo_close();
-
 	return found ? UBUS_STATUS_OK : UBUS_STATUS_NOT_FOUND;
 }
 
 static int
-rpc_iwinfo_devices(struct ubus_context *ctx, struct ubus_object *obj,
-                   struct ubus_request_data *req, const char *method,
-                   struct blob_attr *msg)
+rpc_iwinfo_devices(struct blob_attr *msg, struct blob_buf *buf)
 {
 	void *c;
 	struct dirent *e;
@@ -739,43 +1360,183 @@ rpc_iwinfo_devices(struct ubus_context *ctx, struct ubus_object *obj,
 	if (!d)
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
-	blob_buf_init(&buf, 0);
+	blob_buf_init(buf, 0);
 
-	c = blobmsg_open_array(&buf, "devices");
+	c = blobmsg_open_array(buf, "devices");
 
 	while ((e = readdir(d)) != NULL)
 	{
 		if (e->d_type != DT_LNK)
 			continue;
 
-		if (iwinfo_type(e->d_name))
-			blobmsg_add_string(&buf, NULL, e->d_name);
+		if (rpc_iwinfo_backend(e->d_name))
+			blobmsg_add_string(buf, NULL, e->d_name);
 	}
 
-	blobmsg_close_array(&buf, c);
+	blobmsg_close_array(buf, c);
 
 	closedir(d);
 
-	ubus_send_reply(ctx, req, buf.head);
+	return UBUS_STATUS_OK;
+}
 
-	rpc_iwinfo_close();
+/*
+ * Info and association list of every wireless device in one reply, keyed
+ * by device name.
+ */
+static int
+rpc_iwinfo_status(struct blob_attr *msg, struct blob_buf *buf)
+{
+	int i, len;
+	char *res;
+	void *c, *d, *t;
+	struct dirent *e;
+	DIR *dir;
+
+	dir = opendir("/sys/class/net");
+
+	if (!dir)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	res = malloc(IWINFO_BUFSIZE);
+
+	if (!res)
+	{
+		closedir(dir);
+		return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	blob_buf_init(buf, 0);
+
+	while ((e = readdir(dir)) != NULL)
+	{
+		if (e->d_type != DT_LNK)
+			continue;
+
+		iw = rpc_iwinfo_backend(e->d_name);
+
+		if (!iw)
+			continue;
+
+		ifname = e->d_name;
+
+		c = blobmsg_open_table(buf, ifname);
+
+		rpc_iwinfo_add_info(buf);
+
+		d = blobmsg_open_array(buf, "assoclist");
+
+		if (!iw->assoclist(ifname, res, &len) && (len > 0))
+		{
+			for (i = 0; i + sizeof(struct iwinfo_assoclist_entry) <= len;
+			     i += sizeof(struct iwinfo_assoclist_entry))
+			{
+				t = blobmsg_open_table(buf, NULL);
+				rpc_iwinfo_add_assoc(buf, (struct iwinfo_assoclist_entry *)&res[i]);
+				blobmsg_close_table(buf, t);
+			}
+		}
+
+		blobmsg_close_array(buf, d);
+		blobmsg_close_table(buf, c);
+	}
+
+	closedir(dir);
+	free(res);
 
 	return UBUS_STATUS_OK;
 }
 
+static const struct {
+	const char *method;
+	int (*body)(struct blob_attr *msg, struct blob_buf *buf);
+} rpc_iwinfo_bodies[] = {
+	{ "devices",     rpc_iwinfo_devices     },
+	{ "status",      rpc_iwinfo_status      },
+	{ "info",        rpc_iwinfo_info        },
+	{ "assoclist",   rpc_iwinfo_assoclist   },
+	{ "freqlist",    rpc_iwinfo_freqlist    },
+	{ "txpowerlist", rpc_iwinfo_txpowerlist },
+	{ "countrylist", rpc_iwinfo_countrylist },
+	{ "phyname",     rpc_iwinfo_phyname     },
+};
+
+static int
+rpc_iwinfo_request_run(struct rpc_worker_job *job)
+{
+	struct rpc_iwinfo_request *r =
+		container_of(job, struct rpc_iwinfo_request, job);
+	int rv;
+
+	pthread_mutex_lock(&lock);
+	rv = r->body(r->msg, &job->buf);
+	rpc_iwinfo_close();
+	pthread_mutex_unlock(&lock);
+
+	return rv;
+}
+
+static void
+rpc_iwinfo_request_done(struct rpc_worker_job *job, int ret)
+{
+	struct rpc_iwinfo_request *r =
+		container_of(job, struct rpc_iwinfo_request, job);
+
+	ops->worker_complete(job, ret);
+	free(r);
+
+	rpc_iwinfo_next();
+}
+
+/*
+ * Run the body of the called method on a worker, the reply is sent from
+ * the buffer it filled once it returns.
+ */
+static int
+rpc_iwinfo_dispatch(struct ubus_context *ctx, struct ubus_object *obj,
+                    struct ubus_request_data *req, const char *method,
+                    struct blob_attr *msg)
+{
+	struct rpc_iwinfo_request *r;
+	struct blob_attr *m;
+	int i, rv;
+
+	for (i = 0; i < ARRAY_SIZE(rpc_iwinfo_bodies); i++)
+		if (!strcmp(rpc_iwinfo_bodies[i].method, method))
+			break;
+
+	if (i == ARRAY_SIZE(rpc_iwinfo_bodies))
+		return UBUS_STATUS_METHOD_NOT_FOUND;
+
+	r = calloc_a(sizeof(*r), &m, blob_pad_len(msg));
+
+	if (!r)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	r->msg = memcpy(m, msg, blob_pad_len(msg));
+	r->body = rpc_iwinfo_bodies[i].body;
+	r->job.run = rpc_iwinfo_request_run;
+	r->job.done = rpc_iwinfo_request_done;
+
+	if ((rv = rpc_iwinfo_submit(&r->job, ctx, req)) != UBUS_STATUS_OK)
+		free(r);
+
+	return rv;
+}
 
 static int
 rpc_iwinfo_api_init(const struct rpc_daemon_ops *o, struct ubus_context *ctx)
 {
 	static const struct ubus_method iwinfo_methods[] = {
-		UBUS_METHOD_NOARG("devices", rpc_iwinfo_devices),
-		UBUS_METHOD("info",        rpc_iwinfo_info,        rpc_device_policy),
-		UBUS_METHOD("scan",        rpc_iwinfo_scan,        rpc_device_policy),
-		UBUS_METHOD("assoclist",   rpc_iwinfo_assoclist,   rpc_assoclist_policy),
-		UBUS_METHOD("freqlist",    rpc_iwinfo_freqlist,    rpc_device_policy),
-		UBUS_METHOD("txpowerlist", rpc_iwinfo_txpowerlist, rpc_device_policy),
-		UBUS_METHOD("countrylist", rpc_iwinfo_countrylist, rpc_device_policy),
-		UBUS_METHOD("phyname",     rpc_iwinfo_phyname,     rpc_uci_policy),
+		UBUS_METHOD_NOARG("devices", rpc_iwinfo_dispatch),
+		UBUS_METHOD_NOARG("status",  rpc_iwinfo_dispatch),
+		UBUS_METHOD("info",        rpc_iwinfo_dispatch, rpc_device_policy),
+		UBUS_METHOD("scan",        rpc_iwinfo_scan,     rpc_scan_policy),
+		UBUS_METHOD("assoclist",   rpc_iwinfo_dispatch, rpc_assoclist_policy),
+		UBUS_METHOD("freqlist",    rpc_iwinfo_dispatch, rpc_device_policy),
+		UBUS_METHOD("txpowerlist", rpc_iwinfo_dispatch, rpc_device_policy),
+		UBUS_METHOD("countrylist", rpc_iwinfo_dispatch, rpc_device_policy),
+		UBUS_METHOD("phyname",     rpc_iwinfo_dispatch, rpc_uci_policy),
 	};
 
 	static struct ubus_object_type iwinfo_type =
@@ -788,6 +1549,10 @@ rpc_iwinfo_api_init(const struct rpc_daemon_ops *o, struct ubus_context *ctx)
 		.n_methods = ARRAY_SIZE(iwinfo_methods),
 	};
 
+	ops = o;
+
+	rpc_iwinfo_hotplug_init();
+
 	return ubus_add_object(ctx, &obj);
 }
 
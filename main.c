@@ -28,6 +28,8 @@
 #include <rpcd/uci.h>
 #include <rpcd/plugin.h>
 #include <rpcd/exec.h>
+#include <rpcd/stats.h>
+#include <rpcd/worker.h>
 
 static struct ubus_context *ctx;
 static bool respawn = false;
@@ -62,20 +64,50 @@ int main(int argc, char **argv)
 	struct stat s;
 	const char *hangup;
 	const char *ubus_socket = NULL;
+	const char *confdir = NULL, *acldir = NULL;
+	const char *rundir = RPC_UCI_DIR_PREFIX;
+	bool stats = false;
+	int uci_contexts = -1;
+	int jobs = -1, session_jobs = -1;
+	int workers = -1;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "s:")) != -1) {
+	while ((ch = getopt(argc, argv, "a:c:j:J:s:St:u:w:")) != -1) {
 		switch (ch) {
+		case 'a':
+			acldir = optarg;
+			break;
+		case 'c':
+			confdir = optarg;
+			break;
 		case 's':
 			ubus_socket = optarg;
 			break;
+		case 'S':
+			stats = true;
+			break;
+		case 't':
+			rundir = optarg;
+			break;
+		case 'u':
+			uci_contexts = atoi(optarg);
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			break;
+		case 'J':
+			session_jobs = atoi(optarg);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
 		default:
 			break;
 		}
 	}
 
-	if (stat(RPC_UCI_DIR_PREFIX, &s))
-		mkdir(RPC_UCI_DIR_PREFIX, 0700);
+	if (stat(rundir, &s))
+		mkdir(rundir, 0700);
 
 	umask(0077);
 
@@ -93,9 +125,17 @@ int main(int argc, char **argv)
 
 	ubus_add_uloop(ctx);
 
+	rpc_exec_limits(jobs, session_jobs);
+	rpc_worker_limits(workers);
+
+	rpc_uci_dirs(confdir, rundir);
+	rpc_session_dirs(confdir, acldir, rundir);
+	rpc_plugin_dirs(rundir);
+
 	rpc_session_api_init(ctx);
-	rpc_uci_api_init(ctx);
+	rpc_uci_api_init(ctx, uci_contexts);
 	rpc_plugin_api_init(ctx);
+	rpc_stats_api_init(ctx, stats);
 
 	hangup = getenv("RPC_HANGUP");
 
@@ -17,47 +17,131 @@
  */
 
 #include <rpcd/plugin.h>
+#include <rpcd/stats.h>
 
 static struct blob_buf buf;
 
-struct rpc_plugin_lookup_context {
-	uint32_t id;
-	char *name;
-	bool found;
+/*
+ * Plugins announcing ".rpcd": { "protocol": "blob" } exchange binary
+ * frames instead of JSON text. A frame is one blob_attr, header and
+ * payload in network byte order as laid out by blob_buf, its payload
+ * being the blobmsg attributes of the message, padded to the blob
+ * alignment.
+ */
+struct rpc_plugin_frame {
+	char *data;
+	size_t len;
+	size_t size;
 };
 
-static void
-rpc_plugin_lookup_plugin_cb(struct ubus_context *ctx,
-                            struct ubus_object_data *obj, void *priv)
+static bool
+rpc_plugin_frame_feed(struct rpc_plugin_frame *f, const char *data, size_t len)
 {
-	struct rpc_plugin_lookup_context *c = priv;
+	size_t size;
+	char *p;
+
+	if (f->len + len > RPC_EXEC_MAX_SIZE)
+		return false;
 
-	if (c->id == obj->id)
+	if (f->len + len > f->size)
 	{
-		c->found = true;
-		sprintf(c->name, "%s", obj->path);
+		for (size = f->size ? f->size : 4096; size < f->len + len; size *= 2);
+
+		p = realloc(f->data, size);
+
+		if (!p)
+			return false;
+
+		f->data = p;
+		f->size = size;
 	}
+
+	memcpy(f->data + f->len, data, len);
+	f->len += len;
+
+	return true;
+}
+
+/*
+ * Return the first buffered frame once its header and padded payload are
+ * complete, or right away if the header is bogus, NULL otherwise.
+ */
+static struct blob_attr *
+rpc_plugin_frame_get(struct rpc_plugin_frame *f)
+{
+	struct blob_attr *attr = (struct blob_attr *)f->data;
+
+	if (f->len < sizeof(*attr))
+		return NULL;
+
+	if (blob_raw_len(attr) >= sizeof(*attr) && blob_pad_len(attr) > f->len)
+		return NULL;
+
+	return attr;
+}
+
+/*
+ * Number of bytes missing to complete the first buffered frame, reading
+ * the header first. Zero if the frame is complete or its header is bogus.
+ */
+static size_t
+rpc_plugin_frame_need(struct rpc_plugin_frame *f)
+{
+	struct blob_attr *attr = (struct blob_attr *)f->data;
+
+	if (f->len < sizeof(*attr))
+		return sizeof(*attr) - f->len;
+
+	if (blob_raw_len(attr) < sizeof(*attr) || blob_pad_len(attr) <= f->len)
+		return 0;
+
+	return blob_pad_len(attr) - f->len;
 }
 
 static bool
-rpc_plugin_lookup_plugin(struct ubus_context *ctx, struct ubus_object *obj,
-                         char *strptr)
+rpc_plugin_frame_valid(struct rpc_plugin_frame *f, struct blob_attr *attr)
 {
-	struct rpc_plugin_lookup_context c = { .id = obj->id, .name = strptr };
+	struct blob_attr *cur;
+	int rem;
 
-	if (ubus_lookup(ctx, NULL, rpc_plugin_lookup_plugin_cb, &c))
+	if (blob_raw_len(attr) < sizeof(*attr) || blob_raw_len(attr) > f->len)
 		return false;
 
-	return c.found;
+	blob_for_each_attr(cur, attr, rem)
+		if (!blobmsg_check_attr(cur, true))
+			return false;
+
+	return (rem == 0);
+}
+
+static void
+rpc_plugin_frame_consume(struct rpc_plugin_frame *f)
+{
+	size_t n = blob_pad_len((struct blob_attr *)f->data);
+
+	if (n > f->len)
+		n = f->len;
+
+	memmove(f->data, f->data + n, f->len - n);
+	f->len -= n;
+}
+
+static void
+rpc_plugin_frame_free(struct rpc_plugin_frame *f)
+{
+	free(f->data);
+	memset(f, 0, sizeof(*f));
 }
 
 struct call_context {
-	char path[PATH_MAX];
 	const char *argv[4];
 	char *method;
 	char *input;
+	size_t input_len;
+	bool blob;
 	json_tokener *tok;
 	json_object *obj;
+	struct rpc_plugin_frame output;
 	bool input_done;
 	bool output_done;
 };
@@ -69,7 +153,7 @@ rpc_plugin_call_stdin_cb(struct ustream *s, void *priv)
 
 	if (!c->input_done)
 	{
-		ustream_write(s, c->input, strlen(c->input), false);
+		ustream_write(s, c->input, c->input_len, false);
 		c->input_done = true;
 	}
 
@@ -83,10 +167,18 @@ rpc_plugin_call_stdout_cb(struct blob_buf *blob, char *buf, int len, void *priv)
 
 	if (!c->output_done)
 	{
-		c->obj = json_tokener_parse_ex(c->tok, buf, len);
+		if (c->blob)
+		{
+			if (!rpc_plugin_frame_feed(&c->output, buf, len))
+				c->output_done = true;
+		}
+		else
+		{
+			c->obj = json_tokener_parse_ex(c->tok, buf, len);
 
-		if (json_tokener_get_error(c->tok) != json_tokener_continue)
-			c->output_done = true;
+			if (json_tokener_get_error(c->tok) != json_tokener_continue)
+				c->output_done = true;
+		}
 	}
 
 	return len;
@@ -102,9 +194,23 @@ static int
 rpc_plugin_call_finish_cb(struct blob_buf *blob, int stat, void *priv)
 {
 	struct call_context *c = priv;
+	struct blob_attr *attr;
 	int rv = UBUS_STATUS_INVALID_ARGUMENT;
 
-	if (json_tokener_get_error(c->tok) == json_tokener_success)
+	if (c->blob)
+	{
+		attr = rpc_plugin_frame_get(&c->output);
+
+		if (!attr)
+			rv = c->output.len ? UBUS_STATUS_INVALID_ARGUMENT
+			                   : UBUS_STATUS_NO_DATA;
+		else if (rpc_plugin_frame_valid(&c->output, attr) &&
+		         blob_put_raw(blob, blob_data(attr), blob_len(attr)))
+			rv = UBUS_STATUS_OK;
+
+		rpc_plugin_frame_free(&c->output);
+	}
+	else if (json_tokener_get_error(c->tok) == json_tokener_success)
 	{
 		if (c->obj)
 		{
@@ -120,7 +226,8 @@ rpc_plugin_call_finish_cb(struct blob_buf *blob, int stat, void *priv)
 		}
 	}
 
-	json_tokener_free(c->tok);
+	if (c->tok)
+		json_tokener_free(c->tok);
 
 	free(c->input);
 	free(c->method);
@@ -128,14 +235,511 @@ rpc_plugin_call_finish_cb(struct blob_buf *blob, int stat, void *priv)
 	return rv;
 }
 
+/*
+ * Executable plugins announcing ".rpcd": { "workers": N } in their "list"
+ * output are kept running as "<plugin> serve". Requests are written to the
+ * workers as one JSON object per line, { "id": N, "method": "...",
+ * "args": { ... } }, and answered with { "id": N, "result": { ... } } or
+ * { "id": N, "error": <ubus status> }, in any order. Workers are started
+ * on demand and restarted by the next call after they died. With the blob
+ * protocol the same messages are exchanged as frames.
+ */
+struct rpc_plugin_pool;
+
+struct rpc_plugin_worker {
+	struct rpc_plugin_pool *pool;
+	struct uloop_process process;
+	struct ustream_fd ipipe;
+	struct ustream_fd opipe;
+	json_tokener *tok;
+	struct rpc_plugin_frame frame;
+	struct list_head calls;
+	int n_calls;
+	bool running;
+};
+
+struct rpc_plugin_pool {
+	struct rpc_plugin_exec *plugin;
+	uint32_t next_id;
+	int n_workers;
+	struct rpc_plugin_worker workers[];
+};
+
+/*
+ * Registered executable plugin. It wraps the ubus object, so that the call
+ * handler reaches the executable path, protocol and workers by
+ * container_of() instead of looking the object up.
+ */
+struct rpc_plugin_exec {
+	struct ubus_object obj;
+	struct ubus_object_type type;
+	struct rpc_plugin_pool *pool;
+	const char *path;
+	bool blob;
+};
+
+struct rpc_plugin_worker_call {
+	struct list_head list;
+	struct rpc_plugin_worker *worker;
+	struct ubus_context *ctx;
+	struct ubus_request_data req;
+	struct uloop_timeout timeout;
+	uint32_t id;
+};
+
+enum {
+	RPC_PO_WORKERS,
+	RPC_PO_PROTOCOL,
+	__RPC_PO_MAX,
+};
+
+static const struct blobmsg_policy rpc_plugin_options_policy[__RPC_PO_MAX] = {
+	[RPC_PO_WORKERS]  = { .name = "workers",  .type = BLOBMSG_TYPE_INT32  },
+	[RPC_PO_PROTOCOL] = { .name = "protocol", .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_PW_ID,
+	RPC_PW_RESULT,
+	RPC_PW_ERROR,
+	__RPC_PW_MAX,
+};
+
+static const struct blobmsg_policy rpc_plugin_worker_policy[__RPC_PW_MAX] = {
+	[RPC_PW_ID]     = { .name = "id",     .type = BLOBMSG_TYPE_INT32 },
+	[RPC_PW_RESULT] = { .name = "result", .type = BLOBMSG_TYPE_TABLE },
+	[RPC_PW_ERROR]  = { .name = "error",  .type = BLOBMSG_TYPE_INT32 },
+};
+
+static void
+rpc_plugin_worker_finish(struct rpc_plugin_worker_call *call, int rv)
+{
+	uloop_timeout_cancel(&call->timeout);
+	list_del(&call->list);
+	call->worker->n_calls--;
+
+	rpc_stats_complete(call->ctx, &call->req, rv);
+
+	free(call);
+}
+
+static void
+rpc_plugin_worker_stop(struct rpc_plugin_worker *w, bool terminate)
+{
+	struct rpc_plugin_worker_call *call, *tmp;
+
+	if (!w->running)
+		return;
+
+	w->running = false;
+
+	uloop_process_delete(&w->process);
+
+	if (terminate && w->process.pid > 0)
+		kill(w->process.pid, SIGKILL);
+
+	ustream_free(&w->ipipe.stream);
+	ustream_free(&w->opipe.stream);
+
+	close(w->ipipe.fd.fd);
+	close(w->opipe.fd.fd);
+
+	json_tokener_free(w->tok);
+	w->tok = NULL;
+
+	rpc_plugin_frame_free(&w->frame);
+
+	list_for_each_entry_safe(call, tmp, &w->calls, list)
+		rpc_plugin_worker_finish(call, UBUS_STATUS_UNKNOWN_ERROR);
+}
+
+static void
+rpc_plugin_worker_reply(struct rpc_plugin_worker *w, json_object *obj)
+{
+	struct rpc_plugin_worker_call *call;
+	json_object *id, *res, *err;
+	int rv = UBUS_STATUS_NO_DATA;
+
+	if (json_object_get_type(obj) != json_type_object ||
+	    !json_object_object_get_ex(obj, "id", &id))
+		return;
+
+	list_for_each_entry(call, &w->calls, list)
+	{
+		if (call->id != (uint32_t)json_object_get_int(id))
+			continue;
+
+		if (json_object_object_get_ex(obj, "error", &err))
+		{
+			rv = json_object_get_int(err);
+		}
+		else if (json_object_object_get_ex(obj, "result", &res))
+		{
+			rv = UBUS_STATUS_INVALID_ARGUMENT;
+			blob_buf_init(&buf, 0);
+
+			if (json_object_get_type(res) == json_type_object &&
+			    blobmsg_add_object(&buf, res))
+			{
+				ubus_send_reply(call->ctx, &call->req, buf.head);
+				rv = UBUS_STATUS_OK;
+			}
+		}
+
+		rpc_plugin_worker_finish(call, rv);
+		break;
+	}
+}
+
+static void
+rpc_plugin_worker_reply_blob(struct rpc_plugin_worker *w, struct blob_attr *msg)
+{
+	struct rpc_plugin_worker_call *call;
+	struct blob_attr *tb[__RPC_PW_MAX];
+	int rv = UBUS_STATUS_NO_DATA;
+
+	blobmsg_parse(rpc_plugin_worker_policy, __RPC_PW_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_PW_ID])
+		return;
+
+	list_for_each_entry(call, &w->calls, list)
+	{
+		if (call->id != blobmsg_get_u32(tb[RPC_PW_ID]))
+			continue;
+
+		if (tb[RPC_PW_ERROR])
+		{
+			rv = blobmsg_get_u32(tb[RPC_PW_ERROR]);
+		}
+		else if (tb[RPC_PW_RESULT])
+		{
+			blob_buf_init(&buf, 0);
+			blob_put_raw(&buf, blobmsg_data(tb[RPC_PW_RESULT]),
+			             blobmsg_data_len(tb[RPC_PW_RESULT]));
+
+			ubus_send_reply(call->ctx, &call->req, buf.head);
+			rv = UBUS_STATUS_OK;
+		}
+
+		rpc_plugin_worker_finish(call, rv);
+		break;
+	}
+}
+
+static void
+rpc_plugin_worker_read_frames(struct rpc_plugin_worker *w, struct ustream *s)
+{
+	struct blob_attr *attr;
+	size_t need;
+	int len;
+	char *data;
+
+	while (w->running && (data = ustream_get_read_buf(s, &len)) && len > 0)
+	{
+		/*
+		 * Buffer no more than the current frame so that the size limit
+		 * applies to each reply rather than to a burst of them.
+		 */
+		need = rpc_plugin_frame_need(&w->frame);
+
+		if (need < len)
+			len = need;
+
+		if (!rpc_plugin_frame_feed(&w->frame, data, len))
+		{
+			rpc_plugin_worker_stop(w, true);
+			return;
+		}
+
+		ustream_consume(s, len);
+
+		while (w->running && (attr = rpc_plugin_frame_get(&w->frame)) != NULL)
+		{
+			if (!rpc_plugin_frame_valid(&w->frame, attr))
+			{
+				rpc_plugin_worker_stop(w, true);
+				return;
+			}
+
+			rpc_plugin_worker_reply_blob(w, attr);
+			rpc_plugin_frame_consume(&w->frame);
+		}
+	}
+}
+
+static void
+rpc_plugin_worker_read_cb(struct ustream *s, int bytes)
+{
+	struct rpc_plugin_worker *w =
+		container_of(s, struct rpc_plugin_worker, opipe.stream);
+	enum json_tokener_error err;
+	json_object *obj;
+	int len, used;
+	char *data;
+
+	if (w->pool->plugin->blob)
+	{
+		rpc_plugin_worker_read_frames(w, s);
+		return;
+	}
+
+	while (w->running && (data = ustream_get_read_buf(s, &len)) && len > 0)
+	{
+		obj = json_tokener_parse_ex(w->tok, data, len);
+		err = json_tokener_get_error(w->tok);
+
+		if (err == json_tokener_continue)
+		{
+			ustream_consume(s, len);
+			continue;
+		}
+
+		/* garbage on the channel, the worker can not be trusted anymore */
+		if (err != json_tokener_success || !obj)
+		{
+			rpc_plugin_worker_stop(w, true);
+			return;
+		}
+
+		used = w->tok->char_offset;
+		json_tokener_reset(w->tok);
+		ustream_consume(s, used);
+
+		rpc_plugin_worker_reply(w, obj);
+		json_object_put(obj);
+	}
+}
+
+static void
+rpc_plugin_worker_state_cb(struct ustream *s)
+{
+	struct rpc_plugin_worker *w =
+		container_of(s, struct rpc_plugin_worker, opipe.stream);
+
+	if (s->eof)
+		rpc_plugin_worker_stop(w, true);
+}
+
+static void
+rpc_plugin_worker_process_cb(struct uloop_process *p, int stat)
+{
+	struct rpc_plugin_worker *w =
+		container_of(p, struct rpc_plugin_worker, process);
+
+	/* already reaped, pick up replies written right before exiting */
+	p->pid = 0;
+	ustream_poll(&w->opipe.stream);
+	rpc_plugin_worker_stop(w, false);
+}
+
+static void
+rpc_plugin_worker_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_plugin_worker_call *call =
+		container_of(t, struct rpc_plugin_worker_call, timeout);
+	struct rpc_plugin_worker *w = call->worker;
+
+	rpc_plugin_worker_finish(call, UBUS_STATUS_TIMEOUT);
+	rpc_plugin_worker_stop(w, true);
+}
+
+static bool
+rpc_plugin_worker_start(struct rpc_plugin_worker *w)
+{
+	const char *argv[] = { w->pool->plugin->path, "serve", NULL };
+	int ipipe[2], opipe[2];
+	pid_t pid;
+
+	if (w->running)
+		return true;
+
+	w->tok = json_tokener_new();
+
+	if (!w->tok)
+		return false;
+
+	if (pipe2(ipipe, O_CLOEXEC))
+		goto fail_tok;
+
+	if (pipe2(opipe, O_CLOEXEC))
+		goto fail_ipipe;
+
+	pid = rpc_exec_spawn(argv[0], argv, NULL, ipipe[0], opipe[1], -1);
+
+	if (pid < 0)
+		goto fail_opipe;
+
+	close(ipipe[0]);
+	close(opipe[1]);
+
+	memset(&w->ipipe, 0, sizeof(w->ipipe));
+	w->ipipe.stream.string_data   = true;
+	w->ipipe.stream.w.buffer_len  = 4096;
+	w->ipipe.stream.w.max_buffers = RPC_EXEC_MAX_SIZE / 4096;
+	ustream_fd_init(&w->ipipe, ipipe[1]);
+
+	memset(&w->opipe, 0, sizeof(w->opipe));
+	w->opipe.stream.string_data   = true;
+	w->opipe.stream.r.buffer_len  = 4096;
+	w->opipe.stream.r.max_buffers = RPC_EXEC_MAX_SIZE / 4096;
+	w->opipe.stream.notify_read   = rpc_plugin_worker_read_cb;
+	w->opipe.stream.notify_state  = rpc_plugin_worker_state_cb;
+	ustream_fd_init(&w->opipe, opipe[0]);
+
+	w->process.pid = pid;
+	w->process.cb = rpc_plugin_worker_process_cb;
+	uloop_process_add(&w->process);
+
+	w->running = true;
+
+	return true;
+
+fail_opipe:
+	close(opipe[0]);
+	close(opipe[1]);
+
+fail_ipipe:
+	close(ipipe[0]);
+	close(ipipe[1]);
+
+fail_tok:
+	json_tokener_free(w->tok);
+	w->tok = NULL;
+
+	return false;
+}
+
+/*
+ * Hand the call to the least busy worker of the pool. Returns false if no
+ * worker could take it, in which case the plugin is executed once instead.
+ */
+static bool
+rpc_plugin_worker_call(struct rpc_plugin_pool *pool, struct ubus_context *ctx,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+	struct rpc_plugin_worker *w = &pool->workers[0];
+	struct rpc_plugin_worker_call *call;
+	char *line;
+	int i;
+
+	for (i = 1; i < pool->n_workers; i++)
+		if (pool->workers[i].n_calls < w->n_calls)
+			w = &pool->workers[i];
+
+	if (!rpc_plugin_worker_start(w))
+		return false;
+
+	call = calloc(1, sizeof(*call));
+
+	if (!call)
+		return false;
+
+	call->id = ++pool->next_id;
+
+	blob_buf_init(&buf, 0);
+	blobmsg_add_u32(&buf, "id", call->id);
+	blobmsg_add_string(&buf, "method", method);
+	blobmsg_add_field(&buf, BLOBMSG_TYPE_TABLE, "args",
+	                  blob_data(msg), blob_len(msg));
+
+	if (pool->plugin->blob)
+	{
+		if (ustream_write(&w->ipipe.stream, (char *)buf.head,
+		                  blob_pad_len(buf.head), false) <= 0)
+		{
+			free(call);
+			rpc_plugin_worker_stop(w, true);
+			return false;
+		}
+	}
+	else
+	{
+		line = blobmsg_format_json(buf.head, true);
+
+		if (!line)
+		{
+			free(call);
+			return false;
+		}
+
+		if (ustream_printf(&w->ipipe.stream, "%s\n", line) <= 0)
+		{
+			free(line);
+			free(call);
+			rpc_plugin_worker_stop(w, true);
+			return false;
+		}
+
+		free(line);
+	}
+
+	call->worker = w;
+	call->ctx = ctx;
+	call->timeout.cb = rpc_plugin_worker_timeout_cb;
+	uloop_timeout_set(&call->timeout, RPC_EXEC_MAX_RUNTIME);
+
+	list_add_tail(&call->list, &w->calls);
+	w->n_calls++;
+
+	ubus_defer_request(ctx, req, &call->req);
+
+	return true;
+}
+
+static int
+rpc_plugin_pool_add(struct rpc_plugin_exec *plugin, int n_workers)
+{
+	struct rpc_plugin_pool *pool;
+	int i;
+
+	if (n_workers > RPC_PLUGIN_WORKERS_MAX)
+		n_workers = RPC_PLUGIN_WORKERS_MAX;
+
+	pool = calloc(1, sizeof(*pool) + n_workers * sizeof(pool->workers[0]));
+
+	if (!pool)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	pool->plugin = plugin;
+	pool->n_workers = n_workers;
+
+	for (i = 0; i < n_workers; i++)
+	{
+		pool->workers[i].pool = pool;
+		INIT_LIST_HEAD(&pool->workers[i].calls);
+	}
+
+	plugin->pool = pool;
+
+	return UBUS_STATUS_OK;
+}
+
+enum {
+	RPC_PS_SESSION,
+	__RPC_PS_MAX,
+};
+
+static const struct blobmsg_policy rpc_plugin_session_policy[__RPC_PS_MAX] = {
+	[RPC_PS_SESSION] = { .name = "ubus_rpc_session", .type = BLOBMSG_TYPE_STRING },
+};
+
 static int
 rpc_plugin_call(struct ubus_context *ctx, struct ubus_object *obj,
                 struct ubus_request_data *req, const char *method,
                 struct blob_attr *msg)
 {
 	int rv = UBUS_STATUS_UNKNOWN_ERROR;
+	struct rpc_plugin_exec *plugin =
+		container_of(obj, struct rpc_plugin_exec, obj);
+	struct blob_attr *tb[__RPC_PS_MAX];
 	struct call_context *c;
-	char *plugin;
+
+	if (plugin->pool &&
+	    rpc_plugin_worker_call(plugin->pool, ctx, req, method, msg))
+		return UBUS_STATUS_OK;
 
 	c = calloc(1, sizeof(*c));
 
@@ -143,27 +747,44 @@ rpc_plugin_call(struct ubus_context *ctx, struct ubus_object *obj,
 		goto fail;
 
 	c->method = strdup(method);
-	c->input = blobmsg_format_json(msg, true);
-	c->tok = json_tokener_new();
 
-	if (!c->method || !c->input || !c->tok)
-		goto fail;
+	if (plugin->blob)
+	{
+		blob_buf_init(&buf, 0);
+		blob_put_raw(&buf, blob_data(msg), blob_len(msg));
 
-	plugin = c->path + sprintf(c->path, "%s/", RPC_PLUGIN_DIRECTORY);
+		c->blob = true;
+		c->input = (char *)blob_memdup(buf.head);
+		c->input_len = c->input ? blob_pad_len(buf.head) : 0;
 
-	if (!rpc_plugin_lookup_plugin(ctx, obj, plugin))
+		if (!c->method || !c->input)
+			goto fail;
+	}
+	else
 	{
-		rv = UBUS_STATUS_NOT_FOUND;
-		goto fail;
+		c->input = blobmsg_format_json(msg, true);
+		c->input_len = c->input ? strlen(c->input) : 0;
+		c->tok = json_tokener_new();
+
+		if (!c->method || !c->input || !c->tok)
+			goto fail;
 	}
 
-	c->argv[0] = c->path;
+	c->argv[0] = plugin->path;
 	c->argv[1] = "call";
 	c->argv[2] = c->method;
 
-	return rpc_exec(c->argv, rpc_plugin_call_stdin_cb,
-	                rpc_plugin_call_stdout_cb, rpc_plugin_call_stderr_cb,
-	                rpc_plugin_call_finish_cb, c, ctx, req);
+	blobmsg_parse(rpc_plugin_session_policy, __RPC_PS_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	rv = rpc_exec_as(tb[RPC_PS_SESSION] ?
+	                 blobmsg_data(tb[RPC_PS_SESSION]) : NULL,
+	                 c->argv, rpc_plugin_call_stdin_cb,
+	                 rpc_plugin_call_stdout_cb, rpc_plugin_call_stderr_cb,
+	                 rpc_plugin_call_finish_cb, c, ctx, req);
+
+	if (rv == UBUS_STATUS_OK)
+		return rv;
 
 fail:
 	if (c)
@@ -249,153 +870,458 @@ rpc_plugin_parse_signature(struct blob_attr *sig, struct ubus_method *method)
 	return true;
 }
 
-static struct ubus_object *
-rpc_plugin_parse_exec(const char *name, int fd)
+static struct rpc_plugin_exec *
+rpc_plugin_parse_exec(const char *path, struct blob_attr *list, int *workers)
 {
-	int len, rem, n_method;
+	int rem, n_method;
+	bool blob = false;
 	struct blob_attr *cur;
 	struct ubus_method *methods;
-	struct ubus_object_type *obj_type;
-	struct ubus_object *obj;
-	char outbuf[1024];
+	struct rpc_plugin_exec *plugin;
+	char *name;
 
-	json_tokener *tok;
-	json_object *jsobj;
+	n_method = 0;
 
-	blob_buf_init(&buf, 0);
+	blobmsg_for_each_attr(cur, list, rem)
+		n_method++;
 
-	tok = json_tokener_new();
+	if (!n_method)
+		return NULL;
 
-	if (!tok)
+	methods = calloc(n_method, sizeof(*methods));
+
+	if (!methods)
 		return NULL;
 
-	while ((len = read(fd, outbuf, sizeof(outbuf))) > 0)
+	n_method = 0;
+
+	blobmsg_for_each_attr(cur, list, rem)
 	{
-		jsobj = json_tokener_parse_ex(tok, outbuf, len);
+		if (!strcmp(blobmsg_name(cur), ".rpcd"))
+		{
+			struct blob_attr *tb[__RPC_PO_MAX];
 
-		if (json_tokener_get_error(tok) == json_tokener_continue)
-			continue;
+			blobmsg_parse(rpc_plugin_options_policy, __RPC_PO_MAX, tb,
+			              blobmsg_data(cur), blobmsg_data_len(cur));
 
-		if (json_tokener_get_error(tok) != json_tokener_success)
-			break;
+			if (tb[RPC_PO_WORKERS])
+				*workers = blobmsg_get_u32(tb[RPC_PO_WORKERS]);
 
-		if (jsobj)
-		{
-			if (json_object_get_type(jsobj) == json_type_object)
-				blobmsg_add_object(&buf, jsobj);
+			if (tb[RPC_PO_PROTOCOL])
+				blob = !strcmp(blobmsg_get_string(tb[RPC_PO_PROTOCOL]),
+				               "blob");
 
-			json_object_put(jsobj);
-			break;
+			continue;
 		}
-	}
-
-	json_tokener_free(tok);
 
-	n_method = 0;
+		if (!rpc_plugin_parse_signature(cur, &methods[n_method]))
+			continue;
 
-	blob_for_each_attr(cur, buf.head, rem)
 		n_method++;
+	}
 
-	if (!n_method)
+	plugin = calloc_a(sizeof(*plugin), &name, strlen(path) + 1);
+
+	if (!plugin)
 		return NULL;
 
-	methods = calloc(n_method, sizeof(*methods));
+	plugin->path = strcpy(name, path);
+	plugin->blob = blob;
 
-	if (!methods)
+	name = strrchr(name, '/') + 1;
+
+	if (asprintf((char **)&plugin->type.name, "luci-rpc-plugin-%s", name) < 0)
 		return NULL;
 
-	n_method = 0;
+	plugin->type.methods = methods;
+	plugin->type.n_methods = n_method;
+
+	plugin->obj.name = name;
+	plugin->obj.type = &plugin->type;
+	plugin->obj.methods = methods;
+	plugin->obj.n_methods = n_method;
+
+	return plugin;
+}
+
+static int
+rpc_plugin_register_exec(struct ubus_context *ctx, const char *path,
+                         struct blob_attr *list)
+{
+	int rv, workers = 0;
+	struct rpc_plugin_exec *plugin;
+
+	if (!strchr(path, '/'))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	plugin = rpc_plugin_parse_exec(path, list, &workers);
+
+	if (!plugin)
+		return UBUS_STATUS_NO_DATA;
+
+	rv = ubus_add_object(ctx, &plugin->obj);
+
+	if (!rv && workers > 0)
+		rv = rpc_plugin_pool_add(plugin, workers);
+
+	return rv;
+}
+
+/*
+ * Discovery of executable plugins. The "list" output of every plugin is
+ * stored in RPC_PLUGIN_CACHE along with the inode, size and mtime of the
+ * executable, unchanged plugins are registered from there without running
+ * them. All other plugins are invoked concurrently, each one bounded by
+ * RPC_PLUGIN_LIST_TIMEOUT.
+ */
+struct rpc_plugin_discovery {
+	struct list_head list;
+	struct ubus_context *ctx;
+	struct uloop_process process;
+	struct uloop_timeout timeout;
+	struct ustream_fd opipe;
+	json_tokener *tok;
+	json_object *obj;
+	struct stat s;
+	bool exited;
+	bool parsed;
+	char path[];
+};
+
+enum {
+	RPC_PC_INODE,
+	RPC_PC_SIZE,
+	RPC_PC_MTIME,
+	RPC_PC_LIST,
+	__RPC_PC_MAX,
+};
+
+static const struct blobmsg_policy rpc_plugin_cache_policy[__RPC_PC_MAX] = {
+	[RPC_PC_INODE] = { .name = "inode", .type = BLOBMSG_TYPE_INT64 },
+	[RPC_PC_SIZE]  = { .name = "size",  .type = BLOBMSG_TYPE_INT64 },
+	[RPC_PC_MTIME] = { .name = "mtime", .type = BLOBMSG_TYPE_INT64 },
+	[RPC_PC_LIST]  = { .name = "list",  .type = BLOBMSG_TYPE_TABLE },
+};
+
+static LIST_HEAD(discoveries);
+static struct blob_buf cache;
+static char cache_path[PATH_MAX] = RPC_PLUGIN_CACHE;
+static int rv_discovery = 0;
 
-	blob_for_each_attr(cur, buf.head, rem)
+static void
+rpc_plugin_cache_add(const char *path, struct stat *s, struct blob_attr *list)
+{
+	void *c = blobmsg_open_table(&cache, path);
+
+	blobmsg_add_u64(&cache, "inode", s->st_ino);
+	blobmsg_add_u64(&cache, "size", s->st_size);
+	blobmsg_add_u64(&cache, "mtime", s->st_mtime);
+	blobmsg_add_field(&cache, BLOBMSG_TYPE_TABLE, "list",
+	                  blobmsg_data(list), blobmsg_data_len(list));
+
+	blobmsg_close_table(&cache, c);
+}
+
+static struct blob_attr *
+rpc_plugin_cache_find(struct blob_attr *head, const char *path, struct stat *s)
+{
+	struct blob_attr *tb[__RPC_PC_MAX], *cur;
+	int rem;
+
+	if (!head)
+		return NULL;
+
+	blob_for_each_attr(cur, head, rem)
 	{
-		if (!rpc_plugin_parse_signature(cur, &methods[n_method]))
+		if (strcmp(blobmsg_name(cur), path))
 			continue;
 
-		n_method++;
+		blobmsg_parse(rpc_plugin_cache_policy, __RPC_PC_MAX, tb,
+		              blobmsg_data(cur), blobmsg_data_len(cur));
+
+		if (!tb[RPC_PC_INODE] || !tb[RPC_PC_SIZE] ||
+		    !tb[RPC_PC_MTIME] || !tb[RPC_PC_LIST])
+			return NULL;
+
+		if (blobmsg_get_u64(tb[RPC_PC_INODE]) != s->st_ino ||
+		    blobmsg_get_u64(tb[RPC_PC_SIZE]) != s->st_size ||
+		    blobmsg_get_u64(tb[RPC_PC_MTIME]) != s->st_mtime)
+			return NULL;
+
+		return tb[RPC_PC_LIST];
 	}
 
-	obj = calloc(1, sizeof(*obj));
+	return NULL;
+}
 
-	if (!obj)
-		return NULL;
+static void
+rpc_plugin_cache_write(void)
+{
+	char tmp[PATH_MAX];
+	int fd, len;
 
-	obj_type = calloc(1, sizeof(*obj_type));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_path);
 
-	if (!obj_type)
-		return NULL;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-	if (asprintf((char **)&obj_type->name, "luci-rpc-plugin-%s", name) < 0)
-		return NULL;
+	if (fd < 0)
+		return;
 
-	obj_type->methods = methods;
-	obj_type->n_methods = n_method;
+	len = write(fd, cache.head, blob_pad_len(cache.head));
+	close(fd);
+
+	if (len != blob_pad_len(cache.head) || rename(tmp, cache_path))
+		unlink(tmp);
+}
+
+static void
+rpc_plugin_discovery_finish(struct rpc_plugin_discovery *d)
+{
+	void *c;
+
+	uloop_timeout_cancel(&d->timeout);
+
+	if (!d->exited)
+	{
+		uloop_process_delete(&d->process);
+		kill(d->process.pid, SIGKILL);
+	}
 
-	obj->name = strdup(name);
-	obj->type = obj_type;
-	obj->methods = methods;
-	obj->n_methods = n_method;
+	ustream_free(&d->opipe.stream);
+	close(d->opipe.fd.fd);
 
-	return obj;
+	if (d->obj)
+	{
+		if (json_object_get_type(d->obj) == json_type_object)
+		{
+			blob_buf_init(&buf, 0);
+
+			c = blobmsg_open_table(&buf, "list");
+			blobmsg_add_object(&buf, d->obj);
+			blobmsg_close_table(&buf, c);
+
+			rpc_plugin_cache_add(d->path, &d->s, blob_data(buf.head));
+			rv_discovery |= rpc_plugin_register_exec(d->ctx, d->path,
+			                                         blob_data(buf.head));
+		}
+
+		json_object_put(d->obj);
+	}
+	else
+	{
+		rv_discovery |= UBUS_STATUS_NO_DATA;
+	}
+
+	json_tokener_free(d->tok);
+	list_del(&d->list);
+	free(d);
+
+	if (list_empty(&discoveries))
+		uloop_end();
+}
+
+static void
+rpc_plugin_discovery_read_cb(struct ustream *s, int bytes)
+{
+	struct rpc_plugin_discovery *d =
+		container_of(s, struct rpc_plugin_discovery, opipe.stream);
+	enum json_tokener_error err;
+	char *data;
+	int len;
+
+	while ((data = ustream_get_read_buf(s, &len)) && len > 0)
+	{
+		if (d->parsed)
+		{
+			ustream_consume(s, len);
+			continue;
+		}
+
+		d->obj = json_tokener_parse_ex(d->tok, data, len);
+		err = json_tokener_get_error(d->tok);
+
+		ustream_consume(s, len);
+
+		if (err == json_tokener_continue)
+			continue;
+
+		/*
+		 * The stream is still in use by libubox after this callback
+		 * returns, finish from the timeout instead of freeing it here.
+		 */
+		d->parsed = true;
+		uloop_timeout_set(&d->timeout, 0);
+	}
+}
+
+static void
+rpc_plugin_discovery_state_cb(struct ustream *s)
+{
+	struct rpc_plugin_discovery *d =
+		container_of(s, struct rpc_plugin_discovery, opipe.stream);
+
+	if (s->eof)
+		rpc_plugin_discovery_finish(d);
+}
+
+static void
+rpc_plugin_discovery_process_cb(struct uloop_process *p, int stat)
+{
+	struct rpc_plugin_discovery *d =
+		container_of(p, struct rpc_plugin_discovery, process);
+
+	d->exited = true;
+}
+
+static void
+rpc_plugin_discovery_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_plugin_discovery *d =
+		container_of(t, struct rpc_plugin_discovery, timeout);
+
+	rpc_plugin_discovery_finish(d);
 }
 
 static int
-rpc_plugin_register_exec(struct ubus_context *ctx, const char *path)
+rpc_plugin_discover_exec(struct ubus_context *ctx, const char *path,
+                         struct stat *s)
 {
+	const char *argv[] = { path, "list", NULL };
+	struct rpc_plugin_discovery *d;
+	int fds[2];
 	pid_t pid;
-	int rv = UBUS_STATUS_NO_DATA, fd, fds[2];
-	const char *name;
-	struct ubus_object *plugin;
 
-	name = strrchr(path, '/');
+	d = calloc(1, sizeof(*d) + strlen(path) + 1);
 
-	if (!name)
-		return UBUS_STATUS_INVALID_ARGUMENT;
-
-	if (pipe(fds))
+	if (!d)
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
-	switch ((pid = fork()))
+	d->tok = json_tokener_new();
+
+	if (!d->tok)
+		goto fail;
+
+	if (pipe2(fds, O_CLOEXEC))
+		goto fail;
+
+	pid = rpc_exec_spawn(path, argv, NULL, -1, fds[1], -1);
+	close(fds[1]);
+
+	if (pid < 0)
 	{
-	case -1:
-		return UBUS_STATUS_UNKNOWN_ERROR;
+		close(fds[0]);
+		goto fail;
+	}
+
+	strcpy(d->path, path);
+	d->ctx = ctx;
+	d->s = *s;
+
+	d->opipe.stream.string_data   = true;
+	d->opipe.stream.r.buffer_len  = 4096;
+	d->opipe.stream.r.max_buffers = RPC_EXEC_MAX_SIZE / 4096;
+	d->opipe.stream.notify_read   = rpc_plugin_discovery_read_cb;
+	d->opipe.stream.notify_state  = rpc_plugin_discovery_state_cb;
+	ustream_fd_init(&d->opipe, fds[0]);
+
+	d->process.pid = pid;
+	d->process.cb = rpc_plugin_discovery_process_cb;
+	uloop_process_add(&d->process);
+
+	d->timeout.cb = rpc_plugin_discovery_timeout_cb;
+	uloop_timeout_set(&d->timeout, RPC_PLUGIN_LIST_TIMEOUT);
+
+	list_add(&d->list, &discoveries);
+
+	return UBUS_STATUS_OK;
+
+fail:
+	if (d->tok)
+		json_tokener_free(d->tok);
+
+	free(d);
 
-	case 0:
-		fd = open("/dev/null", O_RDWR);
+	return UBUS_STATUS_UNKNOWN_ERROR;
+}
 
-		if (fd > -1)
+static int
+rpc_plugin_discover(struct ubus_context *ctx)
+{
+	DIR *d;
+	int fd;
+	struct stat s;
+	struct dirent *e;
+	char path[PATH_MAX];
+	struct blob_attr *head = NULL, *list;
+	size_t head_len = 0;
+	int rv = 0;
+
+	fd = open(cache_path, O_RDONLY);
+
+	if (fd >= 0)
+	{
+		if (!fstat(fd, &s) && S_ISREG(s.st_mode) &&
+		    s.st_size >= sizeof(struct blob_attr))
 		{
-			dup2(fd, 0);
-			dup2(fd, 2);
+			head_len = s.st_size;
+			head = mmap(NULL, head_len, PROT_READ, MAP_PRIVATE, fd, 0);
 
-			if (fd > 2)
-				close(fd);
+			if (head == MAP_FAILED)
+			{
+				head = NULL;
+			}
+			else if (blob_pad_len(head) > s.st_size)
+			{
+				munmap(head, head_len);
+				head = NULL;
+			}
 		}
 
-		dup2(fds[1], 1);
+		close(fd);
+	}
 
-		close(fds[0]);
-		close(fds[1]);
+	blob_buf_init(&cache, 0);
+	rv_discovery = 0;
 
-		if (execl(path, path, "list", NULL))
-			return UBUS_STATUS_UNKNOWN_ERROR;
+	if ((d = opendir(RPC_PLUGIN_DIRECTORY)) != NULL)
+	{
+		while ((e = readdir(d)) != NULL)
+		{
+			snprintf(path, sizeof(path) - 1,
+			         RPC_PLUGIN_DIRECTORY "/%s", e->d_name);
 
-	default:
-		plugin = rpc_plugin_parse_exec(name + 1, fds[0]);
+			if (stat(path, &s) || !S_ISREG(s.st_mode) || !(s.st_mode & S_IXUSR))
+				continue;
 
-		if (!plugin)
-			goto out;
+			list = rpc_plugin_cache_find(head, path, &s);
 
-		rv = ubus_add_object(ctx, plugin);
+			if (list)
+			{
+				rpc_plugin_cache_add(path, &s, list);
+				rv |= rpc_plugin_register_exec(ctx, path, list);
+				continue;
+			}
 
-out:
-		close(fds[0]);
-		close(fds[1]);
-		waitpid(pid, NULL, 0);
+			rv |= rpc_plugin_discover_exec(ctx, path, &s);
+		}
 
-		return rv;
+		closedir(d);
 	}
-}
 
+	/* run the loop until all "list" invocations completed or timed out */
+	if (!list_empty(&discoveries))
+		uloop_run();
+
+	rpc_plugin_cache_write();
+	blob_buf_free(&cache);
+
+	rv |= rv_discovery;
+
+	if (head)
+		munmap(head, head_len);
+
+	return rv;
+}
 
 static LIST_HEAD(plugins);
 
@@ -404,6 +1330,14 @@ static const struct rpc_daemon_ops ops = {
 	.session_create_cb  = rpc_session_create_cb,
 	.session_destroy_cb = rpc_session_destroy_cb,
 	.exec               = rpc_exec,
+	.session_access_batch = rpc_session_access_batch,
+	.complete_deferred  = rpc_stats_complete,
+	.exec_lookup        = rpc_exec_lookup,
+	.exec_spawn         = rpc_exec_spawn,
+	.exec_schedule      = rpc_exec_schedule,
+	.exec_release       = rpc_exec_release,
+	.worker_submit      = rpc_worker_submit,
+	.worker_complete    = rpc_worker_complete,
 };
 
 static int
@@ -427,6 +1361,16 @@ rpc_plugin_register_library(struct ubus_context *ctx, const char *path)
 	return p->init(&ops, ctx);
 }
 
+/*
+ * Override the runtime directory holding the discovery cache, NULL keeps
+ * the built-in default.
+ */
+void rpc_plugin_dirs(const char *rundir)
+{
+	if (rundir)
+		snprintf(cache_path, sizeof(cache_path), "%s/plugins.cache", rundir);
+}
+
 int rpc_plugin_api_init(struct ubus_context *ctx)
 {
 	DIR *d;
@@ -435,21 +1379,7 @@ int rpc_plugin_api_init(struct ubus_context *ctx)
 	struct dirent *e;
 	char path[PATH_MAX];
 
-	if ((d = opendir(RPC_PLUGIN_DIRECTORY)) != NULL)
-	{
-		while ((e = readdir(d)) != NULL)
-		{
-			snprintf(path, sizeof(path) - 1,
-			         RPC_PLUGIN_DIRECTORY "/%s", e->d_name);
-
-			if (stat(path, &s) || !S_ISREG(s.st_mode) || !(s.st_mode & S_IXUSR))
-				continue;
-
-			rv |= rpc_plugin_register_exec(ctx, path);
-		}
-
-		closedir(d);
-	}
+	rv |= rpc_plugin_discover(ctx);
 
 	if ((d = opendir(RPC_LIBRARY_DIRECTORY)) != NULL)
 	{
@@ -17,29 +17,119 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define _GNU_SOURCE	/* crypt() */
+#define _GNU_SOURCE	/* crypt_r() */
 
 #include <libubox/avl-cmp.h>
 #include <libubox/blobmsg.h>
 #include <libubox/utils.h>
 #include <libubus.h>
+#include <crypt.h>
+#include <errno.h>
 #include <fnmatch.h>
 #include <glob.h>
+#include <pwd.h>
 #include <uci.h>
 #include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_SHADOW
 #include <shadow.h>
 #endif
 
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
 #include <rpcd/session.h>
+#include <rpcd/stats.h>
+#include <rpcd/worker.h>
 
-static struct avl_tree sessions;
+static struct list_head sessions[RPC_SESSION_HASH_SIZE];
 static struct blob_buf buf;
 
+#define rpc_session_for_each(_i, _ses)					\
+	for (_i = 0; _i < RPC_SESSION_HASH_SIZE; _i++)		\
+		list_for_each_entry(_ses, &sessions[_i], list)
+
+/*
+ * Nodes of ACL sets built from acl.d are carved out of a chain of chunks
+ * owned by the set which is released at once when the set is destroyed.
+ * Such sets are never modified in place, grant and revoke operate on a
+ * private, individually allocated copy.
+ */
+#define RPC_SESSION_ARENA_CHUNK	4096
+
+struct rpc_session_arena {
+	struct rpc_session_arena *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+static struct list_head expiry_wheel[RPC_SESSION_WHEEL_SLOTS];
+static struct uloop_timeout expiry_timer;
+static time_t expiry_tick;
+static int expiry_count;
+
+struct rpc_session_acl_file {
+	struct avl_node avl;
+	struct blob_buf acl;
+	time_t mtime;
+	off_t size;
+	ino_t inode;
+	bool seen;
+};
+
+static struct avl_tree acl_files;
+static struct avl_tree acl_sets;
+static uint32_t acl_files_gen;
+
+/* directories in use, see rpc_session_dirs() */
+static const char *config_dir = NULL;
+static char acl_pattern[PATH_MAX] = RPC_SESSION_ACL_DIR "/*.json";
+static char snapshot_path[PATH_MAX] = RPC_SESSION_SNAPSHOT;
+
 static LIST_HEAD(create_callbacks);
 static LIST_HEAD(destroy_callbacks);
 
+struct rpc_login_backoff {
+	struct avl_node avl;
+	int failures;
+	int pending;
+	time_t until;
+};
+
+struct rpc_login_job {
+	struct list_head list;
+	struct rpc_worker_job work;
+	struct uloop_timeout timeout_timer;
+	struct ubus_context *ctx;
+	struct ubus_request_data req;
+	struct rpc_login_backoff *backoff;
+	struct uci_context *uci;
+	struct uci_section *logins[RPC_LOGIN_MAX_CANDIDATES];
+	const char *hashes[RPC_LOGIN_MAX_CANDIDATES];
+	int n_logins;
+	char *password;
+	int timeout;
+	int match;
+	bool completed;
+};
+
+/* last scope resolved during a batch of ACL checks */
+struct rpc_session_acl_hint {
+	const char *name;
+	struct rpc_session_acl_scope *scope;
+};
+
+static struct avl_tree login_backoff;
+static LIST_HEAD(login_queue);
+static int login_workers;
+static int login_jobs;
+
+static void rpc_login_job_run(void);
+
 enum {
 	RPC_SN_TIMEOUT,
 	__RPC_SN_MAX,
@@ -93,6 +183,7 @@ enum {
 	RPC_SP_SCOPE,
 	RPC_SP_OBJECT,
 	RPC_SP_FUNCTION,
+	RPC_SP_CHECKS,
 	__RPC_SP_MAX,
 };
 static const struct blobmsg_policy perm_policy[__RPC_SP_MAX] = {
@@ -100,6 +191,7 @@ static const struct blobmsg_policy perm_policy[__RPC_SP_MAX] = {
 	[RPC_SP_SCOPE] = { .name = "scope", .type = BLOBMSG_TYPE_STRING },
 	[RPC_SP_OBJECT] = { .name = "object", .type = BLOBMSG_TYPE_STRING },
 	[RPC_SP_FUNCTION] = { .name = "function", .type = BLOBMSG_TYPE_STRING },
+	[RPC_SP_CHECKS] = { .name = "checks", .type = BLOBMSG_TYPE_ARRAY },
 };
 
 enum {
@@ -107,6 +199,7 @@ enum {
 	RPC_DUMP_TIMEOUT,
 	RPC_DUMP_EXPIRES,
 	RPC_DUMP_DATA,
+	RPC_DUMP_ACL,
 	__RPC_DUMP_MAX,
 };
 static const struct blobmsg_policy dump_policy[__RPC_DUMP_MAX] = {
@@ -114,6 +207,19 @@ static const struct blobmsg_policy dump_policy[__RPC_DUMP_MAX] = {
 	[RPC_DUMP_TIMEOUT] = { .name = "timeout", .type = BLOBMSG_TYPE_INT32 },
 	[RPC_DUMP_EXPIRES] = { .name = "expires", .type = BLOBMSG_TYPE_INT32 },
 	[RPC_DUMP_DATA] = { .name = "data", .type = BLOBMSG_TYPE_TABLE },
+	[RPC_DUMP_ACL] = { .name = "acl", .type = BLOBMSG_TYPE_INT32 },
+};
+
+enum {
+	RPC_SNAPSHOT_VERSION,
+	RPC_SNAPSHOT_ACLS,
+	RPC_SNAPSHOT_SESSIONS,
+	__RPC_SNAPSHOT_MAX,
+};
+static const struct blobmsg_policy snapshot_policy[__RPC_SNAPSHOT_MAX] = {
+	[RPC_SNAPSHOT_VERSION] = { .name = "version", .type = BLOBMSG_TYPE_INT32 },
+	[RPC_SNAPSHOT_ACLS] = { .name = "acls", .type = BLOBMSG_TYPE_ARRAY },
+	[RPC_SNAPSHOT_SESSIONS] = { .name = "sessions", .type = BLOBMSG_TYPE_ARRAY },
 };
 
 enum {
@@ -146,29 +252,109 @@ static const struct blobmsg_policy login_policy[__RPC_L_MAX] = {
 		    !fnmatch((_acl)->object, (_obj), FNM_NOESCAPE) &&		\
 		    !fnmatch((_acl)->function, (_func), FNM_NOESCAPE))
 
+#ifdef HAVE_GETRANDOM
 static int
-rpc_random(char *dest)
+rpc_random(uint8_t *dest)
 {
-	unsigned char buf[16] = { 0 };
-	FILE *f;
-	int i;
-	int ret;
-
-	f = fopen("/dev/urandom", "r");
-	if (!f)
+	if (getrandom(dest, RPC_SID_RAW_LEN, 0) != RPC_SID_RAW_LEN)
 		return -1;
 
-	ret = fread(buf, 1, sizeof(buf), f);
-	fclose(f);
+	return 0;
+}
+#else
+/*
+ * Without getrandom(), read entropy for a number of session IDs at once
+ * instead of opening /dev/urandom for every new session.
+ */
+static int
+rpc_random(uint8_t *dest)
+{
+	static uint8_t pool[RPC_SID_RAW_LEN * 32];
+	static int avail = 0;
+	int fd, len = 0, rv;
+
+	if (avail < RPC_SID_RAW_LEN) {
+		fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+		if (fd < 0)
+			return -1;
+
+		while (len < sizeof(pool)) {
+			rv = read(fd, pool + len, sizeof(pool) - len);
+
+			if (rv <= 0)
+				break;
+
+			len += rv;
+		}
+
+		close(fd);
+
+		if (len != sizeof(pool))
+			return -1;
 
-	if (ret < 0)
-		return ret;
+		avail = sizeof(pool);
+	}
 
-	for (i = 0; i < sizeof(buf); i++)
-		sprintf(dest + (i<<1), "%02x", buf[i]);
+	avail -= RPC_SID_RAW_LEN;
+	memcpy(dest, pool + avail, RPC_SID_RAW_LEN);
+	memset(pool + avail, 0, RPC_SID_RAW_LEN);
 
 	return 0;
 }
+#endif
+
+static void
+rpc_session_id_format(const uint8_t *raw, char *dest)
+{
+	static const char hex[] = "0123456789abcdef";
+	int i;
+
+	for (i = 0; i < RPC_SID_RAW_LEN; i++) {
+		*dest++ = hex[raw[i] >> 4];
+		*dest++ = hex[raw[i] & 15];
+	}
+
+	*dest = 0;
+}
+
+static bool
+rpc_session_id_parse(const char *id, uint8_t *raw)
+{
+	int i, n;
+
+	for (i = 0; i < RPC_SID_LEN; i++) {
+		if (id[i] >= '0' && id[i] <= '9')
+			n = id[i] - '0';
+		else if (id[i] >= 'a' && id[i] <= 'f')
+			n = id[i] - 'a' + 10;
+		else
+			return false;
+
+		if (i & 1)
+			raw[i >> 1] |= n;
+		else
+			raw[i >> 1] = n << 4;
+	}
+
+	return (id[i] == 0);
+}
+
+static struct list_head *
+rpc_session_bucket(const uint8_t *raw)
+{
+	uint32_t hash;
+
+	memcpy(&hash, raw, sizeof(hash));
+
+	return &sessions[hash % RPC_SESSION_HASH_SIZE];
+}
+
+static void
+rpc_session_insert(struct rpc_session *ses)
+{
+	list_add(&ses->list, rpc_session_bucket(ses->raw));
+}
 
 static void
 rpc_session_dump_data(struct rpc_session *ses, struct blob_buf *b)
@@ -190,7 +376,10 @@ rpc_session_dump_acls(struct rpc_session *ses, struct blob_buf *b)
 	const char *lastscope = NULL;
 	void *c = NULL, *d = NULL;
 
-	avl_for_each_element(&ses->acls, acl_scope, avl) {
+	if (!ses->acls)
+		return;
+
+	avl_for_each_element(&ses->acls->scopes, acl_scope, avl) {
 		if (!lastscope || strcmp(acl_scope->avl.key, lastscope))
 		{
 			if (c) blobmsg_close_table(b, c);
@@ -217,6 +406,29 @@ rpc_session_dump_acls(struct rpc_session *ses, struct blob_buf *b)
 	if (c) blobmsg_close_table(b, c);
 }
 
+static time_t
+rpc_session_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int
+rpc_session_remaining(struct rpc_session *ses)
+{
+	time_t remaining;
+
+	if (ses->timeout <= 0)
+		return 0;
+
+	remaining = ses->touched + ses->timeout - rpc_session_now();
+
+	return (remaining > 0) ? remaining : 0;
+}
+
 static void
 rpc_session_to_blob(struct rpc_session *ses, bool acls)
 {
@@ -226,7 +438,7 @@ rpc_session_to_blob(struct rpc_session *ses, bool acls)
 
 	blobmsg_add_string(&buf, "ubus_rpc_session", ses->id);
 	blobmsg_add_u32(&buf, "timeout", ses->timeout);
-	blobmsg_add_u32(&buf, "expires", uloop_timeout_remaining(&ses->t) / 1000);
+	blobmsg_add_u32(&buf, "expires", rpc_session_remaining(ses));
 
 	if (acls) {
 		c = blobmsg_open_table(&buf, "acls");
@@ -248,47 +460,212 @@ rpc_session_dump(struct rpc_session *ses, struct ubus_context *ctx,
 	ubus_send_reply(ctx, req, buf.head);
 }
 
+/*
+ * Touching a session merely records the time of the access. Expiry is
+ * handled by a coarse timing wheel with one second resolution: sessions are
+ * hashed into the slot of the second they were due to expire at when they
+ * got scheduled, the sweeper walks one slot per second, destroys sessions
+ * which are really expired and moves touched sessions to their new slot.
+ */
 static void
 rpc_touch_session(struct rpc_session *ses)
 {
 	if (ses->timeout > 0)
-		uloop_timeout_set(&ses->t, ses->timeout * 1000);
+		ses->touched = rpc_session_now();
 }
 
 static void
-rpc_session_destroy(struct rpc_session *ses)
+rpc_session_schedule(struct rpc_session *ses)
+{
+	time_t expires = ses->touched + ses->timeout;
+
+	if (ses->timeout <= 0)
+		return;
+
+	if (!expiry_count++) {
+		expiry_tick = rpc_session_now();
+		uloop_timeout_set(&expiry_timer, 1000);
+	}
+
+	list_add_tail(&ses->expiry, &expiry_wheel[expires % RPC_SESSION_WHEEL_SLOTS]);
+}
+
+static void
+rpc_session_unschedule(struct rpc_session *ses)
+{
+	if (list_empty(&ses->expiry))
+		return;
+
+	list_del_init(&ses->expiry);
+
+	if (!--expiry_count)
+		uloop_timeout_cancel(&expiry_timer);
+}
+
+static void
+rpc_session_flush_acl_cache(struct rpc_session *ses)
+{
+	int i;
+
+	if (!ses->acl_cache)
+		return;
+
+	for (i = 0; i < RPC_SESSION_ACL_CACHE_SIZE; i++)
+		free(ses->acl_cache[i].key);
+
+	free(ses->acl_cache);
+	ses->acl_cache = NULL;
+}
+
+/*
+ * ACL sets are reference counted and may be shared by multiple sessions.
+ * Sets built from acl.d during login are registered in the "acl_sets" tree,
+ * keyed by a signature of the granted access groups, so that subsequent
+ * logins resolving to the same groups reuse the same set. Modifying a set
+ * through grant or revoke first creates a private copy of it.
+ */
+static void *
+rpc_session_acls_alloc(struct rpc_session_acl_set *set, size_t len)
+{
+	struct rpc_session_arena *a = set->arena;
+	size_t size;
+	void *ptr;
+
+	if (!set->pooled)
+		return calloc(1, len);
+
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (!a || a->size - a->used < len) {
+		size = sizeof(*a) + len;
+
+		if (size < RPC_SESSION_ARENA_CHUNK)
+			size = RPC_SESSION_ARENA_CHUNK;
+
+		a = calloc(1, size);
+
+		if (!a)
+			return NULL;
+
+		a->size = size - sizeof(*a);
+		a->next = set->arena;
+		set->arena = a;
+	}
+
+	ptr = a->data + a->used;
+	a->used += len;
+
+	return ptr;
+}
+
+static void
+rpc_session_acls_free(struct rpc_session_acl_set *set, void *ptr)
+{
+	if (!set->pooled)
+		free(ptr);
+}
+
+static struct rpc_session_acl_set *
+rpc_session_acls_new(void)
+{
+	struct rpc_session_acl_set *set;
+
+	set = calloc(1, sizeof(*set));
+
+	if (!set)
+		return NULL;
+
+	avl_init(&set->scopes, avl_strcmp, true, NULL);
+	set->refcount = 1;
+
+	return set;
+}
+
+static void
+rpc_session_acls_unref(struct rpc_session_acl_set *set)
 {
 	struct rpc_session_acl *acl, *nacl;
 	struct rpc_session_acl_scope *acl_scope, *nacl_scope;
+	struct rpc_session_arena *a, *na;
+
+	if (!set || --set->refcount > 0)
+		return;
+
+	if (set->pooled) {
+		for (a = set->arena; a; a = na) {
+			na = a->next;
+			free(a);
+		}
+	}
+	else {
+		avl_for_each_element_safe(&set->scopes, acl_scope, avl, nacl_scope) {
+			avl_remove_all_elements(&acl_scope->acls, acl, avl, nacl)
+				free(acl);
+
+			avl_delete(&set->scopes, &acl_scope->avl);
+			free(acl_scope);
+		}
+	}
+
+	if (set->avl.key) {
+		avl_delete(&acl_sets, &set->avl);
+		free((void *)set->avl.key);
+	}
+
+	free(set);
+}
+
+static void
+rpc_session_destroy(struct rpc_session *ses)
+{
 	struct rpc_session_data *data, *ndata;
 	struct rpc_session_cb *cb;
 
 	list_for_each_entry(cb, &destroy_callbacks, list)
 		cb->cb(ses, cb->priv);
 
-	uloop_timeout_cancel(&ses->t);
+	rpc_session_unschedule(ses);
 
-	avl_for_each_element_safe(&ses->acls, acl_scope, avl, nacl_scope) {
-		avl_remove_all_elements(&acl_scope->acls, acl, avl, nacl)
-			free(acl);
-
-		avl_delete(&ses->acls, &acl_scope->avl);
-		free(acl_scope);
-	}
+	rpc_session_acls_unref(ses->acls);
 
 	avl_remove_all_elements(&ses->data, data, avl, ndata)
 		free(data);
 
-	avl_delete(&sessions, &ses->avl);
+	rpc_session_flush_acl_cache(ses);
+
+	list_del(&ses->list);
 	free(ses);
 }
 
-static void rpc_session_timeout(struct uloop_timeout *t)
+static void
+rpc_session_sweep(struct uloop_timeout *t)
 {
-	struct rpc_session *ses;
+	struct rpc_session *ses, *tmp;
+	struct list_head *slot, *dest;
+	time_t now = rpc_session_now();
 
-	ses = container_of(t, struct rpc_session, t);
-	rpc_session_destroy(ses);
+	if (now - expiry_tick > RPC_SESSION_WHEEL_SLOTS)
+		expiry_tick = now - RPC_SESSION_WHEEL_SLOTS;
+
+	while (expiry_tick < now) {
+		slot = &expiry_wheel[++expiry_tick % RPC_SESSION_WHEEL_SLOTS];
+
+		list_for_each_entry_safe(ses, tmp, slot, expiry) {
+			if (ses->touched + ses->timeout <= now) {
+				rpc_session_destroy(ses);
+				continue;
+			}
+
+			dest = &expiry_wheel[(ses->touched + ses->timeout) %
+			                     RPC_SESSION_WHEEL_SLOTS];
+
+			if (dest != slot)
+				list_move_tail(&ses->expiry, dest);
+		}
+	}
+
+	if (expiry_count)
+		uloop_timeout_set(&expiry_timer, 1000);
 }
 
 static struct rpc_session *
@@ -301,12 +678,9 @@ rpc_session_new(void)
 	if (!ses)
 		return NULL;
 
-	ses->avl.key = ses->id;
-
-	avl_init(&ses->acls, avl_strcmp, true, NULL);
 	avl_init(&ses->data, avl_strcmp, false, NULL);
 
-	ses->t.cb = rpc_session_timeout;
+	INIT_LIST_HEAD(&ses->expiry);
 
 	return ses;
 }
@@ -322,14 +696,19 @@ rpc_session_create(int timeout)
 	if (!ses)
 		return NULL;
 
-	if (rpc_random(ses->id))
+	if (rpc_random(ses->raw)) {
+		free(ses);
 		return NULL;
+	}
+
+	rpc_session_id_format(ses->raw, ses->id);
 
 	ses->timeout = timeout;
 
-	avl_insert(&sessions, &ses->avl);
+	rpc_session_insert(ses);
 
 	rpc_touch_session(ses);
+	rpc_session_schedule(ses);
 
 	list_for_each_entry(cb, &create_callbacks, list)
 		cb->cb(ses, cb->priv);
@@ -341,13 +720,20 @@ static struct rpc_session *
 rpc_session_get(const char *id)
 {
 	struct rpc_session *ses;
+	uint8_t raw[RPC_SID_RAW_LEN];
 
-	ses = avl_find_element(&sessions, id, ses, avl);
-	if (!ses)
+	if (!rpc_session_id_parse(id, raw))
 		return NULL;
 
-	rpc_touch_session(ses);
-	return ses;
+	list_for_each_entry(ses, rpc_session_bucket(raw), list) {
+		if (memcmp(ses->raw, raw, sizeof(raw)))
+			continue;
+
+		rpc_touch_session(ses);
+		return ses;
+	}
+
+	return NULL;
 }
 
 static int
@@ -377,11 +763,12 @@ rpc_handle_list(struct ubus_context *ctx, struct ubus_object *obj,
 {
 	struct rpc_session *ses;
 	struct blob_attr *tb;
+	int i;
 
 	blobmsg_parse(sid_policy, __RPC_SI_MAX, &tb, blob_data(msg), blob_len(msg));
 
 	if (!tb) {
-		avl_for_each_element(&sessions, ses, avl)
+		rpc_session_for_each(i, ses)
 			rpc_session_dump(ses, ctx, req);
 		return 0;
 	}
@@ -401,49 +788,68 @@ uh_id_len(const char *str)
 	return strcspn(str, "*?[");
 }
 
-static int
-rpc_session_grant(struct rpc_session *ses,
-                  const char *scope, const char *object, const char *function)
+static bool
+rpc_session_acls_find(struct rpc_session_acl_set *set, const char *scope,
+                      const char *object, const char *function)
 {
 	struct rpc_session_acl *acl;
 	struct rpc_session_acl_scope *acl_scope;
-	char *new_scope, *new_obj, *new_func, *new_id;
-	int id_len;
-
-	if (!object || !function)
-		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	acl_scope = avl_find_element(&ses->acls, scope, acl_scope, avl);
+	acl_scope = avl_find_element(&set->scopes, scope, acl_scope, avl);
 
 	if (acl_scope) {
 		uh_foreach_matching_acl_prefix(acl, &acl_scope->acls, object, function) {
 			if (!strcmp(acl->object, object) &&
 				!strcmp(acl->function, function))
-				return 0;
+				return true;
 		}
 	}
 
+	return false;
+}
+
+static int
+rpc_session_acls_grant(struct rpc_session_acl_set *set, const char *scope,
+                       const char *object, const char *function)
+{
+	struct rpc_session_acl *acl;
+	struct rpc_session_acl_scope *acl_scope;
+	char *new_scope, *new_obj, *new_func, *new_id;
+	int id_len, obj_len, func_len;
+
+	if (rpc_session_acls_find(set, scope, object, function))
+		return 0;
+
+	acl_scope = avl_find_element(&set->scopes, scope, acl_scope, avl);
+
 	if (!acl_scope) {
-		acl_scope = calloc_a(sizeof(*acl_scope),
-		                     &new_scope, strlen(scope) + 1);
+		acl_scope = rpc_session_acls_alloc(set,
+			sizeof(*acl_scope) + strlen(scope) + 1);
 
 		if (!acl_scope)
 			return UBUS_STATUS_UNKNOWN_ERROR;
 
+		new_scope = (char *)(acl_scope + 1);
+
 		acl_scope->avl.key = strcpy(new_scope, scope);
 		avl_init(&acl_scope->acls, avl_strcmp, true, NULL);
-		avl_insert(&ses->acls, &acl_scope->avl);
+		avl_insert(&set->scopes, &acl_scope->avl);
 	}
 
 	id_len = uh_id_len(object);
-	acl = calloc_a(sizeof(*acl),
-		&new_obj, strlen(object) + 1,
-		&new_func, strlen(function) + 1,
-		&new_id, id_len + 1);
+	obj_len = strlen(object) + 1;
+	func_len = strlen(function) + 1;
+
+	acl = rpc_session_acls_alloc(set,
+		sizeof(*acl) + obj_len + func_len + id_len + 1);
 
 	if (!acl)
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
+	new_obj = (char *)(acl + 1);
+	new_func = new_obj + obj_len;
+	new_id = new_func + func_len;
+
 	acl->object = strcpy(new_obj, object);
 	acl->function = strcpy(new_func, function);
 	acl->avl.key = strncpy(new_id, object, id_len);
@@ -452,26 +858,26 @@ rpc_session_grant(struct rpc_session *ses,
 	return 0;
 }
 
-static int
-rpc_session_revoke(struct rpc_session *ses,
-                   const char *scope, const char *object, const char *function)
+static void
+rpc_session_acls_revoke(struct rpc_session_acl_set *set, const char *scope,
+                        const char *object, const char *function)
 {
 	struct rpc_session_acl *acl, *next;
 	struct rpc_session_acl_scope *acl_scope;
 	int id_len;
 	char *id;
 
-	acl_scope = avl_find_element(&ses->acls, scope, acl_scope, avl);
+	acl_scope = avl_find_element(&set->scopes, scope, acl_scope, avl);
 
 	if (!acl_scope)
-		return 0;
+		return;
 
 	if (!object && !function) {
 		avl_remove_all_elements(&acl_scope->acls, acl, avl, next)
-			free(acl);
-		avl_delete(&ses->acls, &acl_scope->avl);
-		free(acl_scope);
-		return 0;
+			rpc_session_acls_free(set, acl);
+		avl_delete(&set->scopes, &acl_scope->avl);
+		rpc_session_acls_free(set, acl_scope);
+		return;
 	}
 
 	id_len = uh_id_len(object);
@@ -492,51 +898,139 @@ rpc_session_revoke(struct rpc_session *ses,
 		if (!strcmp(acl->object, object) &&
 		    !strcmp(acl->function, function)) {
 			avl_delete(&acl_scope->acls, &acl->avl);
-			free(acl);
+			rpc_session_acls_free(set, acl);
 		}
 		acl = next;
 	}
 
 	if (avl_is_empty(&acl_scope->acls)) {
-		avl_delete(&ses->acls, &acl_scope->avl);
-		free(acl_scope);
+		avl_delete(&set->scopes, &acl_scope->avl);
+		rpc_session_acls_free(set, acl_scope);
 	}
-
-	return 0;
 }
 
-
-static int
-rpc_handle_acl(struct ubus_context *ctx, struct ubus_object *obj,
-               struct ubus_request_data *req, const char *method,
-               struct blob_attr *msg)
+/*
+ * Return an ACL set of the given session which is safe to modify, copying
+ * the current set if it is shared with other sessions.
+ */
+static struct rpc_session_acl_set *
+rpc_session_acls_unshare(struct rpc_session *ses)
 {
-	struct rpc_session *ses;
-	struct blob_attr *tb[__RPC_SA_MAX];
-	struct blob_attr *attr, *sattr;
-	const char *object, *function;
-	const char *scope = "ubus";
-	int rem1, rem2;
+	struct rpc_session_acl *acl;
+	struct rpc_session_acl_scope *acl_scope;
+	struct rpc_session_acl_set *set;
 
-	int (*cb)(struct rpc_session *ses,
-	          const char *scope, const char *object, const char *function);
+	if (ses->acls && ses->acls->refcount == 1 &&
+	    !ses->acls->avl.key && !ses->acls->pooled)
+		return ses->acls;
 
-	blobmsg_parse(acl_policy, __RPC_SA_MAX, tb, blob_data(msg), blob_len(msg));
+	set = rpc_session_acls_new();
 
-	if (!tb[RPC_SA_SID])
-		return UBUS_STATUS_INVALID_ARGUMENT;
+	if (!set)
+		return NULL;
 
-	ses = rpc_session_get(blobmsg_data(tb[RPC_SA_SID]));
-	if (!ses)
-		return UBUS_STATUS_NOT_FOUND;
+	if (ses->acls) {
+		avl_for_each_element(&ses->acls->scopes, acl_scope, avl) {
+			avl_for_each_element(&acl_scope->acls, acl, avl) {
+				if (rpc_session_acls_grant(set, acl_scope->avl.key,
+				                           acl->object, acl->function)) {
+					rpc_session_acls_unref(set);
+					return NULL;
+				}
+			}
+		}
+	}
 
-	if (tb[RPC_SA_SCOPE])
-		scope = blobmsg_data(tb[RPC_SA_SCOPE]);
+	rpc_session_acls_unref(ses->acls);
+	ses->acls = set;
 
-	if (!strcmp(method, "grant"))
-		cb = rpc_session_grant;
-	else
-		cb = rpc_session_revoke;
+	return set;
+}
+
+static int
+rpc_session_grant(struct rpc_session *ses,
+                  const char *scope, const char *object, const char *function)
+{
+	struct rpc_session_acl_set *set;
+	int rv;
+
+	if (!object || !function)
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (ses->acls && rpc_session_acls_find(ses->acls, scope, object, function))
+		return 0;
+
+	set = rpc_session_acls_unshare(ses);
+
+	if (!set)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	rv = rpc_session_acls_grant(set, scope, object, function);
+
+	ses->acl_gen++;
+
+	return rv;
+}
+
+static int
+rpc_session_revoke(struct rpc_session *ses,
+                   const char *scope, const char *object, const char *function)
+{
+	struct rpc_session_acl_set *set;
+	struct rpc_session_acl_scope *acl_scope;
+
+	if (!ses->acls)
+		return 0;
+
+	acl_scope = avl_find_element(&ses->acls->scopes, scope, acl_scope, avl);
+
+	if (!acl_scope)
+		return 0;
+
+	set = rpc_session_acls_unshare(ses);
+
+	if (!set)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	rpc_session_acls_revoke(set, scope, object, function);
+
+	ses->acl_gen++;
+
+	return 0;
+}
+
+
+static int
+rpc_handle_acl(struct ubus_context *ctx, struct ubus_object *obj,
+               struct ubus_request_data *req, const char *method,
+               struct blob_attr *msg)
+{
+	struct rpc_session *ses;
+	struct blob_attr *tb[__RPC_SA_MAX];
+	struct blob_attr *attr, *sattr;
+	const char *object, *function;
+	const char *scope = "ubus";
+	int rem1, rem2;
+
+	int (*cb)(struct rpc_session *ses,
+	          const char *scope, const char *object, const char *function);
+
+	blobmsg_parse(acl_policy, __RPC_SA_MAX, tb, blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_SA_SID])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	ses = rpc_session_get(blobmsg_data(tb[RPC_SA_SID]));
+	if (!ses)
+		return UBUS_STATUS_NOT_FOUND;
+
+	if (tb[RPC_SA_SCOPE])
+		scope = blobmsg_data(tb[RPC_SA_SCOPE]);
+
+	if (!strcmp(method, "grant"))
+		cb = rpc_session_grant;
+	else
+		cb = rpc_session_revoke;
 
 	if (!tb[RPC_SA_OBJECTS])
 		return cb(ses, scope, NULL, NULL);
@@ -567,14 +1061,100 @@ rpc_handle_acl(struct ubus_context *ctx, struct ubus_object *obj,
 	return 0;
 }
 
+/*
+ * Access decisions are memoized in a small direct mapped table per session,
+ * indexed by a hash over the (scope, object, function) tuple. Each slot
+ * records the ACL generation it was computed for, grant and revoke bump the
+ * generation of the session which implicitly invalidates all cached results.
+ */
+static uint32_t
+rpc_session_acl_hash(const char *scope, const char *obj, const char *fun)
+{
+	const char *parts[] = { scope, obj, fun };
+	uint32_t hash = 2166136261u;
+	const char *p;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(parts); i++) {
+		for (p = parts[i]; *p; p++)
+			hash = (hash ^ (uint8_t)*p) * 16777619u;
+
+		hash = (hash ^ 0xff) * 16777619u;
+	}
+
+	return hash;
+}
+
 static bool
-rpc_session_acl_allowed(struct rpc_session *ses, const char *scope,
-                        const char *obj, const char *fun)
+rpc_session_acl_cache_match(struct rpc_session_acl_cache *c, uint32_t hash,
+                            const char *scope, const char *obj, const char *fun)
+{
+	const char *parts[] = { scope, obj, fun };
+	const char *key = c->key;
+	int i;
+
+	if (!key || c->hash != hash)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(parts); i++) {
+		if (strcmp(key, parts[i]))
+			return false;
+
+		key += strlen(key) + 1;
+	}
+
+	return true;
+}
+
+static void
+rpc_session_acl_cache_store(struct rpc_session_acl_cache *c, uint32_t gen,
+                            uint32_t hash, bool allow, const char *scope,
+                            const char *obj, const char *fun)
+{
+	int slen = strlen(scope) + 1, olen = strlen(obj) + 1, flen = strlen(fun) + 1;
+	char *key;
+
+	key = realloc(c->key, slen + olen + flen);
+
+	if (!key) {
+		free(c->key);
+		c->key = NULL;
+		return;
+	}
+
+	memcpy(key, scope, slen);
+	memcpy(key + slen, obj, olen);
+	memcpy(key + slen + olen, fun, flen);
+
+	c->key = key;
+	c->hash = hash;
+	c->gen = gen;
+	c->allow = allow;
+}
+
+static bool
+rpc_session_acl_test(struct rpc_session *ses, const char *scope,
+                     const char *obj, const char *fun,
+                     struct rpc_session_acl_hint *hint)
 {
 	struct rpc_session_acl *acl;
 	struct rpc_session_acl_scope *acl_scope;
 
-	acl_scope = avl_find_element(&ses->acls, scope, acl_scope, avl);
+	if (!ses->acls)
+		return false;
+
+	if (hint && hint->name && !strcmp(hint->name, scope)) {
+		acl_scope = hint->scope;
+	}
+	else {
+		acl_scope = avl_find_element(&ses->acls->scopes, scope,
+		                             acl_scope, avl);
+
+		if (hint) {
+			hint->name = scope;
+			hint->scope = acl_scope;
+		}
+	}
 
 	if (acl_scope) {
 		uh_foreach_matching_acl(acl, &acl_scope->acls, obj, fun)
@@ -584,15 +1164,87 @@ rpc_session_acl_allowed(struct rpc_session *ses, const char *scope,
 	return false;
 }
 
+static bool
+rpc_session_acl_allowed(struct rpc_session *ses, const char *scope,
+                        const char *obj, const char *fun,
+                        struct rpc_session_acl_hint *hint)
+{
+	struct rpc_session_acl_cache *c = NULL;
+	uint32_t hash;
+	bool allow;
+
+	if (!ses->acl_cache)
+		ses->acl_cache = calloc(RPC_SESSION_ACL_CACHE_SIZE,
+		                        sizeof(*ses->acl_cache));
+
+	hash = rpc_session_acl_hash(scope, obj, fun);
+
+	if (ses->acl_cache) {
+		c = &ses->acl_cache[hash % RPC_SESSION_ACL_CACHE_SIZE];
+
+		if (c->gen == ses->acl_gen &&
+		    rpc_session_acl_cache_match(c, hash, scope, obj, fun))
+			return c->allow;
+	}
+
+	allow = rpc_session_acl_test(ses, scope, obj, fun, hint);
+
+	if (c)
+		rpc_session_acl_cache_store(c, ses->acl_gen, hash, allow,
+		                            scope, obj, fun);
+
+	return allow;
+}
+
+/*
+ * A batched check is either an [ object, function ] pair using the scope
+ * given in the request or a [ scope, object, function ] triple.
+ */
+static bool
+rpc_session_parse_check(struct blob_attr *attr, const char *scope,
+                        struct rpc_session_access_check *check)
+{
+	const char *v[3];
+	struct blob_attr *cur;
+	int rem, n = 0;
+
+	blobmsg_for_each_attr(cur, attr, rem) {
+		if (n >= 3 || blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			return false;
+
+		v[n++] = blobmsg_data(cur);
+	}
+
+	if (n == 2) {
+		check->scope = scope;
+		check->object = v[0];
+		check->function = v[1];
+	}
+	else if (n == 3) {
+		check->scope = v[0];
+		check->object = v[1];
+		check->function = v[2];
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+
 static int
 rpc_handle_access(struct ubus_context *ctx, struct ubus_object *obj,
                   struct ubus_request_data *req, const char *method,
                   struct blob_attr *msg)
 {
 	struct rpc_session *ses;
-	struct blob_attr *tb[__RPC_SP_MAX];
+	struct rpc_session_access_check check;
+	struct rpc_session_acl_hint hint = { };
+	struct blob_attr *tb[__RPC_SP_MAX], *cur;
 	const char *scope = "ubus";
 	bool allow;
+	void *c;
+	int rem;
 
 	blobmsg_parse(perm_policy, __RPC_SP_MAX, tb, blob_data(msg), blob_len(msg));
 
@@ -612,10 +1264,33 @@ rpc_handle_access(struct ubus_context *ctx, struct ubus_object *obj,
 
 		allow = rpc_session_acl_allowed(ses, scope,
 		                                blobmsg_data(tb[RPC_SP_OBJECT]),
-		                                blobmsg_data(tb[RPC_SP_FUNCTION]));
+		                                blobmsg_data(tb[RPC_SP_FUNCTION]),
+		                                NULL);
 
 		blobmsg_add_u8(&buf, "access", allow);
 	}
+	else if (tb[RPC_SP_CHECKS])
+	{
+		if (tb[RPC_SP_SCOPE])
+			scope = blobmsg_data(tb[RPC_SP_SCOPE]);
+
+		c = blobmsg_open_array(&buf, "access");
+
+		blobmsg_for_each_attr(cur, tb[RPC_SP_CHECKS], rem) {
+			allow = false;
+
+			if (blobmsg_type(cur) == BLOBMSG_TYPE_ARRAY &&
+			    rpc_session_parse_check(cur, scope, &check))
+				allow = rpc_session_acl_allowed(ses, check.scope,
+				                                check.object,
+				                                check.function,
+				                                &hint);
+
+			blobmsg_add_u8(&buf, NULL, allow);
+		}
+
+		blobmsg_close_array(&buf, c);
+	}
 	else
 	{
 		rpc_session_dump_acls(ses, &buf);
@@ -789,55 +1464,73 @@ rpc_handle_destroy(struct ubus_context *ctx, struct ubus_object *obj,
 }
 
 
-static bool
-rpc_login_test_password(const char *hash, const char *password)
+/*
+ * Returns 1 if the password matches, 0 if it does not and -1 if it could
+ * not be checked. Runs on a worker thread, so only the reentrant variants
+ * of the lookup and crypt functions are used.
+ */
+static int
+rpc_login_test_password(const char *hash, const char *password,
+                        struct crypt_data *data)
 {
 	char *crypt_hash;
+	char pwbuf[1024];
+	int rv;
 
 	/* password is not set */
 	if (!hash || !*hash || !strcmp(hash, "!") || !strcmp(hash, "x"))
 	{
-		return true;
+		return 1;
 	}
 
 	/* password hash refers to shadow/passwd */
 	else if (!strncmp(hash, "$p$", 3))
 	{
 #ifdef HAVE_SHADOW
-		struct spwd *sp = getspnam(hash + 3);
+		struct spwd sp, *spp = NULL;
 
-		if (!sp)
-			return false;
+		rv = getspnam_r(hash + 3, &sp, pwbuf, sizeof(pwbuf), &spp);
 
-		return rpc_login_test_password(sp->sp_pwdp, password);
+		if (!rv && spp)
+			return rpc_login_test_password(spp->sp_pwdp, password, data);
 #else
-		struct passwd *pw = getpwnam(hash + 3);
+		struct passwd pw, *pwp = NULL;
 
-		if (!pw)
-			return false;
+		rv = getpwnam_r(hash + 3, &pw, pwbuf, sizeof(pwbuf), &pwp);
 
-		return rpc_login_test_password(pw->pw_passwd, password);
+		if (!rv && pwp)
+			return rpc_login_test_password(pwp->pw_passwd, password, data);
 #endif
+
+		return (rv && rv != ENOENT) ? -1 : 0;
 	}
 
-	crypt_hash = crypt(password, hash);
+	crypt_hash = crypt_r(password, hash, data);
+
+	if (!crypt_hash)
+		return -1;
 
 	return !strcmp(crypt_hash, hash);
 }
 
-static struct uci_section *
-rpc_login_test_login(struct uci_context *uci,
-                     const char *username, const char *password)
+/*
+ * Collect the login sections matching the given username along with their
+ * password hashes. The hashes point into the given UCI context.
+ */
+static int
+rpc_login_find_logins(struct uci_context *uci, const char *username,
+                      struct uci_section **logins, const char **hashes)
 {
 	struct uci_package *p = NULL;
 	struct uci_section *s;
 	struct uci_element *e;
 	struct uci_ptr ptr = { .package = "rpcd" };
+	int n = 0;
 
 	uci_load(uci, ptr.package, &p);
 
 	if (!p)
-		return false;
+		return 0;
 
 	uci_foreach_element(&p->sections, e)
 	{
@@ -862,12 +1555,7 @@ rpc_login_test_login(struct uci_context *uci,
 		if (strcmp(ptr.o->v.string, username))
 			continue;
 
-		/* If password is NULL, we're restoring ACLs for an existing session,
-		 * in this case do not check the password again. */
-		if (!password)
-			return ptr.s;
-
-		/* test for matching password */
+		/* fetch password hash */
 		ptr.option = "password";
 		ptr.o = NULL;
 
@@ -877,11 +1565,14 @@ rpc_login_test_login(struct uci_context *uci,
 		if (ptr.o->type != UCI_TYPE_STRING)
 			continue;
 
-		if (rpc_login_test_password(ptr.o->v.string, password))
-			return ptr.s;
+		logins[n] = ptr.s;
+		hashes[n] = ptr.o->v.string;
+
+		if (++n >= RPC_LOGIN_MAX_CANDIDATES)
+			break;
 	}
 
-	return NULL;
+	return n;
 }
 
 static bool
@@ -943,7 +1634,7 @@ rpc_login_test_permission(struct uci_section *s,
 }
 
 static void
-rpc_login_setup_acl_scope(struct rpc_session *ses,
+rpc_login_setup_acl_scope(struct rpc_session_acl_set *set,
                           struct blob_attr *acl_perm,
                           struct blob_attr *acl_scope)
 {
@@ -970,9 +1661,9 @@ rpc_login_setup_acl_scope(struct rpc_session *ses,
 				if (blobmsg_type(acl_func) != BLOBMSG_TYPE_STRING)
 					continue;
 
-				rpc_session_grant(ses, blobmsg_name(acl_scope),
-				                       blobmsg_name(acl_obj),
-				                       blobmsg_data(acl_func));
+				rpc_session_acls_grant(set, blobmsg_name(acl_scope),
+				                            blobmsg_name(acl_obj),
+				                            blobmsg_data(acl_func));
 			}
 		}
 	}
@@ -992,30 +1683,23 @@ rpc_login_setup_acl_scope(struct rpc_session *ses,
 			if (blobmsg_type(acl_obj) != BLOBMSG_TYPE_STRING)
 				continue;
 
-			rpc_session_grant(ses, blobmsg_name(acl_scope),
-			                       blobmsg_data(acl_obj),
-			                       blobmsg_name(acl_perm));
+			rpc_session_acls_grant(set, blobmsg_name(acl_scope),
+			                            blobmsg_data(acl_obj),
+			                            blobmsg_name(acl_perm));
 		}
 	}
 }
 
 static void
-rpc_login_setup_acl_file(struct rpc_session *ses, struct uci_section *login,
-                         const char *path)
+rpc_login_setup_acl_file(struct rpc_session_acl_set *set,
+                         struct uci_section *login,
+                         struct rpc_session_acl_file *file)
 {
-	struct blob_buf acl = { 0 };
 	struct blob_attr *acl_group, *acl_perm, *acl_scope;
 	int rem, rem2, rem3;
 
-	blob_buf_init(&acl, 0);
-
-	if (!blobmsg_add_json_from_file(&acl, path)) {
-		fprintf(stderr, "Failed to parse %s\n", path);
-		goto out;
-	}
-
 	/* Iterate access groups in toplevel object */
-	blob_for_each_attr(acl_group, acl.head, rem) {
+	blob_for_each_attr(acl_group, file->acl.head, rem) {
 		/* Iterate permission objects in each access group object */
 		blobmsg_for_each_attr(acl_perm, acl_group, rem2) {
 			if (blobmsg_type(acl_perm) != BLOBMSG_TYPE_TABLE)
@@ -1037,7 +1721,7 @@ rpc_login_setup_acl_file(struct rpc_session *ses, struct uci_section *login,
 			/* Iterate scope objects within the permission object */
 			blobmsg_for_each_attr(acl_scope, acl_perm, rem3) {
 				/* Setup the scopes of the access group */
-				rpc_login_setup_acl_scope(ses, acl_perm, acl_scope);
+				rpc_login_setup_acl_scope(set, acl_perm, acl_scope);
 
 				/*
 				 * Add the access group itself as object to the "access-group"
@@ -1059,105 +1743,449 @@ rpc_login_setup_acl_file(struct rpc_session *ses, struct uci_section *login,
 				 * access groups without having to test access of each single
 				 * <scope>/<object>/<function> tuple defined in a group.
 				 */
-				rpc_session_grant(ses, "access-group",
-				                       blobmsg_name(acl_group),
-				                       blobmsg_name(acl_perm));
+				rpc_session_acls_grant(set, "access-group",
+				                            blobmsg_name(acl_group),
+				                            blobmsg_name(acl_perm));
 			}
 		}
 	}
+}
 
-out:
-	blob_buf_free(&acl);
+/*
+ * Parsed acl.d files are kept in the "acl_files" tree and only re-read if
+ * their mtime, size or inode changed since the last login. Any change to the
+ * set of files bumps "acl_files_gen" which is part of the ACL set signature,
+ * so that sets built from outdated definitions are not handed out anymore.
+ */
+static void
+rpc_login_load_acl_file(struct rpc_session_acl_file *file, struct stat *s)
+{
+	blob_buf_init(&file->acl, 0);
+
+	if (!blobmsg_add_json_from_file(&file->acl, file->avl.key)) {
+		fprintf(stderr, "Failed to parse %s\n", (char *)file->avl.key);
+		blob_buf_init(&file->acl, 0);
+	}
+
+	file->mtime = s->st_mtime;
+	file->size = s->st_size;
+	file->inode = s->st_ino;
+	file->seen = true;
+
+	acl_files_gen++;
 }
 
 static void
-rpc_login_setup_acls(struct rpc_session *ses, struct uci_section *login)
+rpc_login_load_acl_files(void)
 {
-	int i;
+	struct rpc_session_acl_file *file, *nfile;
+	struct stat s;
+	char *path;
 	glob_t gl;
+	int i;
 
-	if (glob(RPC_SESSION_ACL_DIR "/*.json", 0, NULL, &gl))
-		return;
+	avl_for_each_element(&acl_files, file, avl)
+		file->seen = false;
+
+	if (!glob(acl_pattern, 0, NULL, &gl)) {
+		for (i = 0; i < gl.gl_pathc; i++) {
+			if (stat(gl.gl_pathv[i], &s))
+				continue;
+
+			file = avl_find_element(&acl_files, gl.gl_pathv[i], file, avl);
+
+			if (file && file->mtime == s.st_mtime &&
+			    file->size == s.st_size && file->inode == s.st_ino) {
+				file->seen = true;
+				continue;
+			}
+
+			if (!file) {
+				file = calloc_a(sizeof(*file),
+				                &path, strlen(gl.gl_pathv[i]) + 1);
 
-	for (i = 0; i < gl.gl_pathc; i++)
-		rpc_login_setup_acl_file(ses, login, gl.gl_pathv[i]);
+				if (!file)
+					continue;
+
+				file->avl.key = strcpy(path, gl.gl_pathv[i]);
+				avl_insert(&acl_files, &file->avl);
+			}
+
+			rpc_login_load_acl_file(file, &s);
+		}
+
+		globfree(&gl);
+	}
 
-	globfree(&gl);
+	avl_for_each_element_safe(&acl_files, file, avl, nfile) {
+		if (file->seen)
+			continue;
+
+		avl_delete(&acl_files, &file->avl);
+		blob_buf_free(&file->acl);
+		free(file);
+
+		acl_files_gen++;
+	}
+}
+
+/*
+ * Build the signature of the ACL set resulting from the given login section:
+ * the generation of the parsed acl.d files followed by the list of granted
+ * access group permissions, in the order they're applied.
+ */
+static struct blob_attr *
+rpc_login_acl_signature(struct blob_buf *sig, struct uci_section *login)
+{
+	struct rpc_session_acl_file *file;
+	struct blob_attr *acl_group, *acl_perm;
+	int rem, rem2;
+
+	blob_buf_init(sig, 0);
+	blobmsg_add_u32(sig, "generation", acl_files_gen);
+
+	avl_for_each_element(&acl_files, file, avl) {
+		blob_for_each_attr(acl_group, file->acl.head, rem) {
+			blobmsg_for_each_attr(acl_perm, acl_group, rem2) {
+				if (blobmsg_type(acl_perm) != BLOBMSG_TYPE_TABLE)
+					continue;
+
+				if (strcmp(blobmsg_name(acl_perm), "read") &&
+					strcmp(blobmsg_name(acl_perm), "write"))
+					continue;
+
+				if (!rpc_login_test_permission(login, blobmsg_name(acl_perm),
+				                                      blobmsg_name(acl_group)))
+					continue;
+
+				blobmsg_add_string(sig, blobmsg_name(acl_group),
+				                   blobmsg_name(acl_perm));
+			}
+		}
+	}
+
+	return sig->head;
 }
 
 static int
-rpc_handle_login(struct ubus_context *ctx, struct ubus_object *obj,
-                 struct ubus_request_data *req, const char *method,
-                 struct blob_attr *msg)
+rpc_login_acl_signature_cmp(const void *k1, const void *k2, void *ptr)
 {
-	struct uci_context *uci = NULL;
-	struct uci_section *login;
-	struct rpc_session *ses;
-	struct blob_attr *tb[__RPC_L_MAX];
-	int timeout = RPC_DEFAULT_SESSION_TIMEOUT;
-	int rv = 0;
+	const struct blob_attr *a = k1, *b = k2;
 
-	blobmsg_parse(login_policy, __RPC_L_MAX, tb, blob_data(msg), blob_len(msg));
+	if (blob_pad_len(a) != blob_pad_len(b))
+		return (int)blob_pad_len(a) - (int)blob_pad_len(b);
 
-	if (!tb[RPC_L_USERNAME] || !tb[RPC_L_PASSWORD]) {
-		rv = UBUS_STATUS_INVALID_ARGUMENT;
-		goto out;
+	return memcmp(a, b, blob_pad_len(a));
+}
+
+static void
+rpc_login_setup_acls(struct rpc_session *ses, struct uci_section *login)
+{
+	static struct blob_buf sig;
+	struct rpc_session_acl_file *file;
+	struct rpc_session_acl_set *set;
+	struct blob_attr *key;
+
+	rpc_login_load_acl_files();
+
+	key = rpc_login_acl_signature(&sig, login);
+	set = avl_find_element(&acl_sets, key, set, avl);
+
+	if (set) {
+		set->refcount++;
 	}
+	else {
+		set = rpc_session_acls_new();
 
-	uci = uci_alloc_context();
+		if (!set)
+			return;
 
-	if (!uci) {
-		rv = UBUS_STATUS_UNKNOWN_ERROR;
-		goto out;
+		set->pooled = true;
+
+		avl_for_each_element(&acl_files, file, avl)
+			rpc_login_setup_acl_file(set, login, file);
+
+		set->avl.key = blob_memdup(key);
+
+		if (set->avl.key)
+			avl_insert(&acl_sets, &set->avl);
+	}
+
+	rpc_session_acls_unref(ses->acls);
+	ses->acls = set;
+	ses->acl_gen++;
+}
+
+static struct rpc_login_backoff *
+rpc_login_backoff_get(const char *username, bool create)
+{
+	struct rpc_login_backoff *bo;
+	char *new_name;
+
+	bo = avl_find_element(&login_backoff, username, bo, avl);
+
+	if (bo || !create)
+		return bo;
+
+	bo = calloc_a(sizeof(*bo), &new_name, strlen(username) + 1);
+
+	if (!bo)
+		return NULL;
+
+	bo->avl.key = strcpy(new_name, username);
+	avl_insert(&login_backoff, &bo->avl);
+
+	return bo;
+}
+
+static void
+rpc_login_backoff_put(struct rpc_login_backoff *bo)
+{
+	if (!bo->failures && !bo->pending) {
+		avl_delete(&login_backoff, &bo->avl);
+		free(bo);
 	}
+}
+
+static void
+rpc_login_backoff_update(struct rpc_login_backoff *bo, bool success)
+{
+	int delay;
+
+	if (success) {
+		bo->failures = 0;
+		bo->until = 0;
+	}
+	else {
+		if (bo->failures < 16)
+			bo->failures++;
+
+		delay = 1 << (bo->failures - 1);
+
+		if (delay > RPC_LOGIN_BACKOFF_MAX)
+			delay = RPC_LOGIN_BACKOFF_MAX;
+
+		bo->until = rpc_session_now() + delay;
+	}
+
+	rpc_login_backoff_put(bo);
+}
+
+static void
+rpc_login_job_free(struct rpc_login_job *job)
+{
+	if (job->password) {
+		memset(job->password, 0, strlen(job->password));
+		free(job->password);
+	}
+
+	uci_free_context(job->uci);
+	free(job);
+}
+
+/*
+ * Reply to the login request. Only a wrong password counts towards the
+ * backoff, internal errors and timeouts do not.
+ */
+static void
+rpc_login_job_complete(struct rpc_login_job *job, int rv)
+{
+	struct rpc_session *ses;
+
+	if (job->completed)
+		return;
+
+	job->completed = true;
+	uloop_timeout_cancel(&job->timeout_timer);
+
+	login_jobs--;
+	job->backoff->pending--;
+
+	if (!rv && job->match > 0 && job->match <= job->n_logins) {
+		ses = rpc_session_create(job->timeout);
 
-	login = rpc_login_test_login(uci, blobmsg_get_string(tb[RPC_L_USERNAME]),
-	                                  blobmsg_get_string(tb[RPC_L_PASSWORD]));
+		if (ses) {
+			rpc_login_setup_acls(ses, job->logins[job->match - 1]);
 
-	if (!login) {
+			blob_buf_init(&buf, 0);
+			blobmsg_add_string(&buf, "user", job->backoff->avl.key);
+			rpc_session_set(ses, "user", blob_data(buf.head));
+			rpc_session_dump(ses, job->ctx, &job->req);
+		}
+		else {
+			rv = UBUS_STATUS_UNKNOWN_ERROR;
+		}
+	}
+	else if (!rv) {
 		rv = UBUS_STATUS_PERMISSION_DENIED;
-		goto out;
 	}
 
-	if (tb[RPC_L_TIMEOUT])
-		timeout = blobmsg_get_u32(tb[RPC_L_TIMEOUT]);
+	if (!rv || rv == UBUS_STATUS_PERMISSION_DENIED)
+		rpc_login_backoff_update(job->backoff, !rv);
+	else
+		rpc_login_backoff_put(job->backoff);
 
-	ses = rpc_session_create(timeout);
+	rpc_stats_complete(job->ctx, &job->req, rv);
+}
 
-	if (!ses) {
-		rv = UBUS_STATUS_UNKNOWN_ERROR;
-		goto out;
+static void
+rpc_login_job_timeout_cb(struct uloop_timeout *t)
+{
+	struct rpc_login_job *job =
+		container_of(t, struct rpc_login_job, timeout_timer);
+
+	rpc_login_job_complete(job, UBUS_STATUS_TIMEOUT);
+}
+
+/*
+ * Password hashes are verified on the worker threads since crypt() and
+ * the shadow lookup are slow. A check exceeding RPC_LOGIN_TIMEOUT is
+ * answered with a timeout, the job itself is released once the worker
+ * returns.
+ */
+static int
+rpc_login_job_work(struct rpc_worker_job *w)
+{
+	struct rpc_login_job *job = container_of(w, struct rpc_login_job, work);
+	struct crypt_data *data;
+	int i, rv;
+
+	/* large with some libcs, too large for a thread stack */
+	data = calloc(1, sizeof(*data));
+
+	if (!data)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	for (i = 0; i < job->n_logins; i++) {
+		rv = rpc_login_test_password(job->hashes[i], job->password, data);
+
+		if (rv < 0) {
+			free(data);
+			return UBUS_STATUS_UNKNOWN_ERROR;
+		}
+
+		if (rv > 0) {
+			job->match = i + 1;
+			break;
+		}
 	}
 
-	rpc_login_setup_acls(ses, login);
+	free(data);
 
-	rpc_session_set(ses, "user", tb[RPC_L_USERNAME]);
-	rpc_session_dump(ses, ctx, req);
+	return UBUS_STATUS_OK;
+}
 
-out:
-	if (uci)
-		uci_free_context(uci);
+static void
+rpc_login_job_done(struct rpc_worker_job *w, int ret)
+{
+	struct rpc_login_job *job = container_of(w, struct rpc_login_job, work);
 
-	return rv;
+	login_workers--;
+	rpc_login_job_complete(job, ret);
+	rpc_login_job_free(job);
+
+	rpc_login_job_run();
 }
 
+static void
+rpc_login_job_run(void)
+{
+	struct rpc_login_job *job;
 
-static bool
-rpc_validate_sid(const char *id)
+	while (login_workers < RPC_LOGIN_WORKERS && !list_empty(&login_queue)) {
+		job = list_first_entry(&login_queue, struct rpc_login_job, list);
+		list_del(&job->list);
+
+		job->work.run = rpc_login_job_work;
+		job->work.done = rpc_login_job_done;
+
+		if (rpc_worker_submit(&job->work, NULL, NULL)) {
+			rpc_login_job_complete(job, UBUS_STATUS_UNKNOWN_ERROR);
+			rpc_login_job_free(job);
+			continue;
+		}
+
+		login_workers++;
+
+		job->timeout_timer.cb = rpc_login_job_timeout_cb;
+		uloop_timeout_set(&job->timeout_timer, RPC_LOGIN_TIMEOUT);
+	}
+}
+
+static int
+rpc_handle_login(struct ubus_context *ctx, struct ubus_object *obj,
+                 struct ubus_request_data *req, const char *method,
+                 struct blob_attr *msg)
 {
-	if (!id)
-		return false;
+	struct rpc_login_job *job;
+	struct rpc_login_backoff *bo;
+	struct blob_attr *tb[__RPC_L_MAX];
+	const char *username;
 
-	if (strlen(id) != RPC_SID_LEN)
-		return false;
+	blobmsg_parse(login_policy, __RPC_L_MAX, tb, blob_data(msg), blob_len(msg));
 
-	while (*id)
-		if (!isxdigit(*id++))
-			return false;
+	if (!tb[RPC_L_USERNAME] || !tb[RPC_L_PASSWORD])
+		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	return true;
+	username = blobmsg_get_string(tb[RPC_L_USERNAME]);
+
+	bo = rpc_login_backoff_get(username, false);
+
+	if (bo && (bo->until > rpc_session_now() ||
+	           bo->pending >= RPC_LOGIN_USER_PENDING))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (login_jobs >= RPC_LOGIN_QUEUE)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	job = calloc(1, sizeof(*job));
+
+	if (!job)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	job->uci = uci_alloc_context();
+	job->password = strdup(blobmsg_get_string(tb[RPC_L_PASSWORD]));
+
+	if (job->uci && config_dir)
+		uci_set_confdir(job->uci, config_dir);
+
+	if (!job->uci || !job->password) {
+		if (job->uci)
+			uci_free_context(job->uci);
+
+		free(job->password);
+		free(job);
+
+		return UBUS_STATUS_UNKNOWN_ERROR;
+	}
+
+	job->n_logins = rpc_login_find_logins(job->uci, username,
+	                                      job->logins, job->hashes);
+
+	if (!job->n_logins || !(bo = rpc_login_backoff_get(username, true))) {
+		rpc_login_job_free(job);
+		return UBUS_STATUS_PERMISSION_DENIED;
+	}
+
+	job->ctx = ctx;
+	job->backoff = bo;
+	job->timeout = RPC_DEFAULT_SESSION_TIMEOUT;
+
+	if (tb[RPC_L_TIMEOUT])
+		job->timeout = blobmsg_get_u32(tb[RPC_L_TIMEOUT]);
+
+	bo->pending++;
+	login_jobs++;
+
+	ubus_defer_request(ctx, req, &job->req);
+	list_add_tail(&job->list, &login_queue);
+
+	rpc_login_job_run();
+
+	return 0;
 }
 
+
 static int
 rpc_blob_to_file(const char *path, struct blob_attr *attr)
 {
@@ -1181,60 +2209,50 @@ rpc_blob_to_file(const char *path, struct blob_attr *attr)
 	return len;
 }
 
-static struct blob_attr *
-rpc_blob_from_file(const char *path)
+static struct rpc_session_acl_set *
+rpc_session_acls_from_blob(struct blob_attr *attr)
 {
-	int fd = -1, len;
-	struct stat s;
-	struct blob_attr head, *attr = NULL;
-
-	if (stat(path, &s) || !S_ISREG(s.st_mode))
-		return NULL;
-
-	fd = open(path, O_RDONLY);
-
-	if (fd < 0)
-		goto fail;
-
-	len = read(fd, &head, sizeof(head));
-
-	if (len != sizeof(head) || blob_pad_len(&head) != s.st_size)
-		goto fail;
+	int rem1, rem2, rem3;
+	struct blob_attr *scope, *object, *function;
+	struct rpc_session_acl_set *set;
 
-	attr = calloc(1, s.st_size);
+	set = rpc_session_acls_new();
 
-	if (!attr)
-		goto fail;
-
-	memcpy(attr, &head, sizeof(head));
-
-	len += read(fd, (char *)attr + sizeof(head), s.st_size - sizeof(head));
+	if (!set)
+		return NULL;
 
-	if (len != blob_pad_len(&head))
-		goto fail;
+	set->pooled = true;
 
-	close(fd);
+	blobmsg_for_each_attr(scope, attr, rem1) {
+		if (blobmsg_type(scope) != BLOBMSG_TYPE_TABLE)
+			continue;
 
-	return attr;
+		blobmsg_for_each_attr(object, scope, rem2) {
+			if (blobmsg_type(object) != BLOBMSG_TYPE_ARRAY)
+				continue;
 
-fail:
-	if (fd >= 0)
-		close(fd);
+			blobmsg_for_each_attr(function, object, rem3) {
+				if (blobmsg_type(function) != BLOBMSG_TYPE_STRING)
+					continue;
 
-	if (attr)
-		free(attr);
+				rpc_session_acls_grant(set, blobmsg_name(scope),
+				                       blobmsg_name(object),
+				                       blobmsg_data(function));
+			}
+		}
+	}
 
-	return NULL;
+	return set;
 }
 
 static bool
-rpc_session_from_blob(struct uci_context *uci, struct blob_attr *attr)
+rpc_session_from_blob(struct blob_attr *attr,
+                      struct rpc_session_acl_set **sets, int n_sets)
 {
 	int i, rem;
-	const char *user = NULL;
 	struct rpc_session *ses;
-	struct uci_section *login;
 	struct blob_attr *tb[__RPC_DUMP_MAX], *data;
+	uint8_t raw[RPC_SID_RAW_LEN];
 
 	blobmsg_parse(dump_policy, __RPC_DUMP_MAX, tb,
 	              blob_data(attr), blob_len(attr));
@@ -1243,38 +2261,64 @@ rpc_session_from_blob(struct uci_context *uci, struct blob_attr *attr)
 		if (!tb[i])
 			return false;
 
+	if (!rpc_session_id_parse(blobmsg_data(tb[RPC_DUMP_SID]), raw) ||
+	    rpc_session_get(blobmsg_data(tb[RPC_DUMP_SID])))
+		return false;
+
 	ses = rpc_session_new();
 
 	if (!ses)
 		return false;
 
-	memcpy(ses->id, blobmsg_data(tb[RPC_DUMP_SID]), RPC_SID_LEN);
+	memcpy(ses->raw, raw, sizeof(raw));
+	rpc_session_id_format(ses->raw, ses->id);
 
 	ses->timeout = blobmsg_get_u32(tb[RPC_DUMP_TIMEOUT]);
 
-	blobmsg_for_each_attr(data, tb[RPC_DUMP_DATA], rem) {
+	blobmsg_for_each_attr(data, tb[RPC_DUMP_DATA], rem)
 		rpc_session_set(ses, blobmsg_name(data), data);
 
-		if (!strcmp(blobmsg_name(data), "username"))
-			user = blobmsg_get_string(data);
-	}
+	i = blobmsg_get_u32(tb[RPC_DUMP_ACL]);
 
-	if (uci && user) {
-		login = rpc_login_test_login(uci, user, NULL);
-		if (login)
-			rpc_login_setup_acls(ses, login);
+	if (i > 0 && i <= n_sets && sets[i - 1]) {
+		ses->acls = sets[i - 1];
+		ses->acls->refcount++;
+		ses->acl_gen++;
 	}
 
-	avl_insert(&sessions, &ses->avl);
+	rpc_session_insert(ses);
+
+	ses->touched = rpc_session_now() - ses->timeout +
+	               blobmsg_get_u32(tb[RPC_DUMP_EXPIRES]);
 
-	uloop_timeout_set(&ses->t, blobmsg_get_u32(tb[RPC_DUMP_EXPIRES]) * 1000);
+	rpc_session_schedule(ses);
 
 	return true;
 }
 
+/*
+ * Override the UCI configuration directory used to look up logins, the
+ * ACL directory and the runtime directory holding the SIGHUP snapshot,
+ * NULL keeps the built-in default.
+ */
+void rpc_session_dirs(const char *confdir, const char *acldir,
+                      const char *rundir)
+{
+	if (confdir)
+		config_dir = confdir;
+
+	if (acldir)
+		snprintf(acl_pattern, sizeof(acl_pattern), "%s/*.json", acldir);
+
+	if (rundir)
+		snprintf(snapshot_path, sizeof(snapshot_path),
+		         "%s/sessions.snapshot", rundir);
+}
+
 int rpc_session_api_init(struct ubus_context *ctx)
 {
 	struct rpc_session *ses;
+	int i;
 
 	static const struct ubus_method session_methods[] = {
 		UBUS_METHOD("create",  rpc_handle_create,  new_policy),
@@ -1299,15 +2343,26 @@ int rpc_session_api_init(struct ubus_context *ctx)
 		.n_methods = ARRAY_SIZE(session_methods),
 	};
 
-	avl_init(&sessions, avl_strcmp, false, NULL);
+	for (i = 0; i < RPC_SESSION_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&sessions[i]);
+
+	avl_init(&acl_files, avl_strcmp, false, NULL);
+	avl_init(&acl_sets, rpc_login_acl_signature_cmp, false, NULL);
+	avl_init(&login_backoff, avl_strcmp, false, NULL);
+
+	for (i = 0; i < RPC_SESSION_WHEEL_SLOTS; i++)
+		INIT_LIST_HEAD(&expiry_wheel[i]);
+
+	expiry_timer.cb = rpc_session_sweep;
 
 	/* setup the default session */
 	ses = rpc_session_new();
 
 	if (ses) {
 		strcpy(ses->id, RPC_DEFAULT_SESSION_ID);
+		rpc_session_id_parse(ses->id, ses->raw);
 		rpc_login_setup_acls(ses, NULL);
-		avl_insert(&sessions, &ses->avl);
+		rpc_session_insert(ses);
 	}
 
 	return ubus_add_object(ctx, &obj);
@@ -1321,7 +2376,31 @@ bool rpc_session_access(const char *sid, const char *scope,
 	if (!ses)
 		return false;
 
-	return rpc_session_acl_allowed(ses, scope, object, function);
+	return rpc_session_acl_allowed(ses, scope, object, function, NULL);
+}
+
+int rpc_session_access_batch(const char *sid,
+                             struct rpc_session_access_check *checks,
+                             int n_checks)
+{
+	struct rpc_session_acl_hint hint = { };
+	struct rpc_session *ses = rpc_session_get(sid);
+	int i, n_allowed = 0;
+
+	if (!ses)
+		return -1;
+
+	for (i = 0; i < n_checks; i++) {
+		checks[i].allow = rpc_session_acl_allowed(ses, checks[i].scope,
+		                                          checks[i].object,
+		                                          checks[i].function,
+		                                          &hint);
+
+		if (checks[i].allow)
+			n_allowed++;
+	}
+
+	return n_allowed;
 }
 
 void rpc_session_create_cb(struct rpc_session_cb *cb)
@@ -1336,62 +2415,127 @@ void rpc_session_destroy_cb(struct rpc_session_cb *cb)
 		list_add(&cb->list, &destroy_callbacks);
 }
 
+/*
+ * The snapshot is a single blob holding a format version, the distinct
+ * ACL sets in use and the sessions referring to them by their 1-based
+ * index. It is written on SIGHUP and consumed by the respawned process,
+ * which restores sessions without reparsing acl.d or the rpcd config.
+ */
 void rpc_session_freeze(void)
 {
-	struct stat s;
 	struct rpc_session *ses;
-	char path[PATH_MAX];
+	void *c, *d, *e;
+	uint32_t n_sets = 0;
+	int i;
+
+	blob_buf_init(&buf, 0);
+	blobmsg_add_u32(&buf, "version", RPC_SESSION_SNAPSHOT_VERSION);
+
+	rpc_session_for_each(i, ses)
+		if (ses->acls)
+			ses->acls->index = 0;
+
+	c = blobmsg_open_array(&buf, "acls");
+
+	rpc_session_for_each(i, ses) {
+		if (!ses->acls || ses->acls->index)
+			continue;
+
+		ses->acls->index = ++n_sets;
+
+		d = blobmsg_open_table(&buf, NULL);
+		rpc_session_dump_acls(ses, &buf);
+		blobmsg_close_table(&buf, d);
+	}
 
-	if (stat(RPC_SESSION_DIRECTORY, &s))
-		mkdir(RPC_SESSION_DIRECTORY, 0700);
+	blobmsg_close_array(&buf, c);
 
-	avl_for_each_element(&sessions, ses, avl) {
+	c = blobmsg_open_array(&buf, "sessions");
+
+	rpc_session_for_each(i, ses) {
 		/* skip default session */
 		if (!strcmp(ses->id, RPC_DEFAULT_SESSION_ID))
 			continue;
 
-		snprintf(path, sizeof(path) - 1, RPC_SESSION_DIRECTORY "/%s", ses->id);
-		rpc_session_to_blob(ses, false);
-		rpc_blob_to_file(path, buf.head);
+		d = blobmsg_open_table(&buf, NULL);
+
+		blobmsg_add_string(&buf, "ubus_rpc_session", ses->id);
+		blobmsg_add_u32(&buf, "timeout", ses->timeout);
+		blobmsg_add_u32(&buf, "expires", rpc_session_remaining(ses));
+		blobmsg_add_u32(&buf, "acl", ses->acls ? ses->acls->index : 0);
+
+		e = blobmsg_open_table(&buf, "data");
+		rpc_session_dump_data(ses, &buf);
+		blobmsg_close_table(&buf, e);
+
+		blobmsg_close_table(&buf, d);
 	}
+
+	blobmsg_close_array(&buf, c);
+
+	unlink(snapshot_path);
+	rpc_blob_to_file(snapshot_path, buf.head);
 }
 
 void rpc_session_thaw(void)
 {
-	DIR *d;
-	char path[PATH_MAX];
-	struct dirent *e;
-	struct blob_attr *attr;
-	struct uci_context *uci;
+	int fd, i, rem, n_sets = 0;
+	struct stat s;
+	struct blob_attr *head, *tb[__RPC_SNAPSHOT_MAX], *cur;
+	struct rpc_session_acl_set **sets = NULL;
 
-	d = opendir(RPC_SESSION_DIRECTORY);
+	fd = open(snapshot_path, O_RDONLY);
 
-	if (!d)
+	if (fd < 0)
 		return;
 
-	uci = uci_alloc_context();
+	unlink(snapshot_path);
 
-	if (!uci)
+	if (fstat(fd, &s) || !S_ISREG(s.st_mode) ||
+	    s.st_size < sizeof(struct blob_attr)) {
+		close(fd);
 		return;
+	}
 
-	while ((e = readdir(d)) != NULL) {
-		if (!rpc_validate_sid(e->d_name))
-			continue;
+	head = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-		snprintf(path, sizeof(path) - 1,
-		         RPC_SESSION_DIRECTORY "/%s", e->d_name);
+	if (head == MAP_FAILED)
+		return;
 
-		attr = rpc_blob_from_file(path);
+	if (blob_pad_len(head) > s.st_size)
+		goto out;
 
-		if (attr) {
-			rpc_session_from_blob(uci, attr);
-			free(attr);
-		}
+	blobmsg_parse(snapshot_policy, __RPC_SNAPSHOT_MAX, tb,
+	              blob_data(head), blob_len(head));
 
-		unlink(path);
+	if (!tb[RPC_SNAPSHOT_VERSION] || !tb[RPC_SNAPSHOT_ACLS] ||
+	    !tb[RPC_SNAPSHOT_SESSIONS] ||
+	    blobmsg_get_u32(tb[RPC_SNAPSHOT_VERSION]) != RPC_SESSION_SNAPSHOT_VERSION)
+		goto out;
+
+	n_sets = blobmsg_check_array(tb[RPC_SNAPSHOT_ACLS], BLOBMSG_TYPE_TABLE);
+
+	if (n_sets > 0) {
+		sets = calloc(n_sets, sizeof(*sets));
+
+		if (!sets)
+			goto out;
+
+		i = 0;
+		blobmsg_for_each_attr(cur, tb[RPC_SNAPSHOT_ACLS], rem)
+			sets[i++] = rpc_session_acls_from_blob(cur);
 	}
 
-	closedir(d);
+	blobmsg_for_each_attr(cur, tb[RPC_SNAPSHOT_SESSIONS], rem)
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_TABLE)
+			rpc_session_from_blob(cur, sets, n_sets);
 
-	uci_free_context(uci);
+	for (i = 0; i < n_sets; i++)
+		rpc_session_acls_unref(sets[i]);
+
+	free(sets);
+
+out:
+	munmap(head, s.st_size);
 }
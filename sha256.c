@@ -0,0 +1,149 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include <rpcd/sha256.h>
+
+/* FIPS 180-4 */
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+rpc_sha256_block(rpc_sha256_ctx_t *ctx, const uint8_t *p)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+		       ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	memcpy(s, ctx->state, sizeof(s));
+
+	for (i = 0; i < 64; i++)
+	{
+		t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		memmove(&s[1], &s[0], 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->state[i] += s[i];
+}
+
+void
+rpc_sha256_begin(rpc_sha256_ctx_t *ctx)
+{
+	static const uint32_t init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, init, sizeof(init));
+	ctx->len = 0;
+}
+
+void
+rpc_sha256_hash(const void *data, size_t length, rpc_sha256_ctx_t *ctx)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->len % 64, n;
+
+	ctx->len += length;
+
+	if (used)
+	{
+		n = (length < 64 - used) ? length : 64 - used;
+		memcpy(ctx->buffer + used, p, n);
+
+		p += n;
+		length -= n;
+
+		if (used + n < 64)
+			return;
+
+		rpc_sha256_block(ctx, ctx->buffer);
+	}
+
+	for (; length >= 64; p += 64, length -= 64)
+		rpc_sha256_block(ctx, p);
+
+	memcpy(ctx->buffer, p, length);
+}
+
+void
+rpc_sha256_end(void *resbuf, rpc_sha256_ctx_t *ctx)
+{
+	uint64_t bits = ctx->len * 8;
+	size_t used = ctx->len % 64;
+	uint8_t *out = resbuf;
+	int i;
+
+	ctx->buffer[used++] = 0x80;
+
+	if (used > 56)
+	{
+		memset(ctx->buffer + used, 0, 64 - used);
+		rpc_sha256_block(ctx, ctx->buffer);
+		used = 0;
+	}
+
+	memset(ctx->buffer + used, 0, 56 - used);
+
+	for (i = 0; i < 8; i++)
+		ctx->buffer[56 + i] = bits >> (56 - i * 8);
+
+	rpc_sha256_block(ctx, ctx->buffer);
+
+	for (i = 0; i < 8; i++)
+	{
+		out[i * 4]     = ctx->state[i] >> 24;
+		out[i * 4 + 1] = ctx->state[i] >> 16;
+		out[i * 4 + 2] = ctx->state[i] >> 8;
+		out[i * 4 + 3] = ctx->state[i];
+	}
+}
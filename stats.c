@@ -0,0 +1,398 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <time.h>
+
+#include <libubox/blobmsg.h>
+#include <libubox/utils.h>
+
+#include <rpcd/stats.h>
+
+/*
+ * Statistics are collected by replacing the method table of every object
+ * registered on the context with a copy pointing to a common handler which
+ * times the original one. When disabled, the method tables are left alone
+ * and no instrumentation code runs at all.
+ */
+
+struct rpc_stats_pending {
+	struct list_head list;
+	struct rpc_stats_method *method;
+	uint32_t object;
+	uint32_t peer;
+	uint16_t seq;
+	uint64_t start;
+};
+
+static struct blob_buf buf;
+static struct avl_tree objects;
+static LIST_HEAD(pending);
+static int n_pending = 0;
+static struct rpc_stats_method exec[__RPC_STATS_EXEC_MAX] = {
+	[RPC_STATS_EXEC_SPAWN] = { .name = "spawn" },
+	[RPC_STATS_EXEC_QUEUE] = { .name = "queue" },
+	[RPC_STATS_EXEC_RUN]   = { .name = "run" },
+};
+static bool enabled = false;
+
+static int
+rpc_stats_ptr_cmp(const void *k1, const void *k2, void *ptr)
+{
+	if (k1 == k2)
+		return 0;
+
+	return (k1 < k2) ? -1 : 1;
+}
+
+static uint64_t
+rpc_stats_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+rpc_stats_record(struct rpc_stats_method *m, int ret, uint64_t start)
+{
+	uint64_t usec = rpc_stats_usec() - start;
+	int bucket = 0;
+
+	m->calls++;
+	m->total_usec += usec;
+
+	if (usec > m->max_usec)
+		m->max_usec = (usec > UINT32_MAX) ? UINT32_MAX : usec;
+
+	if (ret > UBUS_STATUS_OK && ret < __UBUS_STATUS_LAST)
+		m->errors[ret]++;
+
+	while (bucket < RPC_STATS_BUCKETS - 1 && (usec >> bucket))
+		bucket++;
+
+	m->histogram[bucket]++;
+}
+
+static struct rpc_stats_method *
+rpc_stats_find_method(struct ubus_object *obj, const char *method)
+{
+	struct rpc_stats_object *o;
+	int i;
+
+	o = avl_find_element(&objects, obj, o, avl);
+
+	if (!o)
+		return NULL;
+
+	for (i = 0; i < o->n_methods; i++)
+		if (!strcmp(o->stats[i].name, method))
+			return &o->stats[i];
+
+	return NULL;
+}
+
+static void
+rpc_stats_pending_free(struct rpc_stats_pending *p)
+{
+	p->method->inflight--;
+
+	list_del(&p->list);
+	free(p);
+	n_pending--;
+}
+
+/*
+ * Deferred calls are only accounted when they are completed through
+ * rpc_stats_complete(), i.e. the complete_deferred op of plugins. Calls
+ * of plugins completing them directly are dropped untimed once they are
+ * older than any ubus caller waits, or to make room for new ones.
+ */
+static void
+rpc_stats_pending_expire(uint64_t now)
+{
+	struct rpc_stats_pending *p, *tmp;
+
+	list_for_each_entry_safe(p, tmp, &pending, list) {
+		if (n_pending < RPC_STATS_MAX_PENDING &&
+		    now - p->start < RPC_STATS_PENDING_TIMEOUT * 1000ULL)
+			break;
+
+		rpc_stats_pending_free(p);
+	}
+}
+
+static int
+rpc_stats_handle(struct ubus_context *ctx, struct ubus_object *obj,
+                 struct ubus_request_data *req, const char *method,
+                 struct blob_attr *msg)
+{
+	struct rpc_stats_method *m = rpc_stats_find_method(obj, method);
+	struct rpc_stats_pending *p;
+	uint64_t start;
+	int rv;
+
+	if (!m)
+		return UBUS_STATUS_METHOD_NOT_FOUND;
+
+	start = rpc_stats_usec();
+	rv = m->handler(ctx, obj, req, method, msg);
+
+	if (!req->deferred) {
+		rpc_stats_record(m, rv, start);
+		return rv;
+	}
+
+	rpc_stats_pending_expire(start);
+
+	p = calloc(1, sizeof(*p));
+
+	if (p) {
+		p->method = m;
+		p->object = req->object;
+		p->peer = req->peer;
+		p->seq = req->seq;
+		p->start = start;
+
+		list_add_tail(&p->list, &pending);
+		m->inflight++;
+		n_pending++;
+	}
+
+	return rv;
+}
+
+void
+rpc_stats_complete(struct ubus_context *ctx, struct ubus_request_data *req,
+                   int ret)
+{
+	struct rpc_stats_pending *p;
+
+	if (enabled) {
+		list_for_each_entry(p, &pending, list) {
+			if (p->object != req->object || p->peer != req->peer ||
+			    p->seq != req->seq)
+				continue;
+
+			rpc_stats_record(p->method, ret, p->start);
+			rpc_stats_pending_free(p);
+			break;
+		}
+	}
+
+	ubus_complete_deferred_request(ctx, req, ret);
+}
+
+/*
+ * Time the phases of child processes, the launch itself, the time spent
+ * waiting for admission and the run time. They are reported below "exec"
+ * next to the object statistics.
+ */
+uint64_t
+rpc_stats_exec_begin(void)
+{
+	return enabled ? rpc_stats_usec() : 0;
+}
+
+void
+rpc_stats_exec_end(enum rpc_stats_exec type, uint64_t start, int ret)
+{
+	if (enabled && start)
+		rpc_stats_record(&exec[type], ret, start);
+}
+
+int
+rpc_stats_wrap_object(struct ubus_object *obj)
+{
+	struct rpc_stats_object *o;
+	struct ubus_method *methods;
+	int i;
+
+	if (!enabled || avl_find(&objects, obj))
+		return 0;
+
+	o = calloc_a(sizeof(*o) + obj->n_methods * sizeof(o->stats[0]),
+	             &methods, obj->n_methods * sizeof(*methods));
+
+	if (!o)
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	for (i = 0; i < obj->n_methods; i++) {
+		methods[i] = obj->methods[i];
+		methods[i].handler = rpc_stats_handle;
+
+		o->stats[i].name = obj->methods[i].name;
+		o->stats[i].handler = obj->methods[i].handler;
+	}
+
+	o->obj = obj;
+	o->methods = methods;
+	o->n_methods = obj->n_methods;
+	o->avl.key = obj;
+	avl_insert(&objects, &o->avl);
+
+	obj->methods = methods;
+
+	return 0;
+}
+
+static void
+rpc_stats_dump_method(struct rpc_stats_method *m)
+{
+	char code[4];
+	void *c;
+	int i;
+
+	blobmsg_add_u32(&buf, "calls", m->calls);
+	blobmsg_add_u32(&buf, "inflight", m->inflight);
+	blobmsg_add_u64(&buf, "total_usec", m->total_usec);
+	blobmsg_add_u32(&buf, "max_usec", m->max_usec);
+
+	c = blobmsg_open_table(&buf, "errors");
+
+	for (i = UBUS_STATUS_OK + 1; i < __UBUS_STATUS_LAST; i++) {
+		if (!m->errors[i])
+			continue;
+
+		snprintf(code, sizeof(code), "%d", i);
+		blobmsg_add_u32(&buf, code, m->errors[i]);
+	}
+
+	blobmsg_close_table(&buf, c);
+
+	c = blobmsg_open_array(&buf, "histogram");
+
+	for (i = 0; i < RPC_STATS_BUCKETS; i++)
+		blobmsg_add_u32(&buf, NULL, m->histogram[i]);
+
+	blobmsg_close_array(&buf, c);
+}
+
+static int
+rpc_stats_handle_stats(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+	struct rpc_stats_object *o;
+	void *c, *d, *e;
+	int i;
+
+	blob_buf_init(&buf, 0);
+	blobmsg_add_u8(&buf, "enabled", enabled);
+
+	c = blobmsg_open_table(&buf, "objects");
+
+	avl_for_each_element(&objects, o, avl) {
+		d = blobmsg_open_table(&buf, o->obj->name);
+
+		for (i = 0; i < o->n_methods; i++) {
+			e = blobmsg_open_table(&buf, o->stats[i].name);
+			rpc_stats_dump_method(&o->stats[i]);
+			blobmsg_close_table(&buf, e);
+		}
+
+		blobmsg_close_table(&buf, d);
+	}
+
+	blobmsg_close_table(&buf, c);
+
+	c = blobmsg_open_table(&buf, "exec");
+
+	for (i = 0; i < __RPC_STATS_EXEC_MAX; i++) {
+		d = blobmsg_open_table(&buf, exec[i].name);
+		rpc_stats_dump_method(&exec[i]);
+		blobmsg_close_table(&buf, d);
+	}
+
+	blobmsg_close_table(&buf, c);
+
+	ubus_send_reply(ctx, req, buf.head);
+
+	return 0;
+}
+
+static int
+rpc_stats_handle_reset(struct ubus_context *ctx, struct ubus_object *obj,
+                       struct ubus_request_data *req, const char *method,
+                       struct blob_attr *msg)
+{
+	struct rpc_stats_object *o;
+	struct rpc_stats_method *m;
+	uint32_t inflight;
+	int i;
+
+	avl_for_each_element(&objects, o, avl) {
+		for (i = 0; i < o->n_methods; i++) {
+			m = &o->stats[i];
+			inflight = m->inflight;
+
+			memset(&m->calls, 0, sizeof(*m) -
+			       offsetof(struct rpc_stats_method, calls));
+
+			m->inflight = inflight;
+		}
+	}
+
+	for (i = 0; i < __RPC_STATS_EXEC_MAX; i++) {
+		m = &exec[i];
+		inflight = m->inflight;
+
+		memset(&m->calls, 0, sizeof(*m) -
+		       offsetof(struct rpc_stats_method, calls));
+
+		m->inflight = inflight;
+	}
+
+	return 0;
+}
+
+int rpc_stats_api_init(struct ubus_context *ctx, bool enable)
+{
+	struct ubus_object *cur;
+	int rv;
+
+	static const struct ubus_method stats_methods[] = {
+		UBUS_METHOD_NOARG("stats", rpc_stats_handle_stats),
+		UBUS_METHOD_NOARG("reset", rpc_stats_handle_reset),
+	};
+
+	static struct ubus_object_type stats_type =
+		UBUS_OBJECT_TYPE("luci-rpc-stats", stats_methods);
+
+	static struct ubus_object obj = {
+		.name = "rpcd",
+		.type = &stats_type,
+		.methods = stats_methods,
+		.n_methods = ARRAY_SIZE(stats_methods),
+	};
+
+	avl_init(&objects, rpc_stats_ptr_cmp, false, NULL);
+	enabled = enable;
+
+	if (enabled) {
+		avl_for_each_element(&ctx->objects, cur, avl) {
+			rv = rpc_stats_wrap_object(cur);
+
+			if (rv)
+				return rv;
+		}
+	}
+
+	return ubus_add_object(ctx, &obj);
+}
@@ -16,9 +16,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE	/* copy_file_range() */
+
 #include <libgen.h>
 #include <glob.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
+#include <libubox/avl-cmp.h>
 #include <libubox/blobmsg.h>
 #include <libubox/blobmsg_json.h>
 
@@ -28,16 +34,158 @@
 
 static struct blob_buf buf;
 static struct uci_context *cursor;
+static struct uci_context *cursor_default;
 static struct uloop_timeout apply_timer;
 static struct ubus_context *apply_ctx;
 static char apply_sid[RPC_SID_LEN + 1];
 
+/* directories in use, see rpc_uci_dirs() */
+static char config_dir[PATH_MAX] = RPC_UCI_DIR;
+static char savedir_prefix[PATH_MAX] = RPC_UCI_SAVEDIR_PREFIX;
+static char snapshot_files[PATH_MAX] = RPC_SNAPSHOT_FILES;
+static char snapshot_delta[PATH_MAX] = RPC_SNAPSHOT_DELTA;
+
+/* configs saved below snapshot_files and snapshot_delta */
+struct rpc_uci_snapshot {
+	struct list_head list;
+	char config[];
+};
+
+static LIST_HEAD(snapshots);
+
+/*
+ * UCI contexts bound to the delta directory of one session each, most
+ * recently used first. The global cursor points to one of these or to
+ * cursor_default for calls without session or when the pool is disabled.
+ */
+struct rpc_uci_context {
+	struct list_head list;
+	struct uci_context *uci;
+	char savedir[];
+};
+
+static LIST_HEAD(contexts);
+static int context_count = 0;
+static int context_max = RPC_UCI_CONTEXT_POOL_SIZE;
+static struct rpc_uci_context *context;
+
+/*
+ * Packages kept loaded in pooled contexts between calls, most recently used
+ * first across all contexts. A retained package is only handed out again if
+ * its config and delta files are unchanged. Their number is capped by the
+ * pool size as well.
+ */
+struct rpc_uci_retained {
+	struct list_head list;
+	struct rpc_uci_context *c;
+	struct uci_package *p;
+	struct stat conf;
+	struct stat delta;
+};
+
+static LIST_HEAD(retained);
+static int retained_count = 0;
+
+/*
+ * Packages loaded for reading are kept in their own UCI context each, keyed
+ * by package name and delta directory. An entry is reused as long as the
+ * config file and the delta file are unchanged and no write operation went
+ * through rpcd in the meanwhile.
+ */
+struct rpc_uci_cache_entry {
+	struct list_head list;
+	struct uci_context *uci;
+	struct uci_package *p;
+	char *package;
+	char *savedir;
+	struct stat conf;
+	struct stat delta;
+	bool types_indexed;
+	struct avl_tree types;
+	struct avl_tree values;
+	struct avl_tree options;
+};
+
+/*
+ * Secondary indexes of cached packages, mapping a section type or an
+ * "option=value" token to the sections carrying it, in package order.
+ * They are built on the first filtered query and live as long as the
+ * cache entry itself.
+ */
+struct rpc_uci_index_ref {
+	struct uci_section *s;
+	int index;
+};
+
+struct rpc_uci_index_node {
+	struct avl_node avl;
+	int n_refs;
+	int size;
+	struct rpc_uci_index_ref *refs;
+};
+
+static LIST_HEAD(cache_entries);
+static int cache_count = 0;
+
+/*
+ * Change tracking behind the "since" tokens of uci.get and uci.changes.
+ * Each (delta directory, package) pair which was queried with a token gets
+ * a view remembering a hash and a generation per section. Generations are
+ * drawn from one counter and only ever grow while rpcd runs, tokens combine
+ * the counter with the startup time so stale tokens of a previous instance
+ * are never mistaken for current ones.
+ *
+ * A token is (epoch << 32) | generation with the epoch being the low 21
+ * bits of the startup time, which keeps it within the 53 bits a JSON
+ * number survives in JavaScript clients.
+ */
+struct rpc_uci_view_section {
+	struct avl_node avl;
+	uint32_t hash;
+	uint32_t gen;
+	bool removed;
+	bool seen;
+};
+
+struct rpc_uci_view {
+	struct avl_node avl;
+	char *package;
+	char *savedir;
+	bool dirty;
+	bool changes_dirty;
+	struct stat conf;
+	struct stat delta;
+	struct stat changes;
+	uint32_t base;
+	uint32_t gen;
+	uint32_t changes_gen;
+	int n_removed;
+	struct avl_tree sections;
+};
+
+static struct avl_tree views;
+static uint32_t generation = 0;
+static uint32_t generation_epoch = 0;
+
+#define RPC_UCI_EPOCH_BITS	21
+
+/* pending config.change notifications, keyed by package name */
+struct rpc_uci_event {
+	struct avl_node avl;
+};
+
+static struct ubus_context *event_ctx;
+static struct avl_tree events;
+static struct uloop_timeout event_timer;
+static uint32_t service_id = 0;
+
 enum {
 	RPC_G_CONFIG,
 	RPC_G_SECTION,
 	RPC_G_OPTION,
 	RPC_G_TYPE,
 	RPC_G_MATCH,
+	RPC_G_SINCE,
 	RPC_G_SESSION,
 	__RPC_G_MAX,
 };
@@ -48,6 +196,7 @@ static const struct blobmsg_policy rpc_uci_get_policy[__RPC_G_MAX] = {
 	[RPC_G_OPTION]  = { .name = "option",  .type = BLOBMSG_TYPE_STRING },
 	[RPC_G_TYPE]    = { .name = "type",    .type = BLOBMSG_TYPE_STRING },
 	[RPC_G_MATCH]   = { .name = "match",   .type = BLOBMSG_TYPE_TABLE  },
+	[RPC_G_SINCE]   = { .name = "since",   .type = BLOBMSG_TYPE_INT64  },
 	[RPC_G_SESSION] = { .name = "ubus_rpc_session",
 	                                       .type = BLOBMSG_TYPE_STRING },
 };
@@ -144,6 +293,40 @@ static const struct blobmsg_policy rpc_uci_order_policy[__RPC_O_MAX] = {
 	                                         .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+	RPC_BA_OPERATIONS,
+	RPC_BA_SESSION,
+	__RPC_BA_MAX,
+};
+
+static const struct blobmsg_policy rpc_uci_batch_policy[__RPC_BA_MAX] = {
+	[RPC_BA_OPERATIONS] = { .name = "operations", .type = BLOBMSG_TYPE_ARRAY },
+	[RPC_BA_SESSION]    = { .name = "ubus_rpc_session",
+	                                              .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_BO_METHOD,
+	RPC_BO_CONFIG,
+	__RPC_BO_MAX,
+};
+
+static const struct blobmsg_policy rpc_uci_batch_op_policy[__RPC_BO_MAX] = {
+	[RPC_BO_METHOD] = { .name = "method",  .type = BLOBMSG_TYPE_STRING },
+	[RPC_BO_CONFIG] = { .name = "config",  .type = BLOBMSG_TYPE_STRING },
+};
+
+enum {
+	RPC_OE_ID,
+	RPC_OE_PATH,
+	__RPC_OE_MAX,
+};
+
+static const struct blobmsg_policy rpc_uci_object_event_policy[__RPC_OE_MAX] = {
+	[RPC_OE_ID]   = { .name = "id",   .type = BLOBMSG_TYPE_INT32 },
+	[RPC_OE_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+};
+
 enum {
 	RPC_C_CONFIG,
 	RPC_C_SESSION,
@@ -156,6 +339,20 @@ static const struct blobmsg_policy rpc_uci_config_policy[__RPC_C_MAX] = {
 	                                        .type = BLOBMSG_TYPE_STRING },
 };
 
+enum {
+	RPC_CH_CONFIG,
+	RPC_CH_SINCE,
+	RPC_CH_SESSION,
+	__RPC_CH_MAX,
+};
+
+static const struct blobmsg_policy rpc_uci_changes_policy[__RPC_CH_MAX] = {
+	[RPC_CH_CONFIG]  = { .name = "config",  .type = BLOBMSG_TYPE_STRING },
+	[RPC_CH_SINCE]   = { .name = "since",   .type = BLOBMSG_TYPE_INT64  },
+	[RPC_CH_SESSION] = { .name = "ubus_rpc_session",
+	                                        .type = BLOBMSG_TYPE_STRING },
+};
+
 enum {
 	RPC_T_ROLLBACK,
 	RPC_T_TIMEOUT,
@@ -202,16 +399,130 @@ rpc_uci_status(void)
 	}
 }
 
+static void
+rpc_uci_retained_free(struct rpc_uci_retained *r, bool unload)
+{
+	if (unload)
+		uci_unload(r->c->uci, r->p);
+
+	list_del(&r->list);
+	free(r);
+
+	retained_count--;
+}
+
+/*
+ * Drop the retained packages of the given name or all if NULL, this is
+ * done whenever the package cache is invalidated.
+ */
+static void
+rpc_uci_retained_invalidate(const char *package)
+{
+	struct rpc_uci_retained *r, *tmp;
+
+	list_for_each_entry_safe(r, tmp, &retained, list)
+		if (!package || !strcmp(r->p->e.name, package))
+			rpc_uci_retained_free(r, true);
+}
+
+static void
+rpc_uci_context_free(struct rpc_uci_context *c)
+{
+	struct rpc_uci_retained *r, *tmp;
+
+	if (cursor == c->uci)
+	{
+		cursor = cursor_default;
+		context = NULL;
+	}
+
+	/* packages are freed along with the context */
+	list_for_each_entry_safe(r, tmp, &retained, list)
+		if (r->c == c)
+			rpc_uci_retained_free(r, false);
+
+	list_del(&c->list);
+	uci_free_context(c->uci);
+	free(c);
+
+	context_count--;
+}
+
+static void
+rpc_uci_context_release(const char *savedir)
+{
+	struct rpc_uci_context *c;
+
+	list_for_each_entry(c, &contexts, list)
+	{
+		if (!strcmp(c->savedir, savedir))
+		{
+			rpc_uci_context_free(c);
+			break;
+		}
+	}
+}
+
+static struct rpc_uci_context *
+rpc_uci_context_get(const char *savedir)
+{
+	struct rpc_uci_context *c;
+
+	list_for_each_entry(c, &contexts, list)
+	{
+		if (!strcmp(c->savedir, savedir))
+		{
+			list_move(&c->list, &contexts);
+			return c;
+		}
+	}
+
+	if (context_max <= 0)
+		return NULL;
+
+	if (context_count >= context_max)
+		rpc_uci_context_free(list_last_entry(&contexts,
+		                                     struct rpc_uci_context, list));
+
+	c = calloc(1, sizeof(*c) + strlen(savedir) + 1);
+
+	if (!c)
+		return NULL;
+
+	c->uci = uci_alloc_context();
+
+	if (!c->uci)
+	{
+		free(c);
+		return NULL;
+	}
+
+	strcpy(c->savedir, savedir);
+	uci_set_savedir(c->uci, c->savedir);
+	uci_set_confdir(c->uci, cursor_default->confdir);
+
+	list_add(&c->list, &contexts);
+	context_count++;
+
+	return c;
+}
+
 /*
  * Setup per-session delta save directory. If the passed "sid" blob attribute
  * pointer is NULL then the precedure was not invoked through the ubus-rpc so
  * we do not perform session isolation and use the default save directory.
+ * Otherwise the pooled context of the session is selected, falling back to
+ * rebinding the default context if none can be allocated.
  */
 static void
 rpc_uci_set_savedir(struct blob_attr *sid)
 {
+	struct rpc_uci_context *c;
 	char path[PATH_MAX];
 
+	cursor = cursor_default;
+	context = NULL;
+
 	if (!sid)
 	{
 		uci_set_savedir(cursor, "/tmp/.uci");
@@ -219,168 +530,648 @@ rpc_uci_set_savedir(struct blob_attr *sid)
 	}
 
 	snprintf(path, sizeof(path) - 1,
-	         RPC_UCI_SAVEDIR_PREFIX "%s", blobmsg_get_string(sid));
+	         "%s%s", savedir_prefix, blobmsg_get_string(sid));
+
+	c = rpc_uci_context_get(path);
 
-	uci_set_savedir(cursor, path);
+	if (c)
+	{
+		cursor = c->uci;
+		context = c;
+	}
+	else
+	{
+		uci_set_savedir(cursor, path);
+	}
 }
 
-/*
- * Test read access to given config. If the passed "sid" blob attribute pointer
- * is NULL then the precedure was not invoked through the ubus-rpc so we do not
- * perform access control and always assume true.
- */
-static bool
-rpc_uci_read_access(struct blob_attr *sid, struct blob_attr *config)
+static void
+rpc_uci_cache_stat(const char *dir, const char *package, struct stat *s)
 {
-	rpc_uci_set_savedir(sid);
+	char path[PATH_MAX];
 
-	if (!sid)
-		return true;
+	snprintf(path, sizeof(path) - 1, "%s/%s", dir, package);
 
-	return rpc_session_access(blobmsg_data(sid), "uci",
-	                          blobmsg_data(config), "read");
+	if (stat(path, s))
+		memset(s, 0, sizeof(*s));
 }
 
-/*
- * Test write access to given config. If the passed "sid" blob attribute pointer
- * is NULL then the precedure was not invoked through the ubus-rpc so we do not
- * perform access control and always assume true.
- */
 static bool
-rpc_uci_write_access(struct blob_attr *sid, struct blob_attr *config)
+rpc_uci_cache_stat_eq(const struct stat *a, const struct stat *b)
 {
-	rpc_uci_set_savedir(sid);
+	return (a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	        a->st_mtime == b->st_mtime);
+}
 
-	if (!sid)
-		return true;
+static struct rpc_uci_retained *
+rpc_uci_retained_find(const char *package)
+{
+	struct rpc_uci_retained *r;
 
-	return rpc_session_access(blobmsg_data(sid), "uci",
-	                          blobmsg_data(config), "write");
+	if (!context)
+		return NULL;
+
+	list_for_each_entry(r, &retained, list)
+		if (r->c == context && !strcmp(r->p->e.name, package))
+			return r;
+
+	return NULL;
 }
 
 /*
- * Format applicable blob value as string and place a pointer to the string
- * buffer in "p". Uses a static string buffer.
+ * Unload the retained copy of a package from the cursor, for callers that
+ * need a fresh parse. libuci does not record saved changes in saved_delta,
+ * so retained packages must not be used to report changes.
  */
-static bool
-rpc_uci_format_blob(struct blob_attr *v, const char **p)
+static void
+rpc_uci_retained_drop(const char *package)
 {
-	static char buf[21];
-
-	*p = NULL;
-
-	switch (blobmsg_type(v))
-	{
-	case BLOBMSG_TYPE_STRING:
-		*p = blobmsg_data(v);
-		break;
+	struct rpc_uci_retained *r = rpc_uci_retained_find(package);
 
-	case BLOBMSG_TYPE_INT64:
-		snprintf(buf, sizeof(buf), "%"PRIu64, blobmsg_get_u64(v));
-		*p = buf;
-		break;
+	if (r)
+		rpc_uci_retained_free(r, true);
+}
 
-	case BLOBMSG_TYPE_INT32:
-		snprintf(buf, sizeof(buf), "%u", blobmsg_get_u32(v));
-		*p = buf;
-		break;
+/*
+ * Load a package into the cursor. On a pooled context a retained copy is
+ * reused if its files are unchanged, a stale one is unloaded first.
+ */
+static int
+rpc_uci_load(const char *package, struct uci_package **p)
+{
+	struct rpc_uci_retained *r = rpc_uci_retained_find(package);
+	struct stat conf, delta;
 
-	case BLOBMSG_TYPE_INT16:
-		snprintf(buf, sizeof(buf), "%u", blobmsg_get_u16(v));
-		*p = buf;
-		break;
+	if (r)
+	{
+		rpc_uci_cache_stat(cursor->confdir, package, &conf);
+		rpc_uci_cache_stat(context->savedir, package, &delta);
 
-	case BLOBMSG_TYPE_INT8:
-		snprintf(buf, sizeof(buf), "%u", !!blobmsg_get_u8(v));
-		*p = buf;
-		break;
+		if (rpc_uci_cache_stat_eq(&r->conf, &conf) &&
+		    rpc_uci_cache_stat_eq(&r->delta, &delta))
+		{
+			*p = r->p;
+			rpc_uci_retained_free(r, false);
+			cursor->err = UCI_OK;
+			return UCI_OK;
+		}
 
-	default:
-		break;
+		rpc_uci_retained_free(r, true);
 	}
 
-	return !!*p;
+	return uci_load(cursor, package, p);
 }
 
 /*
- * Lookup the given uci_ptr and enable extended lookup format if the .section
- * value of the uci_ptr looks like extended syntax. Uses an internal copy
- * of the given uci_ptr to perform the lookup as failing extended section
- * lookup operations in libuci will zero our the uci_ptr struct.
- * Copies the internal uci_ptr back to given the uci_ptr on success.
+ * Counterpart of rpc_uci_load(). Pooled contexts keep the package loaded
+ * unless it carries unsaved changes, e.g. after a failed operation.
  */
-static int
-rpc_uci_lookup(struct uci_ptr *ptr)
+static void
+rpc_uci_unload(struct uci_package *p)
 {
-	int rv;
-	struct uci_ptr lookup = *ptr;
+	struct rpc_uci_retained *r;
 
-	if (!lookup.s && lookup.section && *lookup.section == '@')
-		lookup.flags |= UCI_LOOKUP_EXTENDED;
+	if (!context || !uci_list_empty(&p->delta) ||
+	    !(r = calloc(1, sizeof(*r))))
+	{
+		uci_unload(cursor, p);
+		return;
+	}
 
-	rv = uci_lookup_ptr(cursor, &lookup, NULL, true);
+	r->c = context;
+	r->p = p;
 
-	if (!rv)
-		*ptr = lookup;
+	rpc_uci_cache_stat(cursor->confdir, p->e.name, &r->conf);
+	rpc_uci_cache_stat(context->savedir, p->e.name, &r->delta);
 
-	return rv;
+	list_add(&r->list, &retained);
+
+	if (++retained_count > context_max)
+		rpc_uci_retained_free(list_last_entry(&retained,
+		                      struct rpc_uci_retained, list), true);
+}
+
+static uint64_t
+rpc_uci_token(void)
+{
+	return ((uint64_t)generation_epoch << 32) | generation;
 }
 
 /*
- * Checks whether the given uci_option object matches the given string value.
- *  1) If the uci_option is of type list, check whether any of the list elements
- *     equals to the given string
- *  2) If the uci_option is of type string, parse it into space separated tokens
- *     and check if any of the tokens equals to the given string.
- *  Returns true if a list element or token matched the given string.
+ * Translate a client supplied token into a generation, returns false if
+ * the token was not issued by this rpcd instance.
  */
 static bool
-rpc_uci_match_option(struct uci_option *o, const char *cmp)
+rpc_uci_token_gen(struct blob_attr *since, uint32_t *gen)
 {
-	struct uci_element *e;
-	char *s, *p;
-
-	if (o->type == UCI_TYPE_LIST)
-	{
-		uci_foreach_element(&o->v.list, e)
-			if (e->name && !strcmp(e->name, cmp))
-				return true;
+	uint64_t token;
 
+	if (!since)
 		return false;
-	}
 
-	if (!o->v.string)
+	token = blobmsg_get_u64(since);
+
+	if ((token >> 32) != generation_epoch || (uint32_t)token > generation)
 		return false;
 
-	s = strdup(o->v.string);
+	*gen = (uint32_t)token;
+	return true;
+}
 
-	if (!s)
-		return false;
+static void
+rpc_uci_view_free(struct rpc_uci_view *v)
+{
+	struct rpc_uci_view_section *vs, *tmp;
 
-	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
-	{
-		if (!strcmp(p, cmp))
-		{
-			free(s);
-			return true;
-		}
-	}
+	avl_remove_all_elements(&v->sections, vs, avl, tmp)
+		free(vs);
 
-	free(s);
-	return false;
+	avl_delete(&views, &v->avl);
+	free(v);
 }
 
-/*
- * Checks whether the given uci_section matches the type and value blob attrs.
- *  1) Returns false if "type" is given and the section type does not match
- *     the value specified in the "type" string blob attribute, else continue.
- *  2) Tests whether any key in the "matches" table blob attribute exists in
- *     the given uci_section and whether each value is contained in the
- *     corresponding uci option value (see rpc_uci_match_option()).
- *  3) A missing or empty "matches" table blob attribute is always considered
- *     to be a match.
- * Returns true if "type" matches or is NULL and "matches" matches or is NULL.
- */
+static struct rpc_uci_view *
+rpc_uci_view_get(const char *package, const char *savedir)
+{
+	struct rpc_uci_view *v;
+	char path[PATH_MAX], *new_path, *new_package, *new_savedir;
+
+	snprintf(path, sizeof(path) - 1, "%s/%s", savedir, package);
+
+	v = avl_find_element(&views, path, v, avl);
+
+	if (v)
+		return v;
+
+	v = calloc_a(sizeof(*v),
+	             &new_path, strlen(path) + 1,
+	             &new_package, strlen(package) + 1,
+	             &new_savedir, strlen(savedir) + 1);
+
+	if (!v)
+		return NULL;
+
+	v->avl.key = strcpy(new_path, path);
+	v->package = strcpy(new_package, package);
+	v->savedir = strcpy(new_savedir, savedir);
+
+	/* nothing is known about changes before the view existed */
+	v->base = generation + 1;
+	v->dirty = true;
+	v->changes_dirty = true;
+
+	avl_init(&v->sections, avl_strcmp, false, NULL);
+	avl_insert(&views, &v->avl);
+
+	return v;
+}
+
+static void
+rpc_uci_view_invalidate(const char *package)
+{
+	struct rpc_uci_view *v;
+
+	avl_for_each_element(&views, v, avl)
+	{
+		if (!package || !strcmp(v->package, package))
+		{
+			v->dirty = true;
+			v->changes_dirty = true;
+		}
+	}
+}
+
+static void
+rpc_uci_view_purge_savedir(const char *savedir)
+{
+	struct rpc_uci_view *v, *tmp;
+
+	avl_for_each_element_safe(&views, v, avl, tmp)
+		if (!strcmp(v->savedir, savedir))
+			rpc_uci_view_free(v);
+}
+
+static uint32_t
+rpc_uci_hash(uint32_t hash, const char *str)
+{
+	for (; *str; str++)
+		hash = (hash ^ (uint8_t)*str) * 16777619u;
+
+	return (hash ^ 0xff) * 16777619u;
+}
+
+static uint32_t
+rpc_uci_section_hash(struct uci_section *s, int index)
+{
+	struct uci_element *e, *l;
+	struct uci_option *o;
+	uint32_t hash = 2166136261u + index;
+
+	hash = rpc_uci_hash(hash, s->type);
+
+	uci_foreach_element(&s->options, e)
+	{
+		o = uci_to_option(e);
+		hash = rpc_uci_hash(hash, o->e.name);
+
+		if (o->type == UCI_TYPE_STRING)
+			hash = rpc_uci_hash(hash, o->v.string);
+		else if (o->type == UCI_TYPE_LIST)
+			uci_foreach_element(&o->v.list, l)
+				hash = rpc_uci_hash(rpc_uci_hash(hash, ""), l->name);
+	}
+
+	return hash;
+}
+
+/*
+ * Check whether the package changed since the view was last updated, either
+ * through rpcd itself or by modifying the underlying files out of band.
+ */
+static bool
+rpc_uci_view_stale(struct rpc_uci_view *v, const char *confdir)
+{
+	struct stat conf, delta;
+
+	rpc_uci_cache_stat(confdir, v->package, &conf);
+	rpc_uci_cache_stat(v->savedir, v->package, &delta);
+
+	if (v->dirty || !rpc_uci_cache_stat_eq(&v->conf, &conf) ||
+	    !rpc_uci_cache_stat_eq(&v->delta, &delta))
+	{
+		v->conf = conf;
+		v->delta = delta;
+		v->dirty = true;
+	}
+
+	return v->dirty;
+}
+
+/*
+ * Compare the loaded package against the view and stamp new, modified
+ * and removed sections with a fresh generation.
+ */
+static void
+rpc_uci_view_update(struct rpc_uci_view *v, struct uci_package *p)
+{
+	struct rpc_uci_view_section *vs, *tmp;
+	struct uci_element *e;
+	uint32_t hash, stamp = 0;
+	int index = 0;
+	char *name;
+
+	uci_foreach_element(&p->sections, e)
+	{
+		hash = rpc_uci_section_hash(uci_to_section(e), index++);
+		vs = avl_find_element(&v->sections, e->name, vs, avl);
+
+		if (!vs)
+		{
+			vs = calloc_a(sizeof(*vs), &name, strlen(e->name) + 1);
+
+			if (!vs)
+				continue;
+
+			vs->avl.key = strcpy(name, e->name);
+			vs->removed = true;
+			avl_insert(&v->sections, &vs->avl);
+		}
+		else if (vs->removed)
+		{
+			v->n_removed--;
+		}
+
+		if (vs->removed || vs->hash != hash)
+		{
+			if (!stamp)
+				stamp = ++generation;
+
+			vs->hash = hash;
+			vs->gen = stamp;
+			vs->removed = false;
+		}
+
+		vs->seen = true;
+	}
+
+	avl_for_each_element(&v->sections, vs, avl)
+	{
+		if (!vs->seen && !vs->removed)
+		{
+			if (!stamp)
+				stamp = ++generation;
+
+			vs->gen = stamp;
+			vs->removed = true;
+			v->n_removed++;
+		}
+
+		vs->seen = false;
+	}
+
+	/* forget old removals, clients with older tokens get a full dump */
+	if (v->n_removed > RPC_UCI_VIEW_MAX_REMOVED)
+	{
+		avl_for_each_element_safe(&v->sections, vs, avl, tmp)
+		{
+			if (vs->removed)
+			{
+				avl_delete(&v->sections, &vs->avl);
+				free(vs);
+			}
+		}
+
+		v->n_removed = 0;
+		v->base = stamp;
+	}
+
+	if (stamp)
+		v->gen = stamp;
+
+	v->dirty = false;
+}
+
+static void
+rpc_uci_index_free(struct avl_tree *tree)
+{
+	struct rpc_uci_index_node *n, *tmp;
+
+	avl_remove_all_elements(tree, n, avl, tmp)
+	{
+		free(n->refs);
+		free(n);
+	}
+}
+
+static void
+rpc_uci_cache_free(struct rpc_uci_cache_entry *e)
+{
+	rpc_uci_index_free(&e->types);
+	rpc_uci_index_free(&e->values);
+	rpc_uci_index_free(&e->options);
+
+	list_del(&e->list);
+	uci_free_context(e->uci);
+	free(e);
+	cache_count--;
+}
+
+/*
+ * Drop cached entries of the given package or all packages if NULL.
+ */
+static void
+rpc_uci_cache_invalidate(const char *package)
+{
+	struct rpc_uci_cache_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &cache_entries, list)
+		if (!package || !strcmp(e->package, package))
+			rpc_uci_cache_free(e);
+
+	rpc_uci_view_invalidate(package);
+	rpc_uci_retained_invalidate(package);
+}
+
+static void
+rpc_uci_cache_purge_savedir(const char *savedir)
+{
+	struct rpc_uci_cache_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, &cache_entries, list)
+		if (!strcmp(e->savedir, savedir))
+			rpc_uci_cache_free(e);
+
+	rpc_uci_view_purge_savedir(savedir);
+}
+
+static struct rpc_uci_cache_entry *
+rpc_uci_cache_load(const char *package, const char *savedir)
+{
+	struct rpc_uci_cache_entry *e, *tmp;
+	struct stat conf, delta;
+	char *new_package, *new_savedir;
+
+	rpc_uci_cache_stat(cursor->confdir, package, &conf);
+	rpc_uci_cache_stat(savedir, package, &delta);
+
+	list_for_each_entry_safe(e, tmp, &cache_entries, list) {
+		if (strcmp(e->package, package) || strcmp(e->savedir, savedir))
+			continue;
+
+		if (rpc_uci_cache_stat_eq(&e->conf, &conf) &&
+		    rpc_uci_cache_stat_eq(&e->delta, &delta)) {
+			list_move(&e->list, &cache_entries);
+			return e;
+		}
+
+		rpc_uci_cache_free(e);
+		break;
+	}
+
+	e = calloc_a(sizeof(*e),
+	             &new_package, strlen(package) + 1,
+	             &new_savedir, strlen(savedir) + 1);
+
+	if (!e) {
+		cursor->err = UCI_ERR_MEM;
+		return NULL;
+	}
+
+	e->uci = uci_alloc_context();
+
+	if (!e->uci) {
+		cursor->err = UCI_ERR_MEM;
+		free(e);
+		return NULL;
+	}
+
+	uci_set_confdir(e->uci, cursor->confdir);
+	uci_set_savedir(e->uci, savedir);
+
+	if (uci_load(e->uci, package, &e->p)) {
+		cursor->err = e->uci->err;
+		uci_free_context(e->uci);
+		free(e);
+		return NULL;
+	}
+
+	e->package = strcpy(new_package, package);
+	e->savedir = strcpy(new_savedir, savedir);
+
+	avl_init(&e->types, avl_strcmp, false, NULL);
+	avl_init(&e->values, avl_strcmp, false, NULL);
+	avl_init(&e->options, avl_strcmp, false, NULL);
+	e->conf = conf;
+	e->delta = delta;
+
+	list_add(&e->list, &cache_entries);
+
+	if (++cache_count > RPC_UCI_CACHE_SIZE)
+		rpc_uci_cache_free(list_last_entry(&cache_entries,
+		                                   struct rpc_uci_cache_entry, list));
+
+	cursor->err = UCI_OK;
+
+	return e;
+}
+
+/*
+ * Test read access to given config. If the passed "sid" blob attribute pointer
+ * is NULL then the precedure was not invoked through the ubus-rpc so we do not
+ * perform access control and always assume true.
+ */
+static bool
+rpc_uci_read_access(struct blob_attr *sid, struct blob_attr *config)
+{
+	rpc_uci_set_savedir(sid);
+
+	if (!sid)
+		return true;
+
+	return rpc_session_access(blobmsg_data(sid), "uci",
+	                          blobmsg_data(config), "read");
+}
+
+/*
+ * Test write access to given config. If the passed "sid" blob attribute pointer
+ * is NULL then the precedure was not invoked through the ubus-rpc so we do not
+ * perform access control and always assume true.
+ */
+static bool
+rpc_uci_write_access(struct blob_attr *sid, struct blob_attr *config)
+{
+	rpc_uci_set_savedir(sid);
+
+	if (!sid)
+		return true;
+
+	return rpc_session_access(blobmsg_data(sid), "uci",
+	                          blobmsg_data(config), "write");
+}
+
+/*
+ * Format applicable blob value as string and place a pointer to the string
+ * buffer in "p". Uses a static string buffer.
+ */
+static bool
+rpc_uci_format_blob(struct blob_attr *v, const char **p)
+{
+	static char buf[21];
+
+	*p = NULL;
+
+	switch (blobmsg_type(v))
+	{
+	case BLOBMSG_TYPE_STRING:
+		*p = blobmsg_data(v);
+		break;
+
+	case BLOBMSG_TYPE_INT64:
+		snprintf(buf, sizeof(buf), "%"PRIu64, blobmsg_get_u64(v));
+		*p = buf;
+		break;
+
+	case BLOBMSG_TYPE_INT32:
+		snprintf(buf, sizeof(buf), "%u", blobmsg_get_u32(v));
+		*p = buf;
+		break;
+
+	case BLOBMSG_TYPE_INT16:
+		snprintf(buf, sizeof(buf), "%u", blobmsg_get_u16(v));
+		*p = buf;
+		break;
+
+	case BLOBMSG_TYPE_INT8:
+		snprintf(buf, sizeof(buf), "%u", !!blobmsg_get_u8(v));
+		*p = buf;
+		break;
+
+	default:
+		break;
+	}
+
+	return !!*p;
+}
+
+/*
+ * Lookup the given uci_ptr and enable extended lookup format if the .section
+ * value of the uci_ptr looks like extended syntax. Uses an internal copy
+ * of the given uci_ptr to perform the lookup as failing extended section
+ * lookup operations in libuci will zero our the uci_ptr struct.
+ * Copies the internal uci_ptr back to given the uci_ptr on success.
+ */
+static int
+rpc_uci_lookup(struct uci_context *uci, struct uci_ptr *ptr)
+{
+	int rv;
+	struct uci_ptr lookup = *ptr;
+
+	if (!lookup.s && lookup.section && *lookup.section == '@')
+		lookup.flags |= UCI_LOOKUP_EXTENDED;
+
+	rv = uci_lookup_ptr(uci, &lookup, NULL, true);
+
+	if (!rv)
+		*ptr = lookup;
+
+	return rv;
+}
+
+/*
+ * Checks whether the given uci_option object matches the given string value.
+ *  1) If the uci_option is of type list, check whether any of the list elements
+ *     equals to the given string
+ *  2) If the uci_option is of type string, parse it into space separated tokens
+ *     and check if any of the tokens equals to the given string.
+ *  Returns true if a list element or token matched the given string.
+ */
+static bool
+rpc_uci_match_option(struct uci_option *o, const char *cmp)
+{
+	struct uci_element *e;
+	char *s, *p;
+
+	if (o->type == UCI_TYPE_LIST)
+	{
+		uci_foreach_element(&o->v.list, e)
+			if (e->name && !strcmp(e->name, cmp))
+				return true;
+
+		return false;
+	}
+
+	if (!o->v.string)
+		return false;
+
+	s = strdup(o->v.string);
+
+	if (!s)
+		return false;
+
+	for (p = strtok(s, " \t"); p; p = strtok(NULL, " \t"))
+	{
+		if (!strcmp(p, cmp))
+		{
+			free(s);
+			return true;
+		}
+	}
+
+	free(s);
+	return false;
+}
+
+/*
+ * Checks whether the given uci_section matches the type and value blob attrs.
+ *  1) Returns false if "type" is given and the section type does not match
+ *     the value specified in the "type" string blob attribute, else continue.
+ *  2) Tests whether any key in the "matches" table blob attribute exists in
+ *     the given uci_section and whether each value is contained in the
+ *     corresponding uci option value (see rpc_uci_match_option()).
+ *  3) A missing or empty "matches" table blob attribute is always considered
+ *     to be a match.
+ * Returns true if "type" matches or is NULL and "matches" matches or is NULL.
+ */
 static bool
 rpc_uci_match_section(struct uci_section *s,
                       struct blob_attr *type, struct blob_attr *matches)
@@ -420,6 +1211,256 @@ rpc_uci_match_section(struct uci_section *s,
 	return (empty || match);
 }
 
+/* find the index node of key, creating it if it does not exist yet */
+static struct rpc_uci_index_node *
+rpc_uci_index_get(struct avl_tree *tree, const char *key)
+{
+	struct rpc_uci_index_node *n;
+	char *new_key;
+
+	n = avl_find_element(tree, key, n, avl);
+
+	if (n)
+		return n;
+
+	n = calloc_a(sizeof(*n), &new_key, strlen(key) + 1);
+
+	if (!n)
+		return NULL;
+
+	n->avl.key = strcpy(new_key, key);
+	avl_insert(tree, &n->avl);
+
+	return n;
+}
+
+/* record position index of section s below key, once per section */
+static bool
+rpc_uci_index_add(struct avl_tree *tree, const char *key,
+                  struct uci_section *s, int index)
+{
+	struct rpc_uci_index_node *n = rpc_uci_index_get(tree, key);
+	struct rpc_uci_index_ref *refs;
+
+	if (!n)
+		return false;
+
+	/* a section may carry the same token more than once */
+	if (n->n_refs && n->refs[n->n_refs - 1].s == s)
+		return true;
+
+	if (n->n_refs >= n->size)
+	{
+		refs = realloc(n->refs, (n->size + 8) * 2 * sizeof(*refs));
+
+		if (!refs)
+			return false;
+
+		n->refs = refs;
+		n->size = (n->size + 8) * 2;
+	}
+
+	n->refs[n->n_refs].s = s;
+	n->refs[n->n_refs].index = index;
+	n->n_refs++;
+
+	return true;
+}
+
+static bool
+rpc_uci_index_value(struct rpc_uci_cache_entry *e, const char *option,
+                    const char *value, struct uci_section *s, int index)
+{
+	char key[512];
+
+	/* overlong tokens are never looked up, see rpc_uci_index_lookup() */
+	if (snprintf(key, sizeof(key), "%s=%s", option, value) >= sizeof(key))
+		return true;
+
+	return rpc_uci_index_add(&e->values, key, s, index);
+}
+
+static bool
+rpc_uci_index_types(struct rpc_uci_cache_entry *e)
+{
+	struct uci_element *se;
+	int i = 0;
+
+	if (e->types_indexed)
+		return true;
+
+	uci_foreach_element(&e->p->sections, se)
+		if (!rpc_uci_index_add(&e->types, uci_to_section(se)->type,
+		                       uci_to_section(se), i++))
+			return false;
+
+	e->types_indexed = true;
+
+	return true;
+}
+
+/*
+ * Index all values of the given option name, splitting string values into
+ * tokens the same way rpc_uci_match_option() does. Returns false if the
+ * option could not be indexed, callers must fall back to a full scan then.
+ */
+static bool
+rpc_uci_index_option(struct rpc_uci_cache_entry *e, const char *option)
+{
+	struct uci_element *se, *oe, *le;
+	struct uci_section *sec;
+	struct uci_option *o;
+	char *str, *tok;
+	bool ok = true;
+	int i = 0;
+
+	if (avl_find(&e->options, option))
+		return true;
+
+	uci_foreach_element(&e->p->sections, se)
+	{
+		sec = uci_to_section(se);
+
+		uci_foreach_element(&sec->options, oe)
+		{
+			if (strcmp(oe->name, option))
+				continue;
+
+			o = uci_to_option(oe);
+
+			if (o->type == UCI_TYPE_LIST)
+			{
+				uci_foreach_element(&o->v.list, le)
+					if (le->name)
+						ok &= rpc_uci_index_value(e, option, le->name, sec, i);
+			}
+			else if (o->v.string)
+			{
+				str = strdup(o->v.string);
+
+				if (!str)
+				{
+					ok = false;
+					break;
+				}
+
+				for (tok = strtok(str, " \t"); tok; tok = strtok(NULL, " \t"))
+					ok &= rpc_uci_index_value(e, option, tok, sec, i);
+
+				free(str);
+			}
+		}
+
+		i++;
+	}
+
+	if (ok && rpc_uci_index_get(&e->options, option))
+		return true;
+
+	/* drop the partially built value index */
+	rpc_uci_index_free(&e->values);
+	rpc_uci_index_free(&e->options);
+
+	return false;
+}
+
+static int
+rpc_uci_index_ref_cmp(const void *a, const void *b)
+{
+	const struct rpc_uci_index_ref *x = a, *y = b;
+
+	return (x->index - y->index);
+}
+
+/*
+ * Collect the candidate sections for the given type and match filters from
+ * the indexes. Any section passing rpc_uci_match_section() is among them,
+ * the candidates are returned sorted by their position in the package.
+ */
+static int
+rpc_uci_index_lookup(struct rpc_uci_cache_entry *e, struct blob_attr *type,
+                     struct blob_attr *matches,
+                     struct rpc_uci_index_ref **refs)
+{
+	struct rpc_uci_index_node *n;
+	struct rpc_uci_index_ref *res = NULL, *tmp;
+	struct blob_attr *cur;
+	const char *cmp;
+	char key[512];
+	int i, rem, n_res = 0, n_out = 0, n_matches = 0;
+
+	if (matches)
+		blobmsg_for_each_attr(cur, matches, rem)
+			if (rpc_uci_format_blob(cur, &cmp))
+				n_matches++;
+
+	if (n_matches > 0)
+	{
+		blobmsg_for_each_attr(cur, matches, rem)
+		{
+			if (!rpc_uci_format_blob(cur, &cmp))
+				continue;
+
+			if (!rpc_uci_index_option(e, blobmsg_name(cur)))
+				goto fail;
+
+			if (snprintf(key, sizeof(key), "%s=%s",
+			             blobmsg_name(cur), cmp) >= sizeof(key))
+				goto fail;
+
+			n = avl_find_element(&e->values, key, n, avl);
+
+			if (!n)
+				continue;
+
+			tmp = realloc(res, (n_res + n->n_refs) * sizeof(*res));
+
+			if (!tmp)
+				goto fail;
+
+			res = tmp;
+			memcpy(res + n_res, n->refs, n->n_refs * sizeof(*res));
+			n_res += n->n_refs;
+		}
+
+		qsort(res, n_res, sizeof(*res), rpc_uci_index_ref_cmp);
+
+		for (i = 0; i < n_res; i++)
+			if (!n_out || res[n_out - 1].s != res[i].s)
+				res[n_out++] = res[i];
+	}
+	else if (type)
+	{
+		if (!rpc_uci_index_types(e))
+			return -1;
+
+		n = avl_find_element(&e->types, blobmsg_data(type), n, avl);
+
+		if (n && n->n_refs)
+		{
+			res = malloc(n->n_refs * sizeof(*res));
+
+			if (!res)
+				return -1;
+
+			memcpy(res, n->refs, n->n_refs * sizeof(*res));
+			n_out = n->n_refs;
+		}
+	}
+	else
+	{
+		return -1;
+	}
+
+	*refs = res;
+
+	return n_out;
+
+fail:
+	free(res);
+	return -1;
+}
+
 /*
  * Dump the given uci_option value into the global blobmsg buffer and use
  * given "name" as key.
@@ -497,14 +1538,31 @@ rpc_uci_dump_section(struct uci_section *s, const char *name, int index)
  */
 static void
 rpc_uci_dump_package(struct uci_package *p, const char *name,
-                     struct blob_attr *type, struct blob_attr *matches)
+                     struct blob_attr *type, struct blob_attr *matches,
+                     struct rpc_uci_cache_entry *ce)
 {
 	void *c;
 	struct uci_element *e;
-	int i = -1;
+	struct rpc_uci_index_ref *refs = NULL;
+	int i = -1, n_refs = -1;
 
 	c = blobmsg_open_table(&buf, name);
 
+	if (ce && (type || matches))
+		n_refs = rpc_uci_index_lookup(ce, type, matches, &refs);
+
+	if (n_refs >= 0)
+	{
+		for (i = 0; i < n_refs; i++)
+			if (rpc_uci_match_section(refs[i].s, type, matches))
+				rpc_uci_dump_section(refs[i].s, refs[i].s->e.name,
+				                     refs[i].index);
+
+		free(refs);
+		blobmsg_close_table(&buf, c);
+		return;
+	}
+
 	uci_foreach_element(&p->sections, e)
 	{
 		i++;
@@ -519,13 +1577,56 @@ rpc_uci_dump_package(struct uci_package *p, const char *name,
 }
 
 
+/*
+ * Dump the sections of the package modified after generation "since" and
+ * the names of removed ones.
+ */
+static void
+rpc_uci_view_dump(struct rpc_uci_view *v, struct uci_package *p,
+                  uint32_t since)
+{
+	struct rpc_uci_view_section *vs;
+	struct uci_element *e;
+	int i = 0;
+	void *c;
+
+	c = blobmsg_open_table(&buf, "values");
+
+	uci_foreach_element(&p->sections, e)
+	{
+		vs = avl_find_element(&v->sections, e->name, vs, avl);
+
+		if (!vs || vs->gen > since)
+			rpc_uci_dump_section(uci_to_section(e), e->name, i);
+
+		i++;
+	}
+
+	blobmsg_close_table(&buf, c);
+
+	c = blobmsg_open_array(&buf, "removed");
+
+	avl_for_each_element(&v->sections, vs, avl)
+		if (vs->removed && vs->gen > since)
+			blobmsg_add_string(&buf, NULL, vs->avl.key);
+
+	blobmsg_close_array(&buf, c);
+
+	blobmsg_add_u8(&buf, "incremental", true);
+}
+
 static int
 rpc_uci_getcommon(struct ubus_context *ctx, struct ubus_request_data *req,
                   struct blob_attr *msg, bool use_state)
 {
 	struct blob_attr *tb[__RPC_G_MAX];
-	struct uci_package *p = NULL;
+	struct rpc_uci_cache_entry *e;
+	struct rpc_uci_view *v = NULL;
 	struct uci_ptr ptr = { 0 };
+	const char *savedir;
+	uint32_t since = 0;
+	bool valid = false;
+	int rv;
 
 	blobmsg_parse(rpc_uci_get_policy, __RPC_G_MAX, tb,
 	              blob_data(msg), blob_len(msg));
@@ -537,13 +1638,33 @@ rpc_uci_getcommon(struct ubus_context *ctx, struct ubus_request_data *req,
 		return UBUS_STATUS_PERMISSION_DENIED;
 
 	ptr.package = blobmsg_data(tb[RPC_G_CONFIG]);
+	savedir = use_state ? "/var/state" : cursor->savedir;
+
+	if (tb[RPC_G_SINCE])
+	{
+		v = rpc_uci_view_get(ptr.package, savedir);
+		valid = rpc_uci_token_gen(tb[RPC_G_SINCE], &since);
 
-	if (use_state)
-		uci_set_savedir(cursor, "/var/state");
+		if (v && !rpc_uci_view_stale(v, cursor->confdir) &&
+		    valid && v->gen <= since)
+		{
+			blob_buf_init(&buf, 0);
+			blobmsg_add_u8(&buf, "unchanged", true);
+			blobmsg_add_u64(&buf, "generation", rpc_uci_token());
+			ubus_send_reply(ctx, req, buf.head);
 
-	if (uci_load(cursor, ptr.package, &p))
+			return UBUS_STATUS_OK;
+		}
+	}
+
+	e = rpc_uci_cache_load(ptr.package, savedir);
+
+	if (!e)
 		return rpc_uci_status();
 
+	if (v && v->dirty)
+		rpc_uci_view_update(v, e->p);
+
 	if (tb[RPC_G_SECTION])
 	{
 		ptr.section = blobmsg_data(tb[RPC_G_SECTION]);
@@ -552,15 +1673,24 @@ rpc_uci_getcommon(struct ubus_context *ctx, struct ubus_request_data *req,
 			ptr.option = blobmsg_data(tb[RPC_G_OPTION]);
 	}
 
-	if (rpc_uci_lookup(&ptr) || !(ptr.flags & UCI_LOOKUP_COMPLETE))
-		goto out;
+	rv = rpc_uci_lookup(e->uci, &ptr);
+	cursor->err = e->uci->err;
+
+	if (rv || !(ptr.flags & UCI_LOOKUP_COMPLETE))
+		return rpc_uci_status();
 
 	blob_buf_init(&buf, 0);
 
 	switch (ptr.last->type)
 	{
 	case UCI_TYPE_PACKAGE:
-		rpc_uci_dump_package(ptr.p, "values", tb[RPC_G_TYPE], tb[RPC_G_MATCH]);
+		/* filtered dumps can not express sections leaving the filter */
+		if (v && valid && since >= v->base &&
+		    !tb[RPC_G_TYPE] && !tb[RPC_G_MATCH])
+			rpc_uci_view_dump(v, ptr.p, since);
+		else
+			rpc_uci_dump_package(ptr.p, "values", tb[RPC_G_TYPE],
+			                     tb[RPC_G_MATCH], e);
 		break;
 
 	case UCI_TYPE_SECTION:
@@ -575,10 +1705,10 @@ rpc_uci_getcommon(struct ubus_context *ctx, struct ubus_request_data *req,
 		break;
 	}
 
-	ubus_send_reply(ctx, req, buf.head);
+	if (v)
+		blobmsg_add_u64(&buf, "generation", rpc_uci_token());
 
-out:
-	uci_unload(cursor, p);
+	ubus_send_reply(ctx, req, buf.head);
 
 	return rpc_uci_status();
 }
@@ -600,31 +1730,14 @@ rpc_uci_state(struct ubus_context *ctx, struct ubus_object *obj,
 }
 
 static int
-rpc_uci_add(struct ubus_context *ctx, struct ubus_object *obj,
-            struct ubus_request_data *req, const char *method,
-            struct blob_attr *msg)
+rpc_uci_add_section(struct blob_attr **tb, struct uci_package *p,
+                    const char **section)
 {
-	struct blob_attr *tb[__RPC_A_MAX];
 	struct blob_attr *cur, *elem;
-	struct uci_package *p = NULL;
 	struct uci_section *s;
-	struct uci_ptr ptr = { 0 };
+	struct uci_ptr ptr = { .package = p->e.name };
 	int rem, rem2;
 
-	blobmsg_parse(rpc_uci_add_policy, __RPC_A_MAX, tb,
-	              blob_data(msg), blob_len(msg));
-
-	if (!tb[RPC_A_CONFIG] || !tb[RPC_A_TYPE])
-		return UBUS_STATUS_INVALID_ARGUMENT;
-
-	if (!rpc_uci_write_access(tb[RPC_A_SESSION], tb[RPC_A_CONFIG]))
-		return UBUS_STATUS_PERMISSION_DENIED;
-
-	ptr.package = blobmsg_data(tb[RPC_A_CONFIG]);
-
-	if (uci_load(cursor, ptr.package, &p))
-		return rpc_uci_status();
-
 	/* add named section */
 	if (tb[RPC_A_NAME])
 	{
@@ -632,15 +1745,15 @@ rpc_uci_add(struct ubus_context *ctx, struct ubus_object *obj,
 		ptr.value   = blobmsg_data(tb[RPC_A_TYPE]);
 		ptr.option  = NULL;
 
-		if (rpc_uci_lookup(&ptr) || uci_set(cursor, &ptr))
-			goto out;
+		if (rpc_uci_lookup(cursor, &ptr) || uci_set(cursor, &ptr))
+			return rpc_uci_status();
 	}
 
 	/* add anon section */
 	else
 	{
 		if (uci_add_section(cursor, p, blobmsg_data(tb[RPC_A_TYPE]), &s) || !s)
-			goto out;
+			return s ? rpc_uci_status() : UBUS_STATUS_UNKNOWN_ERROR;
 
 		ptr.section = s->e.name;
 	}
@@ -652,7 +1765,7 @@ rpc_uci_add(struct ubus_context *ctx, struct ubus_object *obj,
 			ptr.o = NULL;
 			ptr.option = blobmsg_name(cur);
 
-			if (rpc_uci_lookup(&ptr) || !ptr.s)
+			if (rpc_uci_lookup(cursor, &ptr) || !ptr.s)
 				continue;
 
 			switch (blobmsg_type(cur))
@@ -671,14 +1784,43 @@ rpc_uci_add(struct ubus_context *ctx, struct ubus_object *obj,
 		}
 	}
 
-	uci_save(cursor, p);
+	*section = ptr.section;
 
-	blob_buf_init(&buf, 0);
-	blobmsg_add_string(&buf, "section", ptr.section);
-	ubus_send_reply(ctx, req, buf.head);
+	return 0;
+}
 
-out:
-	uci_unload(cursor, p);
+static int
+rpc_uci_add(struct ubus_context *ctx, struct ubus_object *obj,
+            struct ubus_request_data *req, const char *method,
+            struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_A_MAX];
+	struct uci_package *p = NULL;
+	const char *section;
+
+	blobmsg_parse(rpc_uci_add_policy, __RPC_A_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_A_CONFIG] || !tb[RPC_A_TYPE])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_uci_write_access(tb[RPC_A_SESSION], tb[RPC_A_CONFIG]))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (rpc_uci_load(blobmsg_data(tb[RPC_A_CONFIG]), &p))
+		return rpc_uci_status();
+
+	if (!rpc_uci_add_section(tb, p, &section))
+	{
+		uci_save(cursor, p);
+		rpc_uci_cache_invalidate(p->e.name);
+
+		blob_buf_init(&buf, 0);
+		blobmsg_add_string(&buf, "section", section);
+		ubus_send_reply(ctx, req, buf.head);
+	}
+
+	rpc_uci_unload(p);
 
 	return rpc_uci_status();
 }
@@ -702,7 +1844,7 @@ rpc_uci_merge_set(struct blob_attr *opt, struct uci_ptr *ptr)
 	ptr->option = blobmsg_name(opt);
 	ptr->value = NULL;
 
-	if (rpc_uci_lookup(ptr) || !ptr->s)
+	if (rpc_uci_lookup(cursor, ptr) || !ptr->s)
 		return;
 
 	if (blobmsg_type(opt) == BLOBMSG_TYPE_ARRAY)
@@ -728,33 +1870,21 @@ rpc_uci_merge_set(struct blob_attr *opt, struct uci_ptr *ptr)
 	}
 }
 
+static bool
+rpc_uci_set_valid(struct blob_attr **tb)
+{
+	return (tb[RPC_S_CONFIG] && tb[RPC_S_VALUES] &&
+	        (tb[RPC_S_SECTION] || tb[RPC_S_TYPE] || tb[RPC_S_MATCH]));
+}
+
 static int
-rpc_uci_set(struct ubus_context *ctx, struct ubus_object *obj,
-            struct ubus_request_data *req, const char *method,
-            struct blob_attr *msg)
+rpc_uci_set_values(struct blob_attr **tb, struct uci_package *p)
 {
-	struct blob_attr *tb[__RPC_S_MAX];
 	struct blob_attr *cur;
-	struct uci_package *p = NULL;
 	struct uci_element *e;
-	struct uci_ptr ptr = { 0 };
+	struct uci_ptr ptr = { .package = p->e.name };
 	int rem;
 
-	blobmsg_parse(rpc_uci_set_policy, __RPC_S_MAX, tb,
-	              blob_data(msg), blob_len(msg));
-
-	if (!tb[RPC_S_CONFIG] || !tb[RPC_S_VALUES] ||
-		(!tb[RPC_S_SECTION] && !tb[RPC_S_TYPE] && !tb[RPC_S_MATCH]))
-		return UBUS_STATUS_INVALID_ARGUMENT;
-
-	if (!rpc_uci_write_access(tb[RPC_S_SESSION], tb[RPC_S_CONFIG]))
-		return UBUS_STATUS_PERMISSION_DENIED;
-
-	ptr.package = blobmsg_data(tb[RPC_S_CONFIG]);
-
-	if (uci_load(cursor, ptr.package, &p))
-		return rpc_uci_status();
-
 	if (tb[RPC_S_SECTION])
 	{
 		ptr.section = blobmsg_data(tb[RPC_S_SECTION]);
@@ -777,8 +1907,34 @@ rpc_uci_set(struct ubus_context *ctx, struct ubus_object *obj,
 		}
 	}
 
+	return rpc_uci_status();
+}
+
+static int
+rpc_uci_set(struct ubus_context *ctx, struct ubus_object *obj,
+            struct ubus_request_data *req, const char *method,
+            struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_S_MAX];
+	struct uci_package *p = NULL;
+
+	blobmsg_parse(rpc_uci_set_policy, __RPC_S_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!rpc_uci_set_valid(tb))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_uci_write_access(tb[RPC_S_SESSION], tb[RPC_S_CONFIG]))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (rpc_uci_load(blobmsg_data(tb[RPC_S_CONFIG]), &p))
+		return rpc_uci_status();
+
+	rpc_uci_set_values(tb, p);
+
 	uci_save(cursor, p);
-	uci_unload(cursor, p);
+	rpc_uci_cache_invalidate(p->e.name);
+	rpc_uci_unload(p);
 
 	return rpc_uci_status();
 }
@@ -795,7 +1951,7 @@ rpc_uci_merge_delete(struct blob_attr *opt, struct uci_ptr *ptr)
 	struct blob_attr *cur;
 	int rem;
 
-	if (rpc_uci_lookup(ptr) || !ptr->s)
+	if (rpc_uci_lookup(cursor, ptr) || !ptr->s)
 		return;
 
 	if (!opt)
@@ -815,7 +1971,7 @@ rpc_uci_merge_delete(struct blob_attr *opt, struct uci_ptr *ptr)
 			ptr->o = NULL;
 			ptr->option = blobmsg_data(cur);
 
-			if (rpc_uci_lookup(ptr) || !ptr->o)
+			if (rpc_uci_lookup(cursor, ptr) || !ptr->o)
 				continue;
 
 			uci_delete(cursor, ptr);
@@ -826,37 +1982,25 @@ rpc_uci_merge_delete(struct blob_attr *opt, struct uci_ptr *ptr)
 		ptr->o = NULL;
 		ptr->option = blobmsg_data(opt);
 
-		if (rpc_uci_lookup(ptr) || !ptr->o)
+		if (rpc_uci_lookup(cursor, ptr) || !ptr->o)
 			return;
 
 		uci_delete(cursor, ptr);
 	}
 }
 
+static bool
+rpc_uci_delete_valid(struct blob_attr **tb)
+{
+	return (tb[RPC_D_CONFIG] &&
+	        (tb[RPC_D_SECTION] || tb[RPC_D_TYPE] || tb[RPC_D_MATCH]));
+}
+
 static int
-rpc_uci_delete(struct ubus_context *ctx, struct ubus_object *obj,
-               struct ubus_request_data *req, const char *method,
-               struct blob_attr *msg)
+rpc_uci_delete_values(struct blob_attr **tb, struct uci_package *p)
 {
-	struct blob_attr *tb[__RPC_D_MAX];
-	struct uci_package *p = NULL;
 	struct uci_element *e, *tmp;
-	struct uci_ptr ptr = { 0 };
-
-	blobmsg_parse(rpc_uci_delete_policy, __RPC_D_MAX, tb,
-	              blob_data(msg), blob_len(msg));
-
-	if (!tb[RPC_D_CONFIG] ||
-		(!tb[RPC_D_SECTION] && !tb[RPC_D_TYPE] && !tb[RPC_D_MATCH]))
-		return UBUS_STATUS_INVALID_ARGUMENT;
-
-	if (!rpc_uci_write_access(tb[RPC_D_SESSION], tb[RPC_D_CONFIG]))
-		return UBUS_STATUS_PERMISSION_DENIED;
-
-	ptr.package = blobmsg_data(tb[RPC_D_CONFIG]);
-
-	if (uci_load(cursor, ptr.package, &p))
-		return rpc_uci_status();
+	struct uci_ptr ptr = { .package = p->e.name };
 
 	if (tb[RPC_D_SECTION])
 	{
@@ -885,8 +2029,65 @@ rpc_uci_delete(struct ubus_context *ctx, struct ubus_object *obj,
 		}
 	}
 
+	return rpc_uci_status();
+}
+
+static int
+rpc_uci_delete(struct ubus_context *ctx, struct ubus_object *obj,
+               struct ubus_request_data *req, const char *method,
+               struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_D_MAX];
+	struct uci_package *p = NULL;
+
+	blobmsg_parse(rpc_uci_delete_policy, __RPC_D_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!rpc_uci_delete_valid(tb))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_uci_write_access(tb[RPC_D_SESSION], tb[RPC_D_CONFIG]))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (rpc_uci_load(blobmsg_data(tb[RPC_D_CONFIG]), &p))
+		return rpc_uci_status();
+
+	rpc_uci_delete_values(tb, p);
+
 	uci_save(cursor, p);
-	uci_unload(cursor, p);
+	rpc_uci_cache_invalidate(p->e.name);
+	rpc_uci_unload(p);
+
+	return rpc_uci_status();
+}
+
+static bool
+rpc_uci_rename_valid(struct blob_attr **tb)
+{
+	return (tb[RPC_R_CONFIG] && tb[RPC_R_SECTION] && tb[RPC_R_NAME]);
+}
+
+static int
+rpc_uci_rename_element(struct blob_attr **tb, struct uci_package *p)
+{
+	struct uci_ptr ptr = { .package = p->e.name };
+
+	ptr.section = blobmsg_data(tb[RPC_R_SECTION]);
+	ptr.value   = blobmsg_data(tb[RPC_R_NAME]);
+
+	if (tb[RPC_R_OPTION])
+		ptr.option = blobmsg_data(tb[RPC_R_OPTION]);
+
+	if (uci_lookup_ptr(cursor, &ptr, NULL, true))
+		return rpc_uci_status();
+
+	if ((ptr.option && !ptr.o) || !ptr.s)
+	{
+		cursor->err = UCI_ERR_NOTFOUND;
+		return rpc_uci_status();
+	}
+
+	uci_rename(cursor, &ptr);
 
 	return rpc_uci_status();
 }
@@ -898,90 +2099,324 @@ rpc_uci_rename(struct ubus_context *ctx, struct ubus_object *obj,
 {
 	struct blob_attr *tb[__RPC_R_MAX];
 	struct uci_package *p = NULL;
-	struct uci_ptr ptr = { 0 };
 
-	blobmsg_parse(rpc_uci_rename_policy, __RPC_R_MAX, tb,
-	              blob_data(msg), blob_len(msg));
+	blobmsg_parse(rpc_uci_rename_policy, __RPC_R_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!rpc_uci_rename_valid(tb))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_uci_write_access(tb[RPC_R_SESSION], tb[RPC_R_CONFIG]))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (rpc_uci_load(blobmsg_data(tb[RPC_R_CONFIG]), &p))
+		return rpc_uci_status();
+
+	if (!rpc_uci_rename_element(tb, p))
+	{
+		uci_save(cursor, p);
+		rpc_uci_cache_invalidate(p->e.name);
+	}
+
+	rpc_uci_unload(p);
+
+	return rpc_uci_status();
+}
+
+static bool
+rpc_uci_order_valid(struct blob_attr **tb)
+{
+	return (tb[RPC_O_CONFIG] && tb[RPC_O_SECTIONS]);
+}
+
+static int
+rpc_uci_order_sections(struct blob_attr **tb, struct uci_package *p)
+{
+	struct blob_attr *cur;
+	struct uci_ptr ptr = { .package = p->e.name };
+	int rem, i = 1;
+
+	blobmsg_for_each_attr(cur, tb[RPC_O_SECTIONS], rem)
+	{
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			continue;
+
+		ptr.s = NULL;
+		ptr.section = blobmsg_data(cur);
+
+		if (uci_lookup_ptr(cursor, &ptr, NULL, true) || !ptr.s)
+			continue;
+
+		uci_reorder_section(cursor, ptr.s, i++);
+	}
+
+	return rpc_uci_status();
+}
+
+static int
+rpc_uci_order(struct ubus_context *ctx, struct ubus_object *obj,
+              struct ubus_request_data *req, const char *method,
+              struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_O_MAX];
+	struct uci_package *p = NULL;
+
+	blobmsg_parse(rpc_uci_order_policy, __RPC_O_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!rpc_uci_order_valid(tb))
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	if (!rpc_uci_write_access(tb[RPC_O_SESSION], tb[RPC_O_CONFIG]))
+		return UBUS_STATUS_PERMISSION_DENIED;
+
+	if (rpc_uci_load(blobmsg_data(tb[RPC_O_CONFIG]), &p))
+		return rpc_uci_status();
+
+	rpc_uci_order_sections(tb, p);
+
+	uci_save(cursor, p);
+	rpc_uci_cache_invalidate(p->e.name);
+	rpc_uci_unload(p);
+
+	return rpc_uci_status();
+}
+
+struct rpc_uci_batch_package {
+	const char *name;
+	struct uci_package *p;
+	struct stat delta;
+};
+
+static int
+rpc_uci_batch_op(struct blob_attr *op, struct uci_package *p,
+                 const char **section, bool validate)
+{
+	struct blob_attr *tb[__RPC_D_MAX]; /* largest of the policies below */
+	struct blob_attr *mtb[__RPC_BO_MAX];
+	const char *method;
+
+	blobmsg_parse(rpc_uci_batch_op_policy, __RPC_BO_MAX, mtb,
+	              blobmsg_data(op), blobmsg_data_len(op));
+
+	if (!mtb[RPC_BO_METHOD] || !mtb[RPC_BO_CONFIG])
+		return UBUS_STATUS_INVALID_ARGUMENT;
+
+	method = blobmsg_data(mtb[RPC_BO_METHOD]);
+
+	if (!strcmp(method, "add"))
+	{
+		blobmsg_parse(rpc_uci_add_policy, __RPC_A_MAX, tb,
+		              blobmsg_data(op), blobmsg_data_len(op));
+
+		if (validate)
+			return (tb[RPC_A_TYPE] ? 0 : UBUS_STATUS_INVALID_ARGUMENT);
+
+		return rpc_uci_add_section(tb, p, section);
+	}
+	else if (!strcmp(method, "set"))
+	{
+		blobmsg_parse(rpc_uci_set_policy, __RPC_S_MAX, tb,
+		              blobmsg_data(op), blobmsg_data_len(op));
+
+		if (validate)
+			return (rpc_uci_set_valid(tb) ? 0 : UBUS_STATUS_INVALID_ARGUMENT);
+
+		return rpc_uci_set_values(tb, p);
+	}
+	else if (!strcmp(method, "delete"))
+	{
+		blobmsg_parse(rpc_uci_delete_policy, __RPC_D_MAX, tb,
+		              blobmsg_data(op), blobmsg_data_len(op));
+
+		if (validate)
+			return (rpc_uci_delete_valid(tb) ? 0 : UBUS_STATUS_INVALID_ARGUMENT);
+
+		return rpc_uci_delete_values(tb, p);
+	}
+	else if (!strcmp(method, "rename"))
+	{
+		blobmsg_parse(rpc_uci_rename_policy, __RPC_R_MAX, tb,
+		              blobmsg_data(op), blobmsg_data_len(op));
+
+		if (validate)
+			return (rpc_uci_rename_valid(tb) ? 0 : UBUS_STATUS_INVALID_ARGUMENT);
+
+		return rpc_uci_rename_element(tb, p);
+	}
+	else if (!strcmp(method, "order"))
+	{
+		blobmsg_parse(rpc_uci_order_policy, __RPC_O_MAX, tb,
+		              blobmsg_data(op), blobmsg_data_len(op));
 
-	if (!tb[RPC_R_CONFIG] || !tb[RPC_R_SECTION] || !tb[RPC_R_NAME])
-		return UBUS_STATUS_INVALID_ARGUMENT;
+		if (validate)
+			return (rpc_uci_order_valid(tb) ? 0 : UBUS_STATUS_INVALID_ARGUMENT);
 
-	if (!rpc_uci_write_access(tb[RPC_R_SESSION], tb[RPC_R_CONFIG]))
-		return UBUS_STATUS_PERMISSION_DENIED;
+		return rpc_uci_order_sections(tb, p);
+	}
 
-	ptr.package = blobmsg_data(tb[RPC_R_CONFIG]);
-	ptr.section = blobmsg_data(tb[RPC_R_SECTION]);
-	ptr.value   = blobmsg_data(tb[RPC_R_NAME]);
+	return UBUS_STATUS_METHOD_NOT_FOUND;
+}
 
-	if (tb[RPC_R_OPTION])
-		ptr.option = blobmsg_data(tb[RPC_R_OPTION]);
+static struct rpc_uci_batch_package *
+rpc_uci_batch_find(struct rpc_uci_batch_package *pkgs, int n, const char *name)
+{
+	int i;
 
-	if (uci_load(cursor, ptr.package, &p))
-		return rpc_uci_status();
+	for (i = 0; i < n; i++)
+		if (!strcmp(pkgs[i].name, name))
+			return &pkgs[i];
 
-	if (uci_lookup_ptr(cursor, &ptr, NULL, true))
-		goto out;
+	return NULL;
+}
 
-	if ((ptr.option && !ptr.o) || !ptr.s)
+/*
+ * Save the changes of all packages. uci_save() only appends to the delta
+ * files, so if any package fails to save, the ones saved before it are
+ * rolled back by truncating their delta to the previous size.
+ */
+static int
+rpc_uci_batch_save(struct rpc_uci_batch_package *pkgs, int n)
+{
+	char path[PATH_MAX];
+	int i, rv = UBUS_STATUS_OK;
+
+	for (i = 0; i < n; i++)
+		rpc_uci_cache_stat(cursor->savedir, pkgs[i].name, &pkgs[i].delta);
+
+	for (i = 0; i < n && !rv; i++)
 	{
-		cursor->err = UCI_ERR_NOTFOUND;
-		goto out;
+		cursor->err = UCI_OK;
+
+		if (uci_save(cursor, pkgs[i].p) || cursor->err)
+			rv = cursor->err ? rpc_uci_status() : UBUS_STATUS_UNKNOWN_ERROR;
 	}
 
-	if (uci_rename(cursor, &ptr))
-		goto out;
+	while (rv && i-- > 0)
+	{
+		snprintf(path, sizeof(path) - 1, "%s/%s",
+		         cursor->savedir, pkgs[i].name);
 
-	uci_save(cursor, p);
+		if (!pkgs[i].delta.st_ino)
+			unlink(path);
+		else
+			truncate(path, pkgs[i].delta.st_size);
+	}
 
-out:
-	uci_unload(cursor, p);
+	for (i = 0; i < n; i++)
+		rpc_uci_cache_invalidate(pkgs[i].name);
 
-	return rpc_uci_status();
+	return rv;
 }
 
+/*
+ * Apply a list of add, set, delete, rename and order operations within one
+ * load/save cycle per involved package. Either all changes are saved or,
+ * if any operation or save fails, none of them.
+ */
 static int
-rpc_uci_order(struct ubus_context *ctx, struct ubus_object *obj,
+rpc_uci_batch(struct ubus_context *ctx, struct ubus_object *obj,
               struct ubus_request_data *req, const char *method,
               struct blob_attr *msg)
 {
-	struct blob_attr *tb[__RPC_O_MAX];
-	struct blob_attr *cur;
-	struct uci_package *p = NULL;
-	struct uci_ptr ptr = { 0 };
-	int rem, i = 1;
+	struct rpc_uci_batch_package pkgs[RPC_UCI_BATCH_MAX_PACKAGES];
+	struct rpc_uci_batch_package *pkg;
+	struct blob_attr *tb[__RPC_BA_MAX], *mtb[__RPC_BO_MAX];
+	struct blob_attr *cur, *config;
+	const char *section;
+	int i, rem, rv, n_pkgs = 0, status = UBUS_STATUS_OK;
+	void *c, *d;
 
-	blobmsg_parse(rpc_uci_order_policy, __RPC_O_MAX, tb,
+	blobmsg_parse(rpc_uci_batch_policy, __RPC_BA_MAX, tb,
 	              blob_data(msg), blob_len(msg));
 
-	if (!tb[RPC_O_CONFIG] || !tb[RPC_O_SECTIONS])
+	if (!tb[RPC_BA_OPERATIONS])
 		return UBUS_STATUS_INVALID_ARGUMENT;
 
-	if (!rpc_uci_write_access(tb[RPC_O_SESSION], tb[RPC_O_CONFIG]))
-		return UBUS_STATUS_PERMISSION_DENIED;
+	/* validate operations and collect the involved packages */
+	blobmsg_for_each_attr(cur, tb[RPC_BA_OPERATIONS], rem)
+	{
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE)
+			return UBUS_STATUS_INVALID_ARGUMENT;
 
-	ptr.package = blobmsg_data(tb[RPC_O_CONFIG]);
+		rv = rpc_uci_batch_op(cur, NULL, NULL, true);
 
-	if (uci_load(cursor, ptr.package, &p))
-		return rpc_uci_status();
+		if (rv)
+			return rv;
 
-	blobmsg_for_each_attr(cur, tb[RPC_O_SECTIONS], rem)
-	{
-		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
-			continue;
+		blobmsg_parse(rpc_uci_batch_op_policy, __RPC_BO_MAX, mtb,
+		              blobmsg_data(cur), blobmsg_data_len(cur));
 
-		ptr.s = NULL;
-		ptr.section = blobmsg_data(cur);
+		config = mtb[RPC_BO_CONFIG];
 
-		if (uci_lookup_ptr(cursor, &ptr, NULL, true) || !ptr.s)
+		if (rpc_uci_batch_find(pkgs, n_pkgs, blobmsg_data(config)))
 			continue;
 
-		uci_reorder_section(cursor, ptr.s, i++);
+		if (n_pkgs >= RPC_UCI_BATCH_MAX_PACKAGES)
+			return UBUS_STATUS_INVALID_ARGUMENT;
+
+		if (!rpc_uci_write_access(tb[RPC_BA_SESSION], config))
+			return UBUS_STATUS_PERMISSION_DENIED;
+
+		pkgs[n_pkgs].name = blobmsg_data(config);
+		pkgs[n_pkgs].p = NULL;
+		n_pkgs++;
 	}
 
-	uci_save(cursor, p);
-	uci_unload(cursor, p);
+	for (i = 0; i < n_pkgs; i++)
+	{
+		if (rpc_uci_load(pkgs[i].name, &pkgs[i].p))
+		{
+			status = rpc_uci_status();
+			goto out;
+		}
+	}
 
-	return rpc_uci_status();
+	blob_buf_init(&buf, 0);
+	c = blobmsg_open_array(&buf, "results");
+
+	blobmsg_for_each_attr(cur, tb[RPC_BA_OPERATIONS], rem)
+	{
+		blobmsg_parse(rpc_uci_batch_op_policy, __RPC_BO_MAX, mtb,
+		              blobmsg_data(cur), blobmsg_data_len(cur));
+
+		pkg = rpc_uci_batch_find(pkgs, n_pkgs,
+		                         blobmsg_data(mtb[RPC_BO_CONFIG]));
+
+		section = NULL;
+
+		/* skip remaining operations after the first failure */
+		if (status)
+			rv = UBUS_STATUS_NO_DATA;
+		else
+			rv = rpc_uci_batch_op(cur, pkg->p, &section, false);
+
+		d = blobmsg_open_table(&buf, NULL);
+		blobmsg_add_u32(&buf, "status", rv);
+
+		if (section)
+			blobmsg_add_string(&buf, "section", section);
+
+		blobmsg_close_table(&buf, d);
+
+		if (rv && !status)
+			status = rv;
+	}
+
+	blobmsg_close_array(&buf, c);
+
+	/* the results are only sent once the changes are saved */
+	if (!status && (status = rpc_uci_batch_save(pkgs, n_pkgs)))
+		goto out;
+
+	ubus_send_reply(ctx, req, buf.head);
+
+out:
+	for (i = 0; i < n_pkgs; i++)
+		if (pkgs[i].p)
+			rpc_uci_unload(pkgs[i].p);
+
+	return status;
 }
 
 static void
@@ -1020,27 +2455,72 @@ rpc_uci_dump_change(struct uci_delta *d)
 	blobmsg_close_array(&buf, c);
 }
 
+/*
+ * Check whether the delta of the package changed after generation "since",
+ * stamping the view with a fresh generation if the delta file was modified.
+ */
+static bool
+rpc_uci_view_changes(struct rpc_uci_view *v, bool valid, uint32_t since)
+{
+	struct stat delta;
+
+	rpc_uci_cache_stat(v->savedir, v->package, &delta);
+
+	if (v->changes_dirty || !rpc_uci_cache_stat_eq(&v->changes, &delta))
+	{
+		v->changes = delta;
+		v->changes_gen = ++generation;
+		v->changes_dirty = false;
+	}
+
+	return (!valid || since < v->base || v->changes_gen > since);
+}
+
 static int
 rpc_uci_changes(struct ubus_context *ctx, struct ubus_object *obj,
                 struct ubus_request_data *req, const char *method,
                 struct blob_attr *msg)
 {
-	struct blob_attr *tb[__RPC_C_MAX];
+	struct blob_attr *tb[__RPC_CH_MAX];
 	struct uci_package *p = NULL;
+	struct rpc_uci_view *v = NULL;
 	struct uci_element *e;
+	uint32_t since = 0;
+	bool valid = false;
 	char **configs;
 	void *c, *d;
 	int i;
 
-	blobmsg_parse(rpc_uci_config_policy, __RPC_C_MAX, tb,
+	blobmsg_parse(rpc_uci_changes_policy, __RPC_CH_MAX, tb,
 	              blob_data(msg), blob_len(msg));
 
-	if (tb[RPC_C_CONFIG])
+	if (tb[RPC_CH_SINCE])
+		valid = rpc_uci_token_gen(tb[RPC_CH_SINCE], &since);
+
+	if (tb[RPC_CH_CONFIG])
 	{
-		if (!rpc_uci_read_access(tb[RPC_C_SESSION], tb[RPC_C_CONFIG]))
+		if (!rpc_uci_read_access(tb[RPC_CH_SESSION], tb[RPC_CH_CONFIG]))
 			return UBUS_STATUS_PERMISSION_DENIED;
 
-		if (uci_load(cursor, blobmsg_data(tb[RPC_C_CONFIG]), &p))
+		if (tb[RPC_CH_SINCE])
+		{
+			v = rpc_uci_view_get(blobmsg_data(tb[RPC_CH_CONFIG]),
+			                     cursor->savedir);
+
+			if (v && !rpc_uci_view_changes(v, valid, since))
+			{
+				blob_buf_init(&buf, 0);
+				blobmsg_add_u8(&buf, "unchanged", true);
+				blobmsg_add_u64(&buf, "generation", rpc_uci_token());
+				ubus_send_reply(ctx, req, buf.head);
+
+				return UBUS_STATUS_OK;
+			}
+		}
+
+		rpc_uci_retained_drop(blobmsg_data(tb[RPC_CH_CONFIG]));
+
+		if (uci_load(cursor, blobmsg_data(tb[RPC_CH_CONFIG]), &p))
 			return rpc_uci_status();
 
 		blob_buf_init(&buf, 0);
@@ -1053,12 +2533,15 @@ rpc_uci_changes(struct ubus_context *ctx, struct ubus_object *obj,
 
 		uci_unload(cursor, p);
 
+		if (v)
+			blobmsg_add_u64(&buf, "generation", rpc_uci_token());
+
 		ubus_send_reply(ctx, req, buf.head);
 
 		return rpc_uci_status();
 	}
 
-	rpc_uci_set_savedir(tb[RPC_C_SESSION]);
+	rpc_uci_set_savedir(tb[RPC_CH_SESSION]);
 
 	if (uci_list_configs(cursor, &configs))
 		return rpc_uci_status();
@@ -1069,15 +2552,30 @@ rpc_uci_changes(struct ubus_context *ctx, struct ubus_object *obj,
 
 	for (i = 0; configs[i]; i++)
 	{
-		if (tb[RPC_C_SESSION] &&
-		    !rpc_session_access(blobmsg_data(tb[RPC_C_SESSION]), "uci",
+		if (tb[RPC_CH_SESSION] &&
+		    !rpc_session_access(blobmsg_data(tb[RPC_CH_SESSION]), "uci",
 		                        configs[i], "read"))
 			continue;
 
+		/*
+		 * With a token, only packages whose delta changed since are
+		 * loaded and reported, including ones with all changes gone.
+		 */
+		if (tb[RPC_CH_SINCE])
+		{
+			v = rpc_uci_view_get(configs[i], cursor->savedir);
+
+			if (v && !rpc_uci_view_changes(v, valid, since))
+				continue;
+		}
+
+		rpc_uci_retained_drop(configs[i]);
+
 		if (uci_load(cursor, configs[i], &p))
 			continue;
 
-		if (!uci_list_empty(&p->saved_delta))
+		if (!uci_list_empty(&p->saved_delta) ||
+		    (tb[RPC_CH_SINCE] && valid))
 		{
 			d = blobmsg_open_array(&buf, configs[i]);
 
@@ -1092,29 +2590,101 @@ rpc_uci_changes(struct ubus_context *ctx, struct ubus_object *obj,
 
 	blobmsg_close_table(&buf, c);
 
+	if (tb[RPC_CH_SINCE])
+		blobmsg_add_u64(&buf, "generation", rpc_uci_token());
+
 	ubus_send_reply(ctx, req, buf.head);
 
 	return 0;
 }
 
 static void
-rpc_uci_trigger_event(struct ubus_context *ctx, const char *config)
+rpc_uci_event_complete_cb(struct ubus_request *req, int ret)
+{
+	free(req);
+}
+
+/*
+ * Send the queued config.change events without waiting for procd. Each
+ * package is notified only once per burst; the events are not merged
+ * into a single message since procd triggers match on "package".
+ */
+static void
+rpc_uci_event_flush(struct uloop_timeout *t)
 {
-	char *pkg = strdup(config);
-	static struct blob_buf b;
-	uint32_t id;
+	struct rpc_uci_event *ev, *tmp;
+	struct ubus_request *req;
+	void *c;
+
+	if (!service_id && ubus_lookup_id(event_ctx, "service", &service_id))
+		service_id = 0;
+
+	avl_remove_all_elements(&events, ev, avl, tmp)
+	{
+		req = service_id ? calloc(1, sizeof(*req)) : NULL;
 
-	if (!ubus_lookup_id(ctx, "service", &id)) {
-		void *c;
+		if (req)
+		{
+			blob_buf_init(&buf, 0);
+			blobmsg_add_string(&buf, "type", "config.change");
+			c = blobmsg_open_table(&buf, "data");
+			blobmsg_add_string(&buf, "package", ev->avl.key);
+			blobmsg_close_table(&buf, c);
+
+			if (!ubus_invoke_async(event_ctx, service_id, "event",
+			                       buf.head, req))
+			{
+				req->complete_cb = rpc_uci_event_complete_cb;
+				ubus_complete_request_async(event_ctx, req);
+			}
+			else
+			{
+				free(req);
+			}
+		}
 
-		blob_buf_init(&b, 0);
-		blobmsg_add_string(&b, "type", "config.change");
-		c = blobmsg_open_table(&b, "data");
-		blobmsg_add_string(&b, "package", pkg);
-		blobmsg_close_table(&b, c);
-		ubus_invoke(ctx, id, "event", b.head, NULL, 0, 1000);
+		free(ev);
 	}
-	free(pkg);
+}
+
+static void
+rpc_uci_trigger_event(struct ubus_context *ctx, const char *config)
+{
+	struct rpc_uci_event *ev;
+	char *new_name;
+
+	if (avl_find(&events, config))
+		return;
+
+	ev = calloc_a(sizeof(*ev), &new_name, strlen(config) + 1);
+
+	if (!ev)
+		return;
+
+	ev->avl.key = strcpy(new_name, config);
+	avl_insert(&events, &ev->avl);
+
+	event_ctx = ctx;
+	uloop_timeout_set(&event_timer, 0);
+}
+
+static void
+rpc_uci_object_event_cb(struct ubus_context *ctx, struct ubus_event_handler *ev,
+                        const char *type, struct blob_attr *msg)
+{
+	struct blob_attr *tb[__RPC_OE_MAX];
+
+	blobmsg_parse(rpc_uci_object_event_policy, __RPC_OE_MAX, tb,
+	              blob_data(msg), blob_len(msg));
+
+	if (!tb[RPC_OE_ID] || !tb[RPC_OE_PATH] ||
+	    strcmp(blobmsg_data(tb[RPC_OE_PATH]), "service"))
+		return;
+
+	if (!strcmp(type, "ubus.object.add"))
+		service_id = blobmsg_get_u32(tb[RPC_OE_ID]);
+	else
+		service_id = 0;
 }
 
 static int
@@ -1140,19 +2710,23 @@ rpc_uci_revert_commit(struct ubus_context *ctx, struct blob_attr *msg, bool comm
 
 	if (commit)
 	{
-		if (!uci_load(cursor, ptr.package, &p))
+		if (!rpc_uci_load(ptr.package, &p))
 		{
 			uci_commit(cursor, &p, false);
-			uci_unload(cursor, p);
+			rpc_uci_unload(p);
+			rpc_uci_cache_invalidate(ptr.package);
 			rpc_uci_trigger_event(ctx, blobmsg_get_string(tb[RPC_C_CONFIG]));
 		}
 	}
 	else
 	{
+		rpc_uci_retained_drop(ptr.package);
+
 		if (!uci_lookup_ptr(cursor, &ptr, NULL, true) && ptr.p)
 		{
 			uci_revert(cursor, &ptr);
 			uci_unload(cursor, ptr.p);
+			rpc_uci_cache_invalidate(ptr.package);
 		}
 	}
 
@@ -1240,63 +2814,177 @@ rpc_uci_apply_config(struct ubus_context *ctx, char *config)
 {
 	struct uci_package *p = NULL;
 
-	if (!uci_load(cursor, config, &p)) {
+	if (!rpc_uci_load(config, &p)) {
 		uci_commit(cursor, &p, false);
-		uci_unload(cursor, p);
+		rpc_uci_unload(p);
 	}
+	rpc_uci_cache_invalidate(config);
 	rpc_uci_trigger_event(ctx, config);
 
 	return 0;
 }
 
-static void
-rpc_uci_copy_file(const char *src, const char *target, const char *file)
+static int
+rpc_uci_copy_fd(int in, int out)
 {
-	char tmp[256];
-	FILE *in, *out;
+	static char buf[32 * 1024];
+	ssize_t len, wlen;
+	char *p;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while ((len = copy_file_range(in, NULL, out, NULL, 1024 * 1024 * 1024, 0)) > 0)
+		;
+
+	if (len == 0)
+		return 0;
+
+	/* not supported for this pair of filesystems, copy manually */
+	if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+	    errno != EOPNOTSUPP)
+		return -1;
 
-	snprintf(tmp, sizeof(tmp), "%s%s", src, file);
-	in = fopen(tmp, "rb");
-	snprintf(tmp, sizeof(tmp), "%s%s", target, file);
-	out = fopen(tmp, "wb+");
-	if (in && out)
-		while (!feof(in)) {
-			int len = fread(tmp, 1, sizeof(tmp), in);
+	if (lseek(in, 0, SEEK_SET) || lseek(out, 0, SEEK_SET) || ftruncate(out, 0))
+		return -1;
+#endif
 
-			if(len > 0)
-				fwrite(tmp, 1, len, out);
+	while ((len = read(in, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; len > 0; p += wlen, len -= wlen)
+		{
+			wlen = write(out, p, len);
+
+			if (wlen < 0)
+				return -1;
 		}
-	if(in)
-		fclose(in);
-	if(out)
-		fclose(out);
+	}
+
+	return (len < 0) ? -1 : 0;
+}
+
+/*
+ * Place a copy of src/file at target/file. With "hardlink" set a link is
+ * tried first, this is only safe for config files which UCI commits by
+ * renaming a new file into place. Delta files are appended to and
+ * truncated in place, so they must always be copied. Copies are written
+ * to a temporary file which is renamed over the target.
+ */
+static int
+rpc_uci_copy_file(const char *src, const char *target, const char *file,
+                  bool hardlink)
+{
+	char spath[PATH_MAX], tpath[PATH_MAX], tmp[PATH_MAX];
+	int in, out, rv = -1;
+
+	snprintf(spath, sizeof(spath), "%s%s", src, file);
+	snprintf(tpath, sizeof(tpath), "%s%s", target, file);
+	snprintf(tmp, sizeof(tmp), "%s.%s.rpcd-tmp", target, file);
+
+	rpc_uci_cache_invalidate(file);
+
+	unlink(tmp);
+
+	if (hardlink && !link(spath, tmp))
+		return rename(tmp, tpath);
+
+	in = open(spath, O_RDONLY);
+
+	if (in < 0)
+	{
+		/* source does not exist, make sure the target is gone as well */
+		if (errno == ENOENT)
+			unlink(tpath);
+
+		return -1;
+	}
+
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+	if (out >= 0)
+	{
+		rv = rpc_uci_copy_fd(in, out);
+
+		if (close(out))
+			rv = -1;
+
+		if (!rv)
+			rv = rename(tmp, tpath);
+		else
+			unlink(tmp);
+	}
+
+	close(in);
+
+	return rv;
 }
 
 static void
-rpc_uci_do_rollback(struct ubus_context *ctx, const char *sid, glob_t *gl)
+rpc_uci_snapshot_add(const char *sid, const char *config)
 {
-	int i;
+	struct rpc_uci_snapshot *snap;
 	char tmp[PATH_MAX];
 
+	snap = calloc(1, sizeof(*snap) + strlen(config) + 1);
+
+	if (!snap)
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s%s/", savedir_prefix, sid);
+
+	rpc_uci_copy_file(config_dir, snapshot_files, config, true);
+	rpc_uci_copy_file(tmp, snapshot_delta, config, false);
+
+	strcpy(snap->config, config);
+	list_add_tail(&snap->list, &snapshots);
+}
+
+static void
+rpc_uci_snapshot_purge(void)
+{
+	struct rpc_uci_snapshot *snap, *tmp;
+	char path[PATH_MAX];
+
+	list_for_each_entry_safe(snap, tmp, &snapshots, list)
+	{
+		snprintf(path, sizeof(path), "%s%s", snapshot_files, snap->config);
+		unlink(path);
+
+		snprintf(path, sizeof(path), "%s%s", snapshot_delta, snap->config);
+		unlink(path);
+
+		list_del(&snap->list);
+		free(snap);
+	}
+
+	rmdir(snapshot_files);
+	rmdir(snapshot_delta);
+}
+
+static void
+rpc_uci_do_rollback(struct ubus_context *ctx, const char *sid)
+{
+	struct rpc_uci_snapshot *snap;
+	char tmp[PATH_MAX], src[PATH_MAX], dst[PATH_MAX];
+
 	if (sid) {
-		snprintf(tmp, sizeof(tmp), RPC_UCI_SAVEDIR_PREFIX "%s/", sid);
+		snprintf(tmp, sizeof(tmp), "%s%s/", savedir_prefix, sid);
 		mkdir(tmp, 0700);
 	}
 
-	for (i = 0; i < gl->gl_pathc; i++) {
-		char *config = basename(gl->gl_pathv[i]);
+	list_for_each_entry(snap, &snapshots, list) {
+		rpc_uci_copy_file(snapshot_files, config_dir, snap->config, true);
+		rpc_uci_apply_config(ctx, snap->config);
 
-		if (*config == '.')
-			continue;
+		/* the delta snapshot lives on the same filesystem, move it back */
+		if (sid) {
+			snprintf(src, sizeof(src), "%s%s", snapshot_delta, snap->config);
+			snprintf(dst, sizeof(dst), "%s%s", tmp, snap->config);
 
-		rpc_uci_copy_file(RPC_SNAPSHOT_FILES, RPC_UCI_DIR, config);
-		rpc_uci_apply_config(ctx, config);
-		if (sid)
-			rpc_uci_copy_file(RPC_SNAPSHOT_DELTA, tmp, config);
+			if (rename(src, dst))
+				rpc_uci_copy_file(snapshot_delta, tmp, snap->config, false);
+		}
 	}
 
-	rpc_uci_purge_dir(RPC_SNAPSHOT_FILES);
-	rpc_uci_purge_dir(RPC_SNAPSHOT_DELTA);
+	rpc_uci_snapshot_purge();
 
 	uloop_timeout_cancel(&apply_timer);
 	memset(apply_sid, 0, sizeof(apply_sid));
@@ -1306,14 +2994,7 @@ rpc_uci_do_rollback(struct ubus_context *ctx, const char *sid, glob_t *gl)
 static void
 rpc_uci_apply_timeout(struct uloop_timeout *t)
 {
-	glob_t gl;
-	char tmp[PATH_MAX];
-
-	snprintf(tmp, sizeof(tmp), "%s/*", RPC_SNAPSHOT_FILES);
-	if (glob(tmp, GLOB_PERIOD, NULL, &gl) < 0)
-		return;
-
-	rpc_uci_do_rollback(apply_ctx, NULL, &gl);
+	rpc_uci_do_rollback(apply_ctx, NULL);
 }
 
 static int
@@ -1373,18 +3054,19 @@ rpc_uci_apply(struct ubus_context *ctx, struct ubus_object *obj,
 	if (tb[RPC_T_TIMEOUT])
 		timeout = blobmsg_get_u32(tb[RPC_T_TIMEOUT]);
 
-	rpc_uci_purge_dir(RPC_SNAPSHOT_FILES);
-	rpc_uci_purge_dir(RPC_SNAPSHOT_DELTA);
-
 	if (!apply_sid[0]) {
-		mkdir(RPC_SNAPSHOT_FILES, 0700);
-		mkdir(RPC_SNAPSHOT_DELTA, 0700);
+		rpc_uci_snapshot_purge();
+
+		if (rollback) {
+			mkdir(snapshot_files, 0700);
+			mkdir(snapshot_delta, 0700);
+		}
 
-		snprintf(tmp, sizeof(tmp), RPC_UCI_SAVEDIR_PREFIX "%s/*", sid);
+		snprintf(tmp, sizeof(tmp), "%s%s/*", savedir_prefix, sid);
 		if (glob(tmp, GLOB_PERIOD, NULL, &gl) < 0)
 			return UBUS_STATUS_NOT_FOUND;
 
-		snprintf(tmp, sizeof(tmp), RPC_UCI_SAVEDIR_PREFIX "%s/", sid);
+		snprintf(tmp, sizeof(tmp), "%s%s/", savedir_prefix, sid);
 
 		ret = rpc_uci_apply_access(sid, &gl);
 		if (ret) {
@@ -1396,6 +3078,8 @@ rpc_uci_apply(struct ubus_context *ctx, struct ubus_object *obj,
 		if (rollback)
 			strncpy(apply_sid, sid, RPC_SID_LEN);
 
+		rpc_uci_set_savedir(tb[RPC_T_SESSION]);
+
 		for (i = 0; i < gl.gl_pathc; i++) {
 			char *config = basename(gl.gl_pathv[i]);
 			struct stat s;
@@ -1406,8 +3090,9 @@ rpc_uci_apply(struct ubus_context *ctx, struct ubus_object *obj,
 			if (stat(gl.gl_pathv[i], &s) || !s.st_size)
 				continue;
 
-			rpc_uci_copy_file(RPC_UCI_DIR, RPC_SNAPSHOT_FILES, config);
-			rpc_uci_copy_file(tmp, RPC_SNAPSHOT_DELTA, config);
+			if (rollback)
+				rpc_uci_snapshot_add(sid, config);
+
 			rpc_uci_apply_config(ctx, config);
 		}
 
@@ -1445,8 +3130,7 @@ rpc_uci_confirm(struct ubus_context *ctx, struct ubus_object *obj,
 	if (strcmp(apply_sid, sid))
 		return UBUS_STATUS_PERMISSION_DENIED;
 
-	rpc_uci_purge_dir(RPC_SNAPSHOT_FILES);
-	rpc_uci_purge_dir(RPC_SNAPSHOT_DELTA);
+	rpc_uci_snapshot_purge();
 
 	uloop_timeout_cancel(&apply_timer);
 	memset(apply_sid, 0, sizeof(apply_sid));
@@ -1461,8 +3145,6 @@ rpc_uci_rollback(struct ubus_context *ctx, struct ubus_object *obj,
                  struct blob_attr *msg)
 {
 	struct blob_attr *tb[__RPC_B_MAX];
-	char tmp[PATH_MAX];
-	glob_t gl;
 	char *sid;
 
 	blobmsg_parse(rpc_uci_rollback_policy, __RPC_B_MAX, tb,
@@ -1479,13 +3161,7 @@ rpc_uci_rollback(struct ubus_context *ctx, struct ubus_object *obj,
 	if (strcmp(apply_sid, sid))
 		return UBUS_STATUS_PERMISSION_DENIED;
 
-	snprintf(tmp, sizeof(tmp), "%s/*", RPC_SNAPSHOT_FILES);
-	if (glob(tmp, GLOB_PERIOD, NULL, &gl) < 0)
-		return UBUS_STATUS_NOT_FOUND;
-
-	rpc_uci_do_rollback(ctx, sid, &gl);
-
-	globfree(&gl);
+	rpc_uci_do_rollback(ctx, sid);
 
 	return 0;
 }
@@ -1514,20 +3190,25 @@ rpc_uci_purge_savedir_cb(struct rpc_session *ses, void *priv)
 {
 	char path[PATH_MAX];
 
-	snprintf(path, sizeof(path) - 1, RPC_UCI_SAVEDIR_PREFIX "%s", ses->id);
+	snprintf(path, sizeof(path) - 1, "%s%s", savedir_prefix, ses->id);
 	rpc_uci_purge_dir(path);
+	rpc_uci_cache_purge_savedir(path);
+	rpc_uci_context_release(path);
 }
 
 /*
- * Removes all delta directories which match the RPC_UCI_SAVEDIR_PREFIX.
+ * Removes all delta directories which match the savedir prefix.
  * This is used to clean up garbage when starting rpcd.
  */
 void rpc_uci_purge_savedirs(void)
 {
+	char pattern[PATH_MAX];
 	int i;
 	glob_t gl;
 
-	if (!glob(RPC_UCI_SAVEDIR_PREFIX "*", 0, NULL, &gl))
+	snprintf(pattern, sizeof(pattern), "%s*", savedir_prefix);
+
+	if (!glob(pattern, 0, NULL, &gl))
 	{
 		for (i = 0; i < gl.gl_pathc; i++)
 			rpc_uci_purge_dir(gl.gl_pathv[i]);
@@ -1536,7 +3217,26 @@ void rpc_uci_purge_savedirs(void)
 	}
 }
 
-int rpc_uci_api_init(struct ubus_context *ctx)
+/*
+ * Override the configuration directory and the runtime directory holding
+ * session deltas and apply snapshots, NULL keeps the built-in default.
+ */
+void rpc_uci_dirs(const char *confdir, const char *rundir)
+{
+	if (confdir)
+		snprintf(config_dir, sizeof(config_dir), "%s/", confdir);
+
+	if (rundir)
+	{
+		snprintf(savedir_prefix, sizeof(savedir_prefix), "%s/uci-", rundir);
+		snprintf(snapshot_files, sizeof(snapshot_files),
+		         "%s/snapshot-files/", rundir);
+		snprintf(snapshot_delta, sizeof(snapshot_delta),
+		         "%s/snapshot-delta/", rundir);
+	}
+}
+
+int rpc_uci_api_init(struct ubus_context *ctx, int max_contexts)
 {
 	static const struct ubus_method uci_methods[] = {
 		{ .name = "configs", .handler = rpc_uci_configs },
@@ -1547,7 +3247,8 @@ int rpc_uci_api_init(struct ubus_context *ctx)
 		UBUS_METHOD("delete",   rpc_uci_delete,   rpc_uci_delete_policy),
 		UBUS_METHOD("rename",   rpc_uci_rename,   rpc_uci_rename_policy),
 		UBUS_METHOD("order",    rpc_uci_order,    rpc_uci_order_policy),
-		UBUS_METHOD("changes",  rpc_uci_changes,  rpc_uci_config_policy),
+		UBUS_METHOD("batch",    rpc_uci_batch,    rpc_uci_batch_policy),
+		UBUS_METHOD("changes",  rpc_uci_changes,  rpc_uci_changes_policy),
 		UBUS_METHOD("revert",   rpc_uci_revert,   rpc_uci_config_policy),
 		UBUS_METHOD("commit",   rpc_uci_commit,   rpc_uci_config_policy),
 		UBUS_METHOD("apply",    rpc_uci_apply,    rpc_uci_apply_policy),
@@ -1570,12 +3271,30 @@ int rpc_uci_api_init(struct ubus_context *ctx)
 		.cb = rpc_uci_purge_savedir_cb
 	};
 
-	cursor = uci_alloc_context();
+	static struct ubus_event_handler object_event = {
+		.cb = rpc_uci_object_event_cb
+	};
+
+	cursor = cursor_default = uci_alloc_context();
 
 	if (!cursor)
 		return UBUS_STATUS_UNKNOWN_ERROR;
 
+	if (strcmp(config_dir, RPC_UCI_DIR))
+		uci_set_confdir(cursor, config_dir);
+
+	if (max_contexts >= 0)
+		context_max = max_contexts;
+
 	rpc_session_destroy_cb(&cb);
 
+	avl_init(&events, avl_strcmp, false, NULL);
+	avl_init(&views, avl_strcmp, false, NULL);
+	generation_epoch = (uint32_t)time(NULL) & ((1 << RPC_UCI_EPOCH_BITS) - 1);
+	event_timer.cb = rpc_uci_event_flush;
+
+	ubus_register_event_handler(ctx, &object_event, "ubus.object.add");
+	ubus_register_event_handler(ctx, &object_event, "ubus.object.remove");
+
 	return ubus_add_object(ctx, &obj);
 }
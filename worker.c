@@ -0,0 +1,260 @@
+/*
+ * rpcd - UBUS RPC server
+ *
+ *   Copyright (C) 2013-2014 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libubox/uloop.h>
+
+#include <rpcd/worker.h>
+#include <rpcd/stats.h>
+
+/*
+ * A small pool of threads for handlers doing blocking I/O. Jobs are
+ * queued by the main loop and picked up by the first idle thread, which
+ * runs the blocking part, queues the job as finished and wakes the loop
+ * through a pipe. Replies and completions are always sent from the loop,
+ * as neither libubus nor uloop are thread-safe. Threads are started on
+ * demand up to the configured limit and then kept. Jobs submitted while
+ * RPC_WORKER_MAX_JOBS are pending, or if no thread could be started, run
+ * on the loop itself but are still completed through the pipe.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(queued);
+static LIST_HEAD(finished);
+static int n_queued = 0;
+static int n_idle = 0;
+
+/* only accessed from the main loop */
+static struct uloop_fd notify = { .fd = -1 };
+static int notify_wr = -1;
+static int max_threads = RPC_WORKER_THREADS;
+static int n_threads = 0;
+static int n_jobs = 0;
+
+void
+rpc_worker_limits(int threads)
+{
+	if (threads > 0)
+		max_threads = threads;
+}
+
+/* called with the lock held */
+static void
+rpc_worker_finish(struct rpc_worker_job *job)
+{
+	char c = 0;
+
+	/* one pending byte is enough to wake the loop */
+	if (list_empty(&finished))
+		while (write(notify_wr, &c, 1) < 0 && errno == EINTR);
+
+	list_add_tail(&job->list, &finished);
+}
+
+static void *
+rpc_worker_thread(void *priv)
+{
+	struct rpc_worker_job *job;
+
+	pthread_mutex_lock(&lock);
+
+	while (true)
+	{
+		while (list_empty(&queued))
+		{
+			n_idle++;
+			pthread_cond_wait(&wakeup, &lock);
+			n_idle--;
+		}
+
+		job = list_first_entry(&queued, struct rpc_worker_job, list);
+		list_del(&job->list);
+		n_queued--;
+
+		pthread_mutex_unlock(&lock);
+		job->ret = job->run(job);
+		pthread_mutex_lock(&lock);
+
+		rpc_worker_finish(job);
+	}
+
+	return NULL;
+}
+
+static void
+rpc_worker_notify_cb(struct uloop_fd *u, unsigned int events)
+{
+	struct rpc_worker_job *job, *tmp;
+	LIST_HEAD(done);
+	char b[16];
+
+	while (read(u->fd, b, sizeof(b)) > 0);
+
+	pthread_mutex_lock(&lock);
+	list_splice_init(&finished, &done);
+	pthread_mutex_unlock(&lock);
+
+	list_for_each_entry_safe(job, tmp, &done, list)
+	{
+		list_del(&job->list);
+		n_jobs--;
+
+		if (job->done)
+		{
+			job->done(job, job->ret);
+		}
+		else
+		{
+			rpc_worker_complete(job, job->ret);
+			free(job);
+		}
+	}
+}
+
+static bool
+rpc_worker_notify_init(void)
+{
+	int fds[2];
+
+	if (notify.fd >= 0)
+		return true;
+
+	if (pipe(fds))
+		return false;
+
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	notify.fd = fds[0];
+	notify.cb = rpc_worker_notify_cb;
+	uloop_fd_add(&notify, ULOOP_READ);
+
+	notify_wr = fds[1];
+
+	return true;
+}
+
+static bool
+rpc_worker_spawn(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t set, old;
+	int rv;
+
+	if (pthread_attr_init(&attr))
+		return false;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* signals are left to the main loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	rv = pthread_create(&thread, &attr, rpc_worker_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	pthread_attr_destroy(&attr);
+
+	if (rv)
+		return false;
+
+	n_threads++;
+
+	return true;
+}
+
+/*
+ * Queue a job. With ctx and req given, the request is deferred and
+ * completed once the job finished: by the done callback if there is one,
+ * otherwise by sending the job buffer if run returned success, followed
+ * by free() on the job. Both may be NULL for jobs not tied to a request
+ * or resubmitted from their done callback. The done callback never runs
+ * before this returns.
+ */
+int
+rpc_worker_submit(struct rpc_worker_job *job, struct ubus_context *ctx,
+                  struct ubus_request_data *req)
+{
+	bool spawn;
+
+	if (!rpc_worker_notify_init())
+		return UBUS_STATUS_UNKNOWN_ERROR;
+
+	pthread_mutex_lock(&lock);
+	spawn = (n_queued >= n_idle);
+	pthread_mutex_unlock(&lock);
+
+	if (spawn && n_threads < max_threads)
+		rpc_worker_spawn();
+
+	if (ctx && req)
+	{
+		job->context = ctx;
+		job->deferred = true;
+		ubus_defer_request(ctx, req, &job->request);
+	}
+
+	job->ret = UBUS_STATUS_OK;
+	n_jobs++;
+
+	if (!n_threads || n_jobs > RPC_WORKER_MAX_JOBS)
+	{
+		job->ret = job->run(job);
+
+		pthread_mutex_lock(&lock);
+		rpc_worker_finish(job);
+		pthread_mutex_unlock(&lock);
+
+		return UBUS_STATUS_OK;
+	}
+
+	pthread_mutex_lock(&lock);
+	list_add_tail(&job->list, &queued);
+	n_queued++;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	return UBUS_STATUS_OK;
+}
+
+/*
+ * Reply with the job buffer unless ret signals an error, complete the
+ * deferred request and release the buffer.
+ */
+void
+rpc_worker_complete(struct rpc_worker_job *job, int ret)
+{
+	if (job->deferred)
+	{
+		if (!ret && job->buf.head)
+			ubus_send_reply(job->context, &job->request, job->buf.head);
+
+		rpc_stats_complete(job->context, &job->request, ret);
+		job->deferred = false;
+	}
+
+	blob_buf_free(&job->buf);
+}